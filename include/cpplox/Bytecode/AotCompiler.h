@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+#include "cpplox/Bytecode/LoxObject.h"
+
+namespace cpplox {
+
+  struct AotProgram {
+    // What a C++ file written by AotCompiler defines: the program's bytecode
+    // (for constants and the instructions compiled code leaves to VM::step) and,
+    // per function in file order, its compiled entry point or nullptr for
+    // functions that are interpreted. Run with ByteCodeRunner::runCompiled.
+    std::span<const uint8_t> bytecode;
+    std::span<const CompiledEntry> entries;
+  };
+
+  class AotCompiler {
+    // Ahead-of-time backend: translates a compiled program into a C++ translation
+    // unit with one function per Lox function, built by the system compiler
+    // against the cpplox library. Stack heights are known at every instruction
+    // (see ir::ControlFlowGraph), so generated code addresses the frame's stack
+    // slots at fixed offsets, turns jumps into gotos and does loads, stores,
+    // number arithmetic and comparisons inline. Calls, returns and anything that
+    // allocates or reports errors go through VM's interface for compiled code,
+    // which keeps runtime errors and their lines identical to interpreting.
+    // Functions the IR can't describe (eg. ones using _LONG instructions) are
+    // left to the interpreter.
+  public:
+    std::optional<std::string> translate(function_ptr script, std::string_view name) const;
+    // name must be an identifier, the file defines cpplox::aot::<name> and, unless
+    // CPPLOX_AOT_NO_MAIN is defined, a main() running it. nullopt if the program
+    // can't be serialized.
+    static std::string program_name(std::string_view path);
+    // Identifier derived from path's file name.
+
+  private:
+    std::optional<std::string> translate_function(const Function& function, size_t index) const;
+  };
+
+}  // namespace cpplox
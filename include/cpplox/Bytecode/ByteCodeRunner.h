@@ -2,15 +2,21 @@
 
 #include <fstream>
 #include <memory>
+#include <optional>
 #include <string>
 
 #include "cpplox/Treewalk/ErrorReporter.h"
 #include "cpplox/Treewalk/Scanner.h"
 #include "cpplox/Treewalk/Token.h"
 // TODO: Move above to common/per-functionality to break dependency.
+#include "cpplox/Bytecode/AotCompiler.h"
+#include "cpplox/Bytecode/BytecodeFile.h"
 #include "cpplox/Bytecode/Chunk.h"
+#include "cpplox/Bytecode/CompileCache.h"
 #include "cpplox/Bytecode/Compiler.h"
+#include "cpplox/Bytecode/Jit.h"
 #include "cpplox/Bytecode/VM.h"
+#include "cpplox/Bytecode/WarmStart.h"
 #include "cpplox/Bytecode/GC.h"
 #include "cpplox/Bytecode/StringPool.h"
 
@@ -23,13 +29,47 @@ namespace cpplox {
   public:
     ByteCodeRunner(std::ostream& output = std::cout,
                   std::istream& input = std::cin,
-                  const std::string log_fname = "compiler.log")
+                  const std::string log_fname = "compiler.log",
+                  const CompilerOptions options = {})
         : output(output),
           input(input),
           log_output(log_fname),
           e_reporter{},
-          disassembler{log_output} {};
+          disassembler{log_output},
+          options{options} {};
     void runFile(const std::string& path);
+    // Runs Lox source, or a .loxc file written by compileFile.
+    bool compileFile(const std::string& path, const std::string& out_path);
+    // Compiles path to a .loxc file at out_path without running it.
+    void enable_cache(const std::string& directory, uintmax_t max_bytes = CompileCache::default_max_bytes);
+    // Makes runFile keep compiled Lox source in directory (see CompileCache) and
+    // load it from there instead of compiling the same source again.
+    bool emitCpp(const std::string& path, const std::string& out_path);
+    // Translates path to a C++ file at out_path (see AotCompiler), the program
+    // it defines is named after out_path.
+    void runCompiled(const AotProgram& program);
+    // Runs a program defined by a file emitCpp wrote.
+    void enable_jit(uint32_t hot_calls = Jit::default_hot_calls, JitBackend backend = JitBackend::TEMPLATES,
+                    uint32_t hot_loops = Jit::default_hot_loops);
+    // Functions called hot_calls times are compiled to native code, loops
+    // interpreted hot_loops times are traced (see Jit). On by default where Jit is
+    // supported, with templates.
+    void disable_jit();
+    void set_max_callstack_depth(size_t depth) { max_callstack_depth = depth; }
+    // Calls nested deeper than depth report "Stackoverflow.", the VMs this runner
+    // starts preallocate their stack for that many frames.
+    void enable_warm_start() { warm_start = true; }
+    // Makes runFile start Lox source in the tree-walking interpreter while the
+    // bytecode compiles on another thread (see WarmStart). Ignored when a cache or
+    // snapshot is enabled, their scripts start in the VM.
+    bool snapshotFile(const std::string& path, const std::string& out_path);
+    // Runs path and writes the globals it defined, with its code, to a .loxs
+    // snapshot at out_path (see SnapshotWriter).
+    void enable_snapshot(const std::string& path) { snapshot = path; }
+    // Makes runFile's VM start with the globals of the snapshot at path instead
+    // of running the program that defined them first. Takes precedence over warm
+    // start. Also makes compileFile compile for running on top of the snapshot,
+    // .loxc files optimised as a whole program are refused.
     void runRepl();
 
   private:
@@ -40,8 +80,25 @@ namespace cpplox {
     std::ofstream log_output;
     ErrorReporter e_reporter;
     const Disassembler disassembler;
+    const CompilerOptions options;
+    std::optional<CompileCache> cache{};
+    Jit jit{};
+    bool use_jit{Jit::supported()};
+    // Disabling keeps jit, functions compiled so far still run its code.
+    size_t max_callstack_depth{VM::DEFAULT_MAX_CALLSTACK_DEPTH};
+    bool warm_start{false};
+    std::optional<std::string> snapshot{};
 
     void run(const std::string& source);
+    std::optional<function_ptr> compile(const std::string& source, bool eager = false, bool whole_program = true);
+    // eager compiles every function body whatever options say, for writing code out.
+    // whole_program is false for code running alongside code compiled separately,
+    // eg. REPL lines.
+    CompilerOptions program_options() const;
+    // options, except that scripts starting from a snapshot aren't the whole program.
+    std::optional<function_ptr> load(const std::string& path, std::string& error);
+    void execute(function_ptr function);
+    void run_warm(const std::string& source);
   };
 
 }  // namespace cpplox
\ No newline at end of file
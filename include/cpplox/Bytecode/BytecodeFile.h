@@ -0,0 +1,142 @@
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "cpplox/Bytecode/GC.h"
+#include "cpplox/Bytecode/LoxObject.h"
+#include "cpplox/Bytecode/StringPool.h"
+
+namespace cpplox {
+  class VM;
+
+  // .loxc files hold a compiled program, so running it again skips scanning,
+  // compiling and optimising. Layout (integers little-endian):
+  //  - header: "LOXC", format version, number of opcodes the writer knew about,
+  //    whether the program was optimised as a whole program (see
+  //    Chunk::whole_program), string count, function count, size and FNV-1a
+  //    checksum of the metadata,
+  //  - metadata: interned strings (names and string constants), then per function
+  //    its name, arity, upvalue count, extra slots, location and checksum of its
+  //    body and its tagged constants,
+  //  - bodies: per function its code followed by its line runs.
+  // Function 0 is the script, others are referred to by index from constants.
+
+  class MappedFile {
+    // Read-only mmap of a whole file, unmapped when the last user lets go of it.
+  public:
+    static std::shared_ptr<const MappedFile> open(const std::string& path);
+    // nullptr if the file can't be opened or mapped.
+    static std::shared_ptr<const MappedFile> view(std::span<const uint8_t> bytes);
+    // Wraps bytes that outlive every use of the result, eg. ones compiled into a
+    // program (see AotCompiler).
+    static std::shared_ptr<const MappedFile> slice(std::shared_ptr<const MappedFile> file, size_t offset,
+                                                   size_t size);
+    // size bytes of file from offset on, file stays mapped while the slice is used.
+    MappedFile(const MappedFile&)            = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    const uint8_t* data() const { return bytes; }
+    size_t size() const { return length; }
+
+  private:
+    MappedFile(const uint8_t* bytes, size_t length, bool owned, std::shared_ptr<const MappedFile> whole = nullptr)
+        : bytes{bytes}, length{length}, owned{owned}, whole{std::move(whole)} {};
+    const uint8_t* bytes{nullptr};
+    size_t length{0};
+    bool owned{false};
+    std::shared_ptr<const MappedFile> whole{};
+    // Set for slices.
+  };
+
+  class BytecodeWriter {
+  public:
+    std::optional<std::string> serialize(function_ptr script) const;
+    // nullopt if a chunk holds a constant that only exists at runtime or its lazy
+    // code fails to materialize.
+    bool write(function_ptr script, const std::string& path) const;
+    static std::vector<function_ptr> functions_of(function_ptr script);
+    // Every function of the program in file order: script first, then functions
+    // in the order their chunks' constants refer to them. Materializes lazy chunks.
+    static bool write_bytes(const std::string& bytes, const std::string& path);
+    // Writes to a temporary file next to path and renames it into place, so
+    // readers see either the old file or the complete new one.
+  };
+
+  class BytecodeLoader {
+    // Strings, function objects and constants are created when the file is
+    // loaded, code and lines of a function only when it is first called (see
+    // Chunk::materialize), so functions a run never calls are never decoded.
+    // Both steps validate what they read: a file that is truncated, corrupt or
+    // was written for a different opcode set is rejected rather than run.
+  public:
+    explicit BytecodeLoader(gc_heap* const heap, StringPool* const pool) : heap{heap}, pool{pool} {};
+    std::optional<function_ptr> load(const std::string& path, std::string& error) const;
+    // Returns the script, error says what's wrong with the file otherwise.
+    std::optional<function_ptr> load(std::shared_ptr<const MappedFile> file, const std::string& path,
+                                     std::string& error, std::vector<function_ptr>* loaded = nullptr) const;
+    // loaded receives every function in file order (see BytecodeWriter::functions_of).
+    static bool is_bytecode_file(const std::string& path);
+    // Checks the magic only, load() validates the rest.
+
+    static constexpr std::string_view magic{"LOXC"};
+    static constexpr uint32_t format_version{3};
+    // 2: extra_slots covers temporaries, not only locals.
+    // 3: header records whole_program.
+
+  private:
+    gc_heap* const heap;
+    StringPool* const pool;
+  };
+
+  // .loxs snapshots hold a program together with the globals running it left
+  // behind, so a VM can start from that state instead of running the program
+  // again (eg. a prelude defining functions and building tables). Layout:
+  //  - header: "LOXS", format version, size of the program,
+  //  - program: .loxc image of the program, which has every function globals
+  //    can refer to,
+  //  - heap: size and FNV-1a checksum of the rest, strings, number of upvalues,
+  //    closures (function's index and indices of its upvalues), closed upvalues'
+  //    values and globals (name's index and value).
+  // Values are tagged like constants and refer to strings, functions, closures
+  // and natives (see natives) by index.
+
+  class SnapshotWriter {
+  public:
+    std::optional<std::string> serialize(function_ptr program, const VM& vm) const;
+    // nullopt if a global refers to a function program didn't compile or to a
+    // variable that is still on vm's stack.
+    bool write(function_ptr program, const VM& vm, const std::string& path) const;
+  };
+
+  class SnapshotLoader {
+    // Maps the file and rebuilds its heap in one pass per section: strings are
+    // interned, closures and upvalues allocated and the indices between them
+    // relocated to pointers. Program's code is decoded on first call, as for
+    // .loxc files, so startup doesn't depend on how much code the program has.
+  public:
+    explicit SnapshotLoader(gc_heap* const heap, StringPool* const pool) : heap{heap}, pool{pool} {};
+    bool load(const std::string& path, VM& vm, std::string& error) const;
+    // Defines snapshot's globals in vm, replacing ones of the same name. error
+    // says what's wrong with the file otherwise, vm is left as it was. Programs
+    // optimised as a whole program are refused: scripts running on top of them
+    // share their globals.
+    static bool is_snapshot_file(const std::string& path);
+
+    static constexpr std::string_view magic{"LOXS"};
+    static constexpr uint32_t format_version{2};
+    // 2: program is a format 3 .loxc image.
+
+  private:
+    gc_heap* const heap;
+    StringPool* const pool;
+  };
+
+}  // namespace cpplox
@@ -1,5 +1,7 @@
 #pragma once
 #include <cstdint>
+#include <functional>
+#include <map>
 #include <vector>
 
 #include "Value.h"
@@ -37,6 +39,58 @@ namespace cpplox {
     OP_GET_UPVALUE,    // [opcode, upvalue's index in current closure]
     OP_SET_UPVALUE,    // [opcode, upvalue's index in current closure]
     OP_CLOSE_UPVALUE,  // [opcode]
+    OP_TAIL_CALL,      // [opcode, number of func call arguments], always followed by OP_RETURN
+    OP_JUMP_IF_TRUE,   // [opcode, offset's upper byte, offset's lower byte]
+    OP_JUMP_IF_NOT_CALLEE,  // [opcode, offset's upper byte, offset's lower byte, number of call
+                            //  arguments, expected callee's constant index], guards inlined calls
+    OP_INLINED_RETURN,      // [opcode, number of values below the result to drop]
+    OP_ADD_NN,         // [opcode] and 2 values known to be numbers taken from stack
+    OP_SUBTRACT_NN,    // [opcode] and 2 values known to be numbers taken from stack
+    OP_MULTIPLY_NN,    // [opcode] and 2 values known to be numbers taken from stack
+    OP_DIVIDE_NN,      // [opcode] and 2 values known to be numbers taken from stack
+    OP_GREATER_NN,     // [opcode] and 2 values known to be numbers taken from stack
+    OP_LESS_NN,        // [opcode] and 2 values known to be numbers taken from stack
+    OP_CONSTANT_LONG,       // [opcode, 3 byte constant's index]
+    OP_GET_GLOBAL_LONG,     // [opcode, 3 byte global's constant index]
+    OP_DEFINE_GLOBAL_LONG,  // [opcode, 3 byte global's constant index]
+    OP_SET_GLOBAL_LONG,     // [opcode, 3 byte global's constant index]
+    OP_GET_LOCAL_LONG,      // [opcode, 2 byte local's stack index]
+    OP_SET_LOCAL_LONG,      // [opcode, 2 byte local's stack index]
+    OP_CLOSURE_LONG,        // [opcode, 3 byte function's constant index, 3 bytes per upvalue]
+    OP_JUMP_LONG,           // [opcode, 3 byte offset]
+    OP_JUMP_IF_FALSE_LONG,  // [opcode, 3 byte offset]
+    OP_JUMP_IF_TRUE_LONG,   // [opcode, 3 byte offset]
+    OP_LOOP_LONG,           // [opcode, 3 byte offset]
+    // _LONG variants are only emitted when an operand doesn't fit the short form,
+    // eg. in machine-generated code. Multi-byte operands are big-endian.
+  };
+
+  OpCode wide_variant(OpCode op);
+  // _LONG variant of an instruction that has one.
+  bool is_wide(OpCode op);
+  size_t operand_width(OpCode op);
+  // Size in bytes of instruction's first operand.
+
+  class LineTable {
+    // Source lines of a chunk's code, run-length encoded: a run starts at the first
+    // byte emitted for a line that differs from the previous byte's. Lookups are a
+    // binary search over the runs, only needed to report errors and disassemble.
+  public:
+    struct Run {
+      uint32_t start{0};
+      int line{0};
+    };
+
+    void add(size_t offset, int line);
+    // Records that the byte at offset (and the ones after it, until the next call)
+    // came from line. Offsets must not decrease.
+    int line_at(size_t offset) const;
+    void truncate(size_t code_size);
+    size_t run_count() const { return runs.size(); }
+    const std::vector<Run>& run_list() const { return runs; }
+
+  private:
+    std::vector<Run> runs{};
   };
 
   class Chunk {
@@ -47,15 +101,36 @@ namespace cpplox {
     size_t add_constant(Value val);
     // Returns added value's index in constants vector and does not enforce that 
     // at most uint8::max values can be stored.
+    void truncate(size_t code_size);
+    // Drops bytes from code_size onwards, used by Compiler to replace code it already
+    // emitted (eg. constant folding).
+    size_t instruction_size(size_t offset) const;
+    // Size in bytes of the instruction starting at offset, operands included.
+    size_t operand(size_t offset) const;
+    // First operand of the instruction starting at offset, whatever its width.
+    size_t jump_target(size_t offset) const;
+    // Offset the jump starting at offset lands on.
+    void widen_jumps(const std::map<size_t, size_t>& far_targets);
+    // Re-encodes code switching jumps whose distance doesn't fit 16 bits to their
+    // _LONG variant. far_targets maps offsets of jumps Compiler couldn't encode to
+    // the offsets they should land on.
+    bool materialize();
+    // Fills in code and lines of a chunk read from a .loxc file by running
+    // lazy_code once, VM does it on the function's first call. Returns false if
+    // they turn out to be corrupt, and keeps failing afterwards.
 
     std::vector<uint8_t> code;
     // This implementation stores instructions (OpCode type) and operand indices
     // (uint8_t) in a single vector, treating both as bytes. Consumers are
     // expected to know when casting uint8_t to OpCode is needed during reading.
-    std::vector<int> line_numbers;
-    // TODO optimisation: as of now, each call to add_byte adds entry to
-    // line_numbers. Consider run-length encoding to have memory.
+    LineTable lines;
     std::vector<Value> constants;
+    std::function<bool(Chunk&)> lazy_code{};
+    // Set by BytecodeLoader until the chunk is materialized, empty otherwise.
+    bool whole_program{false};
+    // Set on a script's chunk when opt_level 2 assumed no other code shares its
+    // globals (see CompilerOptions::whole_program), so it can't run on top of a
+    // snapshot.
   };
 
 }  // namespace cpplox
\ No newline at end of file
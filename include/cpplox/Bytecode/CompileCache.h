@@ -0,0 +1,39 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "cpplox/Bytecode/Compiler.h"
+
+namespace cpplox {
+
+  class CompileCache {
+    // Directory of .loxc files named after a hash of the source they were
+    // compiled from and of everything else that shapes the bytecode (compiler
+    // version, options, file format). Entries are written to a temporary file
+    // and renamed into place, so concurrent runs never see a partial one. Hits
+    // bump the entry's modification time and stores evict the least recently
+    // used entries once the directory grows past max_bytes.
+  public:
+    explicit CompileCache(std::filesystem::path directory, uintmax_t max_bytes = default_max_bytes);
+    std::string key(std::string_view source, const CompilerOptions& options) const;
+    std::optional<std::filesystem::path> lookup(const std::string& key) const;
+    bool store(const std::string& key, const std::string& bytes) const;
+    // Returns false if the entry couldn't be written, runs go on without it.
+
+    static constexpr uintmax_t default_max_bytes{64 * 1024 * 1024};
+    static constexpr std::string_view compiler_version{"cpplox-bytecode-1"};
+    // Bump when code generation changes in a way the file format doesn't reflect.
+
+  private:
+    std::filesystem::path directory;
+    uintmax_t max_bytes;
+
+    std::filesystem::path entry_path(const std::string& key) const;
+    void evict() const;
+  };
+
+}  // namespace cpplox
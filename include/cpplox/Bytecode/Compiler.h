@@ -4,7 +4,10 @@
 #include <string>
 #include <utility>
 #include <list>
+#include <map>
 #include <optional>
+#include <unordered_map>
+#include <vector>
 
 #include "Debug.h"
 #include "cpplox/Treewalk/ErrorReporter.h"
@@ -17,6 +20,28 @@ using namespace clox::Types;
 using clox::ErrorsAndDebug::ErrorReporter;
 
 namespace cpplox {
+  struct CompilerOptions {
+    bool peephole{true};
+    // Run PeepholeOptimizer over every chunk once it is compiled.
+    bool peephole_diff{false};
+    // Log each chunk's disassembly before and after optimisation.
+    int opt_level{0};
+    // Above 0 chunks also go through IROptimizer. Off by default to keep compiling
+    // (eg. REPL input) single-pass.
+    bool lazy_functions{false};
+    // Function bodies are only scanned for their extent and the variables they close
+    // over, and compiled on the function's first call (see Chunk::materialize).
+    // Whole-program passes of opt_level 2 skip bodies that weren't compiled yet.
+    bool resumable{false};
+    // Leaves the script's own chunk unoptimised, so running it can start at any of
+    // its top-level declarations (see Compiler::statement_offsets). Functions are
+    // optimised as usual.
+    bool whole_program{true};
+    // No code but the script's own shares its globals. Off when it runs on top of
+    // other code (eg. a snapshot's prelude), which opt_level 2 then assumes to
+    // assign to any global (see IROptimizer::GlobalFacts).
+  };
+
   // Compiler combines parsing and code generation into one step with no
   // intermediary AST being produced. This limits the amount of syntax context
   // available to compiler, but Lox's grammar is simple enough to allow that.
@@ -51,13 +76,22 @@ namespace cpplox {
     };
 
     struct CompiletimeUpvalue {
-      uint8_t index {0};
+      uint16_t index {0};
       //  Closed-over variables's:
       //  is_local is true:  stack index relative to enclosing function's stack position.
       //  is_local is false: upvalue index in enclosing function's upvalue collection.
       bool is_local {false};
    };
 
+    struct ConstantHash {
+      size_t operator()(const Value& val) const;
+    };
+    struct ConstantEqual {
+      bool operator()(const Value& lhs, const Value& rhs) const;
+    };
+    // Key constants pool deduplication by value. Doubles are compared bitwise, so 0
+    // and -0 stay distinct while equal NaNs are shared.
+
     typedef void (Compiler::*ParseFn)(const bool);
     // Some functions have side-effects on the Compiler object, so signature of a
     // non-const member function.
@@ -206,16 +240,19 @@ namespace cpplox {
     explicit Compiler(const std::vector<const Token>& tokens,
                       const Disassembler& disassembler, ErrorReporter& e_reporter,
                       gc_heap* const heap, StringPool* const pool,
+                      const CompilerOptions options = {},
                       size_t token_idx = 0, Compiler* const enclosing = nullptr)
         : tokens{tokens},
           disassembler{disassembler},
           e_reporter{e_reporter},
           heap{heap},
           pool{pool},
+          options{options},
           enclosing{enclosing},
           function{heap->make<Function>(0, 0, pool->insert_or_get("script"), std::make_unique<Chunk>())},
           locals{},
-          healthy{true} {
+          healthy{true},
+          is_script{token_idx == 0} {
       if (token_idx > 0) {
         current = token_idx;
         previous = token_idx - 1;
@@ -229,6 +266,12 @@ namespace cpplox {
     };
     std::optional<function_ptr> compile();
     // Compile can only be called once, very meh but simpler for now.
+    const std::vector<size_t>& statement_offsets() const { return statement_starts; }
+    // Offset in the script's chunk of each top-level declaration, where the stack
+    // holds nothing but the script. Only with options.resumable, empty if the
+    // chunk had to be re-encoded for far jumps.
+    const std::vector<function_ptr>& global_functions() const { return declared_functions; }
+    // Functions declared at top level, in source order.
 
   private:
     const std::vector<const Token>& tokens;
@@ -236,26 +279,56 @@ namespace cpplox {
     ErrorReporter& e_reporter;
     gc_heap* const heap{nullptr};
     StringPool* const pool{nullptr};
+    const CompilerOptions options;
     Compiler* const enclosing{nullptr};
     function_ptr function;
     std::vector<Local> locals;
     // All locals that are in scope during each point of compilation, ordered by
-    // order of declaration in code. Note: OP_GET_LOCAL and OP_SET_LOCAL use 1
-    // byte operands, so locals.size() can be 256 at most.
+    // order of declaration in code. Note: OP_GET_LOCAL_LONG and OP_SET_LOCAL_LONG
+    // use 2 byte operands, so locals.size() can be 65536 at most.
     std::list<CompiletimeUpvalue> upvalues;
     // Resolved identifiers that this function closes-over, ordered declaration
-    // from earliest to last. Just like locals, upvalues.size() can be 256 at most.
+    // from earliest to last. OP_GET_UPVALUE and OP_SET_UPVALUE use 1 byte operands,
+    // so upvalues.size() can be 256 at most.
+    std::vector<std::pair<std::string, uint8_t>> captured{};
+    // Names and upvalue indices a lazily compiled body resolved when its function was
+    // declared, stands in for enclosing Compiler which is gone by the first call.
     size_t current{0};
     size_t previous{0};
     bool had_error{false};
     bool panic_mode{false};
     bool healthy{true};
+    const bool is_script;
+    // Compiling a whole program rather than one function's body.
+    std::vector<size_t> statement_starts{};
+    std::vector<function_ptr> declared_functions{};
+    // Kept alive by the script's constants.
     int scope_depth{0};
     // 0 = global scope, 1 = 1st to-level block, 2 = inside of 1st, ...
+    std::optional<size_t> last_call_instr_idx{};
+    // Offset of the most recently emitted OP_CALL. If it is the last instruction of
+    // a return statement's expression, the call is in tail position.
+    size_t infix_lhs_instr_idx{0};
+    // Offset of the first instruction of the left operand of the infix expression
+    // being compiled. Set by parse_precedence right before calling an infix function.
+    std::unordered_map<Value, size_t, ConstantHash, ConstantEqual> constant_indices{};
+    std::vector<int> constant_uses{};
+    // Index of every value already in function's constants pool and the number of
+    // emitted operands referring to it. Folding releases uses of the constants it
+    // replaces and unused constants at the end of the pool are dropped.
+    std::map<size_t, size_t> far_jumps{};
+    // Jumps whose distance doesn't fit their 16 bit operand, by offset of the jump
+    // and of its target. Widened by end_compiler.
+    static constexpr size_t max_wide_operand{(1 << 24) - 1};
+    // Largest index a 24 bit *_LONG operand can hold.
 
     void advance();
     void declaration();
     void dispatch_function_declaration();
+    std::optional<function_ptr> lazy_function_declaration();
+    // Emits a closure over a function whose body compiles on first call and returns
+    // the function. nullopt if the declaration is malformed, which compiling it
+    // right away reports.
     void function_declaration();
     void var_declaration();
     void statement();
@@ -274,9 +347,9 @@ namespace cpplox {
     void literal(const bool precedence_context_allows_assignment);
     void variable(const bool precedence_context_allows_assignment);
     void parse_precedence(const Precedence& precedence);
-    uint8_t parse_variable(const std::string& err_msg);
+    size_t parse_variable(const std::string& err_msg);
     void declare_variable();
-    void define_variable(const uint8_t const_table_index_of_global_variable_name);
+    void define_variable(const size_t const_table_index_of_global_variable_name);
     void begin_scope();
     void end_scope();
     void if_statement();
@@ -285,21 +358,33 @@ namespace cpplox {
     void return_statement();
     void named_variable(const std::string var_name,
                         const bool precedence_context_allows_assignment);
-    std::pair<uint8_t, bool> resolve_local(const std::string& name);
+    std::pair<uint16_t, bool> resolve_local(const std::string& name);
     std::pair<uint8_t, bool> resolve_upvalue(const std::string& name);
     // TODO: Refactor into string_views?
-    uint8_t add_or_get_upvalue(uint8_t idx, bool is_local);
-    uint8_t add_constant(Value val);
-    uint16_t emit_jump(const OpCode op) const;
+    uint8_t add_or_get_upvalue(uint16_t idx, bool is_local);
+    size_t add_constant(Value val);
+    void release_constant(size_t idx);
+    std::optional<Value> constant_load(size_t start_instr_idx, size_t end_instr_idx) const;
+    std::optional<Value> fold_binary(TokenType op, const Value lhs, const Value rhs);
+    void drop_code(size_t instr_idx);
+    void replace_with_constant(size_t instr_idx, Value val);
+    void skip_operand(const Precedence& precedence);
+    void truncate_code(size_t instr_idx);
+    size_t emit_jump(const OpCode op) const;
     void emit_loop(size_t loop_start_instr_idx);
-    void patch_jump(uint16_t jump_instr_idx);
+    void patch_jump(size_t jump_instr_idx);
+    void emit_with_operand(const OpCode op, size_t operand) const;
+    // Emits op's _LONG variant if operand doesn't fit op's own operand.
     void emit_operand(const uint8_t byte) const;
     void emit_opcode(const OpCode op) const;
     void emit_opcodes(const OpCode op_one, const OpCode op_two) const;
     void emit_constant(Value val);
-    void emit_closure(Value val);
+    void emit_folded(Value val);
+    void emit_closure(Value val, const std::list<CompiletimeUpvalue>& captured);
     void emit_return() const;
     void end_compiler() const;
+    void optimize_program() const;
+    // Passes that need every function compiled first, run by the script's Compiler.
     bool check(TokenType ttype) const;
     void consume(TokenType ttype, const std::string& err_msg);
     void synchronize();
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "cpplox/Bytecode/LoxObject.h"
+#include "cpplox/Bytecode/Stencils.h"
+
+namespace cpplox {
+
+  class CopyAndPatch {
+    // Second code generator for Jit: instead of assembling templates, copies
+    // stencils, machine code the C++ compiler produced at build time for each
+    // instruction (src/Bytecode/stencils), one after another and patches their
+    // holes with the instruction's stack slots, constant, code address and the
+    // addresses of the stencils that run next. Stencils end by jumping to the
+    // next one, which is dropped where the next one follows right away, so a
+    // function's code runs as one chain with VM and its slots in the argument
+    // registers. Instructions without a stencil of their own are interpreted
+    // through the STEP stencil.
+  public:
+    static std::optional<CopyAndPatch> stitch(const Function& function);
+    // nullopt if the function's stack heights aren't known (see
+    // ir::ControlFlowGraph) or the build has no stencils.
+    static bool supported();
+    // Whether the build extracted the stencils stitching can't do without.
+
+    size_t size() const { return code_size; }
+    void write(uint8_t* memory) const;
+    // Copies and patches the code for running at memory, size() bytes long.
+
+  private:
+    struct Piece {
+      const Stencil* stencil;
+      uint64_t a{0};
+      uint64_t b{0};
+      const Value* constant{nullptr};
+      const uint8_t* ip{nullptr};
+      size_t jump{0};
+      // Jumps: block landed on.
+      size_t offset{0};
+      size_t size{0};
+    };
+
+    CopyAndPatch() = default;
+    uint64_t resolve(const Piece& piece, const StencilHole& hole, const uint8_t* memory, size_t next) const;
+
+    std::vector<Piece> pieces{};
+    std::vector<size_t> block_offsets{};
+    size_t code_size{0};
+  };
+
+}  // namespace cpplox
@@ -13,6 +13,8 @@ namespace cpplox {
     void disassemble_chunk(const Chunk& chunk, const std::string name) const;
     size_t disassemble_instruction(const Chunk& chunk, int offset) const;
     void disassemble_constants_table(const Chunk& chunk, const std::string& name) const;
+    void disassemble_diff(const Chunk& before, const Chunk& after, const std::string& name) const;
+    // Prints code of a chunk before and after an optimisation, constants are shared.
 
     // Invariant: functions below should return the address of the next
     // instruction
@@ -21,7 +23,7 @@ namespace cpplox {
                                 size_t offset) const;
     size_t byte_instruction(const std::string name, const Chunk& chunk,
                             size_t offset) const;
-    size_t jump_instruction(const std::string name, int sign, const Chunk& chunk,
+    size_t jump_instruction(const std::string name, const Chunk& chunk,
                             size_t offset) const;
 
   private:
@@ -63,6 +63,9 @@ namespace cpplox {
     #endif
       
       bool is_marked {false};
+      bool is_frozen {false};
+      // Set by gc_heap::freeze, other heaps' collections then neither mark nor
+      // trace the cell.
   };
 
   template<typename T>
@@ -103,6 +106,7 @@ namespace cpplox {
   
     std::vector<gc_root_marking_cb> root_marking_callbacks;
     std::vector<gc_cell_base*> reachable{};
+    bool frozen{false};
 
   public:
     gc_heap()                               = default;
@@ -139,10 +143,35 @@ namespace cpplox {
     #ifdef DEBUG_STRESS_GC
       if (cells.size() > 4) {collect();}
     #endif
+      return track(std::make_unique<T>(std::forward<Args>(args)...));
+    }
+
+    template<typename T>
+    gc_ptr<T> manage(std::unique_ptr<T> data) {
+    #ifdef DEBUG_STRESS_GC
+      if (cells.size() > 4) {collect();}
+    #endif
+      return track(std::move(data));
+    }
+    // Takes ownership of an object that was constructed outside of the heap because it
+    // needs custom allocation (see Closure::create). Caller is responsible for keeping
+    // gc_ptrs stored in data reachable until this returns.
+
+    size_t size() const { return cells.size(); }
+    void freeze();
+    // Makes everything allocated so far read-only for good, so gc_ptrs into this
+    // heap can be held by objects of other heaps, even ones used on other threads:
+    // their collections skip frozen cells instead of writing marks into them.
+    // Nothing may be allocated afterwards. Objects reachable from frozen ones
+    // have to be frozen too, ie. live on this heap.
+    void collect();
+    void debug_print() const;
 
-      auto cell = std::make_unique<gc_cell<T>>(
-        std::make_unique<T>(std::forward<Args>(args)...)
-      );
+  private:
+    template<typename T>
+    gc_ptr<T> track(std::unique_ptr<T> data) {
+      assert(!frozen && "Allocation on a frozen gc_heap");
+      auto cell = std::make_unique<gc_cell<T>>(std::move(data));
       gc_cell<T>* cell_ptr {cell.get()};
       cells.emplace_back(std::move(cell));
 
@@ -154,10 +183,6 @@ namespace cpplox {
     #endif
       return gc_ptr<T>(cell_ptr->data.get(), cell_ptr);
     }
-
-    size_t size() const { return cells.size(); }
-    void collect();
-    void debug_print() const;
   };
 
  // Typed, non-owning pointer exposed to users.
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include <optional>
+#include <set>
+#include <vector>
+
+#include "cpplox/Bytecode/Chunk.h"
+
+namespace cpplox::ir {
+  // Mid-level IR used by IROptimizer. A function's chunk is lifted into a control
+  // flow graph of basic blocks. Within a block every value pushed by an instruction
+  // is defined exactly once by its Node and consumers refer to producers by index,
+  // so a block is a forest of SSA-style expression trees. Locals stay in memory
+  // (stack slots read and written by OP_GET_LOCAL/OP_SET_LOCAL), which keeps
+  // lowering back to the stack-based OpCode set a matter of emitting nodes in order.
+
+  struct Node {
+    OpCode op;
+    std::vector<uint8_t> operands{};
+    // Byte operands as encoded in the chunk, recomputed for jumps when lowering.
+    int line{0};
+    size_t target{0};
+    // Jumps only: index of the block this jump lands on.
+    std::vector<std::optional<size_t>> inputs{};
+    // Nodes producing the values this one pops (or peeks), bottom of the stack
+    // first. nullopt for values pushed before the block started.
+    size_t subtree_size{1};
+    // Number of nodes computing this one's value, itself included.
+    bool removed{false};
+  };
+
+  struct BasicBlock {
+    std::vector<Node> nodes{};
+    std::vector<size_t> successors{};
+    std::optional<size_t> entry_height{};
+    // Stack slots in use (relative to frame's base) when the block starts, unset
+    // for unreachable blocks.
+
+    std::vector<std::optional<size_t>> expression_starts() const;
+    // For every node: index of the first node computing its value, if the node and
+    // the ones computing its inputs form a contiguous range within this block.
+    // Statements between pushing and popping a value (eg. a local popped at the end
+    // of a scope) leave gaps, such ranges can't be replaced as a whole.
+  };
+
+  class ControlFlowGraph {
+  public:
+    static std::optional<ControlFlowGraph> build(const Chunk& chunk, int arity);
+    // Returns nullopt for chunks whose stack heights can't be statically
+    // determined or that use _LONG instructions, those are left as compiled.
+    void lower(Chunk& chunk) const;
+    // Replaces chunk's code and lines. Jump offsets must fit their 16 bit
+    // operands, which holds as long as the code is no longer than 64KiB.
+
+    std::vector<BasicBlock> blocks{};
+    std::set<uint8_t> captured_slots{};
+    // Locals of this function captured by closures, calls can write to them.
+
+  private:
+    bool link_stack_values(int arity);
+  };
+
+  bool is_jump(OpCode op);
+  int stack_effect(const Node& node);
+  // Number of values pushed minus number of values popped.
+  size_t popped_count(const Node& node);
+  // Number of values node consumes, values merely peeked at included.
+  std::optional<size_t> max_stack_height(const Chunk& chunk, int arity);
+  // Most slots code reachable from its start uses above its frame's start:
+  // callee, parameters, locals and the temporaries and call arguments pushed on
+  // top of them. Works on any chunk, _LONG instructions included. nullopt if an
+  // instruction takes values below the callee's slot, reads or writes a local
+  // that isn't on the stack, or paths reach an instruction with different
+  // heights, none of which the compiler emits. Jumps must land on instructions.
+
+}  // namespace cpplox::ir
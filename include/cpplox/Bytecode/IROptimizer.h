@@ -0,0 +1,106 @@
+#pragma once
+
+#include <map>
+#include <optional>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "cpplox/Bytecode/Chunk.h"
+#include "cpplox/Bytecode/IR.h"
+#include "cpplox/Bytecode/Value.h"
+
+namespace cpplox {
+
+  class IROptimizer {
+    // Lifts a compiled chunk into ir::ControlFlowGraph, runs the pass pipeline and
+    // lowers the result back to bytecode. Enabled by CompilerOptions::opt_level > 0,
+    // so by default compiling stays single-pass.
+    //
+    // Passes:
+    //  - propagate_values: local value numbering in every block, seeded with
+    //    constants known to be held by stack slots on block entry (computed by
+    //    forward dataflow over the CFG). Replaces expressions with constants
+    //    (constant propagation), upvalue reads and recomputed expressions with
+    //    reads of a local holding the same value (copy propagation, CSE) and
+    //    resolves conditional jumps on known values.
+    //  - eliminate_dead_code: removes side-effect free computations whose result
+    //    is popped right away and blocks that are never reached.
+    //  - specialize_arithmetic: flow-sensitive inference of which locals and
+    //    temporaries hold numbers (numeric constants, results of arithmetic,
+    //    operands of arithmetic that already passed its type check). Arithmetic
+    //    and comparisons on two numbers become their unchecked _NN variant.
+    //
+    // inline_calls and hoist_loop_invariants need to see every function of the
+    // program, so they run separately once compilation is done.
+    using SlotConstants = std::map<size_t, Value>;
+    using NumberSlots = std::set<size_t>;
+
+    struct GlobalFacts {
+      std::unordered_set<Value> assigned{};
+      // Names any function assigns to with OP_SET_GLOBAL.
+      bool unseen_code{false};
+      // Set if code the optimiser wasn't given (eg. bodies compiled on their first
+      // call, a prelude the script runs on top of) may run: it may assign to any
+      // global and any call may reach it.
+      std::unordered_set<Value> defined_before_calls{};
+      // Names the script defines before it first calls a function that could be
+      // written in Lox. Reading them from within a function can't fail.
+
+      bool may_assign(const Value& name) const { return unseen_code || assigned.contains(name); }
+    };
+
+    struct InlineCandidate {
+      function_ptr function{};
+      std::vector<ir::Node> body{};
+      // Function's code with OP_RETURN replaced by OP_INLINED_RETURN.
+      size_t max_height{0};
+      // Stack slots the body needs, callee's and arguments' included.
+    };
+    static constexpr size_t max_inlined_size{32};
+    // In bytes of the callee's code.
+    static constexpr size_t max_inlined_calls{64};
+    // Per function, bounds code growth.
+
+  public:
+    explicit IROptimizer(int opt_level) : opt_level{opt_level} {};
+    void optimize(Chunk& chunk, int arity) const;
+    void inline_calls(const std::vector<function_ptr>& functions) const;
+    // Splices the body of small, straight-line functions declared as globals (and
+    // capturing nothing) into call sites that load them from their global. The
+    // copy only runs after OP_JUMP_IF_NOT_CALLEE checks that the global still
+    // holds that function, otherwise the original OP_CALL does. functions as for
+    // hoist_loop_invariants.
+    void hoist_loop_invariants(const std::vector<function_ptr>& functions, bool whole_program) const;
+    // Loop-invariant code motion. Reads of globals and upvalues that no
+    // instruction of the loop (nor, for globals, of the whole program) can write
+    // to are moved in front of the loop into hidden locals. functions[0] must be
+    // the script, the others are functions it (transitively) declares. Unless
+    // they are the whole program, global reads only leave loops that call nothing.
+    void respecialize_arithmetic(Chunk& chunk, int arity) const;
+    // For code the optimiser can't vouch for (eg. loaded from a file): turns _NN
+    // instructions back into their checked opcodes and reruns specialize_arithmetic,
+    // so only operands it proves to be numbers skip the VM's type checks. chunk
+    // must pass the loader's checks (known opcodes, jumps landing on instructions).
+
+  private:
+    int opt_level{0};
+
+    std::unordered_map<Value, InlineCandidate> inline_candidates(const std::vector<function_ptr>& functions) const;
+    bool inline_call(ir::ControlFlowGraph& cfg, Chunk& chunk,
+                     const std::unordered_map<Value, InlineCandidate>& candidates) const;
+    GlobalFacts collect_global_facts(const std::vector<function_ptr>& functions, bool whole_program) const;
+    bool hoist_from_loop(ir::ControlFlowGraph& cfg, Chunk& chunk, const GlobalFacts& globals,
+                         bool is_script) const;
+
+    bool propagate_values(ir::ControlFlowGraph& cfg, Chunk& chunk) const;
+    bool eliminate_dead_code(ir::ControlFlowGraph& cfg, Chunk& chunk) const;
+    bool specialize_arithmetic(ir::ControlFlowGraph& cfg, Chunk& chunk) const;
+    std::vector<std::optional<NumberSlots>> numbers_on_entry(const ir::ControlFlowGraph& cfg,
+                                                             const Chunk& chunk) const;
+    std::vector<std::optional<SlotConstants>> slot_constants_on_entry(const ir::ControlFlowGraph& cfg,
+                                                                      const Chunk& chunk) const;
+  };
+
+}  // namespace cpplox
@@ -0,0 +1,134 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <fstream>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "cpplox/Treewalk/ErrorReporter.h"
+#include "cpplox/Bytecode/Compiler.h"
+#include "cpplox/Bytecode/Debug.h"
+#include "cpplox/Bytecode/GC.h"
+#include "cpplox/Bytecode/Jit.h"
+#include "cpplox/Bytecode/StringPool.h"
+
+namespace cpplox {
+
+  using clox::ErrorsAndDebug::ErrorReporter;
+
+  struct ScriptResult {
+    std::string output;
+    // What the script printed.
+    std::string errors;
+    // Empty if it compiled and ran without errors, formatted like ByteCodeRunner
+    // prints them otherwise.
+  };
+
+  class SharedScript {
+    // A script compiled once for every isolate that runs it. Its Functions, Chunks
+    // and the strings compiling interned live on a heap of its own that is frozen
+    // once compiled (see gc_heap::freeze), and isolates read them in place instead
+    // of compiling a copy each, so an isolate only holds what the script creates
+    // while running. Isolates intern strings in this pool first, which never
+    // changes after compiling.
+    //
+    // Function bodies are compiled eagerly, lazy ones would compile into the
+    // frozen heap on first call. Isolates run shared code without Jit, which keeps
+    // call counts, loop profiles and native code in Function itself.
+  public:
+    explicit SharedScript(const std::string& source, const CompilerOptions& options = {});
+    SharedScript(const SharedScript&)            = delete;
+    SharedScript& operator=(const SharedScript&) = delete;
+    ~SharedScript();
+
+    bool compiled() const { return script.has_value(); }
+    const std::string& errors() const { return compile_errors; }
+    // Formatted like ScriptResult::errors.
+    size_t size() const { return heap.size(); }
+    // Objects in the segment, stays the same however many isolates run it.
+
+  private:
+    friend class Isolate;
+
+    gc_heap heap{};
+    StringPool pool{&heap};
+    std::optional<function_ptr> script{};
+    std::string compile_errors{};
+  };
+
+  class Isolate {
+    // Everything running a script touches: heap, string pool, Jit, globals and
+    // stack (the latter two in the VM run creates). Nothing in it is shared with
+    // other isolates and the library keeps no mutable state outside of them, so
+    // isolates on different threads run at the same time. One isolate must only
+    // be used by one thread at a time.
+  public:
+    explicit Isolate(const CompilerOptions& options = {}) : options{options} {}
+    Isolate(const Isolate&)            = delete;
+    Isolate& operator=(const Isolate&) = delete;
+
+    ScriptResult run(const std::string& source);
+    // Compiles and runs source with fresh globals.
+    ScriptResult run(const SharedScript& shared);
+    // Runs shared's code with fresh globals, see SharedScript.
+
+  private:
+    gc_heap heap{};
+    StringPool pool{&heap};
+    ErrorReporter e_reporter{};
+    std::ofstream log_output{};
+    // Never opened, isolates don't log.
+    const Disassembler disassembler{log_output};
+    const CompilerOptions options;
+    Jit jit{};
+  };
+
+  class IsolatePool {
+    // Runs scripts on a fixed set of worker threads, each script in an Isolate of
+    // its own, so one process executes independent scripts on all cores. Jobs
+    // start in the order they were submitted. A fresh isolate per job keeps
+    // memory bounded: heap doesn't collect unless stress testing and StringPool
+    // doesn't survive collections (see its TODO).
+  public:
+    explicit IsolatePool(size_t workers = default_workers(), const CompilerOptions& options = {});
+    IsolatePool(const IsolatePool&)            = delete;
+    IsolatePool& operator=(const IsolatePool&) = delete;
+    ~IsolatePool();
+    // Waits for the jobs submitted so far.
+
+    std::future<ScriptResult> submit(std::string source);
+    std::future<ScriptResult> submit(std::shared_ptr<const SharedScript> shared);
+    // Jobs hold on to shared until they finish. It keeps the options it was
+    // compiled with.
+    size_t size() const { return workers.size(); }
+    static size_t default_workers();
+    // One per core.
+
+  private:
+    struct Job {
+      std::string source;
+      std::shared_ptr<const SharedScript> shared;
+      // Runs instead of source if set.
+      std::promise<ScriptResult> result;
+    };
+
+    const CompilerOptions options;
+    std::mutex mutex{};
+    std::condition_variable queued{};
+    std::deque<Job> jobs{};
+    bool stopping{false};
+    // Guarded by mutex, as is jobs.
+    std::vector<std::thread> workers{};
+
+    std::future<ScriptResult> enqueue(Job job);
+    void work();
+  };
+
+}  // namespace cpplox
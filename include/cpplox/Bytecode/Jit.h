@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "cpplox/Bytecode/LoxObject.h"
+#include "cpplox/Bytecode/Tracer.h"
+
+namespace cpplox {
+
+  enum class JitBackend : uint8_t { TEMPLATES, STENCILS };
+  // How Jit produces code: by assembling its own templates or by stitching
+  // stencils the C++ compiler produced at build time (see CopyAndPatch).
+
+  class Jit {
+    // Baseline compiler for x86-64 Linux: once a function has been called
+    // hot_calls times, every instruction of its chunk is translated to a fixed
+    // machine code template. Stack heights are known at every instruction (see
+    // ir::ControlFlowGraph), so templates address the frame's stack slots at
+    // fixed offsets from a register instead of moving a stack top around, keep
+    // numbers in SSE registers for arithmetic and comparisons and turn jumps into
+    // native ones. Calls, returns and instructions that allocate, touch globals or
+    // fail call out to VM's interface for compiled code (see VM::step), so errors
+    // and their lines match interpreting. Functions the IR can't describe (eg.
+    // ones using _LONG instructions) stay interpreted.
+    //
+    // With JitBackend::STENCILS the code comes from CopyAndPatch instead, for the
+    // same instructions and through the same slow paths.
+    //
+    // Loops the interpreter goes around hot_loops times get traced instead: VM
+    // records one iteration (see TraceRecorder), which is specialised to the
+    // types it saw (see Trace::optimize) and assembled into a native loop that
+    // keeps numbers unboxed in SSE registers across iterations. Leaving the
+    // recorded path writes them back and resumes interpreting where the trace
+    // left off. Traces are assembled from templates whatever the backend.
+    //
+    // Code of each function gets its own pages, which are made executable once
+    // written and live as long as the Jit, ie. as long as the functions using it.
+  public:
+    explicit Jit(uint32_t hot_calls = default_hot_calls, JitBackend backend = JitBackend::TEMPLATES,
+                 uint32_t hot_loops = default_hot_loops)
+        : hot_calls{hot_calls}, hot_loops{hot_loops}, backend{backend} {};
+    Jit(const Jit&)            = delete;
+    Jit& operator=(const Jit&) = delete;
+    ~Jit();
+
+    void set_hot_calls(uint32_t calls) { hot_calls = calls; }
+    void set_hot_loops(uint32_t back_edges) { hot_loops = back_edges; }
+    void set_backend(JitBackend jit_backend) { backend = jit_backend; }
+    void profile(const Function& function);
+    // Counts a call of function and compiles it when it becomes hot.
+    CompiledEntry compile(const Function& function);
+    // nullptr if the function or the platform isn't supported.
+    bool profile(LoopTrace& loop);
+    // Counts a back edge of loop, true once it is hot and should be recorded.
+    void compile(LoopTrace& loop, const Trace* trace);
+    // Sets loop's entry from its recorded iteration, nullptr if recording was
+    // aborted. Loops that can't be compiled aren't recorded again.
+    static bool supported(JitBackend backend = JitBackend::TEMPLATES);
+    // Checks the platform and that Value is laid out the way templates expect,
+    // or that the build has stencils.
+
+    static constexpr uint32_t default_hot_calls{100};
+    static constexpr uint32_t default_hot_loops{50};
+
+  private:
+    uint32_t hot_calls;
+    uint32_t hot_loops;
+    // Only loops of functions that are still interpreted are traced, compiled
+    // code never goes through VM's back edges.
+    JitBackend backend;
+    static constexpr uint32_t not_compilable{UINT32_MAX};
+    // Function::calls of functions compile() gave up on, LoopTrace::back_edges
+    // of loops it didn't trace.
+    std::vector<std::pair<void*, size_t>> regions{};
+
+    const void* install(size_t size, const std::function<void(uint8_t*)>& write);
+    // Gives write fresh pages to put size bytes of code in, which are then made
+    // executable.
+  };
+
+}  // namespace cpplox
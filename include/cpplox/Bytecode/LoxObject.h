@@ -1,6 +1,7 @@
 #pragma once
 #include <span>
 #include <memory>
+#include <vector>
 
 #include "cpplox/Bytecode/Chunk.h"
 #include "cpplox/Bytecode/GC.h"
@@ -10,6 +11,23 @@ namespace cpplox {
 
   class RuntimeUpvalue;
   using upvalue_ptr = gc_ptr<RuntimeUpvalue>;
+  class VM;
+
+  enum class CompiledStatus : uint8_t { RETURNED, TAIL_CALLED, RUNTIME_ERROR };
+  // How compiled code leaves its frame: popped it (VM::compiled_return), handed
+  // it over to a tail called function (VM::compiled_tail_call) or failed.
+  using CompiledEntry = CompiledStatus (*)(VM& vm);
+  using TraceEntry = bool (*)(VM& vm);
+  // Native code for a loop (see Jit): runs iterations from the
+  // loop's header until one leaves the recorded path, then hands the frame back
+  // to the interpreter at frame().ip. false on runtime errors.
+
+  struct LoopTrace {
+    uint32_t header{0};
+    // Offset of the loop's first instruction, where its OP_LOOP jumps back to.
+    uint32_t back_edges{0};
+    TraceEntry entry{nullptr};
+  };
 
   struct Function {
     // Functions are the bridge between the compile time and runtime environments.
@@ -21,6 +39,21 @@ namespace cpplox {
     std::unique_ptr<Chunk> chunk;
     // Lox program is broken into Functions and each Function owns its bytecode Chunk.
     // TODO: Can this be simplified by storing Chunk by value instead?
+    size_t extra_slots{0};
+    // Slots beyond VM::FRAME_SLOTS this function's locals and temporaries reach
+    // (locals addressed with _LONG instructions among them), VM reserves them on
+    // top of the usual frame window.
+    mutable CompiledEntry compiled{nullptr};
+    // Native code an execution tier produced for the whole body, VM runs it in
+    // place of interpreting chunk when the function is called. Compiled code
+    // still reads chunk's constants and code (see VM::step).
+    mutable uint32_t calls{0};
+    // Counted by Jit to find hot functions. Both are mutable as the VM only
+    // holds const Functions, neither changes what the function does.
+    mutable std::vector<LoopTrace> loops{};
+    // Loops of chunk the interpreter went around, for tracing (see Jit).
+
+    LoopTrace& loop_at(uint32_t header) const;
   };
 
   struct NativeFn {
@@ -33,35 +66,58 @@ namespace cpplox {
   };
 
   class RuntimeUpvalue {
-  // TODO: This is doing if/else but with lots of indirection. Benchmark against the pointer tricks that clox does and refactor if bad.
-  private:
-    struct OpenLocator {
-      std::vector<Value>& stack;
-      const size_t index;
-      // Open upvalue is still on stack and (stack, index) represent its location. Not using span it can be invalidated
-      // on resizes etc.
-    };
-    using ClosedLocator = Value;
+  // Follows clox's ObjUpvalue: location points at the captured stack slot while the upvalue
+  // is open and at the upvalue's own closed field once the variable leaves the stack, so
+  // reads and writes are a single dereference either way. Relies on VM never reallocating
+  // its stack while upvalues are open.
+  public:
+    explicit RuntimeUpvalue(Value* slot) : location{slot} {};
+    RuntimeUpvalue(const RuntimeUpvalue&)            = delete;
+    RuntimeUpvalue& operator=(const RuntimeUpvalue&) = delete;
+    // location may point into this object, so copies would alias the original's storage.
+
+    Value* value() const { return location; }
+    void close() {
+      closed = *location;
+      location = &closed;
+    }
+    bool is_open() const { return location != &closed; }
+
+    Value* location{nullptr};
+    Value closed{};
     // Represents non-owning pointer type. Reason: RuntimeUpvalues close over variables, not values. Changes made to any variable
     // via RuntimeUpvalue must be visible to other RuntimeUpvalues that closed over the same variable. Closures, and their RuntimeUpvalues,
     // may be discarded in arbitrary order, so there's no single owner of value. What is more, variables captured in closures can live
     // beyond the closure itself (eg. by being stored in object field).
-    std::variant<OpenLocator, ClosedLocator> val;
-
-  public:
-    explicit RuntimeUpvalue(std::vector<Value>& stack, size_t index) : val{OpenLocator{stack, index}} {};
-    Value* value();
-    // TODO: Add const override for read-only access.
-    void close() { val = ClosedLocator(*this->value()); }
-    size_t stack_index() const { return std::get<OpenLocator>(val).index; }
+    upvalue_ptr next{};
+    // Intrusive link in VM's list of open upvalues. Meaningless once closed.
   };
 
   struct Closure {
-    explicit Closure(function_ptr function) : function{function} {
-      upvalues.reserve(function->upvalue_count);
-    };
+    // Closure and its upvalues live in a single allocation: upvalue_count gc_ptrs are stored
+    // inline right after the object, like clox's flexible array member. Functions that capture
+    // nothing are never wrapped in a Closure, VM calls them directly (see OP_CLOSURE).
+    static std::unique_ptr<Closure> create(function_ptr function);
+    // Hand the result to gc_heap::manage.
+    Closure(const Closure&)            = delete;
+    Closure& operator=(const Closure&) = delete;
+    ~Closure()                         = default;
+    // Trailing upvalues are trivially destructible, so the implicit destructor is enough.
+
+    upvalue_ptr* upvalues() { return reinterpret_cast<upvalue_ptr*>(this + 1); }
+    const upvalue_ptr* upvalues() const { return reinterpret_cast<const upvalue_ptr*>(this + 1); }
+    int upvalue_count() const { return function->upvalue_count; }
+
+    static void operator delete(void* ptr) { ::operator delete(ptr); }
+    // Used by std::unique_ptr<Closure>'s default deleter.
+
     function_ptr function;
-    std::vector<upvalue_ptr> upvalues;
+
+  private:
+    explicit Closure(function_ptr function);
+    static void* operator new(size_t size, int upvalue_count);
+    static void operator delete(void* ptr, int upvalue_count) { ::operator delete(ptr); }
+    // Only called if constructor throws.
   };
 
 
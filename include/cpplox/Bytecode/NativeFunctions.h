@@ -8,4 +8,12 @@ namespace cpplox {
 
 Value clock(int arg_count, std::span<Value> args);
 // Value concat(int arg_count, std::span<Value> args);
+
+struct NativeDefinition {
+  const char* name;
+  Value (*func)(int arg_count, std::span<Value> args);
+};
+
+inline constexpr NativeDefinition natives[]{{"clock", clock}};
+// Every native VM defines as a global, snapshots refer to natives by index.
 }
\ No newline at end of file
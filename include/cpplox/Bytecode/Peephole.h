@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "cpplox/Bytecode/Chunk.h"
+
+namespace cpplox {
+
+  class PeepholeOptimizer {
+    // Rewrites a finished chunk in place without changing its behaviour:
+    //  - drops values pushed only to be popped (OP_GET_LOCAL x; OP_POP),
+    //  - keeps an assigned value on the stack instead of popping and reloading it
+    //    (OP_SET_LOCAL x; OP_POP; OP_GET_LOCAL x),
+    //  - turns OP_NOT; OP_JUMP_IF_FALSE into OP_JUMP_IF_TRUE when both paths pop the
+    //    tested value, and the "or" jump pair into a single OP_JUMP_IF_TRUE,
+    //  - threads chains of jumps and replaces jumps to OP_RETURN with OP_RETURN,
+    //  - removes code no path reaches, eg. OP_NIL; OP_RETURN after explicit return.
+    // Jump offsets and lines are recomputed. Runs once at compile time, so
+    // the VM pays nothing for it.
+    struct Instruction {
+      OpCode op;
+      std::vector<uint8_t> operands{};
+      int line{0};
+      size_t target{0};
+      // Jumps only: index of the instruction this jump lands on.
+      bool removed{false};
+    };
+
+  public:
+    void optimize(Chunk& chunk) const;
+
+  private:
+    std::vector<Instruction> decode(const Chunk& chunk) const;
+    bool encode(const std::vector<Instruction>& instructions, Chunk& chunk) const;
+    // Returns false, leaving chunk untouched, if a jump no longer fits its operand.
+    bool thread_jumps(std::vector<Instruction>& instructions) const;
+    bool rewrite_patterns(std::vector<Instruction>& instructions) const;
+    bool remove_unreachable(std::vector<Instruction>& instructions) const;
+    void compact(std::vector<Instruction>& instructions) const;
+    // Erases removed instructions, jumps to them land on the next remaining one.
+  };
+
+}  // namespace cpplox
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <variant>
+#include <vector>
+
+#include "cpplox/Treewalk/ErrorReporter.h"
+#include "cpplox/Bytecode/Compiler.h"
+#include "cpplox/Bytecode/Debug.h"
+#include "cpplox/Bytecode/GC.h"
+#include "cpplox/Bytecode/Jit.h"
+#include "cpplox/Bytecode/StringPool.h"
+#include "cpplox/Bytecode/VM.h"
+
+namespace cpplox {
+
+  using clox::ErrorsAndDebug::ErrorReporter;
+
+  using HostValue = std::variant<std::monostate, bool, double, std::string>;
+  // Values passed between Runtime and the program embedding it, nil is monostate.
+
+  class Runtime {
+    // Embedding API: owns a heap, a string pool and one VM for as long as the host
+    // keeps it, so a script is compiled once and its functions are called any
+    // number of times without setting anything up again. Interned strings, globals
+    // and code Jit compiled stay around between calls, each call starts from an
+    // empty stack whatever the previous one left behind.
+  public:
+    struct Script {
+      size_t index;
+    };
+
+    explicit Runtime(std::ostream& output = std::cout, const CompilerOptions& options = {});
+    // output gets what scripts print.
+    Runtime(const Runtime&)            = delete;
+    Runtime& operator=(const Runtime&) = delete;
+    ~Runtime();
+
+    std::optional<Script> compile(const std::string& source);
+    // Compiles source and runs its top-level code once, defining its globals.
+    // nullopt after a compile or runtime error.
+    std::optional<HostValue> call(Script script, const std::string& function, std::span<const HostValue> args);
+    // Calls a function script declared at top level, even if a later script
+    // redefined its name. nullopt if there's no such function, the call fails or
+    // returns a function, which can't leave VM.
+    std::string errors() { return e_reporter.to_string(); }
+    // Of the last compile or call.
+
+  private:
+    gc_heap heap{};
+    StringPool pool{&heap};
+    ErrorReporter e_reporter{};
+    std::ofstream log_output{};
+    // Never opened, Runtime doesn't log.
+    const Disassembler disassembler{log_output};
+    const CompilerOptions options;
+    Jit jit{};
+    VM vm;
+    function_ptr host;
+    // Empty script whose frame calls run on top of.
+    std::vector<std::unordered_map<std::string, function_ptr>> scripts{};
+    // Top-level functions of each script by name.
+    std::vector<Value> in_flight{};
+    // Callee and converted arguments of a call that isn't running yet.
+
+    Value to_vm(const HostValue& v);
+    void mark_roots();
+  };
+
+}  // namespace cpplox
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <cstdint>
+
+#include "cpplox/Bytecode/LoxObject.h"
+#include "cpplox/Bytecode/Value.h"
+
+namespace cpplox {
+  class VM;
+}
+
+extern "C" {
+  // What native code produced by Jit calls for anything it doesn't do inline,
+  // wrapping VM's interface for compiled code. C linkage gives them names that
+  // stencils (see CopyAndPatch) can refer to. Compiled code keeps VM's stack
+  // top only in its head, top passes the height it reached.
+
+  cpplox::Value* cpplox_slots(cpplox::VM* vm);
+  // First stack slot of the current frame.
+  bool cpplox_step(cpplox::VM* vm, cpplox::Value* top, const uint8_t* ip);
+  bool cpplox_call(cpplox::VM* vm, cpplox::Value* top, const uint8_t* return_ip, uint64_t arg_count);
+  cpplox::CompiledStatus cpplox_tail_call(cpplox::VM* vm, cpplox::Value* top, const uint8_t* return_ip,
+                                          uint64_t arg_count);
+  cpplox::CompiledStatus cpplox_return(cpplox::VM* vm, cpplox::Value* top);
+  void cpplox_equal(cpplox::Value* lhs);
+  // lhs[0] = lhs[0] == lhs[1]
+  void cpplox_not(cpplox::VM* vm, cpplox::Value* value);
+  bool cpplox_not_callee(const cpplox::Value* callee, const cpplox::Value* inlined);
+  void cpplox_get_upvalue(cpplox::VM* vm, cpplox::Value* destination, uint64_t index);
+  void cpplox_set_upvalue(cpplox::VM* vm, const cpplox::Value* source, uint64_t index);
+  void cpplox_resume(cpplox::VM* vm, cpplox::Value* top, const uint8_t* ip);
+  // Hands the frame back to the interpreter at ip, for traces leaving their path.
+}
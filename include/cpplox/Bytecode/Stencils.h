@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+
+#include "cpplox/Bytecode/SlowPaths.h"
+
+extern "C" {
+  // Holes of stencils (see CopyAndPatch): never defined, CopyAndPatch writes the
+  // value each stands for wherever a stencil refers to its address. Numbers are
+  // read as the address itself.
+  extern char cpplox_hole_a[];
+  extern char cpplox_hole_b[];
+  // Stack slots and operands.
+  extern char cpplox_hole_constant[];
+  // Address of a Value in the chunk's constants.
+  extern char cpplox_hole_ip[];
+  // Address in the chunk's code, for cpplox_step and as calls' return address.
+  cpplox::CompiledStatus cpplox_hole_continue(cpplox::VM* vm, cpplox::Value* slots);
+  // The next instruction's code.
+  cpplox::CompiledStatus cpplox_hole_jump(cpplox::VM* vm, cpplox::Value* slots);
+  // The code of the instruction a jump lands on.
+}
+
+namespace cpplox {
+
+  struct StencilHole {
+    uint32_t offset;
+    // Where in the stencil's code a 64 bit absolute address goes.
+    std::string_view symbol;
+    int64_t addend;
+  };
+
+  struct Stencil {
+    std::string_view name;
+    std::span<const uint8_t> code;
+    std::span<const StencilHole> holes;
+    uint32_t fallthrough_size;
+    // Size without the trailing jump to cpplox_hole_continue, if the stencil
+    // ends with one: stitched right before the next instruction's code, the
+    // jump isn't needed.
+  };
+
+}  // namespace cpplox
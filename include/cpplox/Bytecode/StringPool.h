@@ -3,6 +3,7 @@
 #include "cpplox/Bytecode/Value.h"
 #include "cpplox/Bytecode/LoxObject.h"
 
+#include <optional>
 #include <string_view>
 #include <unordered_map>
 
@@ -16,6 +17,7 @@ namespace cpplox {
     //            pointer, so custom destructor there won't help.
     //          - make gc_heap accept callbacks invoked before objects are destroyed.
     gc_heap* const heap;   
+    const StringPool* const shared {nullptr};
     std::unordered_map<std::string_view, const_string_ptr> ptr_by_content {};
       
   public:
@@ -32,7 +34,16 @@ namespace cpplox {
     // but deleting to be explicit.
 
     explicit StringPool(gc_heap* const heap) : heap{heap} {};
+    StringPool(gc_heap* const heap, const StringPool* const shared) : heap{heap}, shared{shared} {};
+    // Strings shared already holds are returned from there, only the others are
+    // allocated on heap, so each content still has a single pointer. shared must
+    // not change any more (eg. frozen with its heap, see SharedScript): lookups
+    // into it take no lock and may run on several threads at once.
     const_string_ptr insert_or_get(std::string_view sv);
+    std::optional<const_string_ptr> find(std::string_view sv) const;
+    void mark_strings() const;
+    // Marks every interned string, for pools whose strings all have to outlive
+    // collections.
   };
 
 }; // namespace cpplox
\ No newline at end of file
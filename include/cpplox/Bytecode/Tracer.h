@@ -0,0 +1,108 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "cpplox/Bytecode/Chunk.h"
+#include "cpplox/Bytecode/LoxObject.h"
+
+namespace cpplox {
+
+  struct CallFrame;
+
+  struct TraceStep {
+    uint32_t offset;
+    // Of the instruction in its chunk.
+    uint16_t height;
+    // Stack slots of the frame in use before it ran.
+    std::array<uint8_t, 2> types{no_type, no_type};
+    // Alternatives (see Value) of what it read while recording, in operand order:
+    // the local for OP_GET_LOCAL, otherwise values from the top of the stack.
+
+    static constexpr uint8_t no_type{UINT8_MAX};
+  };
+
+  struct TraceOp {
+    // Instruction of an optimised trace, see Trace::optimize. Operates on stack
+    // slots of the loop's frame, a and b, and keeps the chunk's semantics only for
+    // the types the trace was specialised to: ops that may see other types are
+    // preceded by guards.
+    enum class Kind : uint8_t {
+      NUMBER,          // a = number
+      BOOL,            // a = flag
+      NIL,             // a = nil
+      CONSTANT,        // a = chunk's constants[b]
+      MOVE,            // a = b, flag if known to be a number
+      GUARD_NUMBER,    // exit unless a holds a number
+      ARITHMETIC,      // a = a op b, both numbers
+      NEGATE,          // a = -a, a number
+      COMPARE,         // a = a op b, both numbers
+      BRANCH_COMPARE,  // exit unless (a op b) == flag, both numbers
+      BRANCH,          // exit unless a's truthiness is flag
+      NOT_CALLEE,      // exit unless (a != chunk's constants[b]) == flag
+      CALL,            // the OP_CALL at offset, b arguments
+      STEP,            // the instruction at offset, interpreted
+      LOOP_START,      // iterations start here, ops before it run once
+      LOOP,            // back to LOOP_START
+    };
+
+    Kind kind;
+    OpCode op{OpCode::OP_NOOP};
+    // ARITHMETIC, COMPARE and BRANCH_COMPARE: the instruction they do.
+    uint16_t a{0};
+    uint16_t b{0};
+    double number{0};
+    bool flag{false};
+    uint32_t offset{0};
+    uint16_t height{0};
+    // Where ops that may exit resume interpreting, and the stack height there.
+    // For CALL and STEP, the instruction they run.
+  };
+
+  struct Trace {
+    // Instructions a loop's frame ran on one iteration, from the loop's header to
+    // the OP_LOOP jumping back to it. Instructions of functions it called aren't
+    // part of it, their calls are.
+    const Function* function{nullptr};
+    uint32_t header{0};
+    std::vector<TraceStep> steps{};
+
+    std::optional<std::vector<TraceOp>> optimize() const;
+    // Specialises steps to the types they saw: constants are folded and
+    // propagated, and a value needs a guard only where its type isn't known yet.
+    // Locals that hold numbers on every iteration are checked once before the
+    // loop starts, which lets code generators keep them unboxed in registers.
+    // Conditional jumps become guards on the direction they took, so the result
+    // is one linear path. nullopt if the steps use what traces don't support.
+  };
+
+  class TraceRecorder {
+    // Watches the interpreter run a hot loop's next iteration (VM::run calls
+    // record before each instruction), up to the back edge that closes it.
+  public:
+    enum class Status : uint8_t { RECORDING, DONE, ABORTED };
+
+    TraceRecorder(const Function& function, uint32_t header, size_t depth)
+        : trace{&function, header}, loop_depth{depth} {}
+
+    Status record(const CallFrame& frame, size_t frame_depth, const Value* top);
+    // frame is the current one, at depth frame_depth, with its ip past the opcode
+    // of the instruction about to run. Gives up on returns, tail calls, _LONG
+    // instructions and very long iterations. Loops closed by OP_LOOP_LONG are
+    // profiled like the others, but their back edge is wide: recording them
+    // always gives up and they stay interpreted.
+    const Trace& recorded() const { return trace; }
+    size_t depth() const { return loop_depth; }
+
+    static constexpr size_t max_steps{1024};
+
+  private:
+    Trace trace;
+    size_t loop_depth;
+    // Of the loop's frame, frames above it are callees.
+  };
+
+}  // namespace cpplox
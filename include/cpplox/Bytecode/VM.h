@@ -3,8 +3,11 @@
 #include <cassert>
 #include <fstream>
 #include <unordered_map>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <span>
 #include <vector>
-#include <list>
 
 #include "cpplox/Treewalk/ErrorReporter.h"
 // TODO: Move above to common/per-functionality to break dependency.
@@ -14,11 +17,13 @@
 #include "cpplox/Bytecode/Value.h"
 #include "cpplox/Bytecode/NativeFunctions.h"
 #include "cpplox/Bytecode/StringPool.h"
+#include "cpplox/Bytecode/Tracer.h"
 
 
 namespace cpplox {
 
 using clox::ErrorsAndDebug::ErrorReporter;
+class Jit;
 
 
 enum class InterpretResult {
@@ -26,18 +31,20 @@ enum class InterpretResult {
   INTERPRET_RUNTIME_ERROR = 1
 };
 
-class CallFrame {
-  // Represents a single ongoing function call.
- public:
-  explicit CallFrame(const Closure& closure, size_t ip, size_t stack_offset)
-      : closure{closure}, ip{ip}, stack_offset{stack_offset} {};
-  const Closure& closure;
-  size_t ip{0};
-  size_t stack_offset{0};
+struct CallFrame {
+  // Represents a single ongoing function call. Frames live in VM's preallocated
+  // frames array and are reused, so a call only fills in these fields.
+  const Function* function{nullptr};
+  upvalue_ptr* upvalues{nullptr};
+  // Inline upvalues of the called Closure, nullptr when a Function that captures
+  // nothing is called directly.
+  const uint8_t* ip{nullptr};
+  // Next byte to read from function's chunk.
+  Value* slots{nullptr};
   // Local variable slots calculated by compiler are relative to function's
   // start (0th index is reserved, 1st local variable = 1, 2nd = 1, ...).
   // However, the VM has a single stack shared across many function invocations,
-  // so to access the correct stack index, each CallFrame stores the first stack
+  // so to access the correct stack slot, each CallFrame points to the first stack
   // slot that it can use.
 };
 
@@ -45,22 +52,80 @@ class VM {
  public:
   explicit VM(std::ostream& output, const Disassembler& disassembler,
               ErrorReporter& e_reporter, gc_heap* const heap,
-              StringPool* const pool, std::ofstream& log_output)
+              StringPool* const pool, std::ofstream& log_output,
+              Jit* const jit = nullptr,
+              size_t max_callstack_depth = DEFAULT_MAX_CALLSTACK_DEPTH)
       : output(output),
         disassembler{disassembler},
         e_reporter(e_reporter),
         heap{heap},
         pool{pool},
-        log_output{log_output} {
+        log_output{log_output},
+        jit{jit},
+        stack_size{(max_callstack_depth + 1) * FRAME_SLOTS},
+        stack{std::allocator<Value>{}.allocate(stack_size)},
+        stack_top{stack},
+        frames(max_callstack_depth) {
           register_gc_callbacks();
-          globals.insert_or_assign(pool->insert_or_get("clock"), heap->make<NativeFn>(cpplox::clock));
+          for (const NativeDefinition& native : natives) {
+            globals.insert_or_assign(pool->insert_or_get(native.name), heap->make<NativeFn>(native.func));
+          }
         };
+  VM(const VM&)            = delete;
+  VM& operator=(const VM&) = delete;
+  VM(VM&&)                 = delete;
+  VM& operator=(VM&&)      = delete;
+  // VM owns raw stack memory that open upvalues and frames point into.
+  ~VM() {
+    heap->deregister_root_marking_callback();
+    std::allocator<Value>{}.deallocate(stack, stack_size);
+  }
+  // Callbacks registered after the VM's (eg. by its host) have to be gone by now.
 
   InterpretResult interpret(function_ptr func);
-  // interpret() can only be called once, very meh but simpler for now.
-  // TODO: Consider param to constructor (similar to Compiler.h) to make
-  // contract explicit.
-  static const int MAX_CALLSTACK_DEPTH = 128;
+  // Can be called again with another script, eg. the REPL's next line: globals
+  // and everything they reach persist, a runtime error only discards the stack
+  // (after closing its captured variables).
+  void enter(function_ptr script);
+  // Alternative to interpret for hosts running parts of a program themselves (see
+  // WarmStart): sets up script's frame without running it, call_value and resume
+  // then run code on top of it.
+  std::optional<Value> call_value(Value callee, std::span<const Value> args,
+                                  std::optional<int> host_line = std::nullopt);
+  // Calls callee from outside of Lox code and runs it to completion, nullopt after
+  // a runtime error. Given the line of the host's call site, errors of the call
+  // itself report it and tracing stops at callee, the host traces its own frames
+  // (see WarmStart).
+  InterpretResult resume(size_t offset);
+  // Runs the entered script from offset in its chunk until it returns.
+  Value* global(const_string_ptr name);
+  // nullptr if name isn't defined.
+  void define_global(const_string_ptr name, Value val) { globals.insert_or_assign(name, val); }
+  const std::unordered_map<const_string_ptr, Value>& all_globals() const { return globals; }
+  static const size_t DEFAULT_MAX_CALLSTACK_DEPTH = 4096;
+  static const size_t FRAME_SLOTS = std::numeric_limits<uint8_t>::max() + 1;
+  // Each frame addresses at most 256 local slots.
+
+  // Interface for compiled code (see Function::compiled). Compiled code runs with
+  // its function's CallFrame current and addresses stack slots from frame().slots.
+  // Before calling any member below it stores the stack height it reached in
+  // top() and, for anything that can fail or call, the end of the instruction in
+  // frame().ip: runtime errors take their line from it, as they do when
+  // interpreting.
+  CallFrame& frame() const { return *curr_frame; }
+  Value*& top() { return stack_top; }
+  bool step(const uint8_t* ip);
+  // Interprets the single instruction at ip, for anything compiled code doesn't
+  // implement itself. Not for calls, returns and jumps.
+  bool compiled_call(uint8_t arg_count);
+  // Calls the value below the arguments and runs the callee to completion, its
+  // result takes callee's slot.
+  CompiledStatus compiled_tail_call(uint8_t arg_count);
+  // TAIL_CALLED if the callee took over the frame, compiled code returns that
+  // status right away. RETURNED if the callee was called the regular way and
+  // has already returned.
+  CompiledStatus compiled_return();
+  bool is_falsey(Value val) const;
 
  private:
   std::ostream& output;
@@ -69,6 +134,8 @@ class VM {
   gc_heap* const heap;
   StringPool* const pool;
   std::ofstream& log_output;
+  Jit* const jit;
+  // Compiles functions that get hot, nullptr to only interpret.
   std::unordered_map<const_string_ptr, Value> globals;
   // Global variables are resolved dynamically (code referring to a global
   // variable before it's defined is valid, as long as this code is executed
@@ -82,28 +149,52 @@ class VM {
   // (which Compiler does) Further details:
   // https://craftinginterpreters.com/local-variables.html#representing-local-variables
   // TODO: What would it mean to compile a global variable?
-  std::vector<Value> stack;
-  // TODO: Bound the stack & throw error if exceeded.
-  std::list<upvalue_ptr> open_upvalues{};
-  // Captured values that are still in lexical scope (therefore on stack) and
-  // can be directly referenced in other closures. TODO: adding classes
-  // and fields can change the meaning of this list. Ordered by increasing
-  // stack index (head is closest to stack bottom, tail to stack top).
+  const size_t stack_size;
+  Value* const stack;
+  Value* stack_top;
+  // Allocated once for the deepest allowed call chain and never reallocated:
+  // frames and open RuntimeUpvalues hold raw pointers to its slots. Slots in
+  // [stack, stack_top) are live; Value is trivially destructible, so popping
+  // is just moving stack_top.
+  upvalue_ptr open_upvalues{};
+  // Head of an intrusive list (linked through RuntimeUpvalue::next) of captured
+  // variables that are still in lexical scope (therefore on stack) and can be
+  // directly referenced in other closures. Ordered by decreasing stack slot, so
+  // head is closest to stack top and both lookups and closing stop early.
 
+  std::vector<CallFrame> frames;
+  size_t frame_count{0};
+  // Sized to max_callstack_depth up front, calls and returns only move
+  // frame_count and curr_frame.
   CallFrame* curr_frame{nullptr};
-  const Function* curr_fun{nullptr};
-  std::vector<CallFrame> call_frames;
-  // TODO: Consider preallocating & reusing a pool of objects to make function
-  // calls faster.
-  bool already_called{false};
+  std::optional<int> host_line{};
+  // Set during call_value, for the script frame host's call runs on top of.
+  std::optional<TraceRecorder> recorder{};
+  // Set while recording a hot loop's iteration for jit.
 
-  InterpretResult run();
+  void push(const Value val) { std::construct_at(stack_top++, val); }
+  Value pop() { return *--stack_top; }
+  Value& peek(const size_t distance = 0) const { return stack_top[-1 - distance]; }
+
+  template <bool single_step>
+  InterpretResult run(size_t exit_depth);
+  // Interprets until the frame at exit_depth + 1 returns, or one instruction.
+  bool enter_compiled();
+  // Runs the current frame if its function has compiled code and hasn't
+  // started, following tail calls into other compiled functions.
+  bool enter_trace();
+  // At a loop's header after its back edge: runs the loop's trace if it has
+  // one, otherwise profiles the loop and starts recording it once hot.
+  void record_step();
+  void pop_frame();
+  void reset_stack();
+  // Drops whatever a runtime error left behind.
   void register_gc_callbacks() const;
-  const upvalue_ptr add_or_get_upvalue(size_t stack_index);
-  void close_upvalues(size_t last);
-  void update_frame_pointers();
+  const upvalue_ptr add_or_get_upvalue(Value* local);
+  void close_upvalues(const Value* last);
   bool call(uint8_t arg_count);
-  bool is_falsey(Value val) const;
+  bool tail_call(uint8_t arg_count);
+  bool call_function(const Function& function, upvalue_ptr* upvalues, uint8_t arg_count);
   void set_runtime_error(std::string err_msg) const;
   void trace_execution() const;
   template <typename T>
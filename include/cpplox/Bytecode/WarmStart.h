@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "cpplox/Treewalk/ErrorReporter.h"
+#include "cpplox/Treewalk/Interpreter.h"
+#include "cpplox/Treewalk/Token.h"
+#include "cpplox/Bytecode/Compiler.h"
+#include "cpplox/Bytecode/Debug.h"
+#include "cpplox/Bytecode/GC.h"
+#include "cpplox/Bytecode/Jit.h"
+#include "cpplox/Bytecode/StringPool.h"
+#include "cpplox/Bytecode/VM.h"
+
+namespace cpplox {
+
+  using clox::ErrorsAndDebug::ErrorReporter;
+
+  class WarmStart : public clox::GlobalBinding {
+    // Runs a program with the tree-walking interpreter while a worker thread
+    // compiles it, and hands it over to VM once the bytecode is ready: the rest of
+    // the current top-level statement keeps walking the tree but every call it
+    // makes from then on runs compiled, and the following statements run in VM
+    // from their offset in the script's chunk (see CompilerOptions::resumable).
+    // Globals move to VM when it takes over and the tree-walker reads and writes
+    // them there, converting values between the two engines. Closures the
+    // tree-walker created can't be converted: while a global holds one, VM only
+    // runs calls and the tree-walker keeps running top-level statements.
+    //
+    // The worker only allocates on heap and reports compile errors to e_reporter,
+    // the main thread touches neither before it joined the worker. Errors of both
+    // engines end up in e_reporter, runtime ones in VM's format.
+  public:
+    WarmStart(std::ostream& output, const Disassembler& disassembler, ErrorReporter& e_reporter, gc_heap* heap,
+              StringPool* pool, std::ofstream& log_output, Jit* jit, const CompilerOptions& options,
+              size_t max_callstack_depth = VM::DEFAULT_MAX_CALLSTACK_DEPTH);
+    WarmStart(const WarmStart&)            = delete;
+    WarmStart& operator=(const WarmStart&) = delete;
+    ~WarmStart() override;
+
+    void run(const std::vector<const Token>& tokens);
+    // Can only be called once. tokens must outlive the call.
+
+    std::optional<clox::Value> get(const std::string& name) override;
+    bool assign(const std::string& name, const clox::Value& v) override;
+    void define(const std::string& name, const clox::Value& v) override;
+
+  private:
+    class CompiledCallable;
+    struct Wrapper {
+      Value value;
+      std::weak_ptr<CompiledCallable> callable;
+    };
+
+    const Disassembler& disassembler;
+    ErrorReporter& e_reporter;
+    gc_heap* heap;
+    StringPool* pool;
+    CompilerOptions options;
+    VM vm;
+
+    std::thread worker{};
+    std::atomic<bool> compiled{false};
+    // Set by the worker once script, offsets and functions are written.
+    std::optional<function_ptr> script{};
+    std::vector<size_t> offsets{};
+    std::vector<function_ptr> functions{};
+    bool active{false};
+    // VM took over: globals live there.
+    std::unordered_map<const void*, Wrapper> wrappers{};
+    // Callables of VM the tree-walker holds, by object, declared before
+    // everything that may hold one.
+
+    ErrorReporter tree_reporter{};
+    std::vector<clox::StmtPtr> statements{};
+    std::unordered_map<const clox::FunctionStmt*, function_ptr> compiled_functions{};
+    std::unordered_map<const Function*, const clox::FunctionStmt*> declarations{};
+    // Top-level functions of both engines, matched by their order in the source.
+    std::unordered_map<std::string, clox::Value> tree_only{};
+    // Globals holding values VM can't represent.
+    std::vector<Value> in_flight{};
+    // Converted arguments of a call that isn't running yet.
+    clox::Interpreter interpreter;
+    // Last, so wrappers it holds go before the members they unregister from.
+
+    bool poll();
+    // Takes over once the worker is done, false while it isn't. Throws if
+    // compiling failed.
+    void activate();
+    void finish();
+    // Joins the worker.
+    clox::Value call(Value callee, const std::vector<clox::Value>& args);
+    std::optional<Value> to_vm(const clox::Value& v);
+    // nullopt for values only the tree-walker has.
+    clox::Value to_tree(Value v);
+    void store(const std::string& name, const_string_ptr key, const clox::Value& v);
+    void report(const clox::RuntimeException& e);
+    // Reports an error the tree-walker raised (or unwound) the way VM does.
+    static std::string name_of(const clox::CallableSharedPtr& callable);
+    // Function's name as VM traces it.
+    void mark_roots() const;
+  };
+
+}  // namespace cpplox
@@ -1,7 +1,9 @@
 #pragma once
+#include <functional>
 #include <iostream>
 #include <map>
 #include <memory>
+#include <optional>
 #include <variant>
 #include <vector>
 
@@ -30,6 +32,21 @@ class RuntimeException : public std::runtime_error {
   RuntimeException(const std::string& msg, int ln)
       : std::runtime_error(msg.c_str()), line_number(ln) {}
   const int line_number{};
+  std::vector<std::pair<CallableSharedPtr, int>> calls{};
+  // Calls the error unwound, innermost first: callee and the line it was called
+  // on. Hosts trace them (see cpplox::WarmStart).
+};
+
+/*
+ * Calling a value that isn't callable or with the wrong number of arguments. Keeps
+ * both so hosts can word the error their own way.
+ */
+class CallError : public RuntimeException {
+ public:
+  CallError(const std::string& msg, int ln, Value callee, size_t arg_count)
+      : RuntimeException(msg, ln), callee(callee), arg_count(arg_count) {}
+  const Value callee;
+  const size_t arg_count;
 };
 
 /*
@@ -57,9 +74,23 @@ class Callable {
   virtual ~Callable(){};
   virtual Value call(Interpreter& intp, const std::vector<Value>& args) = 0;
   virtual int arity() = 0;
+  // Negative if any number of arguments is fine.
   virtual std::string to_string() = 0;
 };
 
+/*
+ * Storage for global variables that lives outside of Environment, eg. in another
+ * engine running the same program (see cpplox::WarmStart).
+ */
+class GlobalBinding {
+ public:
+  virtual ~GlobalBinding() = default;
+  virtual std::optional<Value> get(const std::string& name) = 0;
+  virtual bool assign(const std::string& name, const Value& v) = 0;
+  // Returns false if name isn't defined.
+  virtual void define(const std::string& name, const Value& v) = 0;
+};
+
 class Environment;
 /*
  * Callable does not take ownership of FunctionStmt as this object is owned by
@@ -77,6 +108,7 @@ class Function : public Callable {
   Value call(Interpreter& intp, const std::vector<Value>& args) override;
   int arity() override;
   std::string to_string() override { return name; }
+  const FunctionStmt& get_declaration() const { return declaration; }
 
  private:
   const FunctionStmt& declaration;
@@ -113,10 +145,13 @@ class Environment {
   void assign_at_distance(Token name, Value v, int dist);
   Value get(Token name);
   Value get_at_distance(Token name, int distance);
+  void bind(GlobalBinding* in_binding);
+  // Moves this environment's entries to binding, which holds them from now on.
 
  private:
   std::map<std::string, Value> values{};
   std::shared_ptr<Environment> enclosing;
+  GlobalBinding* binding{nullptr};
 };
 
 /*
@@ -148,6 +183,8 @@ class Interpreter : public ExprVisitor, public StmtVisitor {
   };
 
   void interpret(const std::vector<StmtPtr>& statements);
+  void execute(const clox::Stmt::Stmt& statement);
+  // Runs a single statement, RuntimeException is left to the caller.
   void resolve(const clox::Expr::Expr& expr, int distance);
 
   void visitBinary(const BinaryExpr& binary_expr);
@@ -175,6 +212,13 @@ class Interpreter : public ExprVisitor, public StmtVisitor {
   std::shared_ptr<Environment> current_env;
   std::shared_ptr<Environment> global_env;
   std::map<const clox::Expr::Expr*, int> locals{};
+  std::function<void()> before_call{};
+  // Runs before each call expression evaluates its callee, lets hosts change what
+  // the callee resolves to.
+  int call_line{0};
+  // Line of the call being made, for hosts' callables.
+  size_t depth{0};
+  // Calls in progress.
 
  private:
   // TODO: How to default initialize those well? Is constructor enough or
@@ -0,0 +1,243 @@
+#include "cpplox/Bytecode/AotCompiler.h"
+
+#include <cctype>
+#include <filesystem>
+#include <sstream>
+#include <vector>
+
+#include "cpplox/Bytecode/BytecodeFile.h"
+#include "cpplox/Bytecode/IR.h"
+
+namespace cpplox {
+
+namespace {
+const char* binary_operator(OpCode op) {
+  switch (op) {
+    case OpCode::OP_ADD:
+    case OpCode::OP_ADD_NN:
+      return "+";
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_SUBTRACT_NN:
+      return "-";
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_MULTIPLY_NN:
+      return "*";
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_DIVIDE_NN:
+      return "/";
+    case OpCode::OP_GREATER:
+    case OpCode::OP_GREATER_NN:
+      return ">";
+    case OpCode::OP_LESS:
+    case OpCode::OP_LESS_NN:
+      return "<";
+    default:
+      return nullptr;
+  }
+}
+
+bool is_checked_arithmetic(OpCode op) {
+  return op == OpCode::OP_ADD || op == OpCode::OP_SUBTRACT || op == OpCode::OP_MULTIPLY ||
+         op == OpCode::OP_DIVIDE || op == OpCode::OP_GREATER || op == OpCode::OP_LESS;
+}
+
+std::string number(size_t slot) {
+  return "*std::get_if<double>(&s[" + std::to_string(slot) + "])";
+}
+}  // namespace
+
+std::string AotCompiler::program_name(std::string_view path) {
+  std::string name{std::filesystem::path(path).stem().string()};
+  for (char& c : name) {
+    if (!std::isalnum(static_cast<unsigned char>(c))) c = '_';
+  }
+  if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) name = "program_" + name;
+  return name;
+}
+
+std::optional<std::string> AotCompiler::translate(function_ptr script, std::string_view name) const {
+  const std::optional<std::string> bytecode{BytecodeWriter().serialize(script)};
+  if (!bytecode) return std::nullopt;
+  const std::vector<function_ptr> functions{BytecodeWriter::functions_of(script)};
+
+  std::ostringstream out{};
+  out << "// Generated by cpplox --emit-cpp, do not edit.\n"
+      << "#include <variant>\n\n"
+      << "#include \"cpplox/Bytecode/AotCompiler.h\"\n"
+      << "#include \"cpplox/Bytecode/ByteCodeRunner.h\"\n"
+      << "#include \"cpplox/Bytecode/VM.h\"\n\n"
+      << "namespace {\n"
+      << "using namespace cpplox;\n\n"
+      << "constexpr uint8_t bytecode[] = {";
+  for (size_t i = 0; i < bytecode->size(); i++) {
+    out << (i % 16 == 0 ? "\n    " : " ") << static_cast<int>(static_cast<uint8_t>((*bytecode)[i])) << ",";
+  }
+  out << "\n};\n";
+
+  std::vector<bool> compiled(functions.size(), false);
+  for (size_t i = 0; i < functions.size(); i++) {
+    if (const std::optional<std::string> function = translate_function(*functions[i], i)) {
+      out << "\n" << *function;
+      compiled[i] = true;
+    }
+  }
+
+  out << "\nconstexpr CompiledEntry entries[] = {";
+  for (size_t i = 0; i < functions.size(); i++) {
+    out << "\n    " << (compiled[i] ? "function_" + std::to_string(i) : "nullptr") << ",";
+  }
+  out << "\n};\n"
+      << "}  // namespace\n\n"
+      << "namespace cpplox::aot {\n"
+      << "extern const AotProgram " << name << ";\n"
+      << "const AotProgram " << name << "{bytecode, entries};\n"
+      << "}  // namespace cpplox::aot\n\n"
+      << "#ifndef CPPLOX_AOT_NO_MAIN\n"
+      << "int main() {\n"
+      << "  cpplox::ByteCodeRunner().runCompiled(cpplox::aot::" << name << ");\n"
+      << "  return 0;\n"
+      << "}\n"
+      << "#endif\n";
+  return out.str();
+}
+
+std::optional<std::string> AotCompiler::translate_function(const Function& function, size_t index) const {
+  const std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(*function.chunk, function.arity)};
+  if (!cfg) return std::nullopt;
+
+  std::vector<bool> is_target(cfg->blocks.size(), false);
+  for (const ir::BasicBlock& block : cfg->blocks) {
+    if (!block.entry_height) continue;
+    for (const ir::Node& node : block.nodes) {
+      if (ir::is_jump(node.op)) is_target[node.target] = true;
+    }
+  }
+
+  std::ostringstream out{};
+  out << "CompiledStatus function_" << index << "(VM& vm) {\n"
+      << "  // " << *function.name << "\n"
+      << "  CallFrame& f{vm.frame()};\n"
+      << "  Value* const s{f.slots};\n"
+      << "  [[maybe_unused]] const uint8_t* const code{f.function->chunk->code.data()};\n"
+      << "  [[maybe_unused]] const Value* const k{f.function->chunk->constants.data()};\n";
+
+  size_t offset{0};
+  for (size_t b = 0; b < cfg->blocks.size(); b++) {
+    const ir::BasicBlock& block{cfg->blocks[b]};
+    if (is_target[b]) out << " b" << b << ":;\n";
+    size_t h{block.entry_height.value_or(0)};
+    for (const ir::Node& node : block.nodes) {
+      const size_t at{offset};
+      const size_t end{offset + 1 + node.operands.size()};
+      offset = end;
+      if (!block.entry_height) continue;
+      // Unreachable, nothing jumps here.
+
+      const std::string top{"s[" + std::to_string(h - 1) + "]"};
+      const std::string sync{"  vm.top() = s + " + std::to_string(h) + ";\n"};
+      const std::string set_ip{"  f.ip = code + " + std::to_string(end) + ";\n"};
+      const std::string interpret{sync + "  if (!vm.step(code + " + std::to_string(at) +
+                                  ")) return CompiledStatus::RUNTIME_ERROR;\n"};
+      const std::string slow_path{"  } else {\n  " + sync + "    if (!vm.step(code + " + std::to_string(at) +
+                                  ")) return CompiledStatus::RUNTIME_ERROR;\n  }\n"};
+      // Else branch of a fast path for numbers.
+      const std::string label{node.target < cfg->blocks.size() ? "b" + std::to_string(node.target) : ""};
+      switch (node.op) {
+        case OpCode::OP_CONSTANT:
+          out << "  s[" << h << "] = k[" << static_cast<int>(node.operands[0]) << "];\n";
+          break;
+        case OpCode::OP_NIL:
+          out << "  s[" << h << "] = std::monostate{};\n";
+          break;
+        case OpCode::OP_TRUE:
+        case OpCode::OP_FALSE:
+          out << "  s[" << h << "] = " << (node.op == OpCode::OP_TRUE ? "true" : "false") << ";\n";
+          break;
+        case OpCode::OP_POP:
+        case OpCode::OP_NOOP:
+          break;
+        case OpCode::OP_GET_LOCAL:
+          out << "  s[" << h << "] = s[" << static_cast<int>(node.operands[0]) << "];\n";
+          break;
+        case OpCode::OP_SET_LOCAL:
+          out << "  s[" << static_cast<int>(node.operands[0]) << "] = " << top << ";\n";
+          break;
+        case OpCode::OP_GET_UPVALUE:
+          out << "  s[" << h << "] = *f.upvalues[" << static_cast<int>(node.operands[0]) << "]->location;\n";
+          break;
+        case OpCode::OP_SET_UPVALUE:
+          out << "  *f.upvalues[" << static_cast<int>(node.operands[0]) << "]->location = " << top << ";\n";
+          break;
+        case OpCode::OP_EQUAL:
+          out << "  s[" << h - 2 << "] = s[" << h - 2 << "] == " << top << ";\n";
+          break;
+        case OpCode::OP_NOT:
+          out << "  " << top << " = vm.is_falsey(" << top << ");\n";
+          break;
+        case OpCode::OP_NEGATE:
+          out << "  if (std::holds_alternative<double>(" << top << ")) {\n"
+              << "    " << top << " = -" << number(h - 1) << ";\n"
+              << slow_path;
+          break;
+        case OpCode::OP_ADD_NN:
+        case OpCode::OP_SUBTRACT_NN:
+        case OpCode::OP_MULTIPLY_NN:
+        case OpCode::OP_DIVIDE_NN:
+        case OpCode::OP_GREATER_NN:
+        case OpCode::OP_LESS_NN:
+          out << "  s[" << h - 2 << "] = " << number(h - 2) << " " << binary_operator(node.op) << " "
+              << number(h - 1) << ";\n";
+          break;
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+          out << "  goto " << label << ";\n";
+          break;
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_TRUE:
+          out << "  if (" << (node.op == OpCode::OP_JUMP_IF_TRUE ? "!" : "") << "vm.is_falsey(" << top
+              << ")) goto " << label << ";\n";
+          break;
+        case OpCode::OP_JUMP_IF_NOT_CALLEE:
+          out << "  if (s[" << h - 1 - node.operands[2] << "] != k[" << static_cast<int>(node.operands[3])
+              << "]) goto " << label << ";\n";
+          break;
+        case OpCode::OP_INLINED_RETURN:
+          out << "  s[" << h - 1 - node.operands[0] << "] = " << top << ";\n";
+          break;
+        case OpCode::OP_CALL:
+          out << sync << set_ip << "  if (!vm.compiled_call(" << static_cast<int>(node.operands[0])
+              << ")) return CompiledStatus::RUNTIME_ERROR;\n";
+          break;
+        case OpCode::OP_TAIL_CALL:
+          out << sync << set_ip << "  switch (vm.compiled_tail_call(" << static_cast<int>(node.operands[0])
+              << ")) {\n"
+              << "    case CompiledStatus::RETURNED: break;\n"
+              << "    case CompiledStatus::TAIL_CALLED: return CompiledStatus::TAIL_CALLED;\n"
+              << "    case CompiledStatus::RUNTIME_ERROR: return CompiledStatus::RUNTIME_ERROR;\n"
+              << "  }\n";
+          break;
+        case OpCode::OP_RETURN:
+          out << sync << "  return vm.compiled_return();\n";
+          break;
+        default:
+          if (is_checked_arithmetic(node.op)) {
+            out << "  if (std::holds_alternative<double>(s[" << h - 2 << "]) && std::holds_alternative<double>("
+                << top << ")) {\n"
+                << "    s[" << h - 2 << "] = " << number(h - 2) << " " << binary_operator(node.op) << " "
+                << number(h - 1) << ";\n"
+                << slow_path;
+            // Strings, and errors for everything else, take the interpreter's path.
+          } else {
+            out << interpret;
+            // Globals, printing, closures and closing upvalues.
+          }
+          break;
+      }
+      h = static_cast<size_t>(static_cast<int>(h) + ir::stack_effect(node));
+    }
+  }
+  out << "}\n";
+  return out.str();
+}
+
+}  // namespace cpplox
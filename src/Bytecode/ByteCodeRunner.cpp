@@ -1,37 +1,188 @@
 #include <cassert>
 #include <fstream>
 #include <iostream>
+#include <optional>
 
 #include "cpplox/Bytecode/ByteCodeRunner.h"
 #include "cpplox/Bytecode/Value.h"
 
 namespace cpplox {
 
+  namespace {
+    std::string read_source(const std::string& path) {
+      std::ifstream ifs(path);
+      return std::string((std::istreambuf_iterator<char>(ifs)),
+                         (std::istreambuf_iterator<char>()));
+    }
+  }  // namespace
+
   void ByteCodeRunner::runFile(const std::string& path) {
-    std::ifstream ifs(path);
-    std::string source((std::istreambuf_iterator<char>(ifs)),
-                      (std::istreambuf_iterator<char>()));
-    run(source);
+    if (BytecodeLoader::is_bytecode_file(path)) {
+      std::string error{};
+      const std::optional<function_ptr> maybe_function = load(path, error);
+      if (!maybe_function) {
+        output << "[Loading error] " << error << std::endl;
+        return;
+      }
+      execute(maybe_function.value());
+      return;
+    }
+    const std::string source{read_source(path)};
+    if (!cache && warm_start && !snapshot) {
+      run_warm(source);
+      return;
+    }
+    if (!cache) {
+      run(source);
+      return;
+    }
+
+    const std::string key{cache->key(source, program_options())};
+    if (const std::optional<std::filesystem::path> cached = cache->lookup(key)) {
+      std::string error{};
+      if (const std::optional<function_ptr> maybe_function = load(cached->string(), error)) {
+        execute(maybe_function.value());
+        return;
+      }
+      log_output << "Ignoring cached " << cached->string() << ": " << error << std::endl;
+      // Recompiling replaces the damaged entry.
+    }
+    const std::optional<function_ptr> maybe_function = compile(source, true);
+    if (!maybe_function) return;
+    if (const std::optional<std::string> bytes = BytecodeWriter().serialize(maybe_function.value())) {
+      cache->store(key, bytes.value());
+    }
+    execute(maybe_function.value());
+  }
+
+  void ByteCodeRunner::enable_cache(const std::string& directory, uintmax_t max_bytes) {
+    cache.emplace(directory, max_bytes);
+  }
+
+  bool ByteCodeRunner::compileFile(const std::string& path, const std::string& out_path) {
+    const std::optional<function_ptr> maybe_function = compile(read_source(path), true);
+    if (!maybe_function) return false;
+    if (!BytecodeWriter().write(maybe_function.value(), out_path)) {
+      output << "[Writing error] Can't write " << out_path << "." << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool ByteCodeRunner::snapshotFile(const std::string& path, const std::string& out_path) {
+    const std::optional<function_ptr> maybe_function = compile(read_source(path), true, false);
+    // Scripts started from the snapshot share the prelude's globals.
+    if (!maybe_function) return false;
+    VM vm(output, disassembler, e_reporter, &heap, &pool, log_output, use_jit ? &jit : nullptr,
+          max_callstack_depth);
+    vm.interpret(maybe_function.value());
+    if (e_reporter.has_error()) {
+      output << e_reporter.to_string();
+      output.flush();
+      return false;
+    }
+    if (!SnapshotWriter().write(maybe_function.value(), vm, out_path)) {
+      output << "[Writing error] Can't write " << out_path << "." << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  bool ByteCodeRunner::emitCpp(const std::string& path, const std::string& out_path) {
+    const std::optional<function_ptr> maybe_function = compile(read_source(path), true);
+    if (!maybe_function) return false;
+    const std::optional<std::string> cpp =
+        AotCompiler().translate(maybe_function.value(), AotCompiler::program_name(out_path));
+    if (!cpp || !BytecodeWriter::write_bytes(cpp.value(), out_path)) {
+      output << "[Writing error] Can't write " << out_path << "." << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  void ByteCodeRunner::runCompiled(const AotProgram& program) {
+    e_reporter.clear();
+    log_output << " ByteCodeRunner state cleaned." << std::endl;
+    log_output << "=== compiled program ===" << std::endl;
+    std::string error{};
+    std::vector<function_ptr> functions{};
+    const std::optional<function_ptr> maybe_function =
+        BytecodeLoader(&heap, &pool).load(MappedFile::view(program.bytecode), "compiled program", error, &functions);
+    if (!maybe_function || functions.size() != program.entries.size()) {
+      output << "[Loading error] " << (maybe_function ? "Compiled program doesn't match its bytecode." : error)
+             << std::endl;
+      return;
+    }
+    for (size_t i = 0; i < functions.size(); i++) functions[i]->compiled = program.entries[i];
+    execute(maybe_function.value());
+  }
+
+  void ByteCodeRunner::enable_jit(uint32_t hot_calls, JitBackend backend, uint32_t hot_loops) {
+    jit.set_hot_calls(hot_calls);
+    jit.set_hot_loops(hot_loops);
+    jit.set_backend(backend);
+    use_jit = Jit::supported(backend);
+  }
+
+  void ByteCodeRunner::disable_jit() {
+    use_jit = false;
   }
 
   void ByteCodeRunner::runRepl() {
+    VM session(output, disassembler, e_reporter, &heap, &pool, log_output, use_jit ? &jit : nullptr,
+               max_callstack_depth);
+    // Each line is compiled on its own and runs against the globals earlier
+    // lines defined.
     std::string line{};
-    std::string source{};
     while (true) {
       output << "> ";
       output.flush();
-      getline(input, line);
-      source = source + "\n" + line;
-      run(source);
+      if (!getline(input, line)) break;
+      const std::optional<function_ptr> maybe_function = compile(line, false, false);
+      if (!maybe_function) continue;
+      session.interpret(maybe_function.value());
+      if (e_reporter.has_error()) {
+        output << e_reporter.to_string();
+        output.flush();
+      }
     }
   }
 
+  std::optional<function_ptr> ByteCodeRunner::load(const std::string& path, std::string& error) {
+    e_reporter.clear();
+    log_output << " ByteCodeRunner state cleaned." << std::endl;
+    log_output << "=== bytecode file: " << path << " ===" << std::endl;
+    return BytecodeLoader(&heap, &pool).load(path, error);
+  }
+
   void ByteCodeRunner::run(const std::string& source) {
-    // TODO: Both the Compiler and VM register root marking callbacks with heap.
-    // However, heap outlives both of those leaving dangling callbacks after this
-    // block is done. Either unregister those callbacks upon destruction or make
-    // lifetimes identical + add comment.
+    const std::optional<function_ptr> maybe_function = compile(source);
+    if (maybe_function) execute(maybe_function.value());
+  }
+
+  void ByteCodeRunner::run_warm(const std::string& source) {
+    e_reporter.clear();
+    log_output << " ByteCodeRunner state cleaned." << std::endl;
+    log_output << "=== source (warm start) ===" << std::endl;
+    log_output << source << std::endl;
+    log_output << "==/ source /==" << std::endl;
+
+    const std::vector<const Token>& tokens =
+        clox::Scanner{source, e_reporter}.tokenize();
+    if (e_reporter.has_error()) {
+      output << "[Scanning error] " << e_reporter.to_string();
+      return;
+    }
+    WarmStart(output, disassembler, e_reporter, &heap, &pool, log_output, use_jit ? &jit : nullptr, options,
+              max_callstack_depth)
+        .run(tokens);
+    if (e_reporter.has_error()) {
+      output << e_reporter.to_string();
+      output.flush();
+    }
+  }
 
+  std::optional<function_ptr> ByteCodeRunner::compile(const std::string& source, bool eager, bool whole_program) {
     e_reporter.clear();
     log_output << " ByteCodeRunner state cleaned." << std::endl;
     log_output << "=== source ===" << std::endl;
@@ -43,19 +194,45 @@ namespace cpplox {
     if (e_reporter.has_error()) {
       output << "[Scanning error] " << e_reporter.to_string();
       // TODO: Modify Scanner to include it's own [tag] & adjust Runner.cpp
-      return;
+      return std::nullopt;
     }
 
+    CompilerOptions compile_options{program_options()};
+    compile_options.lazy_functions = options.lazy_functions && !eager;
+    compile_options.whole_program = compile_options.whole_program && whole_program;
     std::optional<function_ptr> maybe_function =
-        Compiler(tokens, disassembler, e_reporter, &heap, &pool).compile();
+        Compiler(tokens, disassembler, e_reporter, &heap, &pool, compile_options).compile();
     if (e_reporter.has_error()) {
       output << e_reporter.to_string();
       output.flush();
-      return;
+      return std::nullopt;
     }
     assert(maybe_function.has_value());
-    InterpretResult result = VM(output, disassembler, e_reporter, &heap, &pool, log_output)
-                                .interpret(maybe_function.value());
+    return maybe_function;
+  }
+
+  CompilerOptions ByteCodeRunner::program_options() const {
+    CompilerOptions program{options};
+    program.whole_program = options.whole_program && !snapshot;
+    return program;
+  }
+
+  void ByteCodeRunner::execute(function_ptr function) {
+    VM vm(output, disassembler, e_reporter, &heap, &pool, log_output, use_jit ? &jit : nullptr,
+          max_callstack_depth);
+    if (snapshot && function->chunk->whole_program) {
+      output << "[Loading error] Program was optimised as a whole program, it can't start from "
+             << snapshot.value() << ". Compile it with the snapshot enabled." << std::endl;
+      return;
+    }
+    if (snapshot) {
+      std::string error{};
+      if (!SnapshotLoader(&heap, &pool).load(snapshot.value(), vm, error)) {
+        output << "[Loading error] " << error << std::endl;
+        return;
+      }
+    }
+    InterpretResult result = vm.interpret(function);
     if (e_reporter.has_error()) {
       output << e_reporter.to_string();
       output.flush();
@@ -0,0 +1,788 @@
+#include "cpplox/Bytecode/BytecodeFile.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "cpplox/Bytecode/IR.h"
+#include "cpplox/Bytecode/IROptimizer.h"
+#include "cpplox/Bytecode/VM.h"
+
+namespace cpplox {
+
+namespace {
+constexpr uint32_t opcode_count{static_cast<uint32_t>(OpCode::OP_LOOP_LONG) + 1};
+// Opcodes are numbered by declaration order, so files written before one was
+// added or removed are rejected instead of being misread.
+
+enum class ConstantTag : uint8_t { NUMBER, BOOLEAN, NIL, STRING, FUNCTION, CLOSURE, NATIVE };
+// Closures and natives only exist at runtime, so only snapshots' heaps hold them.
+
+uint32_t checksum(const uint8_t* data, size_t size) {
+  uint32_t hash{2166136261u};
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+  // FNV-1a, catches truncated and damaged files rather than tampering.
+}
+
+class ByteWriter {
+public:
+  void u8(uint8_t value) { bytes.push_back(static_cast<char>(value)); }
+  void u32(uint32_t value) {
+    for (int shift = 0; shift < 32; shift += 8) u8(static_cast<uint8_t>(value >> shift));
+  }
+  void u64(uint64_t value) {
+    u32(static_cast<uint32_t>(value));
+    u32(static_cast<uint32_t>(value >> 32));
+  }
+  void raw(const void* data, size_t size) { bytes.append(static_cast<const char*>(data), size); }
+
+  std::string bytes{};
+};
+
+class ByteReader {
+  // Reads stop at the end of the range: once one would run past it every read
+  // returns zeros and ok() turns false, so callers check once per section.
+public:
+  ByteReader(const uint8_t* data, size_t size) : data{data}, size{size} {};
+  const uint8_t* raw(size_t count) {
+    if (failed || count > size - pos) {
+      failed = true;
+      return nullptr;
+    }
+    pos += count;
+    return data + pos - count;
+  }
+  uint8_t u8() {
+    const uint8_t* p{raw(1)};
+    return p ? p[0] : 0;
+  }
+  uint32_t u32() {
+    const uint8_t* p{raw(4)};
+    return p ? static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+                   static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24
+             : 0;
+  }
+  uint64_t u64() {
+    const uint64_t low{u32()};
+    return low | static_cast<uint64_t>(u32()) << 32;
+  }
+  bool ok() const { return !failed; }
+  bool at_end() const { return !failed && pos == size; }
+  size_t position() const { return pos; }
+
+private:
+  const uint8_t* data{nullptr};
+  size_t size{0};
+  size_t pos{0};
+  bool failed{false};
+};
+
+struct FunctionEntry {
+  uint32_t name{0};
+  uint32_t arity{0};
+  uint32_t upvalue_count{0};
+  uint32_t extra_slots{0};
+  uint32_t body_offset{0};
+  uint32_t body_size{0};
+  uint32_t body_checksum{0};
+  std::vector<std::pair<ConstantTag, uint64_t>> constants{};
+};
+
+bool valid_code(const Chunk& chunk, int arity, size_t upvalue_count, size_t local_slots) {
+  // Checks that executing the code can't read outside of it, its constants, its
+  // frame or its upvalues: opcodes are known, operands index what they name, jumps
+  // land on instructions, execution can't run off the end and the stack height is
+  // the same on every path, never drops below the frame's start and stays within
+  // local_slots. Doesn't check _NN operands are numbers, see IROptimizer::respecialize_arithmetic.
+  const std::vector<uint8_t>& code{chunk.code};
+  std::vector<bool> is_start(code.size(), false);
+  std::vector<size_t> jumps{};
+  OpCode last{OpCode::OP_NOOP};
+  for (size_t offset = 0; offset < code.size();) {
+    if (code[offset] >= opcode_count) return false;
+    const OpCode op{static_cast<OpCode>(code[offset])};
+    if (op == OpCode::OP_CLOSURE || op == OpCode::OP_CLOSURE_LONG) {
+      if (offset + operand_width(op) >= code.size()) return false;
+      const size_t index{chunk.operand(offset)};
+      if (index >= chunk.constants.size() || !std::holds_alternative<function_ptr>(chunk.constants[index])) {
+        return false;
+      }
+      // Size of the instruction depends on the function it creates.
+    }
+    const size_t size{chunk.instruction_size(offset)};
+    if (size > code.size() - offset) return false;
+
+    switch (op) {
+      case OpCode::OP_CONSTANT:
+      case OpCode::OP_CONSTANT_LONG:
+        if (chunk.operand(offset) >= chunk.constants.size()) return false;
+        break;
+      case OpCode::OP_GET_GLOBAL:
+      case OpCode::OP_DEFINE_GLOBAL:
+      case OpCode::OP_SET_GLOBAL:
+      case OpCode::OP_GET_GLOBAL_LONG:
+      case OpCode::OP_DEFINE_GLOBAL_LONG:
+      case OpCode::OP_SET_GLOBAL_LONG:
+        if (chunk.operand(offset) >= chunk.constants.size() ||
+            !std::holds_alternative<const_string_ptr>(chunk.constants[chunk.operand(offset)])) {
+          return false;
+        }
+        break;
+      case OpCode::OP_GET_LOCAL:
+      case OpCode::OP_SET_LOCAL:
+      case OpCode::OP_GET_LOCAL_LONG:
+      case OpCode::OP_SET_LOCAL_LONG:
+        if (chunk.operand(offset) >= local_slots) return false;
+        break;
+      case OpCode::OP_GET_UPVALUE:
+      case OpCode::OP_SET_UPVALUE:
+        if (chunk.operand(offset) >= upvalue_count) return false;
+        break;
+      case OpCode::OP_CLOSURE:
+      case OpCode::OP_CLOSURE_LONG: {
+        const bool is_long{op == OpCode::OP_CLOSURE_LONG};
+        for (size_t i = is_long ? 4 : 2; i < size; i += is_long ? 3 : 2) {
+          const uint8_t is_local{code[offset + i]};
+          const size_t index{is_long ? static_cast<size_t>(code[offset + i + 1] << 8 | code[offset + i + 2])
+                                     : code[offset + i + 1]};
+          if (is_local > 1 || index >= (is_local ? local_slots : upvalue_count)) return false;
+        }
+        break;
+      }
+      case OpCode::OP_JUMP_IF_NOT_CALLEE:
+        if (code[offset + 4] >= chunk.constants.size()) return false;
+        jumps.push_back(offset);
+        break;
+      case OpCode::OP_JUMP:
+      case OpCode::OP_JUMP_IF_FALSE:
+      case OpCode::OP_JUMP_IF_TRUE:
+      case OpCode::OP_LOOP:
+      case OpCode::OP_JUMP_LONG:
+      case OpCode::OP_JUMP_IF_FALSE_LONG:
+      case OpCode::OP_JUMP_IF_TRUE_LONG:
+      case OpCode::OP_LOOP_LONG:
+        jumps.push_back(offset);
+        break;
+      default:
+        break;
+    }
+    is_start[offset] = true;
+    last = op;
+    offset += size;
+  }
+
+  for (const size_t offset : jumps) {
+    const size_t target{chunk.jump_target(offset)};
+    if (target >= code.size() || !is_start[target]) return false;
+    // Backward jumps past the start wrap around and fail the first check.
+  }
+  if (last != OpCode::OP_RETURN && last != OpCode::OP_JUMP && last != OpCode::OP_LOOP &&
+      last != OpCode::OP_JUMP_LONG && last != OpCode::OP_LOOP_LONG) {
+    return false;
+    // Execution would run off the end of the code.
+  }
+  const std::optional<size_t> height{ir::max_stack_height(chunk, arity)};
+  return height && *height <= local_slots;
+}
+
+bool has_magic(const std::string& path, std::string_view magic) {
+  std::ifstream ifs(path, std::ios::binary);
+  std::string file_magic(magic.size(), '\0');
+  ifs.read(file_magic.data(), static_cast<std::streamsize>(file_magic.size()));
+  return ifs.good() && file_magic == magic;
+}
+
+bool load_body(Chunk& chunk, const uint8_t* body, size_t body_size, uint32_t body_checksum) {
+  if (checksum(body, body_size) != body_checksum) return false;
+  ByteReader in{body, body_size};
+  const uint32_t code_size{in.u32()};
+  const uint8_t* code{in.raw(code_size)};
+  if (!code) return false;
+  chunk.code.assign(code, code + code_size);
+
+  const uint32_t run_count{in.u32()};
+  uint32_t previous_start{0};
+  for (uint32_t i = 0; i < run_count && in.ok(); i++) {
+    const uint32_t start{in.u32()};
+    const int line{static_cast<int>(in.u32())};
+    if (start >= code_size || (i > 0 && start <= previous_start)) return false;
+    chunk.lines.add(start, line);
+    previous_start = start;
+  }
+  return in.at_end();
+}
+}  // namespace
+
+std::shared_ptr<const MappedFile> MappedFile::open(const std::string& path) {
+  const int fd{::open(path.c_str(), O_RDONLY)};
+  if (fd < 0) return nullptr;
+  struct stat info {};
+  if (fstat(fd, &info) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  const size_t length{static_cast<size_t>(info.st_size)};
+  void* bytes{nullptr};
+  if (length > 0) {
+    bytes = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  // The mapping stays valid after closing its descriptor.
+  if (bytes == MAP_FAILED) return nullptr;
+  return std::shared_ptr<const MappedFile>(new MappedFile(static_cast<const uint8_t*>(bytes), length, true));
+}
+
+std::shared_ptr<const MappedFile> MappedFile::view(std::span<const uint8_t> bytes) {
+  return std::shared_ptr<const MappedFile>(new MappedFile(bytes.data(), bytes.size(), false));
+}
+
+std::shared_ptr<const MappedFile> MappedFile::slice(std::shared_ptr<const MappedFile> file, size_t offset,
+                                                    size_t size) {
+  const uint8_t* bytes{file->data() + offset};
+  return std::shared_ptr<const MappedFile>(new MappedFile(bytes, size, false, std::move(file)));
+}
+
+MappedFile::~MappedFile() {
+  if (bytes && owned) munmap(const_cast<uint8_t*>(bytes), length);
+}
+
+std::vector<function_ptr> BytecodeWriter::functions_of(function_ptr script) {
+  std::vector<function_ptr> functions{script};
+  std::unordered_set<const Function*> seen{script.get()};
+  for (size_t i = 0; i < functions.size(); i++) {
+    // Grows as constants reveal nested functions.
+    if (functions[i]->chunk->lazy_code) functions[i]->chunk->materialize();
+    for (const Value& constant : functions[i]->chunk->constants) {
+      const auto* nested = std::get_if<function_ptr>(&constant);
+      if (nested && seen.insert(nested->get()).second) functions.push_back(*nested);
+    }
+  }
+  return functions;
+}
+
+std::optional<std::string> BytecodeWriter::serialize(function_ptr script) const {
+  const std::vector<function_ptr> functions{functions_of(script)};
+  std::unordered_map<const Function*, uint32_t> function_index{};
+  for (size_t i = 0; i < functions.size(); i++) function_index.emplace(functions[i].get(), static_cast<uint32_t>(i));
+  std::vector<const_string_ptr> strings{};
+  std::unordered_map<const std::string*, uint32_t> string_index{};
+  const auto string_ref = [&](const_string_ptr str) {
+    const auto [it, inserted] = string_index.try_emplace(str.get(), static_cast<uint32_t>(strings.size()));
+    if (inserted) strings.push_back(str);
+    return it->second;
+  };
+
+  ByteWriter entries{};
+  ByteWriter bodies{};
+  for (size_t i = 0; i < functions.size(); i++) {
+    const Function& function{*functions[i]};
+    const Chunk& chunk{*function.chunk};
+    if (chunk.lazy_code) return std::nullopt;
+    const size_t body_start{bodies.bytes.size()};
+    bodies.u32(static_cast<uint32_t>(chunk.code.size()));
+    bodies.raw(chunk.code.data(), chunk.code.size());
+    bodies.u32(static_cast<uint32_t>(chunk.lines.run_list().size()));
+    for (const LineTable::Run& run : chunk.lines.run_list()) {
+      bodies.u32(run.start);
+      bodies.u32(static_cast<uint32_t>(run.line));
+    }
+    const size_t body_size{bodies.bytes.size() - body_start};
+
+    entries.u32(string_ref(function.name));
+    entries.u32(static_cast<uint32_t>(function.arity));
+    entries.u32(static_cast<uint32_t>(function.upvalue_count));
+    entries.u32(static_cast<uint32_t>(function.extra_slots));
+    entries.u32(static_cast<uint32_t>(body_start));
+    entries.u32(static_cast<uint32_t>(body_size));
+    entries.u32(checksum(reinterpret_cast<const uint8_t*>(bodies.bytes.data()) + body_start, body_size));
+    entries.u32(static_cast<uint32_t>(chunk.constants.size()));
+    for (const Value& constant : chunk.constants) {
+      if (const auto* number = std::get_if<double>(&constant)) {
+        entries.u8(static_cast<uint8_t>(ConstantTag::NUMBER));
+        entries.u64(std::bit_cast<uint64_t>(*number));
+      } else if (const auto* boolean = std::get_if<bool>(&constant)) {
+        entries.u8(static_cast<uint8_t>(ConstantTag::BOOLEAN));
+        entries.u64(*boolean ? 1 : 0);
+      } else if (std::holds_alternative<std::monostate>(constant)) {
+        entries.u8(static_cast<uint8_t>(ConstantTag::NIL));
+        entries.u64(0);
+      } else if (const auto* str = std::get_if<const_string_ptr>(&constant)) {
+        entries.u8(static_cast<uint8_t>(ConstantTag::STRING));
+        entries.u64(string_ref(*str));
+      } else if (const auto* nested = std::get_if<function_ptr>(&constant)) {
+        entries.u8(static_cast<uint8_t>(ConstantTag::FUNCTION));
+        entries.u64(function_index.at(nested->get()));
+      } else {
+        return std::nullopt;
+        // Natives and closures are only created at runtime.
+      }
+    }
+  }
+
+  ByteWriter meta{};
+  for (const const_string_ptr& str : strings) {
+    meta.u32(static_cast<uint32_t>(str->size()));
+    meta.raw(str->data(), str->size());
+  }
+  meta.raw(entries.bytes.data(), entries.bytes.size());
+
+  ByteWriter out{};
+  out.raw(BytecodeLoader::magic.data(), BytecodeLoader::magic.size());
+  out.u32(BytecodeLoader::format_version);
+  out.u32(opcode_count);
+  out.u32(script->chunk->whole_program ? 1 : 0);
+  out.u32(static_cast<uint32_t>(strings.size()));
+  out.u32(static_cast<uint32_t>(functions.size()));
+  out.u32(static_cast<uint32_t>(meta.bytes.size()));
+  out.u32(checksum(reinterpret_cast<const uint8_t*>(meta.bytes.data()), meta.bytes.size()));
+  out.raw(meta.bytes.data(), meta.bytes.size());
+  out.raw(bodies.bytes.data(), bodies.bytes.size());
+  return std::move(out.bytes);
+}
+
+bool BytecodeWriter::write(function_ptr script, const std::string& path) const {
+  const std::optional<std::string> bytes{serialize(script)};
+  return bytes && write_bytes(*bytes, path);
+}
+
+bool BytecodeWriter::write_bytes(const std::string& bytes, const std::string& path) {
+  const std::string temporary_path{path + ".tmp" + std::to_string(getpid())};
+  {
+    std::ofstream ofs(temporary_path, std::ios::binary | std::ios::trunc);
+    ofs.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    if (!ofs.good()) {
+      std::remove(temporary_path.c_str());
+      return false;
+    }
+  }
+  return std::rename(temporary_path.c_str(), path.c_str()) == 0;
+}
+
+bool BytecodeLoader::is_bytecode_file(const std::string& path) {
+  return has_magic(path, magic);
+}
+
+std::optional<function_ptr> BytecodeLoader::load(const std::string& path, std::string& error) const {
+  const std::shared_ptr<const MappedFile> file{MappedFile::open(path)};
+  if (!file) {
+    error = "Can't read " + path + ".";
+    return std::nullopt;
+  }
+  return load(file, path, error);
+}
+
+std::optional<function_ptr> BytecodeLoader::load(std::shared_ptr<const MappedFile> file, const std::string& path,
+                                                 std::string& error, std::vector<function_ptr>* loaded) const {
+  ByteReader header{file->data(), file->size()};
+  const uint8_t* file_magic{header.raw(magic.size())};
+  if (!file_magic || std::string_view(reinterpret_cast<const char*>(file_magic), magic.size()) != magic) {
+    error = path + " is not a compiled Lox file.";
+    return std::nullopt;
+  }
+  const uint32_t version{header.u32()};
+  const uint32_t file_opcode_count{header.u32()};
+  const uint32_t whole_program{header.u32()};
+  const uint32_t string_count{header.u32()};
+  const uint32_t function_count{header.u32()};
+  const uint32_t meta_size{header.u32()};
+  const uint32_t meta_checksum{header.u32()};
+  if (header.ok() && version != format_version) {
+    error = path + " uses format version " + std::to_string(version) + ", expected " +
+            std::to_string(format_version) + ".";
+    return std::nullopt;
+  }
+  if (header.ok() && file_opcode_count != opcode_count) {
+    error = path + " was compiled for a different instruction set.";
+    return std::nullopt;
+  }
+  const uint8_t* meta_bytes{header.raw(meta_size)};
+  if (!meta_bytes || function_count == 0) {
+    error = path + " is truncated.";
+    return std::nullopt;
+  }
+  if (checksum(meta_bytes, meta_size) != meta_checksum || whole_program > 1) {
+    error = path + " is corrupt.";
+    return std::nullopt;
+  }
+  const size_t bodies_start{header.position()};
+  const size_t bodies_size{file->size() - bodies_start};
+
+  ByteReader meta{meta_bytes, meta_size};
+  std::vector<std::string_view> texts{};
+  for (uint32_t i = 0; i < string_count && meta.ok(); i++) {
+    const uint32_t size{meta.u32()};
+    const uint8_t* text{meta.raw(size)};
+    if (text) texts.emplace_back(reinterpret_cast<const char*>(text), size);
+  }
+  std::vector<FunctionEntry> entries{};
+  for (uint32_t i = 0; i < function_count && meta.ok(); i++) {
+    FunctionEntry entry{.name = meta.u32(),
+                        .arity = meta.u32(),
+                        .upvalue_count = meta.u32(),
+                        .extra_slots = meta.u32(),
+                        .body_offset = meta.u32(),
+                        .body_size = meta.u32(),
+                        .body_checksum = meta.u32()};
+    const uint32_t constant_count{meta.u32()};
+    for (uint32_t c = 0; c < constant_count && meta.ok(); c++) {
+      const auto tag{static_cast<ConstantTag>(meta.u8())};
+      entry.constants.emplace_back(tag, meta.u64());
+    }
+    entries.push_back(std::move(entry));
+  }
+  bool valid{meta.at_end()};
+  for (const FunctionEntry& entry : entries) {
+    valid = valid && entry.name < texts.size() && entry.arity <= std::numeric_limits<uint8_t>::max() &&
+            entry.upvalue_count <= std::numeric_limits<uint16_t>::max() &&
+            entry.extra_slots <= std::numeric_limits<uint16_t>::max() &&
+            entry.body_size <= bodies_size && entry.body_offset <= bodies_size - entry.body_size;
+    for (const auto& [tag, payload] : entry.constants) {
+      valid = valid && (tag == ConstantTag::NUMBER || tag == ConstantTag::BOOLEAN || tag == ConstantTag::NIL ||
+                        (tag == ConstantTag::STRING && payload < texts.size()) ||
+                        (tag == ConstantTag::FUNCTION && payload < entries.size()));
+    }
+  }
+  if (!valid) {
+    error = path + " is corrupt.";
+    return std::nullopt;
+  }
+
+  std::vector<const_string_ptr> strings{};
+  std::vector<function_ptr> functions{};
+  heap->register_root_marking_callback([&] {
+    for (const const_string_ptr& str : strings) heap->mark(str);
+    for (const function_ptr& function : functions) heap->mark(function);
+  });
+  // Nothing but these vectors refers to the new objects until the script runs.
+  for (const std::string_view text : texts) strings.push_back(pool->insert_or_get(text));
+  for (const FunctionEntry& entry : entries) {
+    functions.push_back(heap->make<Function>(static_cast<int>(entry.arity), static_cast<int>(entry.upvalue_count),
+                                             strings[entry.name], std::make_unique<Chunk>()));
+  }
+  for (size_t i = 0; i < entries.size(); i++) {
+    const FunctionEntry& entry{entries[i]};
+    Function& function{*functions[i]};
+    function.extra_slots = entry.extra_slots;
+    for (const auto& [tag, payload] : entry.constants) {
+      switch (tag) {
+        case ConstantTag::NUMBER:
+          function.chunk->constants.push_back(std::bit_cast<double>(payload));
+          break;
+        case ConstantTag::BOOLEAN:
+          function.chunk->constants.push_back(payload != 0);
+          break;
+        case ConstantTag::NIL:
+          function.chunk->constants.push_back(std::monostate{});
+          break;
+        case ConstantTag::STRING:
+          function.chunk->constants.push_back(strings[payload]);
+          break;
+        case ConstantTag::FUNCTION:
+          function.chunk->constants.push_back(functions[payload]);
+          break;
+        case ConstantTag::CLOSURE:
+        case ConstantTag::NATIVE:
+          break;
+          // Only in snapshots' heaps, validation above rejects them in constants.
+      }
+    }
+    const uint8_t* body{file->data() + bodies_start + entry.body_offset};
+    const size_t local_slots{VM::FRAME_SLOTS + entry.extra_slots};
+    function.chunk->lazy_code = [file, body, size = entry.body_size, expected = entry.body_checksum,
+                                 arity = function.arity, upvalue_count = entry.upvalue_count,
+                                 local_slots](Chunk& chunk) {
+      if (!load_body(chunk, body, size, expected) || !valid_code(chunk, arity, upvalue_count, local_slots)) {
+        return false;
+      }
+      IROptimizer{1}.respecialize_arithmetic(chunk, arity);
+      return true;
+      // Checksums only catch accidental damage, _NN operands are proven again.
+    };
+    // Holds on to the mapping until the body is decoded.
+  }
+  functions[0]->chunk->whole_program = whole_program == 1;
+  heap->deregister_root_marking_callback();
+
+  if (!functions[0]->chunk->materialize()) {
+    error = path + " is corrupt.";
+    return std::nullopt;
+  }
+  if (loaded) *loaded = functions;
+  return functions[0];
+}
+
+std::optional<std::string> SnapshotWriter::serialize(function_ptr program, const VM& vm) const {
+  const std::optional<std::string> image{BytecodeWriter().serialize(program)};
+  if (!image) return std::nullopt;
+  const std::vector<function_ptr> functions{BytecodeWriter::functions_of(program)};
+  std::unordered_map<const Function*, uint32_t> function_index{};
+  for (size_t i = 0; i < functions.size(); i++) function_index.emplace(functions[i].get(), static_cast<uint32_t>(i));
+
+  std::vector<const_string_ptr> strings{};
+  std::unordered_map<const std::string*, uint32_t> string_index{};
+  std::vector<const Closure*> closures{};
+  std::unordered_map<const Closure*, uint32_t> closure_index{};
+  std::vector<const RuntimeUpvalue*> upvalues{};
+  std::unordered_map<const RuntimeUpvalue*, uint32_t> upvalue_index{};
+  const auto string_ref = [&](const_string_ptr str) {
+    const auto [it, inserted] = string_index.try_emplace(str.get(), static_cast<uint32_t>(strings.size()));
+    if (inserted) strings.push_back(str);
+    return it->second;
+  };
+  const auto upvalue_ref = [&](const RuntimeUpvalue* upvalue) {
+    const auto [it, inserted] = upvalue_index.try_emplace(upvalue, static_cast<uint32_t>(upvalues.size()));
+    if (inserted) upvalues.push_back(upvalue);
+    return it->second;
+  };
+  const auto write_value = [&](ByteWriter& out, const Value& v) {
+    // Indices are handed out on first sight, the loops below write what they
+    // refer to.
+    if (const auto* number = std::get_if<double>(&v)) {
+      out.u8(static_cast<uint8_t>(ConstantTag::NUMBER));
+      out.u64(std::bit_cast<uint64_t>(*number));
+    } else if (const auto* boolean = std::get_if<bool>(&v)) {
+      out.u8(static_cast<uint8_t>(ConstantTag::BOOLEAN));
+      out.u64(*boolean ? 1 : 0);
+    } else if (std::holds_alternative<std::monostate>(v)) {
+      out.u8(static_cast<uint8_t>(ConstantTag::NIL));
+      out.u64(0);
+    } else if (const auto* str = std::get_if<const_string_ptr>(&v)) {
+      out.u8(static_cast<uint8_t>(ConstantTag::STRING));
+      out.u64(string_ref(*str));
+    } else if (const auto* function = std::get_if<function_ptr>(&v)) {
+      const auto it = function_index.find(function->get());
+      if (it == function_index.end()) return false;
+      out.u8(static_cast<uint8_t>(ConstantTag::FUNCTION));
+      out.u64(it->second);
+    } else if (const auto* closure = std::get_if<closure_ptr>(&v)) {
+      const auto [it, inserted] = closure_index.try_emplace(closure->get(), static_cast<uint32_t>(closures.size()));
+      if (inserted) closures.push_back(closure->get());
+      out.u8(static_cast<uint8_t>(ConstantTag::CLOSURE));
+      out.u64(it->second);
+    } else {
+      const native_function_ptr native{std::get<native_function_ptr>(v)};
+      const auto* definition = std::find_if(std::begin(natives), std::end(natives),
+                                            [&](const NativeDefinition& d) { return d.func == native->func; });
+      if (definition == std::end(natives)) return false;
+      out.u8(static_cast<uint8_t>(ConstantTag::NATIVE));
+      out.u64(static_cast<uint64_t>(definition - std::begin(natives)));
+    }
+    return true;
+  };
+
+  ByteWriter globals_out{};
+  for (const auto& [name, v] : vm.all_globals()) {
+    globals_out.u32(string_ref(name));
+    if (!write_value(globals_out, v)) return std::nullopt;
+  }
+  ByteWriter closures_out{};
+  ByteWriter upvalues_out{};
+  for (size_t c = 0, u = 0; c < closures.size() || u < upvalues.size();) {
+    // Closures reach upvalues and closed upvalues reach closures, until neither
+    // reveals new ones.
+    for (; c < closures.size(); c++) {
+      const Closure& closure{*closures[c]};
+      const auto it = function_index.find(closure.function.get());
+      if (it == function_index.end()) return std::nullopt;
+      closures_out.u32(it->second);
+      for (int i = 0; i < closure.upvalue_count(); i++) closures_out.u32(upvalue_ref(closure.upvalues()[i].get()));
+    }
+    for (; u < upvalues.size(); u++) {
+      if (upvalues[u]->is_open() || !write_value(upvalues_out, upvalues[u]->closed)) return std::nullopt;
+    }
+  }
+
+  ByteWriter heap_out{};
+  heap_out.u32(static_cast<uint32_t>(strings.size()));
+  for (const const_string_ptr& str : strings) {
+    heap_out.u32(static_cast<uint32_t>(str->size()));
+    heap_out.raw(str->data(), str->size());
+  }
+  heap_out.u32(static_cast<uint32_t>(upvalues.size()));
+  heap_out.u32(static_cast<uint32_t>(closures.size()));
+  heap_out.raw(closures_out.bytes.data(), closures_out.bytes.size());
+  heap_out.raw(upvalues_out.bytes.data(), upvalues_out.bytes.size());
+  heap_out.u32(static_cast<uint32_t>(vm.all_globals().size()));
+  heap_out.raw(globals_out.bytes.data(), globals_out.bytes.size());
+
+  ByteWriter out{};
+  out.raw(SnapshotLoader::magic.data(), SnapshotLoader::magic.size());
+  out.u32(SnapshotLoader::format_version);
+  out.u32(static_cast<uint32_t>(image->size()));
+  out.raw(image->data(), image->size());
+  out.u32(static_cast<uint32_t>(heap_out.bytes.size()));
+  out.u32(checksum(reinterpret_cast<const uint8_t*>(heap_out.bytes.data()), heap_out.bytes.size()));
+  out.raw(heap_out.bytes.data(), heap_out.bytes.size());
+  return std::move(out.bytes);
+}
+
+bool SnapshotWriter::write(function_ptr program, const VM& vm, const std::string& path) const {
+  const std::optional<std::string> bytes{serialize(program, vm)};
+  return bytes && BytecodeWriter::write_bytes(*bytes, path);
+}
+
+bool SnapshotLoader::is_snapshot_file(const std::string& path) {
+  return has_magic(path, magic);
+}
+
+bool SnapshotLoader::load(const std::string& path, VM& vm, std::string& error) const {
+  const std::shared_ptr<const MappedFile> file{MappedFile::open(path)};
+  if (!file) {
+    error = "Can't read " + path + ".";
+    return false;
+  }
+  ByteReader header{file->data(), file->size()};
+  const uint8_t* file_magic{header.raw(magic.size())};
+  if (!file_magic || std::string_view(reinterpret_cast<const char*>(file_magic), magic.size()) != magic) {
+    error = path + " is not a Lox snapshot.";
+    return false;
+  }
+  const uint32_t version{header.u32()};
+  if (header.ok() && version != format_version) {
+    error = path + " uses format version " + std::to_string(version) + ", expected " +
+            std::to_string(format_version) + ".";
+    return false;
+  }
+  const uint32_t program_size{header.u32()};
+  const size_t program_start{header.position()};
+  header.raw(program_size);
+  const uint32_t heap_size{header.u32()};
+  const uint32_t heap_checksum{header.u32()};
+  const uint8_t* heap_bytes{header.raw(heap_size)};
+  if (!heap_bytes || !header.at_end()) {
+    error = path + " is truncated.";
+    return false;
+  }
+  if (checksum(heap_bytes, heap_size) != heap_checksum) {
+    error = path + " is corrupt.";
+    return false;
+  }
+
+  std::vector<function_ptr> functions{};
+  if (!BytecodeLoader(heap, pool).load(MappedFile::slice(file, program_start, program_size), path, error,
+                                       &functions)) {
+    return false;
+  }
+  if (functions[0]->chunk->whole_program) {
+    error = path + " was optimised as a whole program, scripts can't start from it.";
+    return false;
+  }
+  std::vector<const_string_ptr> strings{};
+  std::vector<upvalue_ptr> upvalues{};
+  std::vector<closure_ptr> closures{};
+  std::vector<std::optional<native_function_ptr>> natives_by_index(std::size(natives));
+  heap->register_root_marking_callback([&] {
+    for (const function_ptr& function : functions) heap->mark(function);
+    for (const const_string_ptr& str : strings) heap->mark(str);
+    for (const upvalue_ptr& upvalue : upvalues) heap->mark(upvalue);
+    for (const closure_ptr& closure : closures) heap->mark(closure);
+    for (const std::optional<native_function_ptr>& native : natives_by_index) {
+      if (native) heap->mark(*native);
+    }
+  });
+  // Nothing else refers to the new objects until globals are defined.
+
+  ByteReader in{heap_bytes, heap_size};
+  bool valid{true};
+  const auto read_value = [&]() -> Value {
+    const auto tag{static_cast<ConstantTag>(in.u8())};
+    const uint64_t payload{in.u64()};
+    switch (tag) {
+      case ConstantTag::NUMBER:
+        return std::bit_cast<double>(payload);
+      case ConstantTag::BOOLEAN:
+        return payload != 0;
+      case ConstantTag::NIL:
+        return std::monostate{};
+      case ConstantTag::STRING:
+        if (payload < strings.size()) return strings[payload];
+        break;
+      case ConstantTag::FUNCTION:
+        if (payload < functions.size()) return functions[payload];
+        break;
+      case ConstantTag::CLOSURE:
+        if (payload < closures.size()) return closures[payload];
+        break;
+      case ConstantTag::NATIVE:
+        if (payload < natives_by_index.size()) {
+          std::optional<native_function_ptr>& native{natives_by_index[payload]};
+          if (!native) native = heap->make<NativeFn>(natives[payload].func);
+          return *native;
+          // One object per native, so copies of it stay equal.
+        }
+        break;
+    }
+    valid = false;
+    return std::monostate{};
+  };
+
+  const uint32_t string_count{in.u32()};
+  for (uint32_t i = 0; i < string_count && in.ok(); i++) {
+    const uint32_t size{in.u32()};
+    if (const uint8_t* text = in.raw(size)) {
+      strings.push_back(pool->insert_or_get(std::string_view(reinterpret_cast<const char*>(text), size)));
+    }
+  }
+  const uint32_t upvalue_count{in.u32()};
+  const uint32_t closure_count{in.u32()};
+  if (in.ok() && upvalue_count <= heap_size && closure_count <= heap_size) {
+    // Each takes at least a byte, which bounds allocations for corrupt counts.
+    for (uint32_t i = 0; i < upvalue_count; i++) {
+      const upvalue_ptr upvalue{heap->make<RuntimeUpvalue>(nullptr)};
+      upvalue->location = &upvalue->closed;
+      upvalues.push_back(upvalue);
+    }
+    for (uint32_t i = 0; i < closure_count && in.ok() && valid; i++) {
+      const uint32_t function{in.u32()};
+      if (function >= functions.size()) {
+        valid = false;
+        break;
+      }
+      closures.push_back(heap->manage(Closure::create(functions[function])));
+      for (int u = 0; u < functions[function]->upvalue_count; u++) {
+        const uint32_t upvalue{in.u32()};
+        valid = valid && upvalue < upvalues.size();
+        closures.back()->upvalues()[u] = valid ? upvalues[upvalue] : upvalue_ptr{};
+      }
+    }
+    for (uint32_t i = 0; i < upvalue_count && in.ok() && valid; i++) upvalues[i]->closed = read_value();
+  } else {
+    valid = false;
+  }
+  std::vector<std::pair<const_string_ptr, Value>> globals{};
+  const uint32_t global_count{in.u32()};
+  for (uint32_t i = 0; i < global_count && in.ok() && valid; i++) {
+    const uint32_t name{in.u32()};
+    const Value v{read_value()};
+    if (name < strings.size()) {
+      globals.emplace_back(strings[name], v);
+    } else {
+      valid = false;
+    }
+  }
+  if (valid && in.at_end()) {
+    for (const auto& [name, v] : globals) vm.define_global(name, v);
+  }
+  heap->deregister_root_marking_callback();
+  if (!valid || !in.at_end()) {
+    error = path + " is corrupt.";
+    return false;
+  }
+  return true;
+}
+
+}  // namespace cpplox
@@ -1,7 +1,12 @@
 #include "cpplox/Bytecode/Chunk.h"
 
+#include <algorithm>
+#include <cassert>
+#include <iterator>
 #include <limits>
 
+#include "cpplox/Bytecode/LoxObject.h"
+
 namespace cpplox {
 
   template <typename Enumeration>
@@ -10,9 +15,96 @@ namespace cpplox {
     return static_cast<typename std::underlying_type<Enumeration>::type>(value);
   }
 
+  namespace {
+    bool is_jump(OpCode op) {
+      switch (op) {
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_TRUE:
+        case OpCode::OP_LOOP:
+        case OpCode::OP_JUMP_IF_NOT_CALLEE:
+        case OpCode::OP_JUMP_LONG:
+        case OpCode::OP_JUMP_IF_FALSE_LONG:
+        case OpCode::OP_JUMP_IF_TRUE_LONG:
+        case OpCode::OP_LOOP_LONG:
+          return true;
+        default:
+          return false;
+      }
+    }
+
+    bool is_backward(OpCode jump) {
+      return jump == OpCode::OP_LOOP || jump == OpCode::OP_LOOP_LONG;
+    }
+  }  // namespace
+
+  OpCode wide_variant(OpCode op) {
+    switch (op) {
+      case OpCode::OP_CONSTANT:
+        return OpCode::OP_CONSTANT_LONG;
+      case OpCode::OP_GET_GLOBAL:
+        return OpCode::OP_GET_GLOBAL_LONG;
+      case OpCode::OP_DEFINE_GLOBAL:
+        return OpCode::OP_DEFINE_GLOBAL_LONG;
+      case OpCode::OP_SET_GLOBAL:
+        return OpCode::OP_SET_GLOBAL_LONG;
+      case OpCode::OP_GET_LOCAL:
+        return OpCode::OP_GET_LOCAL_LONG;
+      case OpCode::OP_SET_LOCAL:
+        return OpCode::OP_SET_LOCAL_LONG;
+      case OpCode::OP_CLOSURE:
+        return OpCode::OP_CLOSURE_LONG;
+      case OpCode::OP_JUMP:
+        return OpCode::OP_JUMP_LONG;
+      case OpCode::OP_JUMP_IF_FALSE:
+        return OpCode::OP_JUMP_IF_FALSE_LONG;
+      case OpCode::OP_JUMP_IF_TRUE:
+        return OpCode::OP_JUMP_IF_TRUE_LONG;
+      case OpCode::OP_LOOP:
+        return OpCode::OP_LOOP_LONG;
+      default:
+        assert(is_wide(op));
+        return op;
+    }
+  }
+
+  bool is_wide(OpCode op) {
+    return as_uint8t(op) >= as_uint8t(OpCode::OP_CONSTANT_LONG) && as_uint8t(op) <= as_uint8t(OpCode::OP_LOOP_LONG);
+  }
+
+  size_t operand_width(OpCode op) {
+    switch (op) {
+      case OpCode::OP_GET_LOCAL_LONG:
+      case OpCode::OP_SET_LOCAL_LONG:
+      case OpCode::OP_JUMP:
+      case OpCode::OP_JUMP_IF_FALSE:
+      case OpCode::OP_JUMP_IF_TRUE:
+      case OpCode::OP_LOOP:
+      case OpCode::OP_JUMP_IF_NOT_CALLEE:
+        return 2;
+      default:
+        return is_wide(op) ? 3 : 1;
+    }
+  }
+
+  void LineTable::add(size_t offset, int line) {
+    if (!runs.empty() && runs.back().start == offset) runs.pop_back();
+    if (runs.empty() || runs.back().line != line) runs.push_back({static_cast<uint32_t>(offset), line});
+  }
+
+  int LineTable::line_at(size_t offset) const {
+    const auto run {std::upper_bound(runs.begin(), runs.end(), offset,
+                                     [](size_t offset, const Run& run) { return offset < run.start; })};
+    return run == runs.begin() ? 0 : std::prev(run)->line;
+  }
+
+  void LineTable::truncate(size_t code_size) {
+    while (!runs.empty() && runs.back().start >= code_size) runs.pop_back();
+  }
+
   void Chunk::add_byte(const uint8_t byte, int lineno) {
+    lines.add(code.size(), lineno);
     code.push_back(byte);
-    line_numbers.push_back(lineno);
   };
 
   void Chunk::add_opcode(const OpCode opcode, int lineno) {
@@ -24,4 +116,142 @@ namespace cpplox {
     return constants.size() - 1;
   }
 
+  void Chunk::truncate(size_t code_size) {
+    code.resize(code_size);
+    lines.truncate(code_size);
+  }
+
+  bool Chunk::materialize() {
+    const std::function<bool(Chunk&)> load{std::move(lazy_code)};
+    lazy_code = nullptr;
+    if (load(*this)) return true;
+    code.clear();
+    lines = LineTable{};
+    lazy_code = [](Chunk&) { return false; };
+    return false;
+  }
+
+  size_t Chunk::instruction_size(size_t offset) const {
+    switch (static_cast<OpCode>(code[offset])) {
+      case OpCode::OP_CONSTANT:
+      case OpCode::OP_GET_LOCAL:
+      case OpCode::OP_SET_LOCAL:
+      case OpCode::OP_GET_GLOBAL:
+      case OpCode::OP_DEFINE_GLOBAL:
+      case OpCode::OP_SET_GLOBAL:
+      case OpCode::OP_CALL:
+      case OpCode::OP_TAIL_CALL:
+      case OpCode::OP_NOOP:
+      case OpCode::OP_GET_UPVALUE:
+      case OpCode::OP_SET_UPVALUE:
+      case OpCode::OP_INLINED_RETURN:
+        return 2;
+      case OpCode::OP_JUMP_IF_FALSE:
+      case OpCode::OP_JUMP_IF_TRUE:
+      case OpCode::OP_JUMP:
+      case OpCode::OP_LOOP:
+        return 3;
+      case OpCode::OP_GET_LOCAL_LONG:
+      case OpCode::OP_SET_LOCAL_LONG:
+        return 3;
+      case OpCode::OP_JUMP_IF_NOT_CALLEE:
+        return 5;
+      case OpCode::OP_CONSTANT_LONG:
+      case OpCode::OP_GET_GLOBAL_LONG:
+      case OpCode::OP_DEFINE_GLOBAL_LONG:
+      case OpCode::OP_SET_GLOBAL_LONG:
+      case OpCode::OP_JUMP_LONG:
+      case OpCode::OP_JUMP_IF_FALSE_LONG:
+      case OpCode::OP_JUMP_IF_TRUE_LONG:
+      case OpCode::OP_LOOP_LONG:
+        return 4;
+      case OpCode::OP_CLOSURE:
+        return 2 + 2 * std::get<function_ptr>(constants[code[offset + 1]])->upvalue_count;
+      case OpCode::OP_CLOSURE_LONG:
+        return 4 + 3 * std::get<function_ptr>(constants[operand(offset)])->upvalue_count;
+      default:
+        return 1;
+    }
+  }
+
+  size_t Chunk::operand(size_t offset) const {
+    size_t value{0};
+    for (size_t i = 1; i <= operand_width(static_cast<OpCode>(code[offset])); i++) {
+      value = value << 8 | code[offset + i];
+    }
+    return value;
+  }
+
+  size_t Chunk::jump_target(size_t offset) const {
+    const size_t next_offset{offset + instruction_size(offset)};
+    return is_backward(static_cast<OpCode>(code[offset])) ? next_offset - operand(offset)
+                                                          : next_offset + operand(offset);
+  }
+
+  void Chunk::widen_jumps(const std::map<size_t, size_t>& far_targets) {
+    std::vector<size_t> offsets{};
+    for (size_t offset = 0; offset < code.size(); offset += instruction_size(offset)) offsets.push_back(offset);
+    std::vector<size_t> index_at(code.size() + 1, 0);
+    for (size_t i = 0; i < offsets.size(); i++) index_at[offsets[i]] = i;
+    index_at[code.size()] = offsets.size();
+
+    std::vector<size_t> targets(offsets.size(), 0);
+    std::vector<bool> wide(offsets.size(), false);
+    for (size_t i = 0; i < offsets.size(); i++) {
+      const OpCode op{static_cast<OpCode>(code[offsets[i]])};
+      if (!is_jump(op)) continue;
+      const auto far{far_targets.find(offsets[i])};
+      targets[i] = index_at[far != far_targets.end() ? far->second : jump_target(offsets[i])];
+      wide[i] = is_wide(op) || far != far_targets.end();
+    }
+
+    std::vector<size_t> new_offsets(offsets.size() + 1, 0);
+    const auto distance = [&](size_t i) {
+      const size_t next_offset{new_offsets[i + 1]};
+      const size_t target_offset{new_offsets[targets[i]]};
+      return target_offset < next_offset ? next_offset - target_offset : target_offset - next_offset;
+    };
+    bool changed{true};
+    while (changed) {
+      changed = false;
+      for (size_t i = 0; i < offsets.size(); i++) {
+        const size_t size{instruction_size(offsets[i])};
+        new_offsets[i + 1] = new_offsets[i] + size + (wide[i] && !is_wide(static_cast<OpCode>(code[offsets[i]])) ? 1 : 0);
+      }
+      for (size_t i = 0; i < offsets.size(); i++) {
+        const OpCode op{static_cast<OpCode>(code[offsets[i]])};
+        if (is_jump(op) && !wide[i] && op != OpCode::OP_JUMP_IF_NOT_CALLEE &&
+            distance(i) > std::numeric_limits<uint16_t>::max()) {
+          wide[i] = true;
+          changed = true;
+        }
+      }
+      // Widening a jump moves the code after it, which can push other jumps out
+      // of range. Jumps only ever grow, so this terminates.
+    }
+
+    std::vector<uint8_t> new_code{};
+    LineTable new_lines{};
+    new_code.reserve(new_offsets.back());
+    for (size_t i = 0; i < offsets.size(); i++) {
+      const size_t offset{offsets[i]};
+      const size_t size{instruction_size(offset)};
+      const OpCode op{static_cast<OpCode>(code[offset])};
+      new_lines.add(new_code.size(), lines.line_at(offset));
+      if (!is_jump(op)) {
+        new_code.insert(new_code.end(), code.begin() + offset, code.begin() + offset + size);
+      } else {
+        const OpCode new_op{wide[i] ? wide_variant(op) : op};
+        const size_t dist{distance(i)};
+        assert(dist >> (8 * operand_width(new_op)) == 0);
+        new_code.push_back(as_uint8t(new_op));
+        for (size_t byte = operand_width(new_op); byte-- > 0;) new_code.push_back((dist >> (8 * byte)) & 0xff);
+        new_code.insert(new_code.end(), code.begin() + offset + 1 + operand_width(op), code.begin() + offset + size);
+        // Operands after the offset (OP_JUMP_IF_NOT_CALLEE's) stay as they are.
+      }
+    }
+    code = std::move(new_code);
+    lines = std::move(new_lines);
+  }
+
 }  // namespace cpplox
\ No newline at end of file
@@ -0,0 +1,87 @@
+#include "cpplox/Bytecode/CompileCache.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <vector>
+
+#include "cpplox/Bytecode/BytecodeFile.h"
+
+namespace cpplox {
+
+namespace fs = std::filesystem;
+
+namespace {
+uint64_t fnv1a(uint64_t hash, std::string_view bytes) {
+  for (const char byte : bytes) {
+    hash = (hash ^ static_cast<uint8_t>(byte)) * 1099511628211u;
+  }
+  return hash;
+}
+}  // namespace
+
+CompileCache::CompileCache(fs::path directory, uintmax_t max_bytes)
+    : directory{std::move(directory)}, max_bytes{max_bytes} {
+  std::error_code ec{};
+  fs::create_directories(this->directory, ec);
+}
+
+std::string CompileCache::key(std::string_view source, const CompilerOptions& options) const {
+  const std::string configuration{std::string{compiler_version} + " format " +
+                                  std::to_string(BytecodeLoader::format_version) + " peephole " +
+                                  std::to_string(options.peephole) + " O" + std::to_string(options.opt_level) +
+                                  " whole " + std::to_string(options.whole_program)};
+  // peephole_diff only affects logging.
+  const uint64_t hash{fnv1a(fnv1a(14695981039346656037u, configuration), source)};
+  char hex[17];
+  std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+  return hex;
+}
+
+fs::path CompileCache::entry_path(const std::string& key) const {
+  return directory / (key + ".loxc");
+}
+
+std::optional<fs::path> CompileCache::lookup(const std::string& key) const {
+  const fs::path path{entry_path(key)};
+  std::error_code ec{};
+  if (!fs::is_regular_file(path, ec)) return std::nullopt;
+  fs::last_write_time(path, fs::file_time_type::clock::now(), ec);
+  // Marks the entry as recently used.
+  return path;
+}
+
+bool CompileCache::store(const std::string& key, const std::string& bytes) const {
+  if (!BytecodeWriter::write_bytes(bytes, entry_path(key).string())) return false;
+  evict();
+  return true;
+}
+
+void CompileCache::evict() const {
+  struct Entry {
+    fs::path path{};
+    uintmax_t size{0};
+    fs::file_time_type last_used{};
+  };
+  std::vector<Entry> entries{};
+  uintmax_t total{0};
+  std::error_code ec{};
+  for (const fs::directory_entry& file : fs::directory_iterator(directory, ec)) {
+    if (file.path().extension() != ".loxc") continue;
+    Entry entry{.path = file.path(), .size = file.file_size(ec), .last_used = file.last_write_time(ec)};
+    if (ec) continue;
+    // Another run may have evicted it already.
+    total += entry.size;
+    entries.push_back(std::move(entry));
+  }
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry& lhs, const Entry& rhs) { return lhs.last_used < rhs.last_used; });
+  for (const Entry& entry : entries) {
+    if (total <= max_bytes) break;
+    fs::remove(entry.path, ec);
+    total -= entry.size;
+  }
+  // Runs holding an evicted entry's mapping keep reading it, the file is only
+  // unlinked.
+}
+
+}  // namespace cpplox
@@ -1,14 +1,54 @@
 #include "cpplox/Bytecode/Compiler.h"
 
+#include <algorithm>
+#include <bit>
 #include <stdexcept>
+#include <unordered_set>
 
 #include "cpplox/Bytecode/Debug.h"
+#include "cpplox/Bytecode/IR.h"
+#include "cpplox/Bytecode/IROptimizer.h"
+#include "cpplox/Bytecode/Peephole.h"
+#include "cpplox/Bytecode/VM.h"
 #include "cpplox/Bytecode/common.h"
 #include "cpplox/Treewalk/Scanner.h"
 // TOOD: Move scanner to common / scanner package
 
 namespace cpplox {
 
+namespace {
+bool is_falsey_constant(const Value& val) {
+  return std::holds_alternative<std::monostate>(val) ||
+         (std::holds_alternative<bool>(val) && !std::get<bool>(val));
+  // Mirrors VM::is_falsey.
+}
+
+void reserve_stack(Function& function) {
+  const std::optional<size_t> max_height{ir::max_stack_height(*function.chunk, function.arity)};
+  assert(max_height);
+  const size_t height{*max_height};
+  if (height > VM::FRAME_SLOTS) {
+    function.extra_slots = std::max(function.extra_slots, height - VM::FRAME_SLOTS);
+  }
+  // VM checks a call's frame fits the stack once, so it must cover everything the
+  // code pushes, not only the locals it addresses.
+}
+}  // namespace
+
+size_t Compiler::ConstantHash::operator()(const Value& val) const {
+  if (const double* num = std::get_if<double>(&val)) {
+    return std::hash<uint64_t>{}(std::bit_cast<uint64_t>(*num));
+  }
+  return std::hash<Value>{}(val);
+}
+
+bool Compiler::ConstantEqual::operator()(const Value& lhs, const Value& rhs) const {
+  if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+    return std::bit_cast<uint64_t>(std::get<double>(lhs)) == std::bit_cast<uint64_t>(std::get<double>(rhs));
+  }
+  return lhs.index() == rhs.index() && lhs == rhs;
+}
+
 std::optional<function_ptr> Compiler::compile() {
   if (!healthy) {
     throw std::logic_error(
@@ -21,12 +61,17 @@ std::optional<function_ptr> Compiler::compile() {
   had_error = false;
   panic_mode = false;
   while (current < tokens.size() && !match(TokenType::LOX_EOF)) {
+    if (options.resumable) statement_starts.push_back(function->chunk->code.size());
     declaration();
   }
   if (tokens[previous].get_type() != TokenType::LOX_EOF) {
     error_at(previous, "Expected end of file.");
   }
   end_compiler();
+  if (!far_jumps.empty()) statement_starts.clear();
+  if (!had_error && options.opt_level > 1) {
+    optimize_program();
+  }
   return had_error ? std::nullopt : std::optional<function_ptr>(function);
 }
 
@@ -50,7 +95,7 @@ void Compiler::declaration() {
 }
 
 void Compiler::var_declaration() {
-  uint8_t maybe_const_table_index_of_global_variable_name =
+  size_t maybe_const_table_index_of_global_variable_name =
       parse_variable("Expected variable name after 'var'.");
   if (match(TokenType::EQUAL)) {
     expression();  // initialiser expression
@@ -62,7 +107,7 @@ void Compiler::var_declaration() {
 }
 
 void Compiler::dispatch_function_declaration() {
-  uint8_t maybe_const_table_index_of_global_variable_name =
+  size_t maybe_const_table_index_of_global_variable_name =
       parse_variable("Expected function name after 'fun'.");
   if (scope_depth > 0) {
     locals.back().depth = scope_depth;
@@ -75,7 +120,14 @@ void Compiler::dispatch_function_declaration() {
   // TODO: ^ is this even needed? Think if functions are always global in their
   // own Compiler.
 
-  Compiler function_compiler{tokens, disassembler, e_reporter, heap, pool, current, this};
+  if (options.lazy_functions) {
+    if (const std::optional<function_ptr> stub = lazy_function_declaration()) {
+      if (is_script && scope_depth == 0) declared_functions.push_back(*stub);
+      define_variable(maybe_const_table_index_of_global_variable_name);
+      return;
+    }
+  }
+  Compiler function_compiler{tokens, disassembler, e_reporter, heap, pool, options, current, this};
   function_compiler.register_gc_callbacks();
   // TODO: Move to ctor and dctor.
   function_compiler.function_declaration();
@@ -83,19 +135,83 @@ void Compiler::dispatch_function_declaration() {
   // Instead of managing recursive state in a single Compiler object, create a
   // a new compiler to process each function & then steal the bytecode it generated.
   
-  emit_closure(function_compiler.function);
-  for (auto& upvalue : function_compiler.upvalues) {
-    emit_operand(upvalue.is_local ? 1 : 0);
-    emit_operand(upvalue.index);
-  }
+  emit_closure(function_compiler.function, function_compiler.upvalues);
+  if (is_script && scope_depth == 0) declared_functions.push_back(function_compiler.function);
 
   define_variable(maybe_const_table_index_of_global_variable_name);
   current = function_compiler.current;
   previous = function_compiler.previous;
-  had_error = function_compiler.had_error;
+  had_error = had_error || function_compiler.had_error;
   panic_mode = function_compiler.panic_mode;
 }
 
+std::optional<function_ptr> Compiler::lazy_function_declaration() {
+  std::unordered_set<std::string> params{};
+  size_t arity{0};
+  size_t idx{current};
+  if (tokens[idx++].get_type() != TokenType::LEFT_PAREN) return std::nullopt;
+  while (tokens[idx].get_type() != TokenType::RIGHT_PAREN) {
+    if (arity > 0 && tokens[idx++].get_type() != TokenType::COMMA) return std::nullopt;
+    if (tokens[idx].get_type() != TokenType::IDENTIFIER) return std::nullopt;
+    params.insert(tokens[idx++].get_lexeme());
+    arity++;
+  }
+  if (arity > std::numeric_limits<uint8_t>::max() || tokens[idx++].get_type() != TokenType::RIGHT_PAREN ||
+      tokens[idx].get_type() != TokenType::LEFT_BRACE) {
+    return std::nullopt;
+  }
+
+  std::vector<std::string> names{};
+  for (int depth = 0;; idx++) {
+    const TokenType ttype{tokens[idx].get_type()};
+    if (ttype == TokenType::LOX_EOF) return std::nullopt;
+    if (ttype == TokenType::IDENTIFIER) names.push_back(tokens[idx].get_lexeme());
+    depth += ttype == TokenType::LEFT_BRACE ? 1 : ttype == TokenType::RIGHT_BRACE ? -1 : 0;
+    if (depth == 0) break;
+  }
+  // idx is the body's closing brace.
+
+  Compiler stub_compiler{tokens, disassembler, e_reporter, heap, pool, options, current, this};
+  const function_ptr stub{stub_compiler.function};
+  stub->arity = static_cast<int>(arity);
+  std::unordered_set<std::string> seen{};
+  for (const std::string& name : names) {
+    if (params.contains(name) || !seen.insert(name).second) continue;
+    const auto [upvalue_idx, found] = stub_compiler.resolve_upvalue(name);
+    if (found) stub_compiler.captured.emplace_back(name, upvalue_idx);
+  }
+  // Without the body's own scopes every name that resolves outside of it is
+  // captured, which may close over a variable the body shadows. That costs an
+  // unused upvalue but keeps indices of the ones in use valid.
+
+  auto body = std::make_shared<std::vector<const Token>>(tokens.begin() + current - 1, tokens.begin() + idx + 1);
+  body->emplace_back(TokenType::LOX_EOF, "", tokens[idx].get_line());
+  // The function's name up to its closing brace, source tokens don't outlive compile.
+  stub->chunk->lazy_code = [body, &disassembler = disassembler, &e_reporter = e_reporter, heap = heap,
+                            pool = pool, options = options, captured = stub_compiler.captured,
+                            function = stub.get()](Chunk& chunk) {
+    Compiler body_compiler{*body, disassembler, e_reporter, heap, pool, options, 1};
+    body_compiler.captured = captured;
+    body_compiler.register_gc_callbacks();
+    body_compiler.function_declaration();
+    body_compiler.end_compiler();
+    if (body_compiler.had_error) return false;
+    Chunk& compiled{*body_compiler.function->chunk};
+    chunk.code = std::move(compiled.code);
+    chunk.lines = std::move(compiled.lines);
+    chunk.constants = std::move(compiled.constants);
+    function->extra_slots = body_compiler.function->extra_slots;
+    return true;
+  };
+  emit_closure(stub, stub_compiler.upvalues);
+
+  previous = idx;
+  current = idx + 1;
+  had_error = had_error || stub_compiler.had_error;
+  panic_mode = panic_mode || stub_compiler.panic_mode;
+  return stub;
+}
+
 void Compiler::function_declaration() {
   begin_scope();
   // Wrapping function declaration in a scope to avoid top-level function
@@ -108,7 +224,7 @@ void Compiler::function_declaration() {
         return;
       }
       function->arity++;
-      uint8_t zero_as_function_args_are_local =
+      size_t zero_as_function_args_are_local =
           parse_variable("Expected variable name.");
       assert(zero_as_function_args_are_local == 0);
       define_variable(zero_as_function_args_are_local);
@@ -198,7 +314,19 @@ void Compiler::grouping(const bool precedence_context_allows_assignment) {
 
 void Compiler::unary(const bool precedence_context_allows_assignment) {
   const Token& token{tokens[previous]};
+  const size_t operand_instr_idx {function->chunk->code.size()};
   parse_precedence(Precedence::UNARY);
+  if (const std::optional<Value> operand = constant_load(operand_instr_idx, function->chunk->code.size())) {
+    if (token.get_type() == TokenType::BANG) {
+      replace_with_constant(operand_instr_idx, is_falsey_constant(*operand));
+      return;
+    }
+    if (token.get_type() == TokenType::MINUS && std::holds_alternative<double>(*operand)) {
+      replace_with_constant(operand_instr_idx, -std::get<double>(*operand));
+      return;
+    }
+    // Negating a non-number is left for the VM to report at runtime.
+  }
   switch (token.get_type()) {
     case TokenType::BANG:
       emit_opcode(OpCode::OP_NOT);
@@ -217,6 +345,8 @@ void Compiler::binary(const bool precedence_context_allows_assignment) {
   const ParseRule& current_rule = rules.at(static_cast<size_t>(op));
   Precedence one_higher =
       static_cast<Precedence>(static_cast<size_t>(current_rule.precedence) + 1);
+  const size_t lhs_instr_idx {infix_lhs_instr_idx};
+  const size_t rhs_instr_idx {function->chunk->code.size()};
   parse_precedence(one_higher);
   // As binary operators are left-associative, parsing this op's right-hand
   // operand has to be constrained to only include more binding operators.
@@ -224,6 +354,15 @@ void Compiler::binary(const bool precedence_context_allows_assignment) {
   // be included, not "3", "+" and "4"; when compiling RHS of * in 2 *
   // instance.call() tokens for "instance", "." and "call()" should be consumed.
 
+  const std::optional<Value> lhs {constant_load(lhs_instr_idx, rhs_instr_idx)};
+  const std::optional<Value> rhs {constant_load(rhs_instr_idx, function->chunk->code.size())};
+  if (lhs && rhs) {
+    if (const std::optional<Value> folded = fold_binary(op, *lhs, *rhs)) {
+      replace_with_constant(lhs_instr_idx, *folded);
+      return;
+    }
+  }
+
   switch (op) {
     case TokenType::BANG_EQUAL:
       emit_opcodes(OpCode::OP_EQUAL, OpCode::OP_NOT);
@@ -266,7 +405,18 @@ void Compiler::and_(const bool precedence_context_allows_assignment) {
   // expression.
   // !falsey: VM pops LHS value and evaluates RHS, which becomes the
   // result.
-  uint16_t jump_over_rhs_instr_idx = emit_jump(OpCode::OP_JUMP_IF_FALSE);
+  const size_t lhs_instr_idx {infix_lhs_instr_idx};
+  if (const std::optional<Value> lhs = constant_load(lhs_instr_idx, function->chunk->code.size())) {
+    if (is_falsey_constant(*lhs)) {
+      skip_operand(Precedence::AND);
+    } else {
+      drop_code(lhs_instr_idx);
+      parse_precedence(Precedence::AND);
+    }
+    return;
+    // LHS known at compile time decides which operand is the result, no jumps needed.
+  }
+  size_t jump_over_rhs_instr_idx = emit_jump(OpCode::OP_JUMP_IF_FALSE);
   emit_opcode(OpCode::OP_POP);
   parse_precedence(Precedence::AND);
   patch_jump(jump_over_rhs_instr_idx);
@@ -278,9 +428,20 @@ void Compiler::or_(const bool precedence_context_allows_assignment) {
   // !falsey: VM skips RHS and leaves LHS value as the result for the entire
   // expression. TODO optimisation idea: add OP_JUMP_IF_TRUE as currently
   // "or" is slower than "and".
-  uint16_t jump_to_rhs_instr_idx = emit_jump(OpCode::OP_JUMP_IF_FALSE);
+  const size_t lhs_instr_idx {infix_lhs_instr_idx};
+  if (const std::optional<Value> lhs = constant_load(lhs_instr_idx, function->chunk->code.size())) {
+    if (is_falsey_constant(*lhs)) {
+      drop_code(lhs_instr_idx);
+      parse_precedence(Precedence::OR);
+    } else {
+      skip_operand(Precedence::OR);
+    }
+    return;
+    // See and_.
+  }
+  size_t jump_to_rhs_instr_idx = emit_jump(OpCode::OP_JUMP_IF_FALSE);
   // Jumps over the jump_over_rhs jump. Parse that!
-  uint16_t jump_over_rhs_instr_idx = emit_jump(OpCode::OP_JUMP);
+  size_t jump_over_rhs_instr_idx = emit_jump(OpCode::OP_JUMP);
   patch_jump(jump_to_rhs_instr_idx);
   emit_opcode(OpCode::OP_POP);
   parse_precedence(Precedence::OR);
@@ -321,6 +482,7 @@ void Compiler::call(const bool precedence_context_allows_assignment) {
   consume(TokenType::RIGHT_PAREN, "Expected ')' at the end of function call.");
   emit_opcode(OpCode::OP_CALL);
   emit_operand(arg_count);
+  last_call_instr_idx = function->chunk->code.size() - 2;
 }
 
 void Compiler::return_statement() {
@@ -332,6 +494,13 @@ void Compiler::return_statement() {
   } else {
     expression();
     consume(TokenType::SEMICOLON, "Expected ';' after return value.");
+    std::vector<uint8_t>& code {function->chunk->code};
+    if (last_call_instr_idx == code.size() - 2) {
+      code[*last_call_instr_idx] = static_cast<uint8_t>(OpCode::OP_TAIL_CALL);
+      // Call's result is the returned value on every path reaching it: "and"/"or"
+      // jumps that skip the call land on OP_RETURN below, so rewriting it in place
+      // is safe. VM reuses the current frame for the callee.
+    }
     emit_opcode(OpCode::OP_RETURN);
   }
 }
@@ -358,6 +527,7 @@ void Compiler::parse_precedence(const Precedence& precedence) {
   // "b" would peek() and see subsequent "=" incorrectly treating "a * b" as a
   // valid assignment target. This flag informs parsing functions is surrounding
   // precedence is low enough to consume "=" during parsing.
+  const size_t expr_instr_idx {function->chunk->code.size()};
   (this->*prefix_fn)(precedence_context_allows_assignment);
   // When reading valid code left to right, the first token is always belongs
   // to some prefix expression. Best to step in debugger to see how it  works.
@@ -365,6 +535,8 @@ void Compiler::parse_precedence(const Precedence& precedence) {
   token_type_as_number = static_cast<size_t>(tokens[current].get_type());
   while (precedence <= rules[token_type_as_number].precedence) {
     advance();
+    infix_lhs_instr_idx = expr_instr_idx;
+    // Everything emitted since expr_instr_idx is the infix operator's LHS.
     (this->*rules[token_type_as_number].infix)(
         precedence_context_allows_assignment);
     token_type_as_number = static_cast<size_t>(tokens[current].get_type());
@@ -377,7 +549,7 @@ void Compiler::parse_precedence(const Precedence& precedence) {
   }
 }
 
-uint8_t Compiler::parse_variable(const std::string& err_msg) {
+size_t Compiler::parse_variable(const std::string& err_msg) {
   consume(TokenType::IDENTIFIER, err_msg);
   declare_variable();
   if (scope_depth == 0) {
@@ -411,20 +583,22 @@ void Compiler::declare_variable() {
     // = 2; } Shadowing is ok though: { var a = 1; { var a = 2; } }
   }
 
-  if (locals.size() > std::numeric_limits<uint8_t>::max()) {
+  if (locals.size() > std::numeric_limits<uint16_t>::max()) {
     error_at(previous, "Too many local variables.");
-    // VM limitation: the instructions working with local variables refer to
-    // them by a 1 byte slot index. Exceeding 256 variables (max representable
-    // id is 255) would break addressing.
+    // VM limitation: OP_GET_LOCAL_LONG and OP_SET_LOCAL_LONG refer to locals by a
+    // 2 byte slot index.
     return;
   }
   locals.push_back({.name = var_name, .depth = -1, .ready = false, .is_captured = false});
+  if (locals.size() > VM::FRAME_SLOTS) {
+    function->extra_slots = std::max(function->extra_slots, locals.size() - VM::FRAME_SLOTS);
+  }
   // Local is declared but must not be resolved as its initializer is yet to be
   // parsed.
 }
 
 void Compiler::define_variable(
-    const uint8_t const_table_index_of_global_variable_name) {
+    const size_t const_table_index_of_global_variable_name) {
   if (scope_depth > 0) {
     locals.back().depth = scope_depth;
     locals.back().ready = true;
@@ -441,8 +615,7 @@ void Compiler::define_variable(
     // name; but it also already identifies them by array index (here), so it
     // should be possible to use vector instead of map (unless problems in
     // later chapters).
-    emit_opcode(OpCode::OP_DEFINE_GLOBAL);
-    emit_operand(const_table_index_of_global_variable_name);
+    emit_with_operand(OpCode::OP_DEFINE_GLOBAL, const_table_index_of_global_variable_name);
   }
 }
 
@@ -472,13 +645,13 @@ void Compiler::if_statement() {
   consume(TokenType::LEFT_PAREN, "Expected '(' after if");
   expression();
   consume(TokenType::RIGHT_PAREN, "Expected ')' after condition");
-  uint16_t jump_over_if_branch_instr_idx = emit_jump(OpCode::OP_JUMP_IF_FALSE);
+  size_t jump_over_if_branch_instr_idx = emit_jump(OpCode::OP_JUMP_IF_FALSE);
   // Conditionally jump over the "if" branch.
   emit_opcode(OpCode::OP_POP);
   // Evaluating the "if" condition leaves value on stack that has to be cleaned
   // up. This POP will be reached only if the condition is true (= no jump).
   statement();
-  uint16_t jump_over_else_branch_instr_idx = emit_jump(OpCode::OP_JUMP);
+  size_t jump_over_else_branch_instr_idx = emit_jump(OpCode::OP_JUMP);
   // Unconditionally jump over the the "else" branch.
   patch_jump(jump_over_if_branch_instr_idx);
   // "if" jump should land after last instruction in "if" branch.
@@ -497,7 +670,7 @@ void Compiler::while_statement() {
   consume(TokenType::LEFT_PAREN, "Expected '(' after while");
   expression();
   consume(TokenType::RIGHT_PAREN, "Expected ')' after condition");
-  uint16_t jump_over_while_body_instr_idx = emit_jump(OpCode::OP_JUMP_IF_FALSE);
+  size_t jump_over_while_body_instr_idx = emit_jump(OpCode::OP_JUMP_IF_FALSE);
   emit_opcode(OpCode::OP_POP);
   statement();
   emit_loop(loop_start_instr_idx);
@@ -519,7 +692,7 @@ void Compiler::for_statement() {
   size_t loop_start_instr_idx = function->chunk->code.size();
   // Every loop iteration starts with evaluating the condition.
 
-  uint16_t maybe_jump_over_loop_body_instr_idx{0};
+  size_t maybe_jump_over_loop_body_instr_idx{0};
   bool had_condition{false};
   if (!check(TokenType::SEMICOLON)) {
     expression();
@@ -534,8 +707,8 @@ void Compiler::for_statement() {
     // Increment clause should be evaluated at the end of each loop iteration.
     // https://craftinginterpreters.com/jumping-back-and-forth.html#increment-clause
     // has a helpful diagram.
-    uint16_t jump_over_incr_expr_instr_idx = emit_jump(OpCode::OP_JUMP);
-    uint16_t maybe_increment_expr_instr_idx = function->chunk->code.size();
+    size_t jump_over_incr_expr_instr_idx = emit_jump(OpCode::OP_JUMP);
+    size_t maybe_increment_expr_instr_idx = function->chunk->code.size();
     expression();
     emit_opcode(OpCode::OP_POP);
     emit_loop(loop_start_instr_idx);
@@ -564,7 +737,7 @@ void Compiler::named_variable(const std::string var_name,
   auto [idx_if_found, found] = resolve_local(var_name);
   OpCode get_op;  // Op to emit if named variable is read from.
   OpCode set_op;  // Op to emit if named variable is written to.
-  uint8_t idx{0};
+  size_t idx{0};
   if (found) {
     idx = idx_if_found;
     get_op = OpCode::OP_GET_LOCAL;
@@ -593,14 +766,13 @@ void Compiler::named_variable(const std::string var_name,
     // example: a.call().y = x;, Note: a.call().y == x; would produce
     // TokenType::EQUAL_EQUAL.
     expression();
-    emit_opcode(set_op);
+    emit_with_operand(set_op, idx);
   } else {
-    emit_opcode(get_op);
+    emit_with_operand(get_op, idx);
   }
-  emit_operand(idx);
 }
 
-std::pair<uint8_t, bool> Compiler::resolve_local(const std::string& name) {
+std::pair<uint16_t, bool> Compiler::resolve_local(const std::string& name) {
   // At runtime, locals are loaded and stored using the stack slot index, so
   // that’s what the compiler needs to calculate when it resolves the variable.
   // Luckily, locals vector has the same layout at VM's stack will have at
@@ -613,7 +785,7 @@ std::pair<uint8_t, bool> Compiler::resolve_local(const std::string& name) {
         error_at(previous, "Can't read local variable in its own initializer.",
                  "[Resolving error]");
       }
-      return {static_cast<uint8_t>(idx), true};
+      return {static_cast<uint16_t>(idx), true};
     }
     idx--;
   }
@@ -623,6 +795,9 @@ std::pair<uint8_t, bool> Compiler::resolve_local(const std::string& name) {
 std::pair<uint8_t, bool> Compiler::resolve_upvalue(const std::string& name) {
   // Recursively resolves name in enclosing lexicical scopes.
   if (enclosing == nullptr) {
+    for (const auto& [captured_name, idx] : captured) {
+      if (captured_name == name) return {idx, true};
+    }
     return {0, false};
   }
   auto [idx_if_found, found] = enclosing->resolve_local(name);
@@ -637,7 +812,7 @@ std::pair<uint8_t, bool> Compiler::resolve_upvalue(const std::string& name) {
   return {0, false};
 }
 
-uint8_t Compiler::add_or_get_upvalue(uint8_t index, bool is_local) {
+uint8_t Compiler::add_or_get_upvalue(uint16_t index, bool is_local) {
   // Returns existing upvalue's index if the same variable from enclosing function
   // is referenced multiple times.
   uint8_t upvalues_idx = 0;
@@ -656,17 +831,143 @@ uint8_t Compiler::add_or_get_upvalue(uint8_t index, bool is_local) {
   return static_cast<uint8_t>(idx);
 }
 
-uint8_t Compiler::add_constant(Value val) {
-  size_t idx = function->chunk->add_constant(val);
-  if (idx > std::numeric_limits<uint8_t>::max()) {
-    error_at(previous, "Too many constants in code chunk. OP_CONSTANT uses a single byte operand.");
-    // VM limitation: the instructions working with constants refer to them by a 1 byte slot index.
-    // Exceeding 256 variables (max representable id is 255) would break addressing.
+size_t Compiler::add_constant(Value val) {
+  const auto [iter, inserted] = constant_indices.try_emplace(val, function->chunk->constants.size());
+  if (inserted) {
+    function->chunk->add_constant(val);
+    constant_uses.push_back(0);
   }
-  return static_cast<uint8_t>(idx);
+  // Equal constants share a slot, so repeated literals and global names keep
+  // fitting the single byte operand of the short instructions.
+  const size_t idx {iter->second};
+  constant_uses[idx]++;
+  if (idx > max_wide_operand) {
+    error_at(previous, "Too many constants in code chunk. OP_CONSTANT_LONG uses a 3 byte operand.");
+  }
+  return idx;
+}
+
+void Compiler::release_constant(size_t idx) {
+  constant_uses[idx]--;
+  std::vector<Value>& constants {function->chunk->constants};
+  while (!constants.empty() && constant_uses.back() == 0) {
+    constant_indices.erase(constants.back());
+    constants.pop_back();
+    constant_uses.pop_back();
+  }
+  // Only trailing constants can be dropped without renumbering emitted operands.
+}
+
+std::optional<Value> Compiler::constant_load(size_t start_instr_idx, size_t end_instr_idx) const {
+  const Chunk& chunk {*function->chunk};
+  if (start_instr_idx >= end_instr_idx) return std::nullopt;
+  const OpCode op {chunk.code[start_instr_idx]};
+  if ((op == OpCode::OP_CONSTANT || op == OpCode::OP_CONSTANT_LONG) &&
+      end_instr_idx - start_instr_idx == chunk.instruction_size(start_instr_idx)) {
+    return chunk.constants[chunk.operand(start_instr_idx)];
+  }
+  if (end_instr_idx - start_instr_idx == 1) {
+    switch (op) {
+      case OpCode::OP_TRUE:
+        return Value{true};
+      case OpCode::OP_FALSE:
+        return Value{false};
+      case OpCode::OP_NIL:
+        return Value{std::monostate{}};
+      default:
+        break;
+    }
+  }
+  return std::nullopt;
+  // Code in [start, end) has to be exactly one instruction pushing a constant.
 }
 
-uint16_t Compiler::emit_jump(const OpCode op) const {
+std::optional<Value> Compiler::fold_binary(TokenType op, const Value lhs, const Value rhs) {
+  switch (op) {
+    case TokenType::EQUAL_EQUAL:
+      return Value{lhs == rhs};
+    case TokenType::BANG_EQUAL:
+      return Value{!(lhs == rhs)};
+    default:
+      break;
+  }
+  if (std::holds_alternative<const_string_ptr>(lhs) && std::holds_alternative<const_string_ptr>(rhs) &&
+      op == TokenType::PLUS) {
+    return Value{pool->insert_or_get(*std::get<const_string_ptr>(lhs) + *std::get<const_string_ptr>(rhs))};
+  }
+  if (!std::holds_alternative<double>(lhs) || !std::holds_alternative<double>(rhs)) {
+    return std::nullopt;
+  }
+  // Type errors are reported by the VM at runtime, same as without folding.
+
+  const double a {std::get<double>(lhs)};
+  const double b {std::get<double>(rhs)};
+  switch (op) {
+    case TokenType::GREATER:
+      return Value{a > b};
+    case TokenType::GREATER_EQUAL:
+      return Value{!(a < b)};
+    case TokenType::LESS:
+      return Value{a < b};
+    case TokenType::LESS_EQUAL:
+      return Value{!(a > b)};
+    // Same composition as the emitted OP_LESS/OP_GREATER + OP_NOT, NaN included.
+    case TokenType::STAR:
+      return Value{a * b};
+    case TokenType::SLASH:
+      return Value{a / b};
+    case TokenType::PLUS:
+      return Value{a + b};
+    case TokenType::MINUS:
+      return Value{a - b};
+    default:
+      return std::nullopt;
+  }
+}
+
+void Compiler::drop_code(size_t instr_idx) {
+  const Chunk& chunk {*function->chunk};
+  for (size_t i = instr_idx; i < chunk.code.size(); i += chunk.instruction_size(i)) {
+    switch (static_cast<OpCode>(chunk.code[i])) {
+      case OpCode::OP_CONSTANT:
+      case OpCode::OP_CONSTANT_LONG:
+      case OpCode::OP_GET_GLOBAL:
+      case OpCode::OP_GET_GLOBAL_LONG:
+      case OpCode::OP_SET_GLOBAL:
+      case OpCode::OP_SET_GLOBAL_LONG:
+      case OpCode::OP_CLOSURE:
+      case OpCode::OP_CLOSURE_LONG:
+        release_constant(chunk.operand(i));
+        break;
+      default:
+        break;
+    }
+  }
+  truncate_code(instr_idx);
+  // Every use of a constant is an operand of one of these, so constants only the
+  // dropped code referred to end up unused.
+}
+
+void Compiler::replace_with_constant(size_t instr_idx, Value val) {
+  drop_code(instr_idx);
+  emit_folded(val);
+}
+
+void Compiler::skip_operand(const Precedence& precedence) {
+  const size_t operand_instr_idx {function->chunk->code.size()};
+  parse_precedence(precedence);
+  drop_code(operand_instr_idx);
+  // Operand is still parsed for errors, but its code and the uses of constants it
+  // added or reused are discarded as it can never be evaluated.
+}
+
+void Compiler::truncate_code(size_t instr_idx) {
+  function->chunk->truncate(instr_idx);
+  if (last_call_instr_idx >= instr_idx) last_call_instr_idx.reset();
+  far_jumps.erase(far_jumps.lower_bound(instr_idx), far_jumps.end());
+}
+
+size_t Compiler::emit_jump(const OpCode op) const {
   emit_opcode(op);
   emit_operand(0);
   emit_operand(0);
@@ -675,30 +976,52 @@ uint16_t Compiler::emit_jump(const OpCode op) const {
 }
 
 void Compiler::emit_loop(size_t loop_start_instr_idx) {
-  emit_opcode(OpCode::OP_LOOP);
-  size_t jump_dist = function->chunk->code.size() + 2 - loop_start_instr_idx;
+  size_t jump_dist = function->chunk->code.size() + 3 - loop_start_instr_idx;
   // Intent: jump such that execution is resumed at "while" condition
   // evaluation.
-  if (jump_dist > std::numeric_limits<uint16_t>::max()) {
+  if (jump_dist <= std::numeric_limits<uint16_t>::max()) {
+    emit_with_operand(OpCode::OP_LOOP, jump_dist);
+    return;
+  }
+  if (function->chunk->code.size() > max_wide_operand / 2) {
     error_at(previous, "Loop body too large, too much code to jump over.");
   }
-  function->chunk->code.push_back((jump_dist >> 8) & 0xff);
-  function->chunk->code.push_back(jump_dist & 0xff);
+  emit_with_operand(OpCode::OP_LOOP_LONG, jump_dist + 1);
 }
 
-void Compiler::patch_jump(uint16_t jump_instr_idx) {
+void Compiler::patch_jump(size_t jump_instr_idx) {
   size_t jump_dist = function->chunk->code.size() - 3 - jump_instr_idx;
   // Intent: jump such that execution is resumed at code.size() (so 1 after last
   // instruction). While interpreting this jump instruction, the VM will consume
   // jump's 2 operands moving IP by 2 and then start processing the next
   // instruction moving IP by 1 and jump distance has to be adjusted.
   if (jump_dist > std::numeric_limits<uint16_t>::max()) {
-    error_at_current("Too much code to jump over.");
+    if (function->chunk->code.size() > max_wide_operand / 2) {
+      error_at_current("Too much code to jump over.");
+    }
+    far_jumps[jump_instr_idx] = function->chunk->code.size();
+    jump_dist = 0;
+    // Offsets of code emitted since the jump are already taken, so end_compiler
+    // widens it once the function is done. Up to a third of the code can be
+    // jumps growing by a byte, code half the maximum jump keeps them in range.
   }
   function->chunk->code[jump_instr_idx + 1] = (jump_dist >> 8) & 0xff;
   function->chunk->code[jump_instr_idx + 2] = jump_dist & 0xff;
 }
 
+void Compiler::emit_with_operand(const OpCode op, size_t operand) const {
+  if (operand_width(op) == 1 && operand <= std::numeric_limits<uint8_t>::max()) {
+    emit_opcode(op);
+    emit_operand(static_cast<uint8_t>(operand));
+    return;
+  }
+  const OpCode encoded_op {operand_width(op) == 1 ? wide_variant(op) : op};
+  emit_opcode(encoded_op);
+  for (size_t byte = operand_width(encoded_op); byte-- > 0;) {
+    emit_operand((operand >> (8 * byte)) & 0xff);
+  }
+}
+
 void Compiler::emit_operand(uint8_t byte) const {
   function->chunk->add_byte(byte, tokens[previous].get_line());
 }
@@ -712,15 +1035,34 @@ void Compiler::emit_opcodes(const OpCode op_one, const OpCode op_two) const {
   emit_opcode(op_two);
 }
 
-void Compiler::emit_closure(Value val) {
-  emit_opcode(OpCode::OP_CLOSURE);
-  emit_operand(add_constant(val));
+void Compiler::emit_closure(Value val, const std::list<CompiletimeUpvalue>& captured) {
+  const size_t idx {add_constant(val)};
+  const bool wide {idx > std::numeric_limits<uint8_t>::max() ||
+                   std::any_of(captured.begin(), captured.end(), [](const CompiletimeUpvalue& upvalue) {
+                     return upvalue.index > std::numeric_limits<uint8_t>::max();
+                   })};
+  emit_with_operand(wide ? OpCode::OP_CLOSURE_LONG : OpCode::OP_CLOSURE, idx);
+  for (const CompiletimeUpvalue& upvalue : captured) {
+    emit_operand(upvalue.is_local ? 1 : 0);
+    if (wide) emit_operand(upvalue.index >> 8);
+    emit_operand(upvalue.index & 0xff);
+  }
+  // Captured locals past slot 255 need the long form's 2 byte indices.
 }
 
 void Compiler::emit_constant(Value val) {
   // Constants stay alive as long as the owning function is reachable during GC.
-  emit_opcode(OpCode::OP_CONSTANT);
-  emit_operand(add_constant(val));
+  emit_with_operand(OpCode::OP_CONSTANT, add_constant(val));
+}
+
+void Compiler::emit_folded(Value val) {
+  if (const bool* boolean = std::get_if<bool>(&val)) {
+    emit_opcode(*boolean ? OpCode::OP_TRUE : OpCode::OP_FALSE);
+  } else if (std::holds_alternative<std::monostate>(val)) {
+    emit_opcode(OpCode::OP_NIL);
+  } else {
+    emit_constant(val);
+  }
 }
 
 void Compiler::emit_return() const {
@@ -731,6 +1073,22 @@ void Compiler::end_compiler() const {
   emit_return();
   heap->deregister_root_marking_callback();
   // TODO: Move to ctor & dctor
+  if (!had_error) {
+    // Chunks with errors are never run and can have unpatched jumps.
+    if (!far_jumps.empty()) function->chunk->widen_jumps(far_jumps);
+    const Chunk unoptimized {options.peephole_diff ? *function->chunk : Chunk{}};
+    const bool keep_offsets {is_script && options.resumable};
+    if (options.opt_level > 0 && !keep_offsets) {
+      IROptimizer{options.opt_level}.optimize(*function->chunk, function->arity);
+    }
+    if (options.peephole && !keep_offsets) {
+      PeepholeOptimizer{}.optimize(*function->chunk);
+    }
+    if (options.peephole_diff) {
+      disassembler.disassemble_diff(unoptimized, *function->chunk, *function->name);
+    }
+    reserve_stack(*function);
+  }
 #ifdef DEBUG_PRINT_CODE
   if (!had_error) {
     disassembler.disassemble_chunk(*function->chunk, *function->name);
@@ -738,6 +1096,39 @@ void Compiler::end_compiler() const {
 #endif
 }
 
+void Compiler::optimize_program() const {
+  std::vector<function_ptr> functions{function};
+  bool whole_program{options.whole_program};
+  for (size_t i = 0; i < functions.size(); i++) {
+    for (const Value& constant : functions[i]->chunk->constants) {
+      const function_ptr* nested = std::get_if<function_ptr>(&constant);
+      if (nested && (*nested)->chunk->lazy_code) whole_program = false;
+      if (nested && !(*nested)->chunk->lazy_code) functions.push_back(*nested);
+    }
+  }
+  // Bodies that weren't compiled yet may assign to any global.
+  std::vector<Chunk> unoptimized{};
+  for (const function_ptr& compiled : functions) unoptimized.push_back(*compiled->chunk);
+
+  const IROptimizer optimizer{options.opt_level};
+  optimizer.inline_calls(functions);
+  optimizer.hoist_loop_invariants(functions, whole_program);
+  if (options.resumable) *functions[0]->chunk = unoptimized[0];
+  // Script's statement offsets stay valid.
+  function->chunk->whole_program = whole_program;
+  for (size_t i = 0; i < functions.size(); i++) {
+    Chunk& chunk{*functions[i]->chunk};
+    if (chunk.code == unoptimized[i].code) continue;
+    if (options.peephole) {
+      PeepholeOptimizer{}.optimize(chunk);
+    }
+    if (options.peephole_diff) {
+      disassembler.disassemble_diff(unoptimized[i], chunk, *functions[i]->name);
+    }
+    reserve_stack(*functions[i]);
+  }
+}
+
 bool Compiler::check(TokenType ttype) const {
   return tokens[current].get_type() == ttype;
 }
@@ -0,0 +1,310 @@
+#include "cpplox/Bytecode/CopyAndPatch.h"
+
+#include <cstring>
+#include <span>
+#include <string_view>
+
+#include "cpplox/Bytecode/IR.h"
+#include "cpplox/Bytecode/SlowPaths.h"
+#include "Stencils.inc"
+// Generated by StencilExtractor (see src/Bytecode/stencils), defines stencils::all.
+
+namespace cpplox {
+
+namespace {
+const Stencil* find(std::string_view name) {
+  for (const Stencil& stencil : stencils::all) {
+    if (stencil.name == name) return &stencil;
+  }
+  return nullptr;
+}
+
+struct SlowPath {
+  std::string_view symbol;
+  uint64_t address;
+};
+
+template <typename F>
+SlowPath slow_path(std::string_view symbol, F* function) {
+  return {symbol, reinterpret_cast<uint64_t>(function)};
+}
+
+const SlowPath slow_paths[]{
+    slow_path("cpplox_slots", cpplox_slots),
+    slow_path("cpplox_step", cpplox_step),
+    slow_path("cpplox_call", cpplox_call),
+    slow_path("cpplox_tail_call", cpplox_tail_call),
+    slow_path("cpplox_return", cpplox_return),
+    slow_path("cpplox_equal", cpplox_equal),
+    slow_path("cpplox_not", cpplox_not),
+    slow_path("cpplox_not_callee", cpplox_not_callee),
+    slow_path("cpplox_get_upvalue", cpplox_get_upvalue),
+    slow_path("cpplox_set_upvalue", cpplox_set_upvalue),
+};
+
+constexpr std::string_view holes[]{"cpplox_hole_a",  "cpplox_hole_b",        "cpplox_hole_constant",
+                                   "cpplox_hole_ip", "cpplox_hole_continue", "cpplox_hole_jump"};
+
+constexpr std::string_view required[]{"ENTER",        "STEP",      "JUMP",      "JUMP_IF_FALSE",
+                                      "JUMP_IF_TRUE", "JUMP_IF_NOT_CALLEE", "CALL", "TAIL_CALL",
+                                      "RETURN"};
+// Control flow can't be left to cpplox_step, everything else can.
+
+std::string_view stencil_name(OpCode op) {
+  switch (op) {
+    case OpCode::OP_CONSTANT:
+      return "CONSTANT";
+    case OpCode::OP_NIL:
+      return "NIL";
+    case OpCode::OP_TRUE:
+      return "TRUE";
+    case OpCode::OP_FALSE:
+      return "FALSE";
+    case OpCode::OP_GET_LOCAL:
+    case OpCode::OP_SET_LOCAL:
+    case OpCode::OP_INLINED_RETURN:
+      return "COPY";
+    case OpCode::OP_GET_UPVALUE:
+      return "GET_UPVALUE";
+    case OpCode::OP_SET_UPVALUE:
+      return "SET_UPVALUE";
+    case OpCode::OP_EQUAL:
+      return "EQUAL";
+    case OpCode::OP_NOT:
+      return "NOT";
+    case OpCode::OP_NEGATE:
+      return "NEGATE";
+    case OpCode::OP_ADD:
+      return "ADD";
+    case OpCode::OP_ADD_NN:
+      return "ADD_NN";
+    case OpCode::OP_SUBTRACT:
+      return "SUBTRACT";
+    case OpCode::OP_SUBTRACT_NN:
+      return "SUBTRACT_NN";
+    case OpCode::OP_MULTIPLY:
+      return "MULTIPLY";
+    case OpCode::OP_MULTIPLY_NN:
+      return "MULTIPLY_NN";
+    case OpCode::OP_DIVIDE:
+      return "DIVIDE";
+    case OpCode::OP_DIVIDE_NN:
+      return "DIVIDE_NN";
+    case OpCode::OP_GREATER:
+      return "GREATER";
+    case OpCode::OP_GREATER_NN:
+      return "GREATER_NN";
+    case OpCode::OP_LESS:
+      return "LESS";
+    case OpCode::OP_LESS_NN:
+      return "LESS_NN";
+    case OpCode::OP_JUMP:
+    case OpCode::OP_LOOP:
+      return "JUMP";
+    case OpCode::OP_JUMP_IF_FALSE:
+      return "JUMP_IF_FALSE";
+    case OpCode::OP_JUMP_IF_TRUE:
+      return "JUMP_IF_TRUE";
+    case OpCode::OP_JUMP_IF_NOT_CALLEE:
+      return "JUMP_IF_NOT_CALLEE";
+    case OpCode::OP_CALL:
+      return "CALL";
+    case OpCode::OP_TAIL_CALL:
+      return "TAIL_CALL";
+    case OpCode::OP_RETURN:
+      return "RETURN";
+    default:
+      return "STEP";
+      // Globals, printing, closures and closing upvalues.
+  }
+}
+
+bool has_hole(const Stencil& stencil, std::string_view symbol) {
+  for (const StencilHole& hole : stencil.holes) {
+    if (hole.symbol == symbol) return true;
+  }
+  return false;
+}
+
+bool resolvable(std::string_view symbol) {
+  for (std::string_view hole : holes) {
+    if (hole == symbol) return true;
+  }
+  for (const SlowPath& path : slow_paths) {
+    if (path.symbol == symbol) return true;
+  }
+  return false;
+}
+
+bool check_stencils() {
+  for (std::string_view name : required) {
+    if (!find(name)) return false;
+  }
+  for (const Stencil& stencil : stencils::all) {
+    for (const StencilHole& hole : stencil.holes) {
+      if (!resolvable(hole.symbol)) return false;
+    }
+  }
+  return true;
+}
+}  // namespace
+
+bool CopyAndPatch::supported() {
+  static const bool complete{check_stencils()};
+  return complete;
+}
+
+std::optional<CopyAndPatch> CopyAndPatch::stitch(const Function& function) {
+  if (!supported()) return std::nullopt;
+  const Chunk& chunk{*function.chunk};
+  const std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(chunk, function.arity)};
+  if (!cfg) return std::nullopt;
+
+  CopyAndPatch code{};
+  code.pieces.push_back({find("ENTER")});
+  std::vector<size_t> block_pieces{};
+  size_t offset{0};
+  for (const ir::BasicBlock& block : cfg->blocks) {
+    block_pieces.push_back(code.pieces.size());
+    size_t h{block.entry_height.value_or(0)};
+    for (const ir::Node& node : block.nodes) {
+      const size_t at{offset};
+      const size_t end{offset + 1 + node.operands.size()};
+      offset = end;
+      if (!block.entry_height) continue;
+      // Unreachable, nothing jumps here.
+
+      const auto emit = [&](uint64_t a, uint64_t b = 0) -> Piece& {
+        const Stencil* stencil{find(stencil_name(node.op))};
+        if (stencil) {
+          code.pieces.push_back({stencil, a, b, nullptr, chunk.code.data() + at});
+        } else {
+          code.pieces.push_back({find("STEP"), h, 0, nullptr, chunk.code.data() + at});
+          // Stencils the compiler didn't produce in a usable form.
+        }
+        return code.pieces.back();
+      };
+      switch (node.op) {
+        case OpCode::OP_POP:
+        case OpCode::OP_NOOP:
+          break;
+        case OpCode::OP_CONSTANT:
+          emit(h).constant = chunk.constants.data() + node.operands[0];
+          break;
+        case OpCode::OP_GET_LOCAL:
+          emit(h, node.operands[0]);
+          break;
+        case OpCode::OP_SET_LOCAL:
+          emit(node.operands[0], h - 1);
+          break;
+        case OpCode::OP_INLINED_RETURN:
+          emit(h - 1 - node.operands[0], h - 1);
+          break;
+        case OpCode::OP_GET_UPVALUE:
+          emit(h, node.operands[0]);
+          break;
+        case OpCode::OP_SET_UPVALUE:
+          emit(h - 1, node.operands[0]);
+          break;
+        case OpCode::OP_EQUAL:
+          emit(h - 2);
+          break;
+        case OpCode::OP_NOT:
+          emit(h - 1);
+          break;
+        case OpCode::OP_NEGATE:
+          emit(h - 1, h);
+          break;
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_LESS:
+        case OpCode::OP_ADD_NN:
+        case OpCode::OP_SUBTRACT_NN:
+        case OpCode::OP_MULTIPLY_NN:
+        case OpCode::OP_DIVIDE_NN:
+        case OpCode::OP_GREATER_NN:
+        case OpCode::OP_LESS_NN:
+          emit(h - 2, h);
+          break;
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+          emit(0).jump = node.target;
+          break;
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_TRUE:
+          emit(h - 1).jump = node.target;
+          break;
+        case OpCode::OP_JUMP_IF_NOT_CALLEE: {
+          Piece& piece{emit(h - 1 - node.operands[2])};
+          piece.constant = chunk.constants.data() + node.operands[3];
+          piece.jump     = node.target;
+          break;
+        }
+        case OpCode::OP_CALL:
+        case OpCode::OP_TAIL_CALL:
+          emit(h, node.operands[0]).ip = chunk.code.data() + end;
+          break;
+        default:
+          emit(h);
+          // NIL, TRUE, FALSE, RETURN and everything left to STEP.
+          break;
+      }
+      h = static_cast<size_t>(static_cast<int>(h) + ir::stack_effect(node));
+    }
+  }
+
+  for (size_t i = 0; i < code.pieces.size(); i++) {
+    Piece& piece{code.pieces[i]};
+    const bool last{i + 1 == code.pieces.size()};
+    if (last && has_hole(*piece.stencil, "cpplox_hole_continue")) return std::nullopt;
+    // Would run off the end of the code.
+    piece.offset = code.code_size;
+    piece.size   = last ? piece.stencil->code.size() : piece.stencil->fallthrough_size;
+    code.code_size += piece.size;
+  }
+  for (size_t first : block_pieces) {
+    code.block_offsets.push_back(first < code.pieces.size() ? code.pieces[first].offset : code.code_size);
+  }
+  return code;
+}
+
+void CopyAndPatch::write(uint8_t* memory) const {
+  for (size_t i = 0; i < pieces.size(); i++) {
+    const Piece& piece{pieces[i]};
+    std::memcpy(memory + piece.offset, piece.stencil->code.data(), piece.size);
+    for (const StencilHole& hole : piece.stencil->holes) {
+      if (hole.offset + sizeof(uint64_t) > piece.size) continue;
+      // The jump to the next piece, dropped as that follows right away.
+      const uint64_t value{resolve(piece, hole, memory, i + 1)};
+      std::memcpy(memory + piece.offset + hole.offset, &value, sizeof(value));
+    }
+  }
+}
+
+uint64_t CopyAndPatch::resolve(const Piece& piece, const StencilHole& hole, const uint8_t* memory,
+                               size_t next) const {
+  uint64_t value{0};
+  if (hole.symbol == "cpplox_hole_a") {
+    value = piece.a;
+  } else if (hole.symbol == "cpplox_hole_b") {
+    value = piece.b;
+  } else if (hole.symbol == "cpplox_hole_constant") {
+    value = reinterpret_cast<uint64_t>(piece.constant);
+  } else if (hole.symbol == "cpplox_hole_ip") {
+    value = reinterpret_cast<uint64_t>(piece.ip);
+  } else if (hole.symbol == "cpplox_hole_continue") {
+    value = reinterpret_cast<uint64_t>(memory + pieces[next].offset);
+  } else if (hole.symbol == "cpplox_hole_jump") {
+    value = reinterpret_cast<uint64_t>(memory + block_offsets[piece.jump]);
+  } else {
+    for (const SlowPath& path : slow_paths) {
+      if (path.symbol == hole.symbol) value = path.address;
+    }
+  }
+  return value + static_cast<uint64_t>(hole.addend);
+}
+
+}  // namespace cpplox
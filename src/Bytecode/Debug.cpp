@@ -23,10 +23,10 @@ size_t Disassembler::disassemble_instruction(const Chunk& chunk,
                                              int offset) const {
   debug_out << std::setfill('0') << std::setw(4) << std::right << offset << " ";
   if (offset > 0 &&
-      chunk.line_numbers[offset - 1] == chunk.line_numbers[offset]) {
+      chunk.lines.line_at(offset - 1) == chunk.lines.line_at(offset)) {
     debug_out << "   | ";
   } else {
-    debug_out << std::setfill(' ') << std::setw(4) << chunk.line_numbers[offset]
+    debug_out << std::setfill(' ') << std::setw(4) << chunk.lines.line_at(offset)
               << " ";
   }
 
@@ -83,28 +83,77 @@ size_t Disassembler::disassemble_instruction(const Chunk& chunk,
     case OpCode::OP_PRINT:
       return simple_instruction("OP_PRINT", offset);
     case OpCode::OP_JUMP:
-      return jump_instruction("OP_JUMP", 1, chunk, offset);
+      return jump_instruction("OP_JUMP", chunk, offset);
     case OpCode::OP_JUMP_IF_FALSE:
-      return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+      return jump_instruction("OP_JUMP_IF_FALSE", chunk, offset);
+    case OpCode::OP_JUMP_IF_TRUE:
+      return jump_instruction("OP_JUMP_IF_TRUE", chunk, offset);
     case OpCode::OP_LOOP:
-      return jump_instruction("OP_LOOP", -1, chunk, offset);
+      return jump_instruction("OP_LOOP", chunk, offset);
     case OpCode::OP_CALL:
       return byte_instruction("OP_CALL", chunk, offset);
-    case OpCode::OP_CLOSURE: {
-      uint8_t const_idx = chunk.code[offset+1];
-      offset += 2;
+    case OpCode::OP_TAIL_CALL:
+      return byte_instruction("OP_TAIL_CALL", chunk, offset);
+    case OpCode::OP_JUMP_IF_NOT_CALLEE: {
+      const uint16_t jump = static_cast<uint16_t>(chunk.code[offset + 1] << 8 | chunk.code[offset + 2]);
+      debug_out << std::setfill(' ') << std::left << std::setw(20) << "OP_JUMP_IF_NOT_CALLEE"
+                << std::right << " " << std::setw(4) << offset << " -> " << offset + 5 + jump
+                << " unless " << to_string(chunk.constants[chunk.code[offset + 4]]) << " called with "
+                << static_cast<unsigned int>(chunk.code[offset + 3]) << " arguments" << std::endl;
+      return offset + 5;
+    }
+    case OpCode::OP_INLINED_RETURN:
+      return byte_instruction("OP_INLINED_RETURN", chunk, offset);
+    case OpCode::OP_ADD_NN:
+      return simple_instruction("OP_ADD_NN", offset);
+    case OpCode::OP_SUBTRACT_NN:
+      return simple_instruction("OP_SUBTRACT_NN", offset);
+    case OpCode::OP_MULTIPLY_NN:
+      return simple_instruction("OP_MULTIPLY_NN", offset);
+    case OpCode::OP_DIVIDE_NN:
+      return simple_instruction("OP_DIVIDE_NN", offset);
+    case OpCode::OP_GREATER_NN:
+      return simple_instruction("OP_GREATER_NN", offset);
+    case OpCode::OP_LESS_NN:
+      return simple_instruction("OP_LESS_NN", offset);
+    case OpCode::OP_CONSTANT_LONG:
+      return constant_instruction("OP_CONSTANT_LONG", chunk, offset);
+    case OpCode::OP_GET_GLOBAL_LONG:
+      return constant_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
+    case OpCode::OP_DEFINE_GLOBAL_LONG:
+      return constant_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+    case OpCode::OP_SET_GLOBAL_LONG:
+      return constant_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
+    case OpCode::OP_GET_LOCAL_LONG:
+      return byte_instruction("OP_GET_LOCAL_LONG", chunk, offset);
+    case OpCode::OP_SET_LOCAL_LONG:
+      return byte_instruction("OP_SET_LOCAL_LONG", chunk, offset);
+    case OpCode::OP_JUMP_LONG:
+      return jump_instruction("OP_JUMP_LONG", chunk, offset);
+    case OpCode::OP_JUMP_IF_FALSE_LONG:
+      return jump_instruction("OP_JUMP_IF_FALSE_LONG", chunk, offset);
+    case OpCode::OP_JUMP_IF_TRUE_LONG:
+      return jump_instruction("OP_JUMP_IF_TRUE_LONG", chunk, offset);
+    case OpCode::OP_LOOP_LONG:
+      return jump_instruction("OP_LOOP_LONG", chunk, offset);
+    case OpCode::OP_CLOSURE:
+    case OpCode::OP_CLOSURE_LONG: {
+      const bool wide {instruction == OpCode::OP_CLOSURE_LONG};
+      const size_t const_idx {chunk.operand(offset)};
+      offset += 1 + operand_width(instruction);
       const function_ptr* ptr {std::get_if<function_ptr>(&chunk.constants[const_idx])};
       assert(ptr);
       const function_ptr func_ptr {*ptr};
-      debug_out << std::left << std::setw(16) << "OP_CLOSURE" << std::right
-                << std::setw(4) << static_cast<unsigned int>(const_idx) << " "
+      debug_out << std::left << std::setw(16) << (wide ? "OP_CLOSURE_LONG" : "OP_CLOSURE") << std::right
+                << std::setw(4) << const_idx << " "
                 << to_string(func_ptr) << std::endl;
       for (int i = 0; i < func_ptr->upvalue_count; i++) {
         debug_out << std::setfill('0') << std::setw(4) << offset
                   << "      |                     " 
-                  << (chunk.code[offset++] == 0 ? "upvalue" : "local")
-                  << " " << static_cast<unsigned int>(chunk.code[offset++]) 
-                  << std::endl;
+                  << (chunk.code[offset++] == 0 ? "upvalue" : "local");
+        unsigned int index {chunk.code[offset++]};
+        if (wide) index = index << 8 | chunk.code[offset++];
+        debug_out << " " << index << std::endl;
       }
       return offset;
     }
@@ -115,6 +164,23 @@ size_t Disassembler::disassemble_instruction(const Chunk& chunk,
   }
 }
 
+void Disassembler::disassemble_diff(const Chunk& before, const Chunk& after,
+                                    const std::string& name) const {
+  debug_out << "=== optimized chunk " << name << ": " << before.code.size()
+            << " -> " << after.code.size() << " bytes === " << std::endl;
+  debug_out << "--- before" << std::endl;
+  size_t offset{0};
+  while (offset < before.code.size()) {
+    offset = disassemble_instruction(before, offset);
+  }
+  debug_out << "+++ after" << std::endl;
+  offset = 0;
+  while (offset < after.code.size()) {
+    offset = disassemble_instruction(after, offset);
+  }
+  debug_out << "==/ optimized chunk " << name << " /== " << std::endl;
+}
+
 void Disassembler::disassemble_constants_table(const Chunk& chunk, const std::string& name) const {
   debug_out << "=== constants " << name << " === " << std::endl;
   for (size_t i = 0; i < chunk.constants.size(); i++) {
@@ -133,30 +199,28 @@ size_t Disassembler::simple_instruction(const std::string name,
 size_t Disassembler::constant_instruction(const std::string name,
                                           const Chunk& chunk,
                                           size_t offset) const {
-  uint8_t const_idx = chunk.code[offset + 1];
+  const size_t const_idx = chunk.operand(offset);
   debug_out << std::setfill(' ') << std::left << std::setw(20) << name
             << std::right << std::setw(4)
-            << static_cast<unsigned int>(const_idx) << " ";
+            << const_idx << " ";
   debug_out << "'" << to_string(chunk.constants[const_idx]) << "'" << std::endl;
-  return offset + 2;
+  return offset + chunk.instruction_size(offset);
 }
 
 size_t Disassembler::byte_instruction(const std::string name,
                                       const Chunk& chunk, size_t offset) const {
-  uint8_t idx = chunk.code[offset + 1];
+  const size_t idx = chunk.operand(offset);
   debug_out << std::setfill(' ') << std::left << name << std::setw(16) << " ";
-  debug_out << static_cast<unsigned int>(idx) << " " << std::endl;
-  return offset + 2;
+  debug_out << idx << " " << std::endl;
+  return offset + chunk.instruction_size(offset);
 }
 
-size_t Disassembler::jump_instruction(const std::string name, int sign,
+size_t Disassembler::jump_instruction(const std::string name,
                                       const Chunk& chunk, size_t offset) const {
-  uint16_t jump = static_cast<uint16_t>((chunk.code[offset + 1] << 8));
-  jump |= chunk.code[offset + 2];
   debug_out << std::setfill(' ') << std::left << std::setw(20) << name
             << std::right << " " << std::setw(4) << offset << " -> "
-            << offset + 3 + sign * jump << std::endl;
-  return offset + 3;
+            << chunk.jump_target(offset) << std::endl;
+  return offset + chunk.instruction_size(offset);
 }
 
 }  // namespace cpplox
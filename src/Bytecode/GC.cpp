@@ -50,13 +50,20 @@ namespace cpplox {
   };
 
   void gc_heap::mark_internal(gc_cell_base* cell) {
-    if (cell == nullptr || cell->is_marked) { 
+    if (cell == nullptr || cell->is_marked || cell->is_frozen) {
       return;
     }
     cell->is_marked = true;
     reachable.push_back(cell);
   }
 
+  void gc_heap::freeze() {
+    for (auto& cell : cells) {
+      cell->is_frozen = true;
+    }
+    frozen = true;
+  }
+
   void gc_heap::debug_print() const {
     std::cout << std::endl << " === debug_print === " << std::endl;
     std::cout << "Num cells: " << cells.size() << std::endl;
@@ -0,0 +1,350 @@
+#include "cpplox/Bytecode/IR.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+namespace cpplox::ir {
+
+bool is_jump(OpCode op) {
+  return op == OpCode::OP_JUMP || op == OpCode::OP_LOOP || op == OpCode::OP_JUMP_IF_FALSE ||
+         op == OpCode::OP_JUMP_IF_TRUE || op == OpCode::OP_JUMP_IF_NOT_CALLEE;
+}
+
+namespace {
+bool ends_block(OpCode op) {
+  return is_jump(op) || op == OpCode::OP_RETURN;
+}
+
+bool falls_through(OpCode op) {
+  return op != OpCode::OP_JUMP && op != OpCode::OP_LOOP && op != OpCode::OP_RETURN;
+}
+
+size_t pushed_count(const Node& node) {
+  switch (node.op) {
+    case OpCode::OP_POP:
+    case OpCode::OP_PRINT:
+    case OpCode::OP_DEFINE_GLOBAL:
+    case OpCode::OP_CLOSE_UPVALUE:
+    case OpCode::OP_RETURN:
+    case OpCode::OP_JUMP:
+    case OpCode::OP_LOOP:
+    case OpCode::OP_NOOP:
+    case OpCode::OP_JUMP_IF_NOT_CALLEE:
+      return 0;
+    default:
+      return 1;
+  }
+}
+}  // namespace
+
+size_t popped_count(const Node& node) {
+  switch (node.op) {
+    case OpCode::OP_CONSTANT:
+    case OpCode::OP_NIL:
+    case OpCode::OP_TRUE:
+    case OpCode::OP_FALSE:
+    case OpCode::OP_GET_LOCAL:
+    case OpCode::OP_GET_GLOBAL:
+    case OpCode::OP_GET_UPVALUE:
+    case OpCode::OP_CLOSURE:
+    case OpCode::OP_JUMP:
+    case OpCode::OP_LOOP:
+    case OpCode::OP_NOOP:
+    case OpCode::OP_JUMP_IF_NOT_CALLEE:
+      return 0;
+      // Looks below the arguments without taking anything off the stack.
+    case OpCode::OP_EQUAL:
+    case OpCode::OP_GREATER:
+    case OpCode::OP_LESS:
+    case OpCode::OP_ADD:
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_ADD_NN:
+    case OpCode::OP_SUBTRACT_NN:
+    case OpCode::OP_MULTIPLY_NN:
+    case OpCode::OP_DIVIDE_NN:
+    case OpCode::OP_GREATER_NN:
+    case OpCode::OP_LESS_NN:
+      return 2;
+    case OpCode::OP_CALL:
+    case OpCode::OP_TAIL_CALL:
+    case OpCode::OP_INLINED_RETURN:
+      return node.operands[0] + 1;
+    default:
+      return 1;
+      // Setters and conditional jumps only peek, modelled as popping the value and
+      // pushing it back.
+  }
+}
+
+int stack_effect(const Node& node) {
+  return static_cast<int>(pushed_count(node)) - static_cast<int>(popped_count(node));
+}
+
+std::optional<ControlFlowGraph> ControlFlowGraph::build(const Chunk& chunk, int arity) {
+  ControlFlowGraph cfg{};
+  std::vector<Node> nodes{};
+  std::vector<size_t> offsets{};
+  std::vector<size_t> target_offsets{};
+  std::vector<bool> is_leader(chunk.code.size() + 1, false);
+  is_leader[0] = true;
+  for (size_t offset = 0; offset < chunk.code.size();) {
+    if (is_wide(static_cast<OpCode>(chunk.code[offset]))) return std::nullopt;
+    const size_t size{chunk.instruction_size(offset)};
+    Node node{.op = static_cast<OpCode>(chunk.code[offset]),
+              .operands = std::vector<uint8_t>(chunk.code.begin() + offset + 1, chunk.code.begin() + offset + size),
+              .line = chunk.lines.line_at(offset)};
+    size_t target_offset{0};
+    if (is_jump(node.op)) {
+      const size_t jump_dist = static_cast<size_t>(node.operands[0] << 8) | node.operands[1];
+      target_offset = node.op == OpCode::OP_LOOP ? offset + size - jump_dist : offset + size + jump_dist;
+      if (target_offset >= chunk.code.size()) return std::nullopt;
+      is_leader[target_offset] = true;
+    }
+    if (ends_block(node.op)) is_leader[offset + size] = true;
+    if (node.op == OpCode::OP_CLOSURE) {
+      for (size_t i = 1; i < node.operands.size(); i += 2) {
+        if (node.operands[i] == 1) cfg.captured_slots.insert(node.operands[i + 1]);
+      }
+    }
+    nodes.push_back(std::move(node));
+    offsets.push_back(offset);
+    target_offsets.push_back(target_offset);
+    offset += size;
+  }
+
+  std::vector<size_t> block_at(chunk.code.size() + 1, 0);
+  for (size_t i = 0; i < nodes.size(); i++) {
+    if (is_leader[offsets[i]]) cfg.blocks.emplace_back();
+    block_at[offsets[i]] = cfg.blocks.size() - 1;
+    cfg.blocks.back().nodes.push_back(std::move(nodes[i]));
+  }
+  size_t node_idx{0};
+  for (size_t b = 0; b < cfg.blocks.size(); b++) {
+    BasicBlock& block{cfg.blocks[b]};
+    for (Node& node : block.nodes) {
+      if (is_jump(node.op)) node.target = block_at[target_offsets[node_idx]];
+      node_idx++;
+    }
+    const Node& last{block.nodes.back()};
+    if (falls_through(last.op) && b + 1 < cfg.blocks.size()) block.successors.push_back(b + 1);
+    if (is_jump(last.op)) block.successors.push_back(last.target);
+  }
+
+  if (!cfg.link_stack_values(arity)) return std::nullopt;
+  return cfg;
+}
+
+bool ControlFlowGraph::link_stack_values(int arity) {
+  blocks[0].entry_height = arity + 1;
+  // Slot 0 holds the function being called, followed by its arguments.
+  std::vector<size_t> worklist{0};
+  while (!worklist.empty()) {
+    BasicBlock& block{blocks[worklist.back()]};
+    worklist.pop_back();
+    std::vector<std::optional<size_t>> stack(*block.entry_height, std::nullopt);
+    for (size_t i = 0; i < block.nodes.size(); i++) {
+      Node& node{block.nodes[i]};
+      const size_t popped{popped_count(node)};
+      if (popped > stack.size()) return false;
+      node.inputs.assign(stack.end() - popped, stack.end());
+      stack.resize(stack.size() - popped);
+      node.subtree_size = 1;
+      for (const std::optional<size_t> input : node.inputs) {
+        if (input) node.subtree_size += block.nodes[*input].subtree_size;
+      }
+      if (pushed_count(node) > 0) stack.push_back(i);
+    }
+    for (const size_t successor : block.successors) {
+      if (!blocks[successor].entry_height) {
+        blocks[successor].entry_height = stack.size();
+        worklist.push_back(successor);
+      } else if (*blocks[successor].entry_height != stack.size()) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+std::vector<std::optional<size_t>> BasicBlock::expression_starts() const {
+  std::vector<std::optional<size_t>> starts(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++) {
+    std::optional<size_t> start{i};
+    for (const std::optional<size_t> input : nodes[i].inputs) {
+      if (!input || !starts[*input]) {
+        start.reset();
+        break;
+      }
+      start = std::min(*start, *starts[*input]);
+    }
+    if (start && i + 1 - *start == nodes[i].subtree_size) starts[i] = start;
+  }
+  return starts;
+}
+
+std::optional<size_t> max_stack_height(const Chunk& chunk, int arity) {
+  constexpr size_t unreached{std::numeric_limits<size_t>::max()};
+  std::vector<size_t> height_at(chunk.code.size(), unreached);
+  std::vector<size_t> pending{};
+  size_t max_height{1 + static_cast<size_t>(arity)};
+  bool consistent{true};
+  const auto reach = [&](size_t offset, size_t height) {
+    if (offset >= chunk.code.size()) return;
+    if (height_at[offset] == unreached) {
+      height_at[offset] = height;
+      pending.push_back(offset);
+    } else if (height_at[offset] != height) {
+      consistent = false;
+    }
+  };
+  reach(0, max_height);
+  while (!pending.empty() && consistent) {
+    const size_t offset{pending.back()};
+    pending.pop_back();
+    const OpCode op{static_cast<OpCode>(chunk.code[offset])};
+    size_t height{height_at[offset]};
+    size_t popped{0};
+    size_t pushed{0};
+    switch (op) {
+      case OpCode::OP_CONSTANT:
+      case OpCode::OP_CONSTANT_LONG:
+      case OpCode::OP_NIL:
+      case OpCode::OP_TRUE:
+      case OpCode::OP_FALSE:
+      case OpCode::OP_GET_GLOBAL:
+      case OpCode::OP_GET_GLOBAL_LONG:
+      case OpCode::OP_GET_UPVALUE:
+      case OpCode::OP_CLOSURE:
+      case OpCode::OP_CLOSURE_LONG:
+        pushed = 1;
+        break;
+      case OpCode::OP_GET_LOCAL:
+      case OpCode::OP_GET_LOCAL_LONG:
+        if (chunk.operand(offset) >= height) return std::nullopt;
+        pushed = 1;
+        break;
+      case OpCode::OP_SET_LOCAL:
+      case OpCode::OP_SET_LOCAL_LONG:
+        if (chunk.operand(offset) >= height) return std::nullopt;
+        popped = pushed = 1;
+        break;
+      case OpCode::OP_POP:
+      case OpCode::OP_PRINT:
+      case OpCode::OP_DEFINE_GLOBAL:
+      case OpCode::OP_DEFINE_GLOBAL_LONG:
+      case OpCode::OP_CLOSE_UPVALUE:
+      case OpCode::OP_RETURN:
+        popped = 1;
+        break;
+      case OpCode::OP_EQUAL:
+      case OpCode::OP_GREATER:
+      case OpCode::OP_LESS:
+      case OpCode::OP_ADD:
+      case OpCode::OP_SUBTRACT:
+      case OpCode::OP_MULTIPLY:
+      case OpCode::OP_DIVIDE:
+      case OpCode::OP_ADD_NN:
+      case OpCode::OP_SUBTRACT_NN:
+      case OpCode::OP_MULTIPLY_NN:
+      case OpCode::OP_DIVIDE_NN:
+      case OpCode::OP_GREATER_NN:
+      case OpCode::OP_LESS_NN:
+        popped = 2;
+        pushed = 1;
+        break;
+      case OpCode::OP_CALL:
+      case OpCode::OP_TAIL_CALL:
+      case OpCode::OP_INLINED_RETURN:
+        popped = chunk.operand(offset) + 1;
+        pushed = 1;
+        // Arguments (or inlined callee's locals) go, the callee's slot holds the result.
+        break;
+      case OpCode::OP_JUMP_IF_NOT_CALLEE:
+        popped = pushed = static_cast<size_t>(chunk.code[offset + 3]) + 1;
+        // Peeks at the callee below the arguments.
+        break;
+      case OpCode::OP_JUMP:
+      case OpCode::OP_LOOP:
+      case OpCode::OP_NOOP:
+      case OpCode::OP_JUMP_LONG:
+      case OpCode::OP_LOOP_LONG:
+        break;
+      default:
+        popped = pushed = 1;
+        // Setters, unary operators and conditional jumps peek at the top value.
+        break;
+    }
+    if (popped >= height) return std::nullopt;
+    // Slot 0 belongs to the callee, nothing takes it.
+    height = height - popped + pushed;
+    max_height = std::max(max_height, height);
+    switch (op) {
+      case OpCode::OP_JUMP_IF_FALSE:
+      case OpCode::OP_JUMP_IF_TRUE:
+      case OpCode::OP_JUMP_IF_NOT_CALLEE:
+      case OpCode::OP_JUMP_IF_FALSE_LONG:
+      case OpCode::OP_JUMP_IF_TRUE_LONG:
+        reach(chunk.jump_target(offset), height);
+        reach(offset + chunk.instruction_size(offset), height);
+        break;
+      case OpCode::OP_JUMP:
+      case OpCode::OP_LOOP:
+      case OpCode::OP_JUMP_LONG:
+      case OpCode::OP_LOOP_LONG:
+        reach(chunk.jump_target(offset), height);
+        break;
+      case OpCode::OP_RETURN:
+        break;
+      default:
+        reach(offset + chunk.instruction_size(offset), height);
+        break;
+    }
+  }
+  if (!consistent) return std::nullopt;
+  return max_height;
+}
+
+void ControlFlowGraph::lower(Chunk& chunk) const {
+  std::vector<size_t> block_offsets(blocks.size() + 1, 0);
+  for (size_t b = 0; b < blocks.size(); b++) {
+    block_offsets[b + 1] = block_offsets[b];
+    for (const Node& node : blocks[b].nodes) {
+      if (!node.removed) block_offsets[b + 1] += 1 + node.operands.size();
+    }
+  }
+
+  std::vector<uint8_t> code{};
+  LineTable lines{};
+  code.reserve(block_offsets.back());
+  for (const BasicBlock& block : blocks) {
+    for (const Node& node : block.nodes) {
+      if (node.removed) continue;
+      OpCode op{node.op};
+      std::vector<uint8_t> operands{node.operands};
+      if (is_jump(op)) {
+        const size_t next_offset{code.size() + 1 + operands.size()};
+        const size_t target_offset{block_offsets[node.target]};
+        if (op == OpCode::OP_JUMP || op == OpCode::OP_LOOP) {
+          op = target_offset < next_offset ? OpCode::OP_LOOP : OpCode::OP_JUMP;
+        }
+        assert((op == OpCode::OP_LOOP) == (target_offset < next_offset));
+        const size_t jump_dist{target_offset < next_offset ? next_offset - target_offset
+                                                           : target_offset - next_offset};
+        assert(jump_dist <= std::numeric_limits<uint16_t>::max());
+        // Passes growing the code check its size first.
+        operands[0] = static_cast<uint8_t>((jump_dist >> 8) & 0xff);
+        operands[1] = static_cast<uint8_t>(jump_dist & 0xff);
+      }
+      lines.add(code.size(), node.line);
+      code.push_back(static_cast<uint8_t>(op));
+      code.insert(code.end(), operands.begin(), operands.end());
+    }
+  }
+  chunk.code = std::move(code);
+  chunk.lines = std::move(lines);
+}
+
+}  // namespace cpplox::ir
@@ -0,0 +1,990 @@
+#include "cpplox/Bytecode/IROptimizer.h"
+
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include <limits>
+#include <set>
+#include <utility>
+
+#include "cpplox/Bytecode/LoxObject.h"
+
+namespace cpplox {
+
+namespace {
+bool same_constant(const Value& lhs, const Value& rhs) {
+  if (std::holds_alternative<double>(lhs) && std::holds_alternative<double>(rhs)) {
+    return std::bit_cast<uint64_t>(std::get<double>(lhs)) == std::bit_cast<uint64_t>(std::get<double>(rhs));
+  }
+  return lhs.index() == rhs.index() && lhs == rhs;
+  // Identity rather than Lox equality: NaN is the same constant as itself.
+}
+
+bool is_falsey(const Value& val) {
+  return std::holds_alternative<std::monostate>(val) ||
+         (std::holds_alternative<bool>(val) && !std::get<bool>(val));
+  // Mirrors VM::is_falsey.
+}
+
+bool is_constant_load(OpCode op) {
+  return op == OpCode::OP_CONSTANT || op == OpCode::OP_NIL || op == OpCode::OP_TRUE || op == OpCode::OP_FALSE;
+}
+
+bool is_numbered(OpCode op) {
+  switch (op) {
+    case OpCode::OP_EQUAL:
+    case OpCode::OP_GREATER:
+    case OpCode::OP_LESS:
+    case OpCode::OP_ADD:
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_NOT:
+    case OpCode::OP_NEGATE:
+      return true;
+    default:
+      return false;
+  }
+  // Result depends only on the operands, equal operands give equal results.
+}
+
+bool is_pure(OpCode op) {
+  return is_constant_load(op) || is_numbered(op) || op == OpCode::OP_GET_LOCAL ||
+         op == OpCode::OP_GET_UPVALUE;
+  // No side effects, but arithmetic can still report a runtime error.
+}
+
+std::optional<OpCode> unchecked_variant(OpCode op) {
+  switch (op) {
+    case OpCode::OP_ADD:
+      return OpCode::OP_ADD_NN;
+    case OpCode::OP_SUBTRACT:
+      return OpCode::OP_SUBTRACT_NN;
+    case OpCode::OP_MULTIPLY:
+      return OpCode::OP_MULTIPLY_NN;
+    case OpCode::OP_DIVIDE:
+      return OpCode::OP_DIVIDE_NN;
+    case OpCode::OP_GREATER:
+      return OpCode::OP_GREATER_NN;
+    case OpCode::OP_LESS:
+      return OpCode::OP_LESS_NN;
+    default:
+      return std::nullopt;
+  }
+}
+
+OpCode checked_variant(OpCode op) {
+  switch (op) {
+    case OpCode::OP_ADD_NN:
+      return OpCode::OP_ADD;
+    case OpCode::OP_SUBTRACT_NN:
+      return OpCode::OP_SUBTRACT;
+    case OpCode::OP_MULTIPLY_NN:
+      return OpCode::OP_MULTIPLY;
+    case OpCode::OP_DIVIDE_NN:
+      return OpCode::OP_DIVIDE;
+    case OpCode::OP_GREATER_NN:
+      return OpCode::OP_GREATER;
+    case OpCode::OP_LESS_NN:
+      return OpCode::OP_LESS;
+    default:
+      return op;
+  }
+}
+
+bool is_unchecked(OpCode op) {
+  switch (op) {
+    case OpCode::OP_ADD_NN:
+    case OpCode::OP_SUBTRACT_NN:
+    case OpCode::OP_MULTIPLY_NN:
+    case OpCode::OP_DIVIDE_NN:
+    case OpCode::OP_GREATER_NN:
+    case OpCode::OP_LESS_NN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool proves_numbers(OpCode op) {
+  switch (op) {
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_GREATER:
+    case OpCode::OP_LESS:
+    case OpCode::OP_NEGATE:
+      return true;
+    default:
+      return false;
+  }
+  // Operands of these were numbers if execution got past them. OP_ADD also
+  // accepts strings.
+}
+
+bool cannot_fail(OpCode op) {
+  return is_constant_load(op) || op == OpCode::OP_GET_LOCAL || op == OpCode::OP_GET_UPVALUE ||
+         op == OpCode::OP_NOT || op == OpCode::OP_EQUAL || is_unchecked(op);
+}
+
+std::optional<Value> fold(OpCode op, const std::vector<Value>& args) {
+  switch (op) {
+    case OpCode::OP_EQUAL:
+      return Value{args[0] == args[1]};
+    case OpCode::OP_NOT:
+      return Value{is_falsey(args[0])};
+    default:
+      break;
+  }
+  if (!std::all_of(args.begin(), args.end(), [](const Value& arg) { return std::holds_alternative<double>(arg); })) {
+    return std::nullopt;
+    // Type errors are left for the VM to report. String concatenation is folded by
+    // Compiler, which can intern the result.
+  }
+  switch (op) {
+    case OpCode::OP_NEGATE:
+      return Value{-std::get<double>(args[0])};
+    case OpCode::OP_GREATER:
+      return Value{std::get<double>(args[0]) > std::get<double>(args[1])};
+    case OpCode::OP_LESS:
+      return Value{std::get<double>(args[0]) < std::get<double>(args[1])};
+    case OpCode::OP_ADD:
+      return Value{std::get<double>(args[0]) + std::get<double>(args[1])};
+    case OpCode::OP_SUBTRACT:
+      return Value{std::get<double>(args[0]) - std::get<double>(args[1])};
+    case OpCode::OP_MULTIPLY:
+      return Value{std::get<double>(args[0]) * std::get<double>(args[1])};
+    case OpCode::OP_DIVIDE:
+      return Value{std::get<double>(args[0]) / std::get<double>(args[1])};
+    default:
+      return std::nullopt;
+  }
+}
+
+class ValueTable {
+  // Value numbers: equal numbers are guaranteed to be equal values at runtime.
+public:
+  size_t fresh() {
+    constants.emplace_back();
+    return constants.size() - 1;
+  }
+
+  size_t of_constant(const Value& val) {
+    for (const size_t vn : constant_numbers) {
+      if (same_constant(*constants[vn], val)) return vn;
+    }
+    constants.emplace_back(val);
+    constant_numbers.push_back(constants.size() - 1);
+    return constants.size() - 1;
+  }
+
+  size_t of_expression(OpCode op, const std::vector<size_t>& inputs) {
+    auto key{std::make_pair(op, inputs)};
+    if (const auto it = expressions.find(key); it != expressions.end()) return it->second;
+
+    std::vector<Value> args{};
+    for (const size_t vn : inputs) {
+      if (!constants[vn]) break;
+      args.push_back(*constants[vn]);
+    }
+    const std::optional<Value> folded{args.size() == inputs.size() ? fold(op, args) : std::nullopt};
+    const size_t vn{folded ? of_constant(*folded) : fresh()};
+    expressions.emplace(std::move(key), vn);
+    return vn;
+  }
+
+  const std::optional<Value>& constant(size_t vn) const { return constants[vn]; }
+
+  void forget_expressions() { expressions.clear(); }
+  // Expressions are numbered per block, only constants are known across blocks.
+
+private:
+  std::vector<std::optional<Value>> constants{};
+  std::vector<size_t> constant_numbers{};
+  std::map<std::pair<OpCode, std::vector<size_t>>, size_t> expressions{};
+};
+
+template <typename Visitor>
+std::vector<size_t> number_values(const ir::BasicBlock& block, const std::map<size_t, Value>& entry_constants,
+                                  const ir::ControlFlowGraph& cfg, const Chunk& chunk, ValueTable& values,
+                                  Visitor&& visit) {
+  // Assigns a value number to every node of the block, calling visit(node index,
+  // value numbers of stack slots below the node's result, result) before the
+  // result is pushed. Returns value numbers of stack slots at the end of the block.
+  std::vector<size_t> stack(*block.entry_height);
+  for (size_t slot = 0; slot < stack.size(); slot++) {
+    const auto it{entry_constants.find(slot)};
+    stack[slot] = it != entry_constants.end() ? values.of_constant(it->second) : values.fresh();
+  }
+  std::map<uint8_t, size_t> upvalues{};
+  values.forget_expressions();
+
+  for (size_t i = 0; i < block.nodes.size(); i++) {
+    const OpCode op{block.nodes[i].op};
+    const std::vector<uint8_t> operands{block.nodes[i].operands};
+    const size_t popped{ir::popped_count(block.nodes[i])};
+    const bool pushes{ir::stack_effect(block.nodes[i]) + static_cast<int>(popped) > 0};
+    const std::vector<size_t> inputs(stack.end() - popped, stack.end());
+    stack.resize(stack.size() - popped);
+
+    size_t result{0};
+    switch (op) {
+      case OpCode::OP_CONSTANT:
+        result = values.of_constant(chunk.constants[operands[0]]);
+        break;
+      case OpCode::OP_NIL:
+        result = values.of_constant(Value{std::monostate{}});
+        break;
+      case OpCode::OP_TRUE:
+        result = values.of_constant(Value{true});
+        break;
+      case OpCode::OP_FALSE:
+        result = values.of_constant(Value{false});
+        break;
+      case OpCode::OP_GET_LOCAL:
+        result = operands[0] < stack.size() ? stack[operands[0]] : values.fresh();
+        break;
+      case OpCode::OP_SET_LOCAL:
+        if (operands[0] < stack.size()) stack[operands[0]] = inputs[0];
+        result = inputs[0];
+        break;
+      case OpCode::OP_GET_UPVALUE: {
+        const auto [it, inserted] = upvalues.try_emplace(operands[0], 0);
+        if (inserted) it->second = values.fresh();
+        result = it->second;
+        break;
+      }
+      case OpCode::OP_SET_UPVALUE:
+        upvalues.insert_or_assign(operands[0], inputs[0]);
+        result = inputs[0];
+        break;
+      case OpCode::OP_SET_GLOBAL:
+      case OpCode::OP_JUMP_IF_FALSE:
+      case OpCode::OP_JUMP_IF_TRUE:
+        result = inputs[0];
+        break;
+      case OpCode::OP_CALL:
+      case OpCode::OP_TAIL_CALL:
+        result = values.fresh();
+        for (const uint8_t slot : cfg.captured_slots) {
+          if (slot < stack.size()) stack[slot] = values.fresh();
+        }
+        upvalues.clear();
+        // Callee can assign to captured locals and to any upvalue.
+        break;
+      default:
+        result = is_numbered(op) ? values.of_expression(op, inputs) : values.fresh();
+    }
+    visit(i, stack, result);
+    if (pushes) stack.push_back(result);
+  }
+  return stack;
+}
+
+struct TypedValue {
+  bool number{false};
+  std::optional<size_t> slot{};
+  // Local this value was read from or assigned to, while the local still holds it.
+};
+
+template <typename Visitor>
+std::vector<TypedValue> infer_types(const ir::BasicBlock& block, const std::set<size_t>& entry_numbers,
+                                    const ir::ControlFlowGraph& cfg, const Chunk& chunk, Visitor&& visit) {
+  // Tracks which values on the stack are known to be numbers, calling visit(node
+  // index, node's inputs) before each node runs. Returns the stack at the end of
+  // the block.
+  std::vector<TypedValue> stack(*block.entry_height);
+  for (const size_t slot : entry_numbers) {
+    if (slot < stack.size()) stack[slot].number = true;
+  }
+  const auto forget_reads = [&stack](size_t slot) {
+    for (TypedValue& value : stack) {
+      if (value.slot == slot) value.slot.reset();
+    }
+  };
+
+  for (size_t i = 0; i < block.nodes.size(); i++) {
+    const size_t popped{ir::popped_count(block.nodes[i])};
+    const bool pushes{ir::stack_effect(block.nodes[i]) + static_cast<int>(popped) > 0};
+    const std::vector<TypedValue> inputs(stack.end() - popped, stack.end());
+    stack.resize(stack.size() - popped);
+    visit(i, inputs);
+
+    const ir::Node& node{block.nodes[i]};
+    TypedValue result{};
+    switch (node.op) {
+      case OpCode::OP_CONSTANT:
+        result.number = std::holds_alternative<double>(chunk.constants[node.operands[0]]);
+        break;
+      case OpCode::OP_GET_LOCAL:
+        if (node.operands[0] < stack.size()) result = {.number = stack[node.operands[0]].number, .slot = node.operands[0]};
+        break;
+      case OpCode::OP_SET_LOCAL:
+        if (node.operands[0] < stack.size()) {
+          forget_reads(node.operands[0]);
+          stack[node.operands[0]].number = inputs[0].number;
+          result = {.number = inputs[0].number, .slot = node.operands[0]};
+        }
+        break;
+      case OpCode::OP_SET_GLOBAL:
+      case OpCode::OP_SET_UPVALUE:
+      case OpCode::OP_JUMP_IF_FALSE:
+      case OpCode::OP_JUMP_IF_TRUE:
+        result = inputs[0];
+        break;
+      case OpCode::OP_CALL:
+      case OpCode::OP_TAIL_CALL:
+        for (const uint8_t slot : cfg.captured_slots) {
+          if (slot >= stack.size()) continue;
+          stack[slot].number = false;
+          forget_reads(slot);
+        }
+        // Callee can assign anything to captured locals.
+        break;
+      case OpCode::OP_ADD:
+      case OpCode::OP_ADD_NN:
+        result.number = inputs[0].number && inputs[1].number;
+        break;
+      case OpCode::OP_SUBTRACT:
+      case OpCode::OP_MULTIPLY:
+      case OpCode::OP_DIVIDE:
+      case OpCode::OP_NEGATE:
+      case OpCode::OP_SUBTRACT_NN:
+      case OpCode::OP_MULTIPLY_NN:
+      case OpCode::OP_DIVIDE_NN:
+        result.number = true;
+        break;
+      default:
+        break;
+    }
+    if (proves_numbers(node.op)) {
+      for (const TypedValue& input : inputs) {
+        if (input.slot && *input.slot < stack.size()) stack[*input.slot].number = true;
+      }
+      // Flow-sensitive: eg. once "n < 2" passed, n is a number for "n - 1" below.
+    }
+    if (pushes) stack.push_back(result);
+  }
+  return stack;
+}
+
+std::optional<uint8_t> constant_index(const Value& val, Chunk& chunk) {
+  auto it{std::find_if(chunk.constants.begin(), chunk.constants.end(),
+                       [&val](const Value& constant) { return same_constant(constant, val); })};
+  if (it == chunk.constants.end()) {
+    if (chunk.constants.size() > std::numeric_limits<uint8_t>::max()) return std::nullopt;
+    chunk.add_constant(val);
+    it = chunk.constants.end() - 1;
+  }
+  if (it - chunk.constants.begin() > std::numeric_limits<uint8_t>::max()) return std::nullopt;
+  return static_cast<uint8_t>(it - chunk.constants.begin());
+}
+
+std::optional<ir::Node> constant_load(const Value& val, Chunk& chunk, int line) {
+  if (const bool* boolean = std::get_if<bool>(&val)) {
+    return ir::Node{.op = *boolean ? OpCode::OP_TRUE : OpCode::OP_FALSE, .line = line};
+  }
+  if (std::holds_alternative<std::monostate>(val)) return ir::Node{.op = OpCode::OP_NIL, .line = line};
+
+  const std::optional<uint8_t> index{constant_index(val, chunk)};
+  if (!index) return std::nullopt;
+  return ir::Node{.op = OpCode::OP_CONSTANT, .operands = {*index}, .line = line};
+}
+
+bool can_inline(OpCode op) {
+  switch (op) {
+    case OpCode::OP_CONSTANT:
+    case OpCode::OP_NIL:
+    case OpCode::OP_TRUE:
+    case OpCode::OP_FALSE:
+    case OpCode::OP_POP:
+    case OpCode::OP_GET_LOCAL:
+    case OpCode::OP_SET_LOCAL:
+    case OpCode::OP_GET_GLOBAL:
+    case OpCode::OP_SET_GLOBAL:
+    case OpCode::OP_PRINT:
+      return true;
+    default:
+      return is_numbered(op) || is_unchecked(op);
+  }
+  // Code that only touches its own stack window and globals. Calls and closures
+  // would need a frame of their own.
+}
+
+std::vector<std::pair<size_t, size_t>> loop_regions(const ir::ControlFlowGraph& cfg) {
+  // First and last block of every loop, outermost loops first. while_statement and
+  // for_statement lay a loop out contiguously: condition, increment and body all
+  // sit between the loop start and the last OP_LOOP. A for loop with an increment
+  // has two back edges whose ranges partially overlap, both belong to one loop.
+  std::vector<std::pair<size_t, size_t>> regions{};
+  for (size_t b = 0; b < cfg.blocks.size(); b++) {
+    if (!cfg.blocks[b].entry_height) continue;
+    for (const ir::Node& node : cfg.blocks[b].nodes) {
+      if (ir::is_jump(node.op) && node.target <= b) regions.emplace_back(node.target, b);
+    }
+  }
+  const auto contains = [](const std::pair<size_t, size_t>& outer, const std::pair<size_t, size_t>& inner) {
+    return outer.first <= inner.first && inner.second <= outer.second;
+  };
+  bool changed{true};
+  while (changed) {
+    changed = false;
+    for (std::pair<size_t, size_t>& region : regions) {
+      for (const std::pair<size_t, size_t>& other : regions) {
+        if (other.first <= region.second && region.first <= other.second && !contains(region, other) &&
+            !contains(other, region)) {
+          region = {std::min(region.first, other.first), std::max(region.second, other.second)};
+          changed = true;
+        }
+      }
+    }
+  }
+  std::sort(regions.begin(), regions.end());
+  regions.erase(std::unique(regions.begin(), regions.end()), regions.end());
+  std::stable_sort(regions.begin(), regions.end(), [](const auto& lhs, const auto& rhs) {
+    return lhs.second - lhs.first > rhs.second - rhs.first;
+  });
+  return regions;
+}
+}  // namespace
+
+void IROptimizer::optimize(Chunk& chunk, int arity) const {
+  const auto run = [&](bool (IROptimizer::*pass)(ir::ControlFlowGraph&, Chunk&) const) {
+    std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(chunk, arity)};
+    if (!cfg || !(this->*pass)(*cfg, chunk)) return false;
+    cfg->lower(chunk);
+    return true;
+  };
+  const int max_rounds{opt_level > 1 ? 8 : 1};
+  // Passes enable each other (eg. a resolved branch leaves a dead block behind),
+  // higher levels keep going until nothing changes.
+  for (int round = 0; round < max_rounds; round++) {
+    bool changed{false};
+    for (const auto pass : {&IROptimizer::propagate_values, &IROptimizer::eliminate_dead_code}) {
+      changed |= run(pass);
+    }
+    if (!changed) break;
+  }
+  run(&IROptimizer::specialize_arithmetic);
+  // Last, value numbering only knows the checked opcodes.
+}
+
+std::vector<std::optional<IROptimizer::NumberSlots>> IROptimizer::numbers_on_entry(const ir::ControlFlowGraph& cfg,
+                                                                                  const Chunk& chunk) const {
+  std::vector<std::optional<NumberSlots>> entry(cfg.blocks.size());
+  entry[0] = NumberSlots{};
+  // Same optimistic iteration as slot_constants_on_entry.
+  bool changed{true};
+  while (changed) {
+    changed = false;
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+      if (!entry[b] || !cfg.blocks[b].entry_height) continue;
+      const std::vector<TypedValue> exit{
+          infer_types(cfg.blocks[b], *entry[b], cfg, chunk, [](size_t, const std::vector<TypedValue>&) {})};
+      NumberSlots exit_numbers{};
+      for (size_t slot = 0; slot < exit.size(); slot++) {
+        if (exit[slot].number) exit_numbers.insert(slot);
+      }
+
+      for (const size_t successor : cfg.blocks[b].successors) {
+        NumberSlots merged{};
+        if (!entry[successor]) {
+          merged = exit_numbers;
+        } else {
+          std::set_intersection(exit_numbers.begin(), exit_numbers.end(), entry[successor]->begin(),
+                                entry[successor]->end(), std::inserter(merged, merged.end()));
+        }
+        if (!entry[successor] || merged.size() != entry[successor]->size()) {
+          entry[successor] = std::move(merged);
+          changed = true;
+        }
+      }
+    }
+  }
+  return entry;
+}
+
+bool IROptimizer::specialize_arithmetic(ir::ControlFlowGraph& cfg, Chunk& chunk) const {
+  const std::vector<std::optional<NumberSlots>> entry_numbers{numbers_on_entry(cfg, chunk)};
+  bool changed{false};
+  for (size_t b = 0; b < cfg.blocks.size(); b++) {
+    ir::BasicBlock& block{cfg.blocks[b]};
+    if (!block.entry_height || !entry_numbers[b]) continue;
+    infer_types(block, *entry_numbers[b], cfg, chunk, [&](size_t i, const std::vector<TypedValue>& inputs) {
+      ir::Node& node{block.nodes[i]};
+      const std::optional<OpCode> unchecked{unchecked_variant(node.op)};
+      if (unchecked && std::all_of(inputs.begin(), inputs.end(), [](const TypedValue& input) { return input.number; })) {
+        node.op = *unchecked;
+        changed = true;
+      }
+    });
+  }
+  return changed;
+}
+
+void IROptimizer::respecialize_arithmetic(Chunk& chunk, int arity) const {
+  bool demoted{false};
+  for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instruction_size(offset)) {
+    const OpCode op{static_cast<OpCode>(chunk.code[offset])};
+    if (is_unchecked(op)) {
+      chunk.code[offset] = static_cast<uint8_t>(checked_variant(op));
+      demoted = true;
+    }
+  }
+  if (!demoted) return;
+  std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(chunk, arity)};
+  if (cfg && specialize_arithmetic(*cfg, chunk)) cfg->lower(chunk);
+  // Lowering an unchanged graph gives back the same layout, only opcodes differ.
+}
+
+std::vector<std::optional<IROptimizer::SlotConstants>> IROptimizer::slot_constants_on_entry(
+    const ir::ControlFlowGraph& cfg, const Chunk& chunk) const {
+  std::vector<std::optional<SlotConstants>> entry(cfg.blocks.size());
+  entry[0] = SlotConstants{};
+  // Nothing is known about arguments. Blocks not visited yet (nullopt) don't
+  // constrain their successors, which is what lets constants flow into loops.
+  bool changed{true};
+  while (changed) {
+    changed = false;
+    ValueTable values{};
+    for (size_t b = 0; b < cfg.blocks.size(); b++) {
+      if (!entry[b] || !cfg.blocks[b].entry_height) continue;
+      const ir::BasicBlock& block{cfg.blocks[b]};
+      const std::vector<size_t> exit{
+          number_values(block, *entry[b], cfg, chunk, values, [](size_t, const std::vector<size_t>&, size_t) {})};
+      SlotConstants exit_constants{};
+      for (size_t slot = 0; slot < exit.size(); slot++) {
+        if (const std::optional<Value>& constant = values.constant(exit[slot])) {
+          exit_constants.emplace(slot, *constant);
+        }
+      }
+
+      for (const size_t successor : block.successors) {
+        SlotConstants merged{};
+        for (const auto& [slot, constant] : exit_constants) {
+          if (!entry[successor]) {
+            merged.emplace(slot, constant);
+          } else if (const auto it = entry[successor]->find(slot);
+                     it != entry[successor]->end() && same_constant(it->second, constant)) {
+            merged.emplace(slot, constant);
+          }
+        }
+        if (!entry[successor] || merged.size() != entry[successor]->size()) {
+          entry[successor] = std::move(merged);
+          changed = true;
+          // Merging only ever drops constants, so comparing sizes is enough.
+        }
+      }
+    }
+  }
+  return entry;
+}
+
+bool IROptimizer::propagate_values(ir::ControlFlowGraph& cfg, Chunk& chunk) const {
+  const std::vector<std::optional<SlotConstants>> entry_constants{slot_constants_on_entry(cfg, chunk)};
+  ValueTable values{};
+  bool changed{false};
+  for (size_t b = 0; b < cfg.blocks.size(); b++) {
+    ir::BasicBlock& block{cfg.blocks[b]};
+    if (!block.entry_height || !entry_constants[b]) continue;
+    std::vector<bool> pure(block.nodes.size(), false);
+    const std::vector<std::optional<size_t>> starts{block.expression_starts()};
+
+    number_values(block, *entry_constants[b], cfg, chunk, values,
+                  [&](size_t i, const std::vector<size_t>& stack, size_t result) {
+      ir::Node& node{block.nodes[i]};
+      pure[i] = is_pure(node.op) && std::all_of(node.inputs.begin(), node.inputs.end(), [&](const auto& input) {
+        return input && pure[*input];
+      });
+
+      if (node.op == OpCode::OP_JUMP_IF_FALSE || node.op == OpCode::OP_JUMP_IF_TRUE) {
+        if (const std::optional<Value>& condition = values.constant(result)) {
+          if (is_falsey(*condition) == (node.op == OpCode::OP_JUMP_IF_FALSE)) {
+            node.op = OpCode::OP_JUMP;
+          } else {
+            node.removed = true;
+          }
+          changed = true;
+          // Neither version pops the condition, successors see the same stack.
+        }
+        return;
+      }
+      if (!pure[i] || !starts[i] || is_constant_load(node.op)) return;
+
+      std::optional<ir::Node> replacement{};
+      if (const std::optional<Value>& constant = values.constant(result)) {
+        replacement = constant_load(*constant, chunk, node.line);
+      }
+      if (!replacement && node.op != OpCode::OP_GET_LOCAL) {
+        const size_t slots{std::min<size_t>(stack.size(), std::numeric_limits<uint8_t>::max() + 1)};
+        const auto it{std::find(stack.begin(), stack.begin() + slots, result)};
+        if (it != stack.begin() + slots) {
+          replacement = ir::Node{.op = OpCode::OP_GET_LOCAL,
+                                 .operands = {static_cast<uint8_t>(it - stack.begin())},
+                                 .line = node.line};
+        }
+        // A local already holds this value: recomputing an expression (or
+        // following an upvalue) can be replaced with reading it.
+      }
+      if (!replacement) return;
+
+      for (size_t k = *starts[i]; k < i; k++) block.nodes[k].removed = true;
+      node = *replacement;
+      changed = true;
+    });
+  }
+  return changed;
+}
+
+void IROptimizer::inline_calls(const std::vector<function_ptr>& functions) const {
+  const std::unordered_map<Value, InlineCandidate> candidates{inline_candidates(functions)};
+  if (candidates.empty()) return;
+  for (const function_ptr& function : functions) {
+    Chunk& chunk{*function->chunk};
+    for (size_t inlined = 0; inlined < max_inlined_calls; inlined++) {
+      std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(chunk, function->arity)};
+      if (!cfg || !inline_call(*cfg, chunk, candidates)) break;
+      cfg->lower(chunk);
+    }
+  }
+}
+
+std::unordered_map<Value, IROptimizer::InlineCandidate> IROptimizer::inline_candidates(
+    const std::vector<function_ptr>& functions) const {
+  std::unordered_map<Value, InlineCandidate> candidates{};
+  std::unordered_set<Value> defined{};
+  std::unordered_set<Value> redefined{};
+  const Chunk& script{*functions[0]->chunk};
+  const std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(script, functions[0]->arity)};
+  if (!cfg) return candidates;
+
+  for (const ir::BasicBlock& block : cfg->blocks) {
+    for (size_t i = 0; i < block.nodes.size(); i++) {
+      if (block.nodes[i].op != OpCode::OP_DEFINE_GLOBAL) continue;
+      const Value& name{script.constants[block.nodes[i].operands[0]]};
+      if (!defined.insert(name).second) redefined.insert(name);
+      if (i == 0 || block.nodes[i - 1].op != OpCode::OP_CLOSURE) continue;
+
+      const function_ptr function{std::get<function_ptr>(script.constants[block.nodes[i - 1].operands[0]])};
+      if (function->upvalue_count > 0 || function->chunk->lazy_code ||
+          function->chunk->code.size() > max_inlined_size) {
+        continue;
+      }
+      const std::optional<ir::ControlFlowGraph> body{ir::ControlFlowGraph::build(*function->chunk, function->arity)};
+      if (!body || body->blocks[0].nodes.back().op != OpCode::OP_RETURN ||
+          std::any_of(body->blocks.begin() + 1, body->blocks.end(),
+                      [](const ir::BasicBlock& unreachable) { return unreachable.entry_height.has_value(); })) {
+        continue;
+        // Straight-line code only, returning from its last instruction.
+      }
+
+      InlineCandidate candidate{.function = function, .max_height = static_cast<size_t>(function->arity) + 1};
+      size_t height{candidate.max_height};
+      for (const ir::Node& node : body->blocks[0].nodes) {
+        if (node.op == OpCode::OP_RETURN) {
+          candidate.body.push_back({.op = OpCode::OP_INLINED_RETURN,
+                                    .operands = {static_cast<uint8_t>(height - 1)},
+                                    .line = node.line});
+          break;
+        }
+        if (!can_inline(node.op)) break;
+        candidate.body.push_back(node);
+        height = static_cast<size_t>(static_cast<int>(height) + ir::stack_effect(node));
+        candidate.max_height = std::max(candidate.max_height, height);
+      }
+      if (!candidate.body.empty() && candidate.body.back().op == OpCode::OP_INLINED_RETURN) candidates.insert_or_assign(name, candidate);
+    }
+  }
+  for (const Value& name : redefined) candidates.erase(name);
+  // Not wrong thanks to the guard, but the declaration that runs last is the one
+  // worth inlining and that isn't known statically.
+  return candidates;
+}
+
+bool IROptimizer::inline_call(ir::ControlFlowGraph& cfg, Chunk& chunk,
+                              const std::unordered_map<Value, InlineCandidate>& candidates) const {
+  for (size_t b = 0; b < cfg.blocks.size(); b++) {
+    if (!cfg.blocks[b].entry_height) continue;
+    std::vector<ir::Node>& nodes{cfg.blocks[b].nodes};
+    std::vector<size_t> heights(nodes.size());
+    size_t height{*cfg.blocks[b].entry_height};
+    for (size_t i = 0; i < nodes.size(); i++) {
+      heights[i] = height;
+      height = static_cast<size_t>(static_cast<int>(height) + ir::stack_effect(nodes[i]));
+    }
+
+    for (size_t i = nodes.size(); i-- > 0;) {
+      const ir::Node& call{nodes[i]};
+      // Last call first: splitting the block at a call keeps calls computing its
+      // arguments in the same block as their callee, so they can still be inlined.
+      if ((call.op != OpCode::OP_CALL && call.op != OpCode::OP_TAIL_CALL) || !call.inputs[0] ||
+          nodes[*call.inputs[0]].op != OpCode::OP_GET_GLOBAL) {
+        continue;
+      }
+      const auto it{candidates.find(chunk.constants[nodes[*call.inputs[0]].operands[0]])};
+      if (it == candidates.end() || it->second.function->arity != call.operands[0]) continue;
+      const InlineCandidate& candidate{it->second};
+      const Chunk& callee_chunk{*candidate.function->chunk};
+      const size_t base{heights[*call.inputs[0]]};
+      // Callee's stack window starts where its slot is, inlined locals are moved
+      // there.
+      if (base + candidate.max_height > std::numeric_limits<uint8_t>::max() + 1 ||
+          chunk.code.size() + callee_chunk.code.size() + 10 > std::numeric_limits<uint16_t>::max()) {
+        continue;
+      }
+
+      std::vector<ir::Node> inlined{};
+      bool remapped{true};
+      for (const ir::Node& node : candidate.body) {
+        ir::Node& copy{inlined.emplace_back(ir::Node{.op = node.op, .operands = node.operands, .line = call.line})};
+        // No frame is pushed for the callee, so runtime errors in inlined code are
+        // reported at the call: the caller's line under the caller's name.
+        if (node.op == OpCode::OP_GET_LOCAL || node.op == OpCode::OP_SET_LOCAL) {
+          copy.operands[0] = static_cast<uint8_t>(copy.operands[0] + base);
+        } else if (node.op == OpCode::OP_CONSTANT || node.op == OpCode::OP_GET_GLOBAL ||
+                   node.op == OpCode::OP_SET_GLOBAL) {
+          const std::optional<uint8_t> index{constant_index(callee_chunk.constants[node.operands[0]], chunk)};
+          remapped &= index.has_value();
+          copy.operands[0] = index.value_or(0);
+        }
+      }
+      const std::optional<uint8_t> expected_callee{constant_index(Value{candidate.function}, chunk)};
+      if (!remapped || !expected_callee) return false;
+      // Constants pool is full, same for every other call site.
+
+      for (ir::BasicBlock& block : cfg.blocks) {
+        for (ir::Node& node : block.nodes) {
+          if (ir::is_jump(node.op) && node.target > b) node.target += 3;
+        }
+      }
+      const int line{call.line};
+      const uint8_t arg_count{call.operands[0]};
+      inlined.push_back({.op = OpCode::OP_JUMP, .operands = {0, 0}, .line = line, .target = b + 3});
+      ir::BasicBlock call_block{.nodes = {call}};
+      ir::BasicBlock rest{.nodes = std::vector<ir::Node>(nodes.begin() + i + 1, nodes.end())};
+      nodes.resize(i);
+      nodes.push_back({.op = OpCode::OP_JUMP_IF_NOT_CALLEE,
+                       .operands = {0, 0, arg_count, *expected_callee},
+                       .line = line,
+                       .target = b + 2});
+      // [callee, arguments] JUMP_IF_NOT_CALLEE -> call; inlined body; JUMP -> rest
+      // call: CALL; rest: ...
+      cfg.blocks.insert(cfg.blocks.begin() + b + 1,
+                        {ir::BasicBlock{.nodes = std::move(inlined)}, std::move(call_block), std::move(rest)});
+      return true;
+    }
+  }
+  return false;
+}
+
+void IROptimizer::hoist_loop_invariants(const std::vector<function_ptr>& functions, bool whole_program) const {
+  const GlobalFacts globals{collect_global_facts(functions, whole_program)};
+  for (size_t i = 0; i < functions.size(); i++) {
+    Chunk& chunk{*functions[i]->chunk};
+    for (int hoists = 0; hoists < std::numeric_limits<uint8_t>::max(); hoists++) {
+      std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(chunk, functions[i]->arity)};
+      if (!cfg || !hoist_from_loop(*cfg, chunk, globals, i == 0)) break;
+      cfg->lower(chunk);
+      // Each hoist takes a local slot, which bounds the number of rounds anyway.
+    }
+  }
+}
+
+IROptimizer::GlobalFacts IROptimizer::collect_global_facts(const std::vector<function_ptr>& functions,
+                                                          bool whole_program) const {
+  GlobalFacts globals{.unseen_code = !whole_program};
+  std::unordered_set<Value> defined{};
+  for (const function_ptr& function : functions) {
+    const Chunk& chunk{*function->chunk};
+    for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instruction_size(offset)) {
+      const OpCode op{static_cast<OpCode>(chunk.code[offset])};
+      if (op == OpCode::OP_SET_GLOBAL || op == OpCode::OP_SET_GLOBAL_LONG) {
+        globals.assigned.insert(chunk.constants[chunk.operand(offset)]);
+      }
+      if (op == OpCode::OP_DEFINE_GLOBAL || op == OpCode::OP_DEFINE_GLOBAL_LONG) {
+        defined.insert(chunk.constants[chunk.operand(offset)]);
+      }
+    }
+  }
+
+  const Chunk& script{*functions[0]->chunk};
+  const std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(script, functions[0]->arity)};
+  if (!cfg) return globals;
+  // Global declarations only appear at the top level of the script, outside of
+  // any branch, so the ones before the first call have run by the time any
+  // function does.
+  for (const ir::BasicBlock& block : cfg->blocks) {
+    for (const ir::Node& node : block.nodes) {
+      if (node.op == OpCode::OP_DEFINE_GLOBAL) {
+        globals.defined_before_calls.insert(script.constants[node.operands[0]]);
+      } else if (node.op == OpCode::OP_CALL || node.op == OpCode::OP_TAIL_CALL) {
+        const std::optional<size_t> callee{node.inputs[0]};
+        if (callee && block.nodes[*callee].op == OpCode::OP_GET_GLOBAL) {
+          const Value& name{script.constants[block.nodes[*callee].operands[0]]};
+          if (!globals.unseen_code && !defined.contains(name) && !globals.assigned.contains(name)) continue;
+          // Natives (eg. clock) are the only globals the whole program doesn't
+          // define.
+        }
+        return globals;
+      }
+    }
+  }
+  return globals;
+}
+
+bool IROptimizer::hoist_from_loop(ir::ControlFlowGraph& cfg, Chunk& chunk, const GlobalFacts& globals,
+                                  bool is_script) const {
+  std::vector<std::vector<size_t>> predecessors(cfg.blocks.size());
+  for (size_t b = 0; b < cfg.blocks.size(); b++) {
+    if (!cfg.blocks[b].entry_height) continue;
+    for (const size_t successor : cfg.blocks[b].successors) predecessors[successor].push_back(b);
+  }
+
+  for (const auto& [header, latch] : loop_regions(cfg)) {
+    const auto in_loop = [header, latch](size_t b) { return header <= b && b <= latch; };
+    const size_t exit{latch + 1};
+    bool has_exit{false};
+    bool well_formed{true};
+    for (size_t b = header; b <= latch && well_formed; b++) {
+      well_formed = cfg.blocks[b].entry_height.has_value();
+      for (const size_t predecessor : predecessors[b]) {
+        const ir::Node& last{cfg.blocks[predecessor].nodes.back()};
+        well_formed &= in_loop(predecessor) || (b == header && predecessor + 1 == header &&
+                                                !(ir::is_jump(last.op) && last.target == header));
+      }
+      for (const size_t successor : cfg.blocks[b].successors) {
+        well_formed &= in_loop(successor) || successor == exit;
+        has_exit |= successor == exit;
+      }
+    }
+    // Hidden locals are pushed by a new block falling through into the header and
+    // popped when the loop exits, so the loop can only be entered at the header
+    // and left to the block right after it (or by returning).
+    if (!well_formed) continue;
+    const size_t height{*cfg.blocks[header].entry_height};
+    size_t exit_pops{0};
+    if (has_exit) {
+      const ir::BasicBlock& exit_block{cfg.blocks[exit]};
+      well_formed = std::all_of(predecessors[exit].begin(), predecessors[exit].end(), in_loop) &&
+                    *exit_block.entry_height >= height;
+      if (!well_formed) continue;
+      exit_pops = *exit_block.entry_height - height;
+      if (exit_block.nodes.size() < exit_pops ||
+          !std::all_of(exit_block.nodes.begin(), exit_block.nodes.begin() + exit_pops,
+                       [](const ir::Node& node) { return node.op == OpCode::OP_POP; })) {
+        continue;
+        // The condition is popped first, hidden locals sit below it.
+      }
+    }
+
+    bool calls{false};
+    std::set<uint8_t> assigned_upvalues{};
+    std::unordered_set<Value> assigned_globals{};
+    size_t max_height{height};
+    for (size_t b = header; b <= latch; b++) {
+      int stack_height{static_cast<int>(*cfg.blocks[b].entry_height)};
+      for (const ir::Node& node : cfg.blocks[b].nodes) {
+        stack_height += ir::stack_effect(node);
+        max_height = std::max(max_height, static_cast<size_t>(stack_height));
+        if (node.op == OpCode::OP_CALL || node.op == OpCode::OP_TAIL_CALL) calls = true;
+        if (node.op == OpCode::OP_SET_UPVALUE) assigned_upvalues.insert(node.operands[0]);
+        if (node.op == OpCode::OP_SET_GLOBAL) assigned_globals.insert(chunk.constants[node.operands[0]]);
+      }
+    }
+    std::unordered_set<Value> defined_before_loop{};
+    for (size_t b = 0; is_script && b < header; b++) {
+      for (const ir::Node& node : cfg.blocks[b].nodes) {
+        if (node.op == OpCode::OP_DEFINE_GLOBAL) defined_before_loop.insert(chunk.constants[node.operands[0]]);
+      }
+    }
+    const std::unordered_set<Value>& defined{is_script ? defined_before_loop : globals.defined_before_calls};
+    const auto is_invariant = [&](const ir::Node& node) {
+      if (node.op == OpCode::OP_GET_GLOBAL) {
+        const Value& name{chunk.constants[node.operands[0]]};
+        return defined.contains(name) &&
+               (!globals.may_assign(name) || (!calls && !assigned_globals.contains(name)));
+        // Reading an undefined global fails, hoisting must not move that error in
+        // front of whatever the loop prints before getting to the read.
+      }
+      return node.op == OpCode::OP_GET_UPVALUE && !calls && !assigned_upvalues.contains(node.operands[0]);
+      // Only the closure running the loop could assign to its upvalues meanwhile:
+      // the function owning the variable is either suspended or has returned.
+    };
+
+    std::vector<ir::Node> hoisted{};
+    const auto hoisted_index = [&hoisted](const ir::Node& node) -> std::optional<size_t> {
+      const auto it{std::find_if(hoisted.begin(), hoisted.end(), [&node](const ir::Node& read) {
+        return read.op == node.op && read.operands == node.operands;
+      })};
+      return it != hoisted.end() ? std::optional<size_t>{it - hoisted.begin()} : std::nullopt;
+    };
+    for (size_t b = header; b <= latch; b++) {
+      for (const ir::Node& node : cfg.blocks[b].nodes) {
+        if (is_invariant(node) && !hoisted_index(node) &&
+            max_height + hoisted.size() < std::numeric_limits<uint8_t>::max() + 1) {
+          hoisted.push_back({.op = node.op, .operands = node.operands, .line = node.line});
+        }
+      }
+    }
+    // Locals in the loop move up by one slot per hoisted read, slot operands are
+    // a single byte.
+    if (hoisted.empty() || chunk.code.size() + 3 * hoisted.size() > std::numeric_limits<uint16_t>::max()) {
+      continue;
+    }
+
+    const uint8_t shift{static_cast<uint8_t>(hoisted.size())};
+    for (size_t b = header; b <= latch; b++) {
+      for (ir::Node& node : cfg.blocks[b].nodes) {
+        if (node.op == OpCode::OP_GET_LOCAL || node.op == OpCode::OP_SET_LOCAL) {
+          if (node.operands[0] >= height) node.operands[0] += shift;
+        } else if (node.op == OpCode::OP_CLOSURE) {
+          for (size_t i = 1; i < node.operands.size(); i += 2) {
+            if (node.operands[i] == 1 && node.operands[i + 1] >= height) node.operands[i + 1] += shift;
+          }
+        } else if (const std::optional<size_t> j = hoisted_index(node)) {
+          node = {.op = OpCode::OP_GET_LOCAL, .operands = {static_cast<uint8_t>(height + *j)}, .line = node.line};
+        }
+      }
+    }
+    if (has_exit) {
+      std::vector<ir::Node>& exit_nodes{cfg.blocks[exit].nodes};
+      exit_nodes.insert(exit_nodes.begin() + exit_pops, hoisted.size(),
+                        ir::Node{.op = OpCode::OP_POP, .line = cfg.blocks[latch].nodes.back().line});
+    }
+    for (ir::BasicBlock& block : cfg.blocks) {
+      for (ir::Node& node : block.nodes) {
+        if (ir::is_jump(node.op) && node.target >= header) node.target++;
+      }
+    }
+    cfg.blocks.insert(cfg.blocks.begin() + header, ir::BasicBlock{.nodes = std::move(hoisted)});
+    return true;
+  }
+  return false;
+}
+
+bool IROptimizer::eliminate_dead_code(ir::ControlFlowGraph& cfg, Chunk&) const {
+  bool changed{false};
+  for (ir::BasicBlock& block : cfg.blocks) {
+    if (!block.entry_height) {
+      for (ir::Node& node : block.nodes) node.removed = true;
+      changed = true;
+      continue;
+      // Unreachable.
+    }
+    std::vector<bool> discardable(block.nodes.size(), false);
+    const std::vector<std::optional<size_t>> starts{block.expression_starts()};
+    for (size_t i = 0; i < block.nodes.size(); i++) {
+      ir::Node& node{block.nodes[i]};
+      discardable[i] = cannot_fail(node.op) &&
+                       std::all_of(node.inputs.begin(), node.inputs.end(),
+                                   [&](const auto& input) { return input && discardable[*input]; });
+      if (node.op == OpCode::OP_POP && node.inputs[0] && discardable[*node.inputs[0]] && starts[i]) {
+        for (size_t k = *starts[i]; k <= i; k++) block.nodes[k].removed = true;
+        changed = true;
+      }
+    }
+  }
+  return changed;
+}
+
+}  // namespace cpplox
@@ -0,0 +1,115 @@
+#include "cpplox/Bytecode/IsolatePool.h"
+
+#include <algorithm>
+#include <exception>
+#include <sstream>
+#include <utility>
+
+#include "cpplox/Treewalk/Scanner.h"
+#include "cpplox/Bytecode/VM.h"
+
+namespace cpplox {
+
+SharedScript::SharedScript(const std::string& source, const CompilerOptions& options) {
+  heap.register_root_marking_callback([this] { pool.mark_strings(); });
+  // Isolates look strings up in pool, so it mustn't lose any of them.
+  ErrorReporter e_reporter{};
+  const std::vector<const Token> tokens{clox::Scanner{source, e_reporter}.tokenize()};
+  if (e_reporter.has_error()) {
+    compile_errors = "[Scanning error] " + e_reporter.to_string();
+  } else {
+    std::ofstream log_output{};
+    const Disassembler disassembler{log_output};
+    CompilerOptions eager{options};
+    eager.lazy_functions = false;
+    script = Compiler{tokens, disassembler, e_reporter, &heap, &pool, eager}.compile();
+    compile_errors = e_reporter.to_string();
+    if (e_reporter.has_error()) script.reset();
+  }
+  heap.freeze();
+}
+
+SharedScript::~SharedScript() {
+  heap.deregister_root_marking_callback();
+}
+
+ScriptResult Isolate::run(const std::string& source) {
+  e_reporter.clear();
+  std::ostringstream output{};
+  const std::vector<const Token> tokens{clox::Scanner{source, e_reporter}.tokenize()};
+  if (e_reporter.has_error()) return {output.str(), "[Scanning error] " + e_reporter.to_string()};
+
+  const std::optional<function_ptr> script{Compiler{tokens, disassembler, e_reporter, &heap, &pool, options}.compile()};
+  if (!e_reporter.has_error() && script) {
+    VM(output, disassembler, e_reporter, &heap, &pool, log_output, Jit::supported() ? &jit : nullptr)
+        .interpret(*script);
+  }
+  return {output.str(), e_reporter.to_string()};
+}
+
+ScriptResult Isolate::run(const SharedScript& shared) {
+  if (!shared.script) return {"", shared.errors()};
+  e_reporter.clear();
+  std::ostringstream output{};
+  StringPool strings{&heap, &shared.pool};
+  VM(output, disassembler, e_reporter, &heap, &strings, log_output, nullptr).interpret(*shared.script);
+  return {output.str(), e_reporter.to_string()};
+}
+
+IsolatePool::IsolatePool(size_t workers, const CompilerOptions& options) : options{options} {
+  for (size_t i = 0; i < std::max<size_t>(workers, 1); i++) this->workers.emplace_back([this] { work(); });
+}
+
+IsolatePool::~IsolatePool() {
+  {
+    const std::lock_guard lock{mutex};
+    stopping = true;
+  }
+  queued.notify_all();
+  for (std::thread& worker : workers) worker.join();
+}
+
+std::future<ScriptResult> IsolatePool::submit(std::string source) {
+  return enqueue({std::move(source), nullptr, {}});
+}
+
+std::future<ScriptResult> IsolatePool::submit(std::shared_ptr<const SharedScript> shared) {
+  return enqueue({{}, std::move(shared), {}});
+}
+
+std::future<ScriptResult> IsolatePool::enqueue(Job job) {
+  std::future<ScriptResult> future{job.result.get_future()};
+  {
+    const std::lock_guard lock{mutex};
+    jobs.push_back(std::move(job));
+  }
+  queued.notify_one();
+  return future;
+}
+
+size_t IsolatePool::default_workers() {
+  return std::max<size_t>(std::thread::hardware_concurrency(), 1);
+  // hardware_concurrency is 0 where it isn't known.
+}
+
+void IsolatePool::work() {
+  while (true) {
+    Job job{};
+    {
+      std::unique_lock lock{mutex};
+      queued.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (jobs.empty()) return;
+      // Stopping, and everything submitted has started.
+      job = std::move(jobs.front());
+      jobs.pop_front();
+    }
+    try {
+      Isolate isolate{options};
+      job.result.set_value(job.shared ? isolate.run(*job.shared) : isolate.run(job.source));
+    } catch (...) {
+      job.result.set_exception(std::current_exception());
+    }
+  }
+}
+
+}  // namespace cpplox
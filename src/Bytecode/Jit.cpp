@@ -0,0 +1,817 @@
+#include "cpplox/Bytecode/Jit.h"
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <bit>
+#include <cstring>
+#include <new>
+#include <optional>
+
+#include "cpplox/Bytecode/CopyAndPatch.h"
+#include "cpplox/Bytecode/IR.h"
+#include "cpplox/Bytecode/SlowPaths.h"
+#include "cpplox/Bytecode/VM.h"
+
+namespace cpplox {
+
+namespace {
+std::optional<size_t> find_index_offset() {
+  // Templates read and write Values directly: payload at offset 0, one byte of
+  // alternative index at index_offset. Checked rather than assumed as the
+  // layout is up to the standard library.
+  alignas(Value) unsigned char bytes[sizeof(Value)];
+  std::memset(bytes, 0, sizeof(bytes));
+  new (bytes) Value{std::monostate{}};
+  std::optional<size_t> offset{};
+  for (size_t i = 0; i < sizeof(Value); i++) {
+    if (bytes[i] == 0) continue;
+    if (offset || bytes[i] != 2) return std::nullopt;
+    offset = i;
+  }
+  if (!offset || *offset < sizeof(double)) return std::nullopt;
+
+  std::memset(bytes, 0xff, sizeof(bytes));
+  new (bytes) Value{false};
+  if (bytes[0] != 0 || bytes[*offset] != 1) return std::nullopt;
+  std::memset(bytes, 0xff, sizeof(bytes));
+  new (bytes) Value{-2.5};
+  const double number{-2.5};
+  if (std::memcmp(bytes, &number, sizeof(number)) != 0 || bytes[*offset] != 0) return std::nullopt;
+  if (*offset + 1 < sizeof(Value) && bytes[*offset + 1] != 0xff) return std::nullopt;
+  // A wider index would have overwritten the next byte.
+  return offset;
+}
+
+const std::optional<size_t> index_offset{find_index_offset()};
+constexpr int32_t value_size{sizeof(Value)};
+static_assert(sizeof(Value) % 8 == 0);
+
+enum Reg : uint8_t { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+enum Condition : uint8_t { EQUAL = 0x4, NOT_EQUAL = 0x5, BELOW_EQUAL = 0x6, ABOVE = 0x7 };
+enum SseOp : uint8_t { MOVSD = 0x10, ADDSD = 0x58, MULSD = 0x59, SUBSD = 0x5c, DIVSD = 0x5e };
+
+class Assembler {
+  // Just the x86-64 instructions templates and traces need. Memory operands are
+  // always [base + disp32].
+public:
+  struct Label {
+    size_t id;
+  };
+
+  Label label() {
+    bound.push_back(std::nullopt);
+    return Label{bound.size() - 1};
+  }
+  void bind(Label label) { bound[label.id] = code.size(); }
+
+  void push(Reg reg) {
+    if (reg >= R8) byte(0x41);
+    byte(0x50 | (reg & 7));
+  }
+  void pop(Reg reg) {
+    if (reg >= R8) byte(0x41);
+    byte(0x58 | (reg & 7));
+  }
+  void ret() { byte(0xc3); }
+  void adjust_rsp(int8_t delta) {
+    // add rsp, delta
+    byte(0x48);
+    byte(0x83);
+    byte(delta < 0 ? 0xec : 0xc4);
+    byte(static_cast<uint8_t>(delta < 0 ? -delta : delta));
+  }
+  void mov(Reg dst, Reg src) {
+    rex(true, src, dst);
+    byte(0x89);
+    byte(0xc0 | (src & 7) << 3 | (dst & 7));
+  }
+  void mov(Reg dst, uint64_t imm) {
+    rex(true, 0, dst);
+    byte(0xb8 | (dst & 7));
+    for (int i = 0; i < 8; i++) byte(static_cast<uint8_t>(imm >> (8 * i)));
+  }
+  void xor_(Reg dst, Reg src) {
+    rex(true, src, dst);
+    byte(0x31);
+    byte(0xc0 | (src & 7) << 3 | (dst & 7));
+  }
+  void load(Reg dst, Reg base, int32_t disp) {
+    rex(true, dst, base);
+    byte(0x8b);
+    memory(dst, base, disp);
+  }
+  void store(Reg base, int32_t disp, Reg src) {
+    rex(true, src, base);
+    byte(0x89);
+    memory(src, base, disp);
+  }
+  void lea(Reg dst, Reg base, int32_t disp) {
+    rex(true, dst, base);
+    byte(0x8d);
+    memory(dst, base, disp);
+  }
+  void load_sd(uint8_t xmm, Reg base, int32_t disp) {
+    byte(0xf2);
+    rex(false, xmm, base);
+    byte(0x0f);
+    byte(0x10);
+    memory(xmm, base, disp);
+  }
+  void store_sd(Reg base, int32_t disp, uint8_t xmm) {
+    byte(0xf2);
+    rex(false, xmm, base);
+    byte(0x0f);
+    byte(0x11);
+    memory(xmm, base, disp);
+  }
+  void sse(SseOp op, uint8_t dst, uint8_t src) {
+    byte(0xf2);
+    rex(false, dst, src);
+    byte(0x0f);
+    byte(op);
+    byte(0xc0 | (dst & 7) << 3 | (src & 7));
+  }
+  void movsd(uint8_t dst, uint8_t src) {
+    sse(MOVSD, dst, src);
+  }
+  void movq(uint8_t xmm, Reg src) {
+    byte(0x66);
+    rex(true, xmm, src);
+    byte(0x0f);
+    byte(0x6e);
+    byte(0xc0 | (xmm & 7) << 3 | (src & 7));
+  }
+  void movq(Reg dst, uint8_t xmm) {
+    byte(0x66);
+    rex(true, xmm, dst);
+    byte(0x0f);
+    byte(0x7e);
+    byte(0xc0 | (xmm & 7) << 3 | (dst & 7));
+  }
+  void ucomisd(uint8_t lhs, uint8_t rhs) {
+    byte(0x66);
+    rex(false, lhs, rhs);
+    byte(0x0f);
+    byte(0x2e);
+    byte(0xc0 | (lhs & 7) << 3 | (rhs & 7));
+  }
+  void store_byte(Reg base, int32_t disp, uint8_t imm) {
+    rex(false, 0, base);
+    byte(0xc6);
+    memory(0, base, disp);
+    byte(imm);
+  }
+  void store_al(Reg base, int32_t disp) {
+    rex(false, RAX, base);
+    byte(0x88);
+    memory(RAX, base, disp);
+  }
+  void cmp_byte(Reg base, int32_t disp, uint8_t imm) {
+    rex(false, 0, base);
+    byte(0x80);
+    memory(7, base, disp);
+    byte(imm);
+  }
+  void set(Condition condition) {
+    // setcc al
+    byte(0x0f);
+    byte(0x90 | condition);
+    byte(0xc0);
+  }
+  void test_al() {
+    byte(0x84);
+    byte(0xc0);
+  }
+  void call(const void* function) {
+    mov(RAX, reinterpret_cast<uint64_t>(function));
+    byte(0xff);
+    byte(0xd0);
+  }
+  void jmp(Label target) {
+    byte(0xe9);
+    fixup(target);
+  }
+  void jump_if(Condition condition, Label target) {
+    byte(0x0f);
+    byte(0x80 | condition);
+    fixup(target);
+  }
+
+  std::vector<uint8_t> finish() {
+    for (const auto& [at, label] : fixups) {
+      const int32_t rel{static_cast<int32_t>(*bound[label.id] - (at + 4))};
+      std::memcpy(code.data() + at, &rel, sizeof(rel));
+    }
+    return std::move(code);
+  }
+
+private:
+  std::vector<uint8_t> code{};
+  std::vector<std::optional<size_t>> bound{};
+  std::vector<std::pair<size_t, Label>> fixups{};
+
+  void byte(uint8_t value) { code.push_back(value); }
+  void rex(bool wide, uint8_t reg, uint8_t base) {
+    const uint8_t prefix = 0x40 | (wide ? 8 : 0) | (reg >= 8 ? 4 : 0) | (base >= 8 ? 1 : 0);
+    if (prefix != 0x40) byte(prefix);
+  }
+  void memory(uint8_t reg, Reg base, int32_t disp) {
+    byte(0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) byte(0x24);
+    // rsp and r12 as base need a SIB byte.
+    for (int i = 0; i < 4; i++) byte(static_cast<uint8_t>(disp >> (8 * i)));
+  }
+  void fixup(Label target) {
+    fixups.emplace_back(code.size(), target);
+    for (int i = 0; i < 4; i++) byte(0);
+  }
+};
+
+int32_t slot(size_t index) {
+  return static_cast<int32_t>(index) * value_size;
+}
+
+const void* address(auto function) {
+  return reinterpret_cast<const void*>(function);
+}
+
+void jump_if_falsey(Assembler& a, Reg base, size_t value, bool falsey, Assembler::Label target) {
+  // nil and false are falsey, everything else is truthy.
+  const int32_t index{static_cast<int32_t>(*index_offset)};
+  const Assembler::Label skip{a.label()};
+  a.cmp_byte(base, slot(value) + index, 2);
+  a.jump_if(EQUAL, falsey ? target : skip);
+  a.cmp_byte(base, slot(value) + index, 1);
+  a.jump_if(NOT_EQUAL, falsey ? skip : target);
+  a.cmp_byte(base, slot(value), 0);
+  a.jump_if(falsey ? EQUAL : NOT_EQUAL, target);
+  a.bind(skip);
+}
+
+std::optional<std::vector<uint8_t>> assemble(const Function& function);
+std::optional<std::vector<uint8_t>> assemble(const Trace& trace, const std::vector<TraceOp>& ops);
+}  // namespace
+
+Jit::~Jit() {
+  for (const auto& [memory, size] : regions) munmap(memory, size);
+}
+
+bool Jit::supported(JitBackend backend) {
+#if defined(__x86_64__) && defined(__linux__)
+  return backend == JitBackend::STENCILS ? CopyAndPatch::supported() : index_offset.has_value();
+#else
+  return false;
+#endif
+}
+
+void Jit::profile(const Function& function) {
+  if (function.compiled || function.calls == not_compilable || ++function.calls < hot_calls) return;
+  function.compiled = compile(function);
+  if (!function.compiled) function.calls = not_compilable;
+}
+
+CompiledEntry Jit::compile(const Function& function) {
+  if (!supported(backend)) return nullptr;
+  if (backend == JitBackend::STENCILS) {
+    const std::optional<CopyAndPatch> code{CopyAndPatch::stitch(function)};
+    if (!code) return nullptr;
+    return reinterpret_cast<CompiledEntry>(install(code->size(), [&](uint8_t* memory) { code->write(memory); }));
+  }
+  const std::optional<std::vector<uint8_t>> code{assemble(function)};
+  if (!code) return nullptr;
+  return reinterpret_cast<CompiledEntry>(
+      install(code->size(), [&](uint8_t* memory) { std::memcpy(memory, code->data(), code->size()); }));
+}
+
+bool Jit::profile(LoopTrace& loop) {
+  if (loop.back_edges == not_compilable || !supported()) return false;
+  return ++loop.back_edges >= hot_loops;
+}
+
+void Jit::compile(LoopTrace& loop, const Trace* trace) {
+  std::optional<std::vector<TraceOp>> ops{};
+  if (trace) ops = trace->optimize();
+  std::optional<std::vector<uint8_t>> code{};
+  if (ops) code = assemble(*trace, *ops);
+  if (code) {
+    loop.entry = reinterpret_cast<TraceEntry>(
+        install(code->size(), [&](uint8_t* memory) { std::memcpy(memory, code->data(), code->size()); }));
+  }
+  if (!loop.entry) loop.back_edges = not_compilable;
+}
+
+const void* Jit::install(size_t size, const std::function<void(uint8_t*)>& write) {
+  const size_t page{static_cast<size_t>(sysconf(_SC_PAGESIZE))};
+  const size_t mapped{(size + page - 1) / page * page};
+  void* memory{mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)};
+  if (memory == MAP_FAILED) return nullptr;
+  write(static_cast<uint8_t*>(memory));
+  if (mprotect(memory, mapped, PROT_READ | PROT_EXEC) != 0) {
+    munmap(memory, mapped);
+    return nullptr;
+  }
+  regions.emplace_back(memory, mapped);
+  return memory;
+}
+
+namespace {
+std::optional<std::vector<uint8_t>> assemble(const Function& function) {
+  const Chunk& chunk{*function.chunk};
+  const std::optional<ir::ControlFlowGraph> cfg{ir::ControlFlowGraph::build(chunk, function.arity)};
+  if (!cfg) return std::nullopt;
+  const int32_t index{static_cast<int32_t>(*index_offset)};
+  constexpr Reg vm{RBX};
+  constexpr Reg s{R12};
+  // Callee-saved: VM and the frame's first slot.
+
+  Assembler a{};
+  const Assembler::Label error{a.label()};
+  const Assembler::Label exit{a.label()};
+  std::vector<Assembler::Label> blocks{};
+  for (size_t b = 0; b < cfg->blocks.size(); b++) blocks.push_back(a.label());
+
+  a.push(vm);
+  a.push(s);
+  a.adjust_rsp(-8);
+  // Keeps the stack 16 byte aligned for calls.
+  a.mov(vm, RDI);
+  a.call(address(cpplox_slots));
+  a.mov(s, RAX);
+
+  const auto copy = [&](Reg dst, int32_t dst_disp, Reg src, int32_t src_disp) {
+    for (int32_t word = 0; word < value_size; word += 8) {
+      a.load(RAX, src, src_disp + word);
+      a.store(dst, dst_disp + word, RAX);
+    }
+  };
+  const auto guard_number = [&](size_t value, Assembler::Label slow) {
+    a.cmp_byte(s, slot(value) + index, 0);
+    a.jump_if(NOT_EQUAL, slow);
+  };
+  const auto step = [&](size_t offset, size_t height) {
+    a.mov(RDI, vm);
+    a.lea(RSI, s, slot(height));
+    a.mov(RDX, reinterpret_cast<uint64_t>(chunk.code.data() + offset));
+    a.call(address(cpplox_step));
+    a.test_al();
+    a.jump_if(EQUAL, error);
+  };
+  const auto arithmetic = [&](const ir::Node& node, size_t h, bool checked, size_t offset) {
+    const Assembler::Label slow{a.label()};
+    const Assembler::Label done{a.label()};
+    if (checked) {
+      guard_number(h - 2, slow);
+      guard_number(h - 1, slow);
+    }
+    a.load_sd(0, s, slot(h - 2));
+    a.load_sd(1, s, slot(h - 1));
+    switch (node.op) {
+      case OpCode::OP_ADD:
+      case OpCode::OP_ADD_NN:
+        a.sse(ADDSD, 0, 1);
+        break;
+      case OpCode::OP_SUBTRACT:
+      case OpCode::OP_SUBTRACT_NN:
+        a.sse(SUBSD, 0, 1);
+        break;
+      case OpCode::OP_MULTIPLY:
+      case OpCode::OP_MULTIPLY_NN:
+        a.sse(MULSD, 0, 1);
+        break;
+      case OpCode::OP_DIVIDE:
+      case OpCode::OP_DIVIDE_NN:
+        a.sse(DIVSD, 0, 1);
+        break;
+      case OpCode::OP_GREATER:
+      case OpCode::OP_GREATER_NN:
+        a.ucomisd(0, 1);
+        break;
+      default:
+        a.ucomisd(1, 0);
+        // a < b as b > a: unordered operands (NaN) leave ABOVE unset.
+        break;
+    }
+    if (node.op == OpCode::OP_GREATER || node.op == OpCode::OP_GREATER_NN || node.op == OpCode::OP_LESS ||
+        node.op == OpCode::OP_LESS_NN) {
+      a.set(ABOVE);
+      a.store_al(s, slot(h - 2));
+      a.store_byte(s, slot(h - 2) + index, 1);
+    } else {
+      a.store_sd(s, slot(h - 2), 0);
+      a.store_byte(s, slot(h - 2) + index, 0);
+    }
+    if (!checked) return;
+    a.jmp(done);
+    a.bind(slow);
+    step(offset, h);
+    // Strings, and errors for everything else, take the interpreter's path.
+    a.bind(done);
+  };
+
+  size_t offset{0};
+  for (size_t b = 0; b < cfg->blocks.size(); b++) {
+    const ir::BasicBlock& block{cfg->blocks[b]};
+    a.bind(blocks[b]);
+    size_t h{block.entry_height.value_or(0)};
+    for (const ir::Node& node : block.nodes) {
+      const size_t at{offset};
+      const size_t end{offset + 1 + node.operands.size()};
+      offset = end;
+      if (!block.entry_height) continue;
+      // Unreachable, nothing jumps here.
+
+      switch (node.op) {
+        case OpCode::OP_CONSTANT:
+          a.mov(RCX, reinterpret_cast<uint64_t>(chunk.constants.data() + node.operands[0]));
+          copy(s, slot(h), RCX, 0);
+          break;
+        case OpCode::OP_NIL:
+          a.store_byte(s, slot(h) + index, 2);
+          break;
+        case OpCode::OP_TRUE:
+        case OpCode::OP_FALSE:
+          a.store_byte(s, slot(h), node.op == OpCode::OP_TRUE);
+          a.store_byte(s, slot(h) + index, 1);
+          break;
+        case OpCode::OP_POP:
+        case OpCode::OP_NOOP:
+          break;
+        case OpCode::OP_GET_LOCAL:
+          copy(s, slot(h), s, slot(node.operands[0]));
+          break;
+        case OpCode::OP_SET_LOCAL:
+          copy(s, slot(node.operands[0]), s, slot(h - 1));
+          break;
+        case OpCode::OP_GET_UPVALUE:
+        case OpCode::OP_SET_UPVALUE:
+          a.mov(RDI, vm);
+          a.lea(RSI, s, slot(node.op == OpCode::OP_GET_UPVALUE ? h : h - 1));
+          a.mov(RDX, node.operands[0]);
+          a.call(node.op == OpCode::OP_GET_UPVALUE ? address(cpplox_get_upvalue) : address(cpplox_set_upvalue));
+          break;
+        case OpCode::OP_EQUAL:
+          a.lea(RDI, s, slot(h - 2));
+          a.call(address(cpplox_equal));
+          break;
+        case OpCode::OP_NOT:
+          a.mov(RDI, vm);
+          a.lea(RSI, s, slot(h - 1));
+          a.call(address(cpplox_not));
+          break;
+        case OpCode::OP_NEGATE: {
+          const Assembler::Label slow{a.label()};
+          const Assembler::Label done{a.label()};
+          guard_number(h - 1, slow);
+          a.load(RAX, s, slot(h - 1));
+          a.mov(RCX, uint64_t{1} << 63);
+          a.xor_(RAX, RCX);
+          // Flips the sign bit, so -0 stays distinct from 0.
+          a.store(s, slot(h - 1), RAX);
+          a.jmp(done);
+          a.bind(slow);
+          step(at, h);
+          a.bind(done);
+          break;
+        }
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_LESS:
+          arithmetic(node, h, true, at);
+          break;
+        case OpCode::OP_ADD_NN:
+        case OpCode::OP_SUBTRACT_NN:
+        case OpCode::OP_MULTIPLY_NN:
+        case OpCode::OP_DIVIDE_NN:
+        case OpCode::OP_GREATER_NN:
+        case OpCode::OP_LESS_NN:
+          arithmetic(node, h, false, at);
+          break;
+        case OpCode::OP_JUMP:
+        case OpCode::OP_LOOP:
+          a.jmp(blocks[node.target]);
+          break;
+        case OpCode::OP_JUMP_IF_FALSE:
+        case OpCode::OP_JUMP_IF_TRUE:
+          jump_if_falsey(a, s, h - 1, node.op == OpCode::OP_JUMP_IF_FALSE, blocks[node.target]);
+          break;
+        case OpCode::OP_JUMP_IF_NOT_CALLEE:
+          a.lea(RDI, s, slot(h - 1 - node.operands[2]));
+          a.mov(RSI, reinterpret_cast<uint64_t>(chunk.constants.data() + node.operands[3]));
+          a.call(address(cpplox_not_callee));
+          a.test_al();
+          a.jump_if(NOT_EQUAL, blocks[node.target]);
+          break;
+        case OpCode::OP_INLINED_RETURN:
+          copy(s, slot(h - 1 - node.operands[0]), s, slot(h - 1));
+          break;
+        case OpCode::OP_CALL:
+        case OpCode::OP_TAIL_CALL:
+          a.mov(RDI, vm);
+          a.lea(RSI, s, slot(h));
+          a.mov(RDX, reinterpret_cast<uint64_t>(chunk.code.data() + end));
+          a.mov(RCX, node.operands[0]);
+          if (node.op == OpCode::OP_CALL) {
+            a.call(address(cpplox_call));
+            a.test_al();
+            a.jump_if(EQUAL, error);
+          } else {
+            a.call(address(cpplox_tail_call));
+            a.test_al();
+            a.jump_if(NOT_EQUAL, exit);
+            // RETURNED is 0, anything else ends this frame's code.
+          }
+          break;
+        case OpCode::OP_RETURN:
+          a.mov(RDI, vm);
+          a.lea(RSI, s, slot(h));
+          a.call(address(cpplox_return));
+          a.jmp(exit);
+          break;
+        default:
+          step(at, h);
+          // Globals, printing, closures and closing upvalues.
+          break;
+      }
+      h = static_cast<size_t>(static_cast<int>(h) + ir::stack_effect(node));
+    }
+  }
+  static_assert(static_cast<int>(CompiledStatus::RETURNED) == 0);
+
+  a.bind(error);
+  a.mov(RAX, static_cast<uint64_t>(CompiledStatus::RUNTIME_ERROR));
+  a.bind(exit);
+  a.adjust_rsp(8);
+  a.pop(s);
+  a.pop(vm);
+  a.ret();
+
+  return a.finish();
+}
+
+std::optional<std::vector<uint8_t>> assemble(const Trace& trace, const std::vector<TraceOp>& ops) {
+  using Kind = TraceOp::Kind;
+  const Chunk& chunk{*trace.function->chunk};
+  const int32_t index{static_cast<int32_t>(*index_offset)};
+  const size_t entry_height{trace.steps.front().height};
+  constexpr Reg vm{RBX};
+  constexpr Reg s{R12};
+  constexpr size_t registers{14};
+  // Slots below it live in xmm2-xmm15 while they hold numbers, xmm0 and xmm1 are
+  // scratch. Every xmm register is caller-saved, so they're written back to
+  // their slots before calling out and reloaded when needed again.
+
+  struct Exit {
+    Assembler::Label label;
+    std::vector<size_t> dirty;
+    // Slots whose registers are newer than their memory.
+    uint32_t offset;
+    size_t height;
+  };
+
+  Assembler a{};
+  const Assembler::Label error{a.label()};
+  const Assembler::Label done{a.label()};
+  const Assembler::Label loop{a.label()};
+  std::vector<Exit> exits{};
+  std::vector<bool> in_register(registers, false);
+  std::vector<bool> dirty(registers, false);
+  std::vector<bool> loop_carried(registers, false);
+  // Locals held in registers from one iteration to the next: the ones guarded
+  // before LOOP_START.
+  bool looping{false};
+
+  a.push(vm);
+  a.push(s);
+  a.adjust_rsp(-8);
+  a.mov(vm, RDI);
+  a.call(address(cpplox_slots));
+  a.mov(s, RAX);
+
+  const auto xmm = [](size_t value) { return static_cast<uint8_t>(value + 2); };
+  const auto exit_label = [&](const TraceOp& op) {
+    Exit exit{a.label(), {}, op.offset, op.height};
+    for (size_t value = 0; value < std::min(registers, exit.height); value++) {
+      if (dirty[value]) exit.dirty.push_back(value);
+    }
+    exits.push_back(std::move(exit));
+    return exits.back().label;
+  };
+  const auto write_back = [&](size_t value, uint8_t from) {
+    a.store_sd(s, slot(value), from);
+    a.store_byte(s, slot(value) + index, 0);
+  };
+  const auto call_out = [&](size_t height) {
+    for (size_t value = 0; value < std::min(registers, height); value++) {
+      if (dirty[value]) write_back(value, xmm(value));
+    }
+    std::fill(in_register.begin(), in_register.end(), false);
+    std::fill(dirty.begin(), dirty.end(), false);
+    // Slots at and above height are dead.
+  };
+  const auto number = [&](size_t value, uint8_t scratch) {
+    // Register holding the number in value, loaded if needed.
+    if (value >= registers) {
+      a.load_sd(scratch, s, slot(value));
+      return scratch;
+    }
+    if (!in_register[value]) {
+      a.load_sd(xmm(value), s, slot(value));
+      in_register[value] = true;
+    }
+    return xmm(value);
+  };
+  const auto set_number = [&](size_t value, uint8_t from) {
+    if (value >= registers) {
+      write_back(value, from);
+      return;
+    }
+    if (from != xmm(value)) a.movsd(xmm(value), from);
+    in_register[value] = dirty[value] = true;
+  };
+  const auto set_memory = [&](size_t value) {
+    // value is about to be written in memory.
+    if (value < registers) in_register[value] = dirty[value] = false;
+  };
+  const auto step = [&](const uint8_t* ip, size_t height, const void* slow_path) {
+    call_out(height);
+    a.mov(RDI, vm);
+    a.lea(RSI, s, slot(height));
+    a.mov(RDX, reinterpret_cast<uint64_t>(ip));
+    a.call(slow_path);
+    a.test_al();
+    a.jump_if(EQUAL, error);
+  };
+
+  for (const TraceOp& op : ops) {
+    switch (op.kind) {
+      case Kind::NUMBER:
+        a.mov(RAX, std::bit_cast<uint64_t>(op.number));
+        if (op.a < registers) {
+          a.movq(xmm(op.a), RAX);
+          in_register[op.a] = dirty[op.a] = true;
+        } else {
+          a.store(s, slot(op.a), RAX);
+          a.store_byte(s, slot(op.a) + index, 0);
+        }
+        break;
+      case Kind::BOOL:
+        set_memory(op.a);
+        a.store_byte(s, slot(op.a), op.flag);
+        a.store_byte(s, slot(op.a) + index, 1);
+        break;
+      case Kind::NIL:
+        set_memory(op.a);
+        a.store_byte(s, slot(op.a) + index, 2);
+        break;
+      case Kind::CONSTANT:
+        set_memory(op.a);
+        a.mov(RCX, reinterpret_cast<uint64_t>(chunk.constants.data() + op.b));
+        for (int32_t word = 0; word < value_size; word += 8) {
+          a.load(RAX, RCX, word);
+          a.store(s, slot(op.a) + word, RAX);
+        }
+        break;
+      case Kind::MOVE:
+        if (op.flag || (op.b < registers && in_register[op.b])) {
+          set_number(op.a, number(op.b, 0));
+          break;
+        }
+        set_memory(op.a);
+        for (int32_t word = 0; word < value_size; word += 8) {
+          a.load(RAX, s, slot(op.b) + word);
+          a.store(s, slot(op.a) + word, RAX);
+        }
+        break;
+      case Kind::GUARD_NUMBER:
+        if (op.a < registers && in_register[op.a]) break;
+        a.cmp_byte(s, slot(op.a) + index, 0);
+        a.jump_if(NOT_EQUAL, exit_label(op));
+        break;
+      case Kind::ARITHMETIC: {
+        const uint8_t lhs{number(op.a, 0)};
+        const uint8_t rhs{number(op.b, 1)};
+        switch (op.op) {
+          case OpCode::OP_ADD:
+          case OpCode::OP_ADD_NN:
+            a.sse(ADDSD, lhs, rhs);
+            break;
+          case OpCode::OP_SUBTRACT:
+          case OpCode::OP_SUBTRACT_NN:
+            a.sse(SUBSD, lhs, rhs);
+            break;
+          case OpCode::OP_MULTIPLY:
+          case OpCode::OP_MULTIPLY_NN:
+            a.sse(MULSD, lhs, rhs);
+            break;
+          default:
+            a.sse(DIVSD, lhs, rhs);
+            break;
+        }
+        set_number(op.a, lhs);
+        break;
+      }
+      case Kind::NEGATE: {
+        const uint8_t value{number(op.a, 0)};
+        a.movq(RAX, value);
+        a.mov(RCX, uint64_t{1} << 63);
+        a.xor_(RAX, RCX);
+        a.movq(value, RAX);
+        set_number(op.a, value);
+        break;
+      }
+      case Kind::COMPARE:
+      case Kind::BRANCH_COMPARE: {
+        const uint8_t lhs{number(op.a, 0)};
+        const uint8_t rhs{number(op.b, 1)};
+        if (op.op == OpCode::OP_GREATER || op.op == OpCode::OP_GREATER_NN) {
+          a.ucomisd(lhs, rhs);
+        } else {
+          a.ucomisd(rhs, lhs);
+        }
+        if (op.kind == Kind::BRANCH_COMPARE) {
+          a.jump_if(op.flag ? BELOW_EQUAL : ABOVE, exit_label(op));
+          break;
+        }
+        a.set(ABOVE);
+        set_memory(op.a);
+        a.store_al(s, slot(op.a));
+        a.store_byte(s, slot(op.a) + index, 1);
+        break;
+      }
+      case Kind::BRANCH:
+        if (op.a < registers && in_register[op.a]) {
+          if (!op.flag) a.jmp(exit_label(op));
+          break;
+          // Numbers are truthy.
+        }
+        jump_if_falsey(a, s, op.a, op.flag, exit_label(op));
+        break;
+      case Kind::NOT_CALLEE:
+        call_out(op.height);
+        a.lea(RDI, s, slot(op.a));
+        a.mov(RSI, reinterpret_cast<uint64_t>(chunk.constants.data() + op.b));
+        a.call(address(cpplox_not_callee));
+        a.test_al();
+        a.jump_if(op.flag ? EQUAL : NOT_EQUAL, exit_label(op));
+        break;
+      case Kind::CALL:
+        a.mov(RCX, op.b);
+        step(chunk.code.data() + op.offset + chunk.instruction_size(op.offset), op.height, address(cpplox_call));
+        break;
+      case Kind::STEP:
+        step(chunk.code.data() + op.offset, op.height, address(cpplox_step));
+        break;
+      case Kind::LOOP_START:
+        for (size_t value = 0; value < registers; value++) {
+          if (!loop_carried[value]) continue;
+          a.load_sd(xmm(value), s, slot(value));
+          in_register[value] = dirty[value] = true;
+          // Counted as dirty everywhere, the back edge needn't know which
+          // iteration wrote them.
+        }
+        a.bind(loop);
+        break;
+      case Kind::LOOP:
+        for (size_t value = 0; value < registers; value++) {
+          if (loop_carried[value]) {
+            number(value, 0);
+            dirty[value] = true;
+          } else if (dirty[value] && value < entry_height) {
+            write_back(value, xmm(value));
+          }
+        }
+        a.jmp(loop);
+        break;
+    }
+    if (op.kind == Kind::GUARD_NUMBER && !looping && op.a < registers) loop_carried[op.a] = true;
+    if (op.kind == Kind::LOOP_START) looping = true;
+  }
+
+  for (const Exit& exit : exits) {
+    a.bind(exit.label);
+    for (size_t value : exit.dirty) write_back(value, xmm(value));
+    a.mov(RDI, vm);
+    a.lea(RSI, s, slot(exit.height));
+    a.mov(RDX, reinterpret_cast<uint64_t>(chunk.code.data() + exit.offset));
+    a.call(address(cpplox_resume));
+    a.mov(RAX, 1);
+    a.jmp(done);
+  }
+  a.bind(error);
+  a.mov(RAX, 0);
+  a.bind(done);
+  a.adjust_rsp(8);
+  a.pop(s);
+  a.pop(vm);
+  a.ret();
+
+  return a.finish();
+}
+}  // namespace
+
+}  // namespace cpplox
@@ -1,19 +1,36 @@
 #include <iostream>
+#include <memory>
+#include <type_traits>
 
 #include "cpplox/Bytecode/common.h"
 #include "cpplox/Bytecode/LoxObject.h"
 
 
 namespace cpplox {
-  Value* RuntimeUpvalue::value() {
-    if (auto* loc = std::get_if<OpenLocator>(&val)) {
-      assert(loc->index < loc->stack.size());
-      return &loc->stack[loc->index];
-    } else {
-      return &std::get<ClosedLocator>(val);
-    } 
+  static_assert(alignof(upvalue_ptr) <= alignof(Closure) && sizeof(Closure) % alignof(upvalue_ptr) == 0,
+                "Closure's trailing upvalues must be correctly aligned.");
+  static_assert(std::is_trivially_destructible_v<upvalue_ptr>,
+                "Closure does not destroy its trailing upvalues.");
+
+  LoopTrace& Function::loop_at(uint32_t header) const {
+    for (LoopTrace& loop : loops) {
+      if (loop.header == header) return loop;
+    }
+    return loops.emplace_back(LoopTrace{header});
+    // Few loops per function, a linear search beats hashing.
+  }
+
+  std::unique_ptr<Closure> Closure::create(function_ptr function) {
+    return std::unique_ptr<Closure>(new (function->upvalue_count) Closure(function));
   }
 
+  Closure::Closure(function_ptr function) : function{function} {
+    std::uninitialized_default_construct_n(upvalues(), function->upvalue_count);
+  }
+
+  void* Closure::operator new(size_t size, int upvalue_count) {
+    return ::operator new(size + upvalue_count * sizeof(upvalue_ptr));
+  }
   // TODO: Test those.
   template<>
   void trace_references(const std::string* str, gc_heap* heap) {
@@ -44,11 +61,12 @@ namespace cpplox {
 
   template<>
   void trace_references(RuntimeUpvalue* upvalue, gc_heap* heap) {
-    // TODO: Take this as const RuntimeUpvalue once read-only access is added.
   #ifdef DEBUG_LOG_GC
-    std::cout << "[trace_references]: RuntimeUpvalue " << to_string(*upvalue->value()) << std::endl;
+    std::cout << "[trace_references]: RuntimeUpvalue "
+              << (upvalue->is_open() ? "open" : to_string(upvalue->closed)) << std::endl;
   #endif
-    
+    std::visit(GCValueMarkingVisitor(heap), upvalue->closed);
+    // Open upvalues point into VM's stack, which is marked as a root on its own.
   }
 
   template<>
@@ -57,10 +75,12 @@ namespace cpplox {
     std::cout << "[trace_references]: Closure for <fn " << *closure->function->name << ">" << std::endl;
   #endif
 
-    trace_references(closure->function.get(), heap);
-    const auto vmv {GCValueMarkingVisitor(heap)};
-    for (const auto uv : closure->upvalues) {
-      std::visit(vmv, *uv->value());
+    heap->mark(closure->function);
+    for (int i = 0; i < closure->upvalue_count(); i++) {
+      if (closure->upvalues()[i].get() != nullptr) {
+        heap->mark(closure->upvalues()[i]);
+      }
+      // Null while OP_CLOSURE is still capturing, which can allocate and trigger collection.
     }
   }
 } //namespace cpplox
\ No newline at end of file
@@ -0,0 +1,290 @@
+#include "cpplox/Bytecode/Peephole.h"
+
+#include <algorithm>
+#include <limits>
+#include <optional>
+
+namespace cpplox {
+
+namespace {
+bool is_jump(OpCode op) {
+  return op == OpCode::OP_JUMP || op == OpCode::OP_LOOP || op == OpCode::OP_JUMP_IF_FALSE ||
+         op == OpCode::OP_JUMP_IF_TRUE || op == OpCode::OP_JUMP_IF_NOT_CALLEE;
+}
+
+bool is_unconditional_jump(OpCode op) {
+  return op == OpCode::OP_JUMP || op == OpCode::OP_LOOP;
+  // Only differ in direction, encode picks the right one for the final offsets.
+}
+
+bool ends_flow(OpCode op) {
+  return is_unconditional_jump(op) || op == OpCode::OP_RETURN;
+}
+
+bool is_pure_push(OpCode op) {
+  switch (op) {
+    case OpCode::OP_CONSTANT:
+    case OpCode::OP_NIL:
+    case OpCode::OP_TRUE:
+    case OpCode::OP_FALSE:
+    case OpCode::OP_GET_LOCAL:
+    case OpCode::OP_GET_UPVALUE:
+      return true;
+    default:
+      return false;
+  }
+  // OP_GET_GLOBAL is not pure, it reports undefined variables.
+}
+
+std::optional<OpCode> getter_for(OpCode setter) {
+  switch (setter) {
+    case OpCode::OP_SET_LOCAL:
+      return OpCode::OP_GET_LOCAL;
+    case OpCode::OP_SET_UPVALUE:
+      return OpCode::OP_GET_UPVALUE;
+    case OpCode::OP_SET_GLOBAL:
+      return OpCode::OP_GET_GLOBAL;
+    default:
+      return std::nullopt;
+  }
+}
+
+bool tests_top(OpCode op) {
+  return op == OpCode::OP_JUMP_IF_FALSE || op == OpCode::OP_JUMP_IF_TRUE;
+}
+
+OpCode inverted(OpCode conditional_jump) {
+  return conditional_jump == OpCode::OP_JUMP_IF_FALSE ? OpCode::OP_JUMP_IF_TRUE
+                                                      : OpCode::OP_JUMP_IF_FALSE;
+}
+}  // namespace
+
+void PeepholeOptimizer::optimize(Chunk& chunk) const {
+  for (size_t offset = 0; offset < chunk.code.size(); offset += chunk.instruction_size(offset)) {
+    if (is_wide(static_cast<OpCode>(chunk.code[offset]))) return;
+  }
+  // Only needed by huge or machine-generated functions, which are left as compiled.
+  std::vector<Instruction> instructions{decode(chunk)};
+  bool changed{true};
+  while (changed) {
+    changed = false;
+    for (const auto pass : {&PeepholeOptimizer::thread_jumps, &PeepholeOptimizer::rewrite_patterns,
+                            &PeepholeOptimizer::remove_unreachable}) {
+      if ((this->*pass)(instructions)) {
+        compact(instructions);
+        changed = true;
+      }
+    }
+    // One rewrite can expose another, eg. removing unreachable code can leave a
+    // jump to the next instruction. Every pass shrinks or simplifies code, so this
+    // terminates.
+  }
+  encode(instructions, chunk);
+}
+
+std::vector<PeepholeOptimizer::Instruction> PeepholeOptimizer::decode(const Chunk& chunk) const {
+  std::vector<Instruction> instructions{};
+  std::vector<size_t> index_at(chunk.code.size() + 1, 0);
+  for (size_t offset = 0; offset < chunk.code.size();) {
+    const size_t size{chunk.instruction_size(offset)};
+    index_at[offset] = instructions.size();
+    instructions.push_back(
+        {.op = static_cast<OpCode>(chunk.code[offset]),
+         .operands = std::vector<uint8_t>(chunk.code.begin() + offset + 1, chunk.code.begin() + offset + size),
+         .line = chunk.lines.line_at(offset)});
+    offset += size;
+  }
+  index_at[chunk.code.size()] = instructions.size();
+
+  size_t offset{0};
+  for (Instruction& instr : instructions) {
+    const size_t next_offset{offset + 1 + instr.operands.size()};
+    if (is_jump(instr.op)) {
+      const size_t jump_dist = static_cast<size_t>(instr.operands[0] << 8) | instr.operands[1];
+      instr.target = index_at[instr.op == OpCode::OP_LOOP ? next_offset - jump_dist : next_offset + jump_dist];
+    }
+    offset = next_offset;
+  }
+  return instructions;
+}
+
+bool PeepholeOptimizer::encode(const std::vector<Instruction>& instructions, Chunk& chunk) const {
+  std::vector<size_t> offsets(instructions.size() + 1, 0);
+  for (size_t i = 0; i < instructions.size(); i++) {
+    offsets[i + 1] = offsets[i] + 1 + instructions[i].operands.size();
+  }
+
+  std::vector<uint8_t> code{};
+  LineTable lines{};
+  code.reserve(offsets.back());
+  for (size_t i = 0; i < instructions.size(); i++) {
+    const Instruction& instr{instructions[i]};
+    OpCode op{instr.op};
+    std::vector<uint8_t> operands{instr.operands};
+    if (is_jump(op)) {
+      const size_t next_offset{offsets[i + 1]};
+      const size_t target_offset{offsets[instr.target]};
+      if (is_unconditional_jump(op)) {
+        op = target_offset < next_offset ? OpCode::OP_LOOP : OpCode::OP_JUMP;
+      } else if (target_offset < next_offset) {
+        return false;
+      }
+      const size_t jump_dist{target_offset < next_offset ? next_offset - target_offset
+                                                         : target_offset - next_offset};
+      if (jump_dist > std::numeric_limits<uint16_t>::max()) {
+        return false;
+        // Threading can make a jump longer than the ones compiler checked.
+      }
+      operands[0] = static_cast<uint8_t>((jump_dist >> 8) & 0xff);
+      operands[1] = static_cast<uint8_t>(jump_dist & 0xff);
+      // Offset always comes first, OP_JUMP_IF_NOT_CALLEE has more operands after it.
+    }
+    lines.add(code.size(), instr.line);
+    code.push_back(static_cast<uint8_t>(op));
+    code.insert(code.end(), operands.begin(), operands.end());
+  }
+  chunk.code = std::move(code);
+  chunk.lines = std::move(lines);
+  return true;
+}
+
+bool PeepholeOptimizer::thread_jumps(std::vector<Instruction>& instructions) const {
+  bool changed{false};
+  for (size_t i = 0; i < instructions.size(); i++) {
+    Instruction& jump{instructions[i]};
+    if (!is_jump(jump.op)) continue;
+
+    std::vector<size_t> chain{jump.target};
+    bool is_cycle{false};
+    while (chain.back() < instructions.size()) {
+      const Instruction& landing{instructions[chain.back()]};
+      std::optional<size_t> next_target{};
+      if (is_unconditional_jump(landing.op)) {
+        next_target = landing.target;
+      } else if (tests_top(jump.op) && landing.op == jump.op) {
+        next_target = landing.target;
+        // Conditional jumps don't pop the tested value, so landing on the same kind
+        // of conditional jump means it will be taken as well...
+      } else if (tests_top(jump.op) && landing.op == inverted(jump.op)) {
+        next_target = chain.back() + 1;
+        // ...and landing on the inverted one means it won't.
+      }
+      if (!next_target) break;
+      if (!is_unconditional_jump(jump.op) && *next_target <= i) break;
+      // Conditional jumps can only move forward.
+      if (std::find(chain.begin(), chain.end(), *next_target) != chain.end()) {
+        is_cycle = true;
+        break;
+        // Jumps into an empty infinite loop are left alone.
+      }
+      chain.push_back(*next_target);
+    }
+    if (!is_cycle && chain.back() != jump.target) {
+      jump.target = chain.back();
+      changed = true;
+    }
+
+    if (is_unconditional_jump(jump.op) && jump.target < instructions.size() &&
+        instructions[jump.target].op == OpCode::OP_RETURN) {
+      jump = {.op = OpCode::OP_RETURN, .line = jump.line};
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+bool PeepholeOptimizer::rewrite_patterns(std::vector<Instruction>& instructions) const {
+  std::vector<bool> is_target(instructions.size() + 1, false);
+  for (const Instruction& instr : instructions) {
+    if (is_jump(instr.op)) is_target[instr.target] = true;
+  }
+  auto fits = [&](size_t i, size_t length) {
+    if (i + length > instructions.size()) return false;
+    return std::none_of(is_target.begin() + i + 1, is_target.begin() + i + length, [](bool b) { return b; });
+  };
+  // A pattern can only be rewritten if execution can enter it at the first
+  // instruction alone. Jumps to the first instruction are fine: they land on
+  // whatever replaces the pattern.
+
+  bool changed{false};
+  for (size_t i = 0; i < instructions.size(); i++) {
+    Instruction& instr{instructions[i]};
+    if (is_jump(instr.op) && instr.target == i + 1) {
+      instr.removed = true;
+      changed = true;
+      // Jumping to the next instruction, conditional jumps don't pop either.
+    } else if (is_pure_push(instr.op) && fits(i, 2) && instructions[i + 1].op == OpCode::OP_POP) {
+      instr.removed = true;
+      instructions[i + 1].removed = true;
+      changed = true;
+      i += 1;
+    } else if (const std::optional<OpCode> getter = getter_for(instr.op);
+               getter && fits(i, 3) && instructions[i + 1].op == OpCode::OP_POP &&
+               instructions[i + 2].op == *getter && instructions[i + 2].operands == instr.operands) {
+      instructions[i + 1].removed = true;
+      instructions[i + 2].removed = true;
+      changed = true;
+      i += 2;
+      // Setters leave the assigned value on the stack, no need to reload it.
+    } else if (instr.op == OpCode::OP_NOT && fits(i, 2) && i + 2 < instructions.size()) {
+      Instruction& jump{instructions[i + 1]};
+      if ((jump.op == OpCode::OP_JUMP_IF_FALSE || jump.op == OpCode::OP_JUMP_IF_TRUE) &&
+          jump.target < instructions.size() && instructions[jump.target].op == OpCode::OP_POP &&
+          instructions[i + 2].op == OpCode::OP_POP) {
+        instr.removed = true;
+        jump.op = inverted(jump.op);
+        changed = true;
+        i += 1;
+        // Both paths pop the tested value right away, so it doesn't matter that
+        // it is no longer negated.
+      }
+    } else if ((instr.op == OpCode::OP_JUMP_IF_FALSE || instr.op == OpCode::OP_JUMP_IF_TRUE) &&
+               instr.target == i + 2 && fits(i, 2) && is_unconditional_jump(instructions[i + 1].op) &&
+               instructions[i + 1].target > i) {
+      instr.op = inverted(instr.op);
+      instr.target = instructions[i + 1].target;
+      instructions[i + 1].removed = true;
+      changed = true;
+      i += 1;
+      // Conditional jump over an unconditional one, as emitted for "or".
+    }
+  }
+  return changed;
+}
+
+bool PeepholeOptimizer::remove_unreachable(std::vector<Instruction>& instructions) const {
+  std::vector<bool> reachable(instructions.size(), false);
+  std::vector<size_t> worklist{0};
+  while (!worklist.empty()) {
+    const size_t i{worklist.back()};
+    worklist.pop_back();
+    if (i >= instructions.size() || reachable[i]) continue;
+    reachable[i] = true;
+    if (is_jump(instructions[i].op)) worklist.push_back(instructions[i].target);
+    if (!ends_flow(instructions[i].op)) worklist.push_back(i + 1);
+  }
+
+  bool changed{false};
+  for (size_t i = 0; i < instructions.size(); i++) {
+    if (!reachable[i]) {
+      instructions[i].removed = true;
+      changed = true;
+    }
+  }
+  return changed;
+}
+
+void PeepholeOptimizer::compact(std::vector<Instruction>& instructions) const {
+  std::vector<size_t> new_index(instructions.size() + 1, 0);
+  for (size_t i = 0; i < instructions.size(); i++) {
+    new_index[i + 1] = new_index[i] + (instructions[i].removed ? 0 : 1);
+  }
+  // Number of kept instructions before each one: new position of a kept
+  // instruction and of the first kept one after a removed instruction.
+  for (Instruction& instr : instructions) {
+    if (is_jump(instr.op)) instr.target = new_index[instr.target];
+  }
+  std::erase_if(instructions, [](const Instruction& instr) { return instr.removed; });
+}
+
+}  // namespace cpplox
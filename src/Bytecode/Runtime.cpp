@@ -0,0 +1,94 @@
+#include "cpplox/Bytecode/Runtime.h"
+
+#include <limits>
+#include <memory>
+
+#include "cpplox/Treewalk/Scanner.h"
+#include "cpplox/Bytecode/Value.h"
+
+namespace cpplox {
+
+namespace {
+CompilerOptions sharing_globals(CompilerOptions options) {
+  options.whole_program = false;
+  return options;
+}
+// Functions of other scripts assign to the same globals.
+}  // namespace
+
+Runtime::Runtime(std::ostream& output, const CompilerOptions& options)
+    : options{sharing_globals(options)},
+      vm{output, disassembler, e_reporter, &heap, &pool, log_output, Jit::supported() ? &jit : nullptr},
+      host{heap.make<Function>(0, 0, pool.insert_or_get("host"), std::make_unique<Chunk>())} {
+  heap.register_root_marking_callback([this] { mark_roots(); });
+}
+
+Runtime::~Runtime() {
+  heap.deregister_root_marking_callback();
+  // Registered after VM's, which goes with vm.
+}
+
+std::optional<Runtime::Script> Runtime::compile(const std::string& source) {
+  e_reporter.clear();
+  const std::vector<const Token> tokens{clox::Scanner{source, e_reporter}.tokenize()};
+  if (e_reporter.has_error()) return std::nullopt;
+  Compiler compiler{tokens, disassembler, e_reporter, &heap, &pool, options};
+  const std::optional<function_ptr> function = compiler.compile();
+  if (e_reporter.has_error() || !function) return std::nullopt;
+
+  std::unordered_map<std::string, function_ptr>& functions{scripts.emplace_back()};
+  for (const function_ptr declared : compiler.global_functions()) functions.insert_or_assign(*declared->name, declared);
+  if (vm.interpret(*function) != InterpretResult::INTERPRET_OK) {
+    scripts.pop_back();
+    return std::nullopt;
+  }
+  return Script{scripts.size() - 1};
+}
+
+std::optional<HostValue> Runtime::call(Script script, const std::string& function,
+                                       std::span<const HostValue> args) {
+  e_reporter.clear();
+  const std::unordered_map<std::string, function_ptr>& functions{scripts.at(script.index)};
+  const auto callee = functions.find(function);
+  if (callee == functions.end()) {
+    e_reporter.set_error("[Runtime error] Script declares no function " + function + ".");
+    return std::nullopt;
+  }
+  if (args.size() > std::numeric_limits<uint8_t>::max()) {
+    e_reporter.set_error("[Runtime error] Can't call " + function + " with more than 255 arguments.");
+    return std::nullopt;
+  }
+
+  vm.enter(host);
+  in_flight.assign(1, callee->second);
+  for (const HostValue& arg : args) in_flight.push_back(to_vm(arg));
+  const std::optional<Value> result{vm.call_value(in_flight[0], std::span<const Value>{in_flight}.subspan(1))};
+  in_flight.clear();
+  if (!result) return std::nullopt;
+
+  if (const double* number = std::get_if<double>(&*result)) return *number;
+  if (const bool* flag = std::get_if<bool>(&*result)) return *flag;
+  if (std::holds_alternative<std::monostate>(*result)) return std::monostate{};
+  if (const const_string_ptr* str = std::get_if<const_string_ptr>(&*result)) return std::string{**str};
+  e_reporter.set_error("[Runtime error] " + function + " returned " + to_string(*result) +
+                       ", functions can't be passed to the host.");
+  return std::nullopt;
+}
+
+Value Runtime::to_vm(const HostValue& v) {
+  if (const double* number = std::get_if<double>(&v)) return *number;
+  if (const bool* flag = std::get_if<bool>(&v)) return *flag;
+  if (const std::string* str = std::get_if<std::string>(&v)) return pool.insert_or_get(*str);
+  return std::monostate{};
+}
+
+void Runtime::mark_roots() {
+  const GCValueMarkingVisitor marker{&heap};
+  marker(host);
+  for (const auto& functions : scripts) {
+    for (const auto& [name, function] : functions) marker(function);
+  }
+  for (const Value& v : in_flight) std::visit(marker, v);
+}
+
+}  // namespace cpplox
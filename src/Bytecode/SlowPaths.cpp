@@ -0,0 +1,56 @@
+#include "cpplox/Bytecode/SlowPaths.h"
+
+#include "cpplox/Bytecode/VM.h"
+
+using namespace cpplox;
+
+Value* cpplox_slots(VM* vm) {
+  return vm->frame().slots;
+}
+
+bool cpplox_step(VM* vm, Value* top, const uint8_t* ip) {
+  vm->top() = top;
+  return vm->step(ip);
+}
+
+bool cpplox_call(VM* vm, Value* top, const uint8_t* return_ip, uint64_t arg_count) {
+  vm->top()      = top;
+  vm->frame().ip = return_ip;
+  return vm->compiled_call(static_cast<uint8_t>(arg_count));
+}
+
+CompiledStatus cpplox_tail_call(VM* vm, Value* top, const uint8_t* return_ip, uint64_t arg_count) {
+  vm->top()      = top;
+  vm->frame().ip = return_ip;
+  return vm->compiled_tail_call(static_cast<uint8_t>(arg_count));
+}
+
+CompiledStatus cpplox_return(VM* vm, Value* top) {
+  vm->top() = top;
+  return vm->compiled_return();
+}
+
+void cpplox_equal(Value* lhs) {
+  lhs[0] = lhs[0] == lhs[1];
+}
+
+void cpplox_not(VM* vm, Value* value) {
+  *value = vm->is_falsey(*value);
+}
+
+bool cpplox_not_callee(const Value* callee, const Value* inlined) {
+  return *callee != *inlined;
+}
+
+void cpplox_get_upvalue(VM* vm, Value* destination, uint64_t index) {
+  *destination = *vm->frame().upvalues[index]->location;
+}
+
+void cpplox_set_upvalue(VM* vm, const Value* source, uint64_t index) {
+  *vm->frame().upvalues[index]->location = *source;
+}
+
+void cpplox_resume(VM* vm, Value* top, const uint8_t* ip) {
+  vm->top()      = top;
+  vm->frame().ip = ip;
+}
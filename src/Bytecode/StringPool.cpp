@@ -4,6 +4,11 @@
 
 namespace cpplox {
 const_string_ptr StringPool::insert_or_get(std::string_view sv) {
+  if (shared) {
+    if (const std::optional<const_string_ptr> ptr = shared->find(sv)) {
+      return *ptr;
+    }
+  }
   auto iter = ptr_by_content.find(sv);
   if (iter != ptr_by_content.end()) {
     return iter->second;
@@ -13,4 +18,18 @@ const_string_ptr StringPool::insert_or_get(std::string_view sv) {
   return ptr;
 };
 
+std::optional<const_string_ptr> StringPool::find(std::string_view sv) const {
+  const auto iter = ptr_by_content.find(sv);
+  if (iter == ptr_by_content.end()) {
+    return std::nullopt;
+  }
+  return iter->second;
+}
+
+void StringPool::mark_strings() const {
+  for (const auto& [content, ptr] : ptr_by_content) {
+    heap->mark(ptr);
+  }
+}
+
 }; // namespace cpplox
\ No newline at end of file
@@ -0,0 +1,351 @@
+#include "cpplox/Bytecode/Tracer.h"
+
+#include <algorithm>
+#include <variant>
+
+#include "cpplox/Bytecode/VM.h"
+
+namespace cpplox {
+
+TraceRecorder::Status TraceRecorder::record(const CallFrame& frame, size_t frame_depth, const Value* top) {
+  if (frame_depth > loop_depth) return Status::RECORDING;
+  // Callees run as part of the call that got there.
+  if (frame_depth < loop_depth || frame.function != trace.function) return Status::ABORTED;
+  // The loop's frame returned or a tail call replaced it.
+  const Chunk& chunk{*trace.function->chunk};
+  const size_t offset{static_cast<size_t>(frame.ip - 1 - chunk.code.data())};
+  const OpCode op{static_cast<OpCode>(chunk.code[offset])};
+  if (trace.steps.empty() && offset != trace.header) return Status::ABORTED;
+  if (trace.steps.size() == max_steps || is_wide(op) || op == OpCode::OP_RETURN || op == OpCode::OP_TAIL_CALL) {
+    return Status::ABORTED;
+  }
+
+  TraceStep step{static_cast<uint32_t>(offset), static_cast<uint16_t>(top - frame.slots)};
+  const auto type = [](const Value& value) { return static_cast<uint8_t>(value.index()); };
+  switch (op) {
+    case OpCode::OP_GET_LOCAL:
+      step.types[0] = type(frame.slots[chunk.code[offset + 1]]);
+      break;
+    case OpCode::OP_ADD:
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_GREATER:
+    case OpCode::OP_LESS:
+      step.types = {type(top[-2]), type(top[-1])};
+      break;
+    case OpCode::OP_NEGATE:
+    case OpCode::OP_JUMP_IF_FALSE:
+    case OpCode::OP_JUMP_IF_TRUE:
+      step.types[0] = type(top[-1]);
+      break;
+    default:
+      break;
+  }
+  trace.steps.push_back(step);
+  if (op == OpCode::OP_LOOP && chunk.jump_target(offset) == trace.header) return Status::DONE;
+  return Status::RECORDING;
+  // Other back edges are recorded like any other jump: a for loop's increment
+  // jumps back to its condition, inner loops get unrolled.
+}
+
+namespace {
+constexpr uint8_t number_type{0};
+static_assert(std::is_same_v<std::variant_alternative_t<number_type, Value>, double>);
+
+enum class Type : uint8_t { UNKNOWN, NUMBER, BOOL, NIL, OTHER };
+
+struct Known {
+  // What the optimizer knows about a stack slot at a point of the trace.
+  Type type{Type::UNKNOWN};
+  bool constant{false};
+  double number{0};
+  bool boolean{false};
+};
+
+struct Specialised {
+  std::vector<TraceOp> ops{};
+  std::vector<bool> live_in_guards{};
+  // Locals guarded before the iteration wrote them, ie. guards on what the
+  // previous iteration left behind.
+  std::vector<Known> back_edge{};
+  // Slots when jumping back to the header.
+};
+
+bool is_arithmetic(OpCode op) {
+  switch (op) {
+    case OpCode::OP_ADD:
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_GREATER:
+    case OpCode::OP_LESS:
+    case OpCode::OP_ADD_NN:
+    case OpCode::OP_SUBTRACT_NN:
+    case OpCode::OP_MULTIPLY_NN:
+    case OpCode::OP_DIVIDE_NN:
+    case OpCode::OP_GREATER_NN:
+    case OpCode::OP_LESS_NN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool is_checked(OpCode op) {
+  return static_cast<uint8_t>(op) < static_cast<uint8_t>(OpCode::OP_ADD_NN);
+}
+
+bool is_comparison(OpCode op) {
+  return op == OpCode::OP_GREATER || op == OpCode::OP_LESS || op == OpCode::OP_GREATER_NN
+         || op == OpCode::OP_LESS_NN;
+}
+
+Known fold(OpCode op, double lhs, double rhs) {
+  switch (op) {
+    case OpCode::OP_ADD:
+    case OpCode::OP_ADD_NN:
+      return {Type::NUMBER, true, lhs + rhs};
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_SUBTRACT_NN:
+      return {Type::NUMBER, true, lhs - rhs};
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_MULTIPLY_NN:
+      return {Type::NUMBER, true, lhs * rhs};
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_DIVIDE_NN:
+      return {Type::NUMBER, true, lhs / rhs};
+    case OpCode::OP_GREATER:
+    case OpCode::OP_GREATER_NN:
+      return {Type::BOOL, true, 0, lhs > rhs};
+    default:
+      return {Type::BOOL, true, 0, lhs < rhs};
+  }
+}
+
+std::optional<bool> truthiness(const Known& value) {
+  switch (value.type) {
+    case Type::NUMBER:
+    case Type::OTHER:
+      return true;
+    case Type::NIL:
+      return false;
+    case Type::BOOL:
+      return value.constant ? std::optional<bool>{value.boolean} : std::nullopt;
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<Specialised> specialise(const Trace& trace, const std::vector<bool>& numbers) {
+  // One pass over the steps, assuming the locals in numbers hold numbers when
+  // an iteration starts.
+  using Kind = TraceOp::Kind;
+  const Chunk& chunk{*trace.function->chunk};
+  const std::vector<TraceStep>& steps{trace.steps};
+  const uint16_t entry_height{steps.front().height};
+  const TraceStep& back_edge{steps.back()};
+  if (static_cast<OpCode>(chunk.code[back_edge.offset]) != OpCode::OP_LOOP || back_edge.height != entry_height) {
+    return std::nullopt;
+  }
+  uint16_t max_height{0};
+  for (const TraceStep& step : steps) max_height = std::max(max_height, step.height);
+
+  Specialised result{{}, std::vector<bool>(entry_height, false), {}};
+  std::vector<TraceOp>& ops{result.ops};
+  std::vector<Known> known(static_cast<size_t>(max_height) + VM::FRAME_SLOTS);
+  // Room for every local an instruction's operand can name.
+  std::vector<bool> written(known.size(), false);
+  const auto write = [&](uint16_t slot, Known value) {
+    known[slot]   = value;
+    written[slot] = true;
+  };
+  const auto guard = [&](uint16_t slot, const TraceStep& step) {
+    if (known[slot].type == Type::NUMBER) return;
+    ops.push_back({.kind = Kind::GUARD_NUMBER, .a = slot, .offset = step.offset, .height = step.height});
+    known[slot].type = Type::NUMBER;
+    if (slot < entry_height && !written[slot]) result.live_in_guards[slot] = true;
+  };
+  const auto move = [&](uint16_t to, uint16_t from) {
+    ops.push_back({.kind = Kind::MOVE, .a = to, .b = from, .flag = known[from].type == Type::NUMBER});
+    write(to, known[from]);
+  };
+
+  for (uint16_t slot = 0; slot < entry_height; slot++) {
+    if (!numbers[slot]) continue;
+    ops.push_back({.kind = Kind::GUARD_NUMBER, .a = slot, .offset = trace.header, .height = entry_height});
+    known[slot].type = Type::NUMBER;
+  }
+  ops.push_back({.kind = Kind::LOOP_START});
+
+  for (size_t i = 0; i + 1 < steps.size(); i++) {
+    const TraceStep& step{steps[i]};
+    const TraceStep& next{steps[i + 1]};
+    const uint16_t h{step.height};
+    const OpCode op{static_cast<OpCode>(chunk.code[step.offset])};
+    const uint8_t operand{chunk.code[step.offset + 1]};
+    // Of single byte operand instructions.
+    switch (op) {
+      case OpCode::OP_CONSTANT:
+        if (const double* number = std::get_if<double>(&chunk.constants[operand])) {
+          ops.push_back({.kind = Kind::NUMBER, .a = h, .number = *number});
+          write(h, {Type::NUMBER, true, *number});
+        } else {
+          ops.push_back({.kind = Kind::CONSTANT, .a = h, .b = operand});
+          write(h, {Type::OTHER});
+        }
+        break;
+      case OpCode::OP_NIL:
+        ops.push_back({.kind = Kind::NIL, .a = h});
+        write(h, {Type::NIL, true});
+        break;
+      case OpCode::OP_TRUE:
+      case OpCode::OP_FALSE:
+        ops.push_back({.kind = Kind::BOOL, .a = h, .flag = op == OpCode::OP_TRUE});
+        write(h, {Type::BOOL, true, 0, op == OpCode::OP_TRUE});
+        break;
+      case OpCode::OP_POP:
+      case OpCode::OP_NOOP:
+      case OpCode::OP_JUMP:
+      case OpCode::OP_LOOP:
+        break;
+      case OpCode::OP_GET_LOCAL:
+        if (step.types[0] == number_type) guard(operand, step);
+        move(h, operand);
+        break;
+      case OpCode::OP_SET_LOCAL:
+        move(operand, h - 1);
+        break;
+      case OpCode::OP_INLINED_RETURN:
+        move(h - 1 - operand, h - 1);
+        break;
+      case OpCode::OP_NEGATE:
+        if (step.types[0] != number_type) {
+          ops.push_back({.kind = Kind::STEP, .offset = step.offset, .height = h});
+          known[h - 1] = {};
+          break;
+        }
+        guard(h - 1, step);
+        if (known[h - 1].constant) {
+          ops.push_back({.kind = Kind::NUMBER, .a = static_cast<uint16_t>(h - 1), .number = -known[h - 1].number});
+          write(h - 1, {Type::NUMBER, true, -known[h - 1].number});
+        } else {
+          ops.push_back({.kind = Kind::NEGATE, .a = static_cast<uint16_t>(h - 1)});
+          write(h - 1, {Type::NUMBER});
+        }
+        break;
+      case OpCode::OP_JUMP_IF_FALSE:
+      case OpCode::OP_JUMP_IF_TRUE: {
+        const bool taken{next.offset == chunk.jump_target(step.offset)};
+        if (!taken && next.offset != step.offset + chunk.instruction_size(step.offset)) return std::nullopt;
+        const bool truthy{(op == OpCode::OP_JUMP_IF_TRUE) == taken};
+        const uint16_t value{static_cast<uint16_t>(h - 1)};
+        if (const std::optional<bool> known_truthy{truthiness(known[value])}) {
+          if (*known_truthy != truthy) return std::nullopt;
+          break;
+          // Goes the recorded way whenever the trace gets here.
+        }
+        if (!ops.empty() && ops.back().kind == Kind::COMPARE && ops.back().a == value
+            && static_cast<OpCode>(chunk.code[next.offset]) == OpCode::OP_POP) {
+          ops.back().kind = Kind::BRANCH_COMPARE;
+          ops.back().flag = truthy;
+          known[value]    = {};
+          // The condition is popped right away, so it needn't be stored: exits
+          // redo the comparison, whose operands are still in place.
+        } else {
+          ops.push_back({.kind = Kind::BRANCH, .a = value, .flag = truthy, .offset = step.offset, .height = h});
+        }
+        break;
+      }
+      case OpCode::OP_JUMP_IF_NOT_CALLEE:
+        ops.push_back({.kind   = Kind::NOT_CALLEE,
+                       .a      = static_cast<uint16_t>(h - 1 - chunk.code[step.offset + 3]),
+                       .b      = chunk.code[step.offset + 4],
+                       .flag   = next.offset == chunk.jump_target(step.offset),
+                       .offset = step.offset,
+                       .height = h});
+        break;
+      case OpCode::OP_CALL:
+        ops.push_back({.kind = Kind::CALL, .b = operand, .offset = step.offset, .height = h});
+        std::fill(known.begin(), known.end(), Known{});
+        std::fill(written.begin(), written.end(), true);
+        // Callees may write any local through upvalues.
+        break;
+      default:
+        if (is_arithmetic(op)) {
+          const uint16_t lhs{static_cast<uint16_t>(h - 2)};
+          const uint16_t rhs{static_cast<uint16_t>(h - 1)};
+          if (is_checked(op)) {
+            if (step.types[0] != number_type || step.types[1] != number_type) {
+              ops.push_back({.kind = Kind::STEP, .offset = step.offset, .height = h});
+              known[lhs] = {};
+              break;
+              // Strings or errors, left to the interpreter.
+            }
+            guard(lhs, step);
+            guard(rhs, step);
+          }
+          known[lhs].type = known[rhs].type = Type::NUMBER;
+          if (known[lhs].constant && known[rhs].constant) {
+            const Known folded{fold(op, known[lhs].number, known[rhs].number)};
+            if (folded.type == Type::NUMBER) {
+              ops.push_back({.kind = Kind::NUMBER, .a = lhs, .number = folded.number});
+            } else {
+              ops.push_back({.kind = Kind::BOOL, .a = lhs, .flag = folded.boolean});
+            }
+            write(lhs, folded);
+            break;
+          }
+          const bool comparison{is_comparison(op)};
+          ops.push_back({.kind   = comparison ? Kind::COMPARE : Kind::ARITHMETIC,
+                         .op     = op,
+                         .a      = lhs,
+                         .b      = rhs,
+                         .offset = step.offset,
+                         .height = h});
+          write(lhs, {comparison ? Type::BOOL : Type::NUMBER});
+          break;
+        }
+        ops.push_back({.kind = Kind::STEP, .offset = step.offset, .height = h});
+        for (size_t slot = next.height > 0 ? next.height - 1u : 0; slot < known.size(); slot++) known[slot] = {};
+        // Globals, upvalues, printing, closures, OP_EQUAL and OP_NOT: only what
+        // they leave on top of the stack changes.
+        break;
+    }
+  }
+
+  for (uint16_t slot = 0; slot < entry_height; slot++) {
+    if (numbers[slot] && known[slot].type == Type::UNKNOWN) {
+      ops.push_back({.kind = Kind::GUARD_NUMBER, .a = slot, .offset = back_edge.offset, .height = entry_height});
+      known[slot].type = Type::NUMBER;
+    }
+  }
+  ops.push_back({.kind = Kind::LOOP});
+  result.back_edge = std::move(known);
+  return result;
+}
+}  // namespace
+
+std::optional<std::vector<TraceOp>> Trace::optimize() const {
+  if (steps.empty()) return std::nullopt;
+  const std::optional<Specialised> first{specialise(*this, std::vector<bool>(steps.front().height, false))};
+  if (!first) return std::nullopt;
+  std::vector<bool> numbers{first->live_in_guards};
+  // Start out assuming every local guarded on entry stays a number, and drop
+  // those an iteration turns into something else until that holds.
+  for (;;) {
+    std::optional<Specialised> pass{specialise(*this, numbers)};
+    if (!pass) return std::nullopt;
+    bool changed{false};
+    for (size_t slot = 0; slot < numbers.size(); slot++) {
+      const Type type{pass->back_edge[slot].type};
+      if (numbers[slot] && type != Type::NUMBER && type != Type::UNKNOWN) {
+        numbers[slot] = false;
+        changed       = true;
+      }
+    }
+    if (!changed) return std::move(pass->ops);
+  }
+}
+
+}  // namespace cpplox
@@ -2,23 +2,22 @@
 
 #include "cpplox/Bytecode/VM.h"
 #include "cpplox/Bytecode/Compiler.h"
+#include "cpplox/Bytecode/Jit.h"
 #include "cpplox/Bytecode/common.h"
 
 namespace cpplox {
 
   InterpretResult VM::interpret(function_ptr in_func) {
-    if (already_called) {
-      throw std::logic_error(
-        "VM not designed to be called multiple times, create a new instance.");
-    }
-    stack.push_back(heap->make<Closure>(in_func));
+    reset_stack();
+    push(in_func);
     call(0);
-    already_called = true;
 
   #ifdef DEBUG_TRACE_EXECUTION
     log_output << "=== execution ===" << std::endl;
   #endif
-    InterpretResult ret = run();
+    InterpretResult ret = !enter_compiled() ? InterpretResult::INTERPRET_RUNTIME_ERROR
+                          : frame_count == 0 ? InterpretResult::INTERPRET_OK
+                                             : run<false>(0);
   #ifdef DEBUG_TRACE_EXECUTION
     log_output << "==/ execution /==" << std::endl;
   #endif
@@ -26,34 +25,105 @@ namespace cpplox {
     return ret;
   }
 
-  InterpretResult VM::run() {
-  #define READ_CODE() (curr_fun->chunk->code[curr_frame->ip++])
+  void VM::enter(function_ptr script) {
+    reset_stack();
+    push(script);
+    curr_frame = &frames[frame_count++];
+    curr_frame->function = script.get();
+    curr_frame->upvalues = nullptr;
+    curr_frame->ip = script->chunk->code.data();
+    curr_frame->slots = stack;
+    // Not through call: a frame code runs on top of mustn't get hot and compiled,
+    // enter_compiled would run it once the callee returned.
+  }
+
+  std::optional<Value> VM::call_value(Value callee, std::span<const Value> args, std::optional<int> line) {
+    assert(frame_count == 1 && args.size() <= std::numeric_limits<uint8_t>::max());
+    push(callee);
+    for (const Value& arg : args) push(arg);
+    host_line = line;
+    const bool ok {call(static_cast<uint8_t>(args.size())) && enter_compiled() &&
+                   (frame_count == 1 || run<false>(1) == InterpretResult::INTERPRET_OK)};
+    host_line.reset();
+    if (!ok) return std::nullopt;
+    return pop();
+    // Callee's result took its slot above the script's.
+  }
+
+  InterpretResult VM::resume(size_t offset) {
+    assert(frame_count == 1 && stack_top == stack + 1);
+    curr_frame->ip = curr_frame->function->chunk->code.data() + offset;
+    return run<false>(0);
+  }
+
+  Value* VM::global(const_string_ptr name) {
+    const auto iter {globals.find(name)};
+    return iter == globals.end() ? nullptr : &iter->second;
+  }
+
+  template <bool single_step>
+  InterpretResult VM::run(size_t exit_depth) {
+  #define READ_CODE() (*curr_frame->ip++)
   #define READ_UINT16()                                                  \
-    (static_cast<uint16_t>(READ_CODE()) << 8 |                           \
-    static_cast<uint16_t>(READ_CODE()));
+    (curr_frame->ip += 2,                                                \
+    static_cast<uint16_t>(curr_frame->ip[-2] << 8 | curr_frame->ip[-1]))
+  #define READ_UINT24()                                                  \
+    (curr_frame->ip += 3,                                                \
+    static_cast<uint32_t>(curr_frame->ip[-3] << 16 | curr_frame->ip[-2] << 8 | curr_frame->ip[-1]))
+  #define READ_INDEX()                                                   \
+    (is_wide(opcode) ? READ_UINT24() : READ_CODE())
+  // Constant index operand of an instruction sharing its case with its _LONG variant.
   #define BINARY_OP(op)                                                  \
     do {                                                                 \
-      if (!std::holds_alternative<double>(*(stack.end() - 1)) ||         \
-          !std::holds_alternative<double>(*(stack.end() - 2))) {         \
+      if (!std::holds_alternative<double>(peek(0)) ||                    \
+          !std::holds_alternative<double>(peek(1))) {                    \
         set_runtime_error("Operands must be numbers.");                  \
         return InterpretResult::INTERPRET_RUNTIME_ERROR;                 \
       }                                                                  \
-      double rhs = std::get<double>(stack.back());                       \
-      stack.pop_back();                                                  \
-      stack.back() = Value(std::get<double>(stack.back()) op rhs);       \
+      double rhs = std::get<double>(pop());                              \
+      peek() = Value(std::get<double>(peek()) op rhs);                   \
     } while (false)
+  #define UNCHECKED_BINARY_OP(op)                                        \
+    do {                                                                 \
+      double rhs = *std::get_if<double>(&peek(0));                       \
+      pop();                                                             \
+      peek() = Value(*std::get_if<double>(&peek()) op rhs);              \
+    } while (false)
+  // For the _NN opcodes, IROptimizer emits them only where both operands are
+  // known to be numbers.
 
-    while (1) {
+    do {
       OpCode opcode{READ_CODE()};
 
   #ifdef DEBUG_TRACE_EXECUTION
       trace_execution();
   #endif
+      if (!single_step && recorder) record_step();
 
       switch (opcode) {
         case OpCode::OP_JUMP_IF_FALSE: {
           uint16_t offset = READ_UINT16();
-          if (is_falsey(stack.back())) curr_frame->ip += offset;
+          if (is_falsey(peek())) curr_frame->ip += offset;
+          break;
+        }
+        case OpCode::OP_JUMP_IF_TRUE: {
+          uint16_t offset = READ_UINT16();
+          if (!is_falsey(peek())) curr_frame->ip += offset;
+          break;
+        }
+        case OpCode::OP_JUMP_IF_NOT_CALLEE: {
+          uint16_t offset = READ_UINT16();
+          const uint8_t arg_count = READ_CODE();
+          if (peek(arg_count) != curr_frame->function->chunk->constants[READ_CODE()]) curr_frame->ip += offset;
+          // Falls through into the inlined body only if the call would run the
+          // function that was inlined, otherwise jumps to the regular OP_CALL.
+          break;
+        }
+        case OpCode::OP_INLINED_RETURN: {
+          const uint8_t dropped = READ_CODE();
+          *(stack_top - 1 - dropped) = peek();
+          stack_top -= dropped;
+          // Same as OP_RETURN, minus the frame: the result takes the callee's slot.
           break;
         }
         case OpCode::OP_JUMP: {
@@ -64,49 +134,60 @@ namespace cpplox {
         case OpCode::OP_LOOP: {
           uint16_t offset = READ_UINT16();
           curr_frame->ip += -offset;
+          if (!single_step && jit && !enter_trace()) return InterpretResult::INTERPRET_RUNTIME_ERROR;
+          break;
+        }
+        case OpCode::OP_JUMP_IF_FALSE_LONG: {
+          uint32_t offset = READ_UINT24();
+          if (is_falsey(peek())) curr_frame->ip += offset;
+          break;
+        }
+        case OpCode::OP_JUMP_IF_TRUE_LONG: {
+          uint32_t offset = READ_UINT24();
+          if (!is_falsey(peek())) curr_frame->ip += offset;
+          break;
+        }
+        case OpCode::OP_JUMP_LONG: {
+          uint32_t offset = READ_UINT24();
+          curr_frame->ip += offset;
+          break;
+        }
+        case OpCode::OP_LOOP_LONG: {
+          uint32_t offset = READ_UINT24();
+          curr_frame->ip -= offset;
+          if (!single_step && jit && !enter_trace()) return InterpretResult::INTERPRET_RUNTIME_ERROR;
           break;
         }
         case OpCode::OP_PRINT:
-          output << to_string(stack.back()) << std::endl;
-          stack.pop_back();
+          output << to_string(peek()) << std::endl;
+          pop();
           break;
         case OpCode::OP_RETURN: {
-          close_upvalues(curr_frame->stack_offset + 1);
-          if (call_frames.size() == 1) {
-            call_frames.pop_back();
-            assert(stack.size() == 2);
-            // This is top-level function and stack contains return value & main script.
-            stack.clear();
-            return InterpretResult::INTERPRET_OK;
-          }
-          stack[curr_frame->stack_offset] = stack.back();
-          stack.erase(stack.begin() + curr_frame->stack_offset + 1, stack.end());
-          // Instead of: capture return value in a local variable, .erase() to clean function's
-          // stack window and then .push_back() to store the return value, writing directly to the 
-          // base of current closure's stack window. This is done to ensure return value is always
-          // reachable from stack to prevent GC from collecting it. +1 to keep return value.
-          call_frames.pop_back();
-          update_frame_pointers();
+          pop_frame();
+          if (frame_count == exit_depth) return InterpretResult::INTERPRET_OK;
           break;
         }
         case OpCode::OP_CONSTANT:
-          stack.push_back(curr_fun->chunk->constants[READ_CODE()]);
+          push(curr_frame->function->chunk->constants[READ_CODE()]);
+          break;
+        case OpCode::OP_CONSTANT_LONG:
+          push(curr_frame->function->chunk->constants[READ_UINT24()]);
           break;
         case OpCode::OP_NIL:
-          stack.push_back(std::monostate());
+          push(std::monostate());
           break;
         case OpCode::OP_TRUE:
-          stack.push_back(true);
+          push(true);
           break;
         case OpCode::OP_FALSE:
-          stack.push_back(false);
+          push(false);
           break;
         case OpCode::OP_POP:
-          stack.pop_back();
+          pop();
           break;
         case OpCode::OP_CLOSE_UPVALUE: {
-          close_upvalues(stack.size()-1);
-          stack.pop_back();
+          close_upvalues(&peek());
+          pop();
           // TODO: Think through GC - is this GC safe?
           break;
         }
@@ -115,13 +196,24 @@ namespace cpplox {
           break;
         case OpCode::OP_CALL: {
           uint8_t arg_count = READ_CODE();
-          if (!call(arg_count)) {
+          if (!call(arg_count) || !enter_compiled()) {
+            return InterpretResult::INTERPRET_RUNTIME_ERROR;
+          }
+          if (frame_count == exit_depth) return InterpretResult::INTERPRET_OK;
+          // Compiled callee took over this frame through a tail call and returned.
+          break;
+        }
+        case OpCode::OP_TAIL_CALL: {
+          uint8_t arg_count = READ_CODE();
+          if (!tail_call(arg_count) || !enter_compiled()) {
             return InterpretResult::INTERPRET_RUNTIME_ERROR;
           }
+          if (frame_count == exit_depth) return InterpretResult::INTERPRET_OK;
           break;
         }
-        case OpCode::OP_CLOSURE: {
-          const Value maybe_function_ptr = curr_fun->chunk->constants[READ_CODE()];
+        case OpCode::OP_CLOSURE:
+        case OpCode::OP_CLOSURE_LONG: {
+          const Value maybe_function_ptr = curr_frame->function->chunk->constants[READ_INDEX()];
           if (!std::holds_alternative<function_ptr>(maybe_function_ptr)) {
             set_runtime_error("Closure creation error, expected function");
             return InterpretResult::INTERPRET_RUNTIME_ERROR;
@@ -129,27 +221,33 @@ namespace cpplox {
           // TODO: Make naming better? function is in fact function_ptr.
           //       Same with closure.
           const function_ptr function = std::get<function_ptr>(maybe_function_ptr);
-          const closure_ptr closure = heap->make<Closure>(function);
-          stack.push_back(closure);
-          for (uint8_t i = 0; i < function->upvalue_count; i++) {
+          if (function->upvalue_count == 0) {
+            push(function);
+            break;
+            // Nothing to capture, so the Function is callable as is and no Closure is allocated.
+          }
+          const closure_ptr closure = heap->manage(Closure::create(function));
+          push(closure);
+          upvalue_ptr* upvalues = closure->upvalues();
+          for (int i = 0; i < function->upvalue_count; i++) {
             bool is_local = static_cast<bool>(READ_CODE());
-            uint8_t index = READ_CODE();
+            uint16_t index = opcode == OpCode::OP_CLOSURE_LONG ? READ_UINT16() : READ_CODE();
             if (is_local) {
-              closure->upvalues.push_back(add_or_get_upvalue(curr_frame->stack_offset + index));
+              upvalues[i] = add_or_get_upvalue(curr_frame->slots + index);
               // Closing over local variable in enclosing (=currently executing) function.
             } else {
-              closure->upvalues.push_back(curr_frame->closure.upvalues[index]);
+              upvalues[i] = curr_frame->upvalues[index];
               // Storing a pointer to an upvalue already captured by enclosing (=currently executing) function.
             }
           }
           break;
         }
         case OpCode::OP_GET_UPVALUE: {
-          stack.push_back(*curr_frame->closure.upvalues[READ_CODE()]->value());
+          push(*curr_frame->upvalues[READ_CODE()]->location);
           break;
         }
         case OpCode::OP_SET_UPVALUE: {
-          *curr_frame->closure.upvalues[READ_CODE()]->value() = stack.back();
+          *curr_frame->upvalues[READ_CODE()]->location = peek();
           // TODO: Once GC is done -- verity this does not leak memory.
 
           // No .pop_back() as assignment is an expression and has to produce a
@@ -157,25 +255,38 @@ namespace cpplox {
           break;
         }
         case OpCode::OP_GET_LOCAL: {
-          size_t idx = READ_CODE() + curr_frame->stack_offset;
-          assert(idx < stack.size());
-          stack.push_back(stack[idx]);
+          Value* slot = curr_frame->slots + READ_CODE();
+          assert(slot < stack_top);
+          push(*slot);
           // This VM is stack-based and other instructions can only take data from
           // stack top. Register-based VM could fetch data directly by idx at the
           // cost of larger instructions.
           break;
         }
         case OpCode::OP_SET_LOCAL: {
-          size_t idx = READ_CODE() + curr_frame->stack_offset;
-          assert(idx < stack.size());
-          stack[idx] = stack.back();
+          Value* slot = curr_frame->slots + READ_CODE();
+          assert(slot < stack_top);
+          *slot = peek();
           // No .pop_back() as assignment is an expression and has to produce a
           // value. In this case is the assigned value itself, eg. > print a = 8;
           // prints "8".
           break;
         }
-        case OpCode::OP_GET_GLOBAL: {
-          const Value maybe_var_name_ptr = curr_fun->chunk->constants[READ_CODE()]; 
+        case OpCode::OP_GET_LOCAL_LONG: {
+          Value* slot = curr_frame->slots + READ_UINT16();
+          assert(slot < stack_top);
+          push(*slot);
+          break;
+        }
+        case OpCode::OP_SET_LOCAL_LONG: {
+          Value* slot = curr_frame->slots + READ_UINT16();
+          assert(slot < stack_top);
+          *slot = peek();
+          break;
+        }
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_GET_GLOBAL_LONG: {
+          const Value maybe_var_name_ptr = curr_frame->function->chunk->constants[READ_INDEX()]; 
           if (!std::holds_alternative<const_string_ptr>(maybe_var_name_ptr)) {
             set_runtime_error("Global variable name loading error, expected string");
             return InterpretResult::INTERPRET_RUNTIME_ERROR;
@@ -186,22 +297,24 @@ namespace cpplox {
             set_runtime_error("Undefined variable '" + *var_name_ptr + "'.");
             return InterpretResult::INTERPRET_RUNTIME_ERROR;
           }
-          stack.push_back(iter->second);
+          push(iter->second);
           break;
         }
-        case OpCode::OP_DEFINE_GLOBAL: {
-          const Value maybe_var_name_ptr = curr_fun->chunk->constants[READ_CODE()];
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_DEFINE_GLOBAL_LONG: {
+          const Value maybe_var_name_ptr = curr_frame->function->chunk->constants[READ_INDEX()];
           if (!std::holds_alternative<const_string_ptr>(maybe_var_name_ptr)) {
             set_runtime_error("Global variable name loading error, expected string");
             return InterpretResult::INTERPRET_RUNTIME_ERROR;
           }
           globals.insert_or_assign(std::get<const_string_ptr>(maybe_var_name_ptr),
-                                  stack.back());
-          stack.pop_back();
+                                  peek());
+          pop();
           break;
         }
-        case OpCode::OP_SET_GLOBAL: {
-          const Value maybe_var_name_ptr = curr_fun->chunk->constants[READ_CODE()];
+        case OpCode::OP_SET_GLOBAL:
+        case OpCode::OP_SET_GLOBAL_LONG: {
+          const Value maybe_var_name_ptr = curr_frame->function->chunk->constants[READ_INDEX()];
           if (!std::holds_alternative<const_string_ptr>(maybe_var_name_ptr)) {
             set_runtime_error("Global variable name loading error, expected string");
             return InterpretResult::INTERPRET_RUNTIME_ERROR;
@@ -212,7 +325,7 @@ namespace cpplox {
             set_runtime_error("Undefined variable '" + *var_name_ptr + "'.");
             return InterpretResult::INTERPRET_RUNTIME_ERROR;
           }
-          globals[var_name_ptr] = stack.back();
+          globals[var_name_ptr] = peek();
           // No .pop_back() as assignment is an expression and has to produce a
           // value. In this case is the assigned value itself, eg. > print a = 8;
           // prints "8".
@@ -220,9 +333,9 @@ namespace cpplox {
         }
         case OpCode::OP_EQUAL: {
           // As with OP_RETURN - ensuring values remain alive to avoid GC collection.
-          Value res {(*(stack.cend() - 2) == *(stack.cend() - 1))};
-          stack.pop_back();
-          stack.back() = res;
+          Value res {peek(1) == peek(0)};
+          pop();
+          peek() = res;
           break;
         }
         case OpCode::OP_GREATER:
@@ -233,12 +346,12 @@ namespace cpplox {
           break;
         case OpCode::OP_ADD: {
           // As with OP_RETURN - ensuring values remain alive to avoid GC collection.
-          const Value rhs = *(stack.cend() - 1);
-          const Value lhs = *(stack.cend() - 2);
+          const Value rhs = peek(0);
+          const Value lhs = peek(1);
           if (type_match<const_string_ptr>(lhs, rhs)) {
             Value res {pool->insert_or_get(*std::get<const_string_ptr>(lhs) + *std::get<const_string_ptr>(rhs))};
-            stack.pop_back();
-            stack.back() = res;
+            pop();
+            peek() = res;
           } else if (type_match<double>(lhs, rhs)) {
             BINARY_OP(+);
           } else {
@@ -256,23 +369,45 @@ namespace cpplox {
         case OpCode::OP_DIVIDE:
           BINARY_OP(/);
           break;
+        case OpCode::OP_ADD_NN:
+          UNCHECKED_BINARY_OP(+);
+          break;
+        case OpCode::OP_SUBTRACT_NN:
+          UNCHECKED_BINARY_OP(-);
+          break;
+        case OpCode::OP_MULTIPLY_NN:
+          UNCHECKED_BINARY_OP(*);
+          break;
+        case OpCode::OP_DIVIDE_NN:
+          UNCHECKED_BINARY_OP(/);
+          break;
+        case OpCode::OP_GREATER_NN:
+          UNCHECKED_BINARY_OP(>);
+          break;
+        case OpCode::OP_LESS_NN:
+          UNCHECKED_BINARY_OP(<);
+          break;
         case OpCode::OP_NOT:
-          stack.back() = is_falsey(stack.back());
+          peek() = is_falsey(peek());
           break;
         case OpCode::OP_NEGATE:
-          if (!std::holds_alternative<double>(stack.back())) {
+          if (!std::holds_alternative<double>(peek())) {
             set_runtime_error("Operand must be a number.");
             return InterpretResult::INTERPRET_RUNTIME_ERROR;
           }
-          stack.back() = -std::get<double>(stack.back());
+          peek() = -std::get<double>(peek());
           break;
         default:
           return InterpretResult::INTERPRET_RUNTIME_ERROR;
       }
-    }
+    } while (!single_step);
+    return InterpretResult::INTERPRET_OK;
 
+  #undef UNCHECKED_BINARY_OP
   #undef BINARY_OP
   #undef READ_UINT16
+  #undef READ_UINT24
+  #undef READ_INDEX
   #undef READ_CODE
   }
 
@@ -282,8 +417,8 @@ namespace cpplox {
     std::cout << "[VM] Marking stack" << std::endl;
     #endif
       const auto vmv {GCValueMarkingVisitor(heap)};
-      for (const Value v : stack) {
-        std::visit(vmv, v);
+      for (const Value* slot = stack; slot < stack_top; slot++) {
+        std::visit(vmv, *slot);
       }
     #ifdef DEBUG_LOG_GC
     std::cout << "[VM] Marking globals" << std::endl;
@@ -294,21 +429,20 @@ namespace cpplox {
         std::visit(vmv, v);
       }
     #ifdef DEBUG_LOG_GC
-    std::cout << "[VM] Marking call_frames" << std::endl;
+    std::cout << "[VM] Marking frames" << std::endl;
     #endif
-      for (const auto& cf : call_frames) {
-        heap->mark(cf.closure.function);
-        for (const auto uv : cf.closure.upvalues) {
-          std::visit(vmv, *uv->value());
+      for (size_t f = 0; f < frame_count; f++) {
+        const CallFrame& cf {frames[f]};
+        for (int i = 0; cf.upvalues != nullptr && i < cf.function->upvalue_count; i++) {
+          heap->mark(cf.upvalues[i]);
         }
-        // TODO: Brittle, better to keep gc_ptrs in call_frames and just
-        // mark entire closure.
+        // Frame's callee itself is kept alive by its stack slot, marked above.
       }
     #ifdef DEBUG_LOG_GC
     std::cout << "[VM] Marking open upvalues" << std::endl;
     #endif
-      for(const auto uv : open_upvalues) {
-        std::visit(vmv, *uv->value());
+      for (upvalue_ptr uv = open_upvalues; uv.get() != nullptr; uv = uv->next) {
+        heap->mark(uv);
       }
       // TODO: In what cases anything that the closure owns is not reachable via stack?
       // Do closures need to be marked?
@@ -318,57 +452,138 @@ namespace cpplox {
     });
   }
 
-  const upvalue_ptr VM::add_or_get_upvalue(size_t stack_index) {
-    const auto iter = std::find_if(open_upvalues.crbegin(), open_upvalues.crend(), [&](const upvalue_ptr p){
-      return p->stack_index() == stack_index;
-    });
-    // TODO: Early stop manual search? Or a way to efficiently do this in STL.
+  const upvalue_ptr VM::add_or_get_upvalue(Value* local) {
+    upvalue_ptr prev{};
+    upvalue_ptr curr{open_upvalues};
+    while (curr.get() != nullptr && curr->location > local) {
+      prev = curr;
+      curr = curr->next;
+    }
+    // List is sorted by decreasing slot, so the walk stops at the first upvalue
+    // at or below local: either the one to reuse or the insertion point.
+    if (curr.get() != nullptr && curr->location == local) {
+      return curr;
+    }
 
-    if (iter != open_upvalues.crend()) {
-      return *iter;
+    const upvalue_ptr created {heap->make<RuntimeUpvalue>(local)};
+    created->next = curr;
+    if (prev.get() == nullptr) {
+      open_upvalues = created;
     } else {
-      const auto insertion_iter = std::find_if(open_upvalues.begin(), open_upvalues.end(), [&](const upvalue_ptr p){
-        return p->stack_index() > stack_index;
-      });
-      // TODO: Is this predicate correct? Print values to ensure correct order. Also consider unrolling into my own search.
-
-      const auto ret {heap->make<RuntimeUpvalue>(stack, stack_index)};
-      open_upvalues.insert(insertion_iter, ret);
-      return ret;
+      prev->next = created;
     }
+    return created;
   }
 
-  void VM::close_upvalues(size_t last) {
-    while (!open_upvalues.empty() && open_upvalues.back()->stack_index() >= last) {
-      open_upvalues.back()->close();
-      open_upvalues.pop_back();
+  void VM::close_upvalues(const Value* last) {
+    while (open_upvalues.get() != nullptr && open_upvalues->location >= last) {
+      open_upvalues->close();
+      open_upvalues = open_upvalues->next;
     }
   }
 
-  bool VM::call(uint8_t arg_count) {
-    if (call_frames.size() >= MAX_CALLSTACK_DEPTH) {
-      set_runtime_error("Stackoverflow.");
-      return false;
+  void VM::pop_frame() {
+    close_upvalues(curr_frame->slots + 1);
+    if (frame_count == 1) {
+      frame_count--;
+      assert(stack_top == stack + 2);
+      // This is top-level function and stack contains return value & main script.
+      stack_top = stack;
+      return;
     }
+    *curr_frame->slots = peek();
+    stack_top = curr_frame->slots + 1;
+    // Instead of capturing return value in a local variable and pushing it after
+    // discarding function's stack window, writing directly to the base of the window.
+    // This is done to ensure return value is always reachable from stack to prevent
+    // GC from collecting it. +1 to keep return value.
+    frame_count--;
+    curr_frame = &frames[frame_count - 1];
+  }
 
-    size_t callable_idx {stack.size() - 1 - arg_count};
-    if (const auto* p = std::get_if<closure_ptr>(&stack[callable_idx])) {
-      const Closure& c {**p};
-      if (arg_count != c.function->arity) {
-        set_runtime_error("Function " + *c.function->name + " expected " +
-                          std::to_string(c.function->arity) + " parameters," + 
-                          " but got " + std::to_string(arg_count) + ".");
-        return false;
-      }
-      call_frames.emplace_back(c, 0, callable_idx);
-      update_frame_pointers();
-      return true;
-    } else if (const auto* p = std::get_if<native_function_ptr>(&stack[callable_idx])) {
-      Value ret {(*p)->func(arg_count, stack)};
-      stack.erase(stack.end() - 1 - arg_count, stack.end());
+  void VM::reset_stack() {
+    close_upvalues(stack);
+    stack_top   = stack;
+    frame_count = 0;
+    recorder.reset();
+  }
+
+  bool VM::enter_compiled() {
+    while (frame_count > 0 && curr_frame->function->compiled &&
+           curr_frame->ip == curr_frame->function->chunk->code.data()) {
+      // A frame still at its first instruction was just entered by a call. Other
+      // frames are midway through their function, eg. the caller of a native.
+      const CompiledStatus status {curr_frame->function->compiled(*this)};
+      if (status != CompiledStatus::TAIL_CALLED) return status == CompiledStatus::RETURNED;
+    }
+    return true;
+  }
+
+  bool VM::enter_trace() {
+    const Function& function {*curr_frame->function};
+    LoopTrace& loop {function.loop_at(static_cast<uint32_t>(curr_frame->ip - function.chunk->code.data()))};
+    if (loop.entry && recorder && recorder->depth() == frame_count) {
+      const Trace& trace {recorder->recorded()};
+      jit->compile(trace.function->loop_at(trace.header), nullptr);
+      recorder.reset();
+      // An inner loop that already has a trace: the outer one stays interpreted.
+    }
+    if (loop.entry) return loop.entry(*this);
+    if (!recorder && jit->profile(loop)) recorder.emplace(function, loop.header, frame_count);
+    return true;
+  }
+
+  void VM::record_step() {
+    const TraceRecorder::Status status {recorder->record(*curr_frame, frame_count, stack_top)};
+    if (status == TraceRecorder::Status::RECORDING) return;
+    const Trace& trace {recorder->recorded()};
+    jit->compile(trace.function->loop_at(trace.header), status == TraceRecorder::Status::DONE ? &trace : nullptr);
+    recorder.reset();
+  }
+
+  bool VM::step(const uint8_t* ip) {
+    curr_frame->ip = ip;
+    return run<true>(0) == InterpretResult::INTERPRET_OK;
+  }
+
+  bool VM::compiled_call(uint8_t arg_count) {
+    const size_t depth {frame_count};
+    if (!call(arg_count) || !enter_compiled()) return false;
+    return frame_count == depth || run<false>(depth) == InterpretResult::INTERPRET_OK;
+    // Callees without compiled code are interpreted until they return here.
+  }
+
+  CompiledStatus VM::compiled_tail_call(uint8_t arg_count) {
+    const size_t depth {frame_count};
+    const uint8_t* const caller_ip {curr_frame->ip};
+    if (!tail_call(arg_count)) return CompiledStatus::RUNTIME_ERROR;
+    if (frame_count == depth && curr_frame->ip != caller_ip) return CompiledStatus::TAIL_CALLED;
+    // Replacing the frame restarts it at the callee's first instruction. Natives
+    // leave it alone and tail_call's fallback to a regular call adds a frame.
+    if (!enter_compiled()) return CompiledStatus::RUNTIME_ERROR;
+    if (frame_count == depth || run<false>(depth) == InterpretResult::INTERPRET_OK) {
+      return CompiledStatus::RETURNED;
+    }
+    return CompiledStatus::RUNTIME_ERROR;
+  }
+
+  CompiledStatus VM::compiled_return() {
+    pop_frame();
+    return CompiledStatus::RETURNED;
+  }
+
+  bool VM::call(uint8_t arg_count) {
+    Value& callee {peek(arg_count)};
+    if (const auto* p = std::get_if<closure_ptr>(&callee)) {
+      return call_function(*(*p)->function, (*p)->upvalues(), arg_count);
+    } else if (const auto* p = std::get_if<function_ptr>(&callee)) {
+      return call_function(**p, nullptr, arg_count);
+    } else if (const auto* p = std::get_if<native_function_ptr>(&callee)) {
+      Value ret {(*p)->func(arg_count, std::span<Value>(stack, stack_top))};
+      stack_top -= arg_count + 1;
       p = nullptr;
       // Removing args and native function from stack leaves p dangling, so doing it explicitly.
-      stack.push_back(ret);
+      push(ret);
       return true;
     } else {
       set_runtime_error("Did not receive a callable.");
@@ -376,9 +591,66 @@ namespace cpplox {
     }
   }
 
-  void VM::update_frame_pointers() {
-    curr_frame = &call_frames.back();
-    curr_fun = curr_frame->closure.function.get();
+  bool VM::tail_call(uint8_t arg_count) {
+    const Value callee {peek(arg_count)};
+    const Function* function {nullptr};
+    upvalue_ptr* upvalues {nullptr};
+    if (const auto* p = std::get_if<closure_ptr>(&callee)) {
+      function = (*p)->function.get();
+      upvalues = (*p)->upvalues();
+    } else if (const auto* p = std::get_if<function_ptr>(&callee)) {
+      function = p->get();
+    } else {
+      return call(arg_count);
+      // Natives (and errors) take the regular path, OP_RETURN that follows every
+      // OP_TAIL_CALL then returns native's result.
+    }
+    if (arg_count != function->arity || function->extra_slots > curr_frame->function->extra_slots ||
+        function->chunk->lazy_code) {
+      return call_function(*function, upvalues, arg_count);
+      // Reports the arity error, makes sure a wider callee's frame fits or loads
+      // callee's code.
+    }
+
+    close_upvalues(curr_frame->slots + 1);
+    std::copy(stack_top - 1 - arg_count, stack_top, curr_frame->slots);
+    stack_top = curr_frame->slots + 1 + arg_count;
+    curr_frame->function = function;
+    curr_frame->upvalues = upvalues;
+    curr_frame->ip = function->chunk->code.data();
+    // Caller's locals are dead once its return value is the callee's, so callee
+    // takes over caller's frame and stack window and recursion in tail position
+    // runs in constant space. Caller disappears from runtime error traces.
+    if (jit) jit->profile(*function);
+    return true;
+  }
+
+  bool VM::call_function(const Function& function, upvalue_ptr* upvalues, uint8_t arg_count) {
+    if (arg_count != function.arity) {
+      set_runtime_error("Function " + *function.name + " expected " +
+                        std::to_string(function.arity) + " parameters," +
+                        " but got " + std::to_string(arg_count) + ".");
+      return false;
+    }
+    if (function.chunk->lazy_code && !function.chunk->materialize()) {
+      if (!e_reporter.has_error()) set_runtime_error("Corrupt bytecode in " + *function.name + ".");
+      // Bodies Compiler left for their first call report their own errors.
+      return false;
+    }
+    if (jit) jit->profile(function);
+    Value* slots {stack_top - 1 - arg_count};
+    if (frame_count == frames.size() || slots + FRAME_SLOTS + function.extra_slots > stack + stack_size) {
+      set_runtime_error("Stackoverflow.");
+      return false;
+    }
+    // Stack holds one spare window above the deepest frame, so a frame that
+    // passes this check can't push past the end (see Function::extra_slots).
+    curr_frame = &frames[frame_count++];
+    curr_frame->function = &function;
+    curr_frame->upvalues = upvalues;
+    curr_frame->ip = function.chunk->code.data();
+    curr_frame->slots = slots;
+    return true;
   }
 
   bool VM::is_falsey(Value val) const {
@@ -388,30 +660,42 @@ namespace cpplox {
   }
 
   void VM::set_runtime_error(std::string err_msg) const {
-    for (auto it = call_frames.crbegin(); it != call_frames.crend(); it++) {
+    for (size_t f = frame_count; f > (host_line ? 1 : 0); f--) {
+      const CallFrame& cf {frames[f - 1]};
+      const Chunk& chunk {*cf.function->chunk};
       std::string call_site_line =
-          std::to_string(it->closure.function->chunk->line_numbers[it->ip - 1]);
-      std::cerr << "[line " + call_site_line + "] in " + *it->closure.function->name
+          std::to_string(chunk.lines.line_at(cf.ip - chunk.code.data() - 1));
+      std::cerr << "[line " + call_site_line + "] in " + *cf.function->name
                 << std::endl;
       // TODO: Consider taking this stream as constructor param.
     }
-    int line = curr_fun->chunk->line_numbers[curr_frame->ip];
+    const Chunk& chunk {*curr_frame->function->chunk};
+    int line = host_line && curr_frame == &frames[0] ? *host_line
+                                                     : chunk.lines.line_at(curr_frame->ip - chunk.code.data());
     e_reporter.set_error("[Runtime error] [line " + std::to_string(line) +
                         "] while interpreting: " + err_msg);
   }
 
   void VM::trace_execution() const {
     log_output << "          ";
-    if (stack.size() == 0) {
+    if (stack_top == stack) {
       log_output << "[]";
     } else {
-      for (const auto& val : stack) {
-        log_output << "[ " << to_string(val) << " ]";
+      const Value* slot {stack};
+      if (stack_top - stack > static_cast<std::ptrdiff_t>(FRAME_SLOTS)) {
+        slot = curr_frame->slots;
+        log_output << "[ " << slot - stack << " slots ... ]";
+      }
+      for (; slot < stack_top; slot++) {
+        log_output << "[ " << to_string(*slot) << " ]";
       }
     }
+    // Stacks taller than a frame only show the current frame's window, printing
+    // all of a deep recursion's stack before every instruction is quadratic.
     log_output << std::endl;
     log_output.flush();
-    disassembler.disassemble_instruction(*curr_fun->chunk, curr_frame->ip - 1);
+    const Chunk& chunk {*curr_frame->function->chunk};
+    disassembler.disassemble_instruction(chunk, curr_frame->ip - chunk.code.data() - 1);
   }
 
   template <typename T>
@@ -0,0 +1,294 @@
+#include "cpplox/Bytecode/WarmStart.h"
+
+#include <iostream>
+#include <span>
+
+#include "cpplox/Treewalk/Parser.h"
+#include "cpplox/Treewalk/Resolver.h"
+#include "cpplox/Bytecode/Value.h"
+
+namespace cpplox {
+
+namespace {
+struct Stopped {};
+// Thrown through the tree-walker once an error that is already reported ends the
+// program.
+
+struct Reported : clox::RuntimeException {
+  explicit Reported(int line) : clox::RuntimeException{"", line} {}
+};
+// Thrown through the tree-walker once VM reported an error in a call it made from
+// line. VM traced its own frames, the ones the tree-walker unwinds are left.
+
+constexpr size_t max_walked_depth{64};
+// Past this many nested calls the tree-walker waits for the compiler rather than
+// recursing deeper on the native stack, VM then reports overflows as usual.
+
+const void* object_of(const Value& v) {
+  if (const function_ptr* function = std::get_if<function_ptr>(&v)) return function->get();
+  if (const closure_ptr* closure = std::get_if<closure_ptr>(&v)) return closure->get();
+  if (const native_function_ptr* native = std::get_if<native_function_ptr>(&v)) return native->get();
+  return nullptr;
+}
+}  // namespace
+
+class WarmStart::CompiledCallable : public clox::Callable {
+  // What the tree-walker sees of a function, closure or native of VM. Calling it
+  // runs VM.
+ public:
+  CompiledCallable(WarmStart& session, Value value) : value{value}, session{session} {}
+  ~CompiledCallable() override { session.wrappers.erase(object_of(value)); }
+
+  clox::Value call(clox::Interpreter&, const std::vector<clox::Value>& args) override {
+    return session.call(value, args);
+  }
+  int arity() override {
+    if (const function_ptr* function = std::get_if<function_ptr>(&value)) return (*function)->arity;
+    if (const closure_ptr* closure = std::get_if<closure_ptr>(&value)) return (*closure)->function->arity;
+    return -1;
+    // Natives take any number of arguments.
+  }
+  std::string to_string() override { return cpplox::to_string(value); }
+  std::string name() const {
+    if (const function_ptr* function = std::get_if<function_ptr>(&value)) return *(*function)->name;
+    if (const closure_ptr* closure = std::get_if<closure_ptr>(&value)) return *(*closure)->function->name;
+    return cpplox::to_string(value);
+  }
+
+  const Value value;
+
+ private:
+  WarmStart& session;
+};
+
+WarmStart::WarmStart(std::ostream& output, const Disassembler& disassembler, ErrorReporter& e_reporter,
+                     gc_heap* heap, StringPool* pool, std::ofstream& log_output, Jit* jit,
+                     const CompilerOptions& options, size_t max_callstack_depth)
+    : disassembler{disassembler},
+      e_reporter{e_reporter},
+      heap{heap},
+      pool{pool},
+      options{options},
+      vm{output, disassembler, e_reporter, heap, pool, log_output, jit, max_callstack_depth},
+      interpreter{tree_reporter, output} {
+  for (const auto& [name, v] : vm.all_globals()) {
+    if (std::holds_alternative<native_function_ptr>(v)) interpreter.global_env->define(*name, to_tree(v));
+  }
+  // Replaces the tree-walker's own natives, so both engines print and call the same ones.
+  heap->register_root_marking_callback([this] { mark_roots(); });
+}
+
+WarmStart::~WarmStart() {
+  finish();
+  heap->deregister_root_marking_callback();
+  // Registered after VM's, which goes with vm.
+}
+
+void WarmStart::run(const std::vector<const Token>& tokens) {
+  worker = std::thread{[this, &tokens] {
+    CompilerOptions resumable{options};
+    resumable.resumable = true;
+    Compiler compiler{tokens, disassembler, e_reporter, heap, pool, resumable};
+    script    = compiler.compile();
+    offsets   = compiler.statement_offsets();
+    functions = compiler.global_functions();
+    if (e_reporter.has_error()) script.reset();
+    compiled.store(true, std::memory_order_release);
+  }};
+
+  statements = clox::Parser{tokens, tree_reporter}.parse();
+  if (!tree_reporter.has_error()) clox::Resolver{interpreter, tree_reporter}.resolve(statements);
+  if (tree_reporter.has_error()) {
+    finish();
+    if (script) vm.interpret(*script);
+    return;
+    // The compiler reports the same errors its own way, or the program is one
+    // only the tree-walker rejects.
+  }
+
+  interpreter.before_call = [this] {
+    if (!poll() && interpreter.depth >= max_walked_depth) {
+      finish();
+      poll();
+    }
+  };
+  try {
+    for (size_t i = 0; i < statements.size(); i++) {
+      if (poll() && tree_only.empty() && offsets.size() == statements.size()) {
+        vm.resume(offsets[i]);
+        return;
+      }
+      interpreter.execute(*statements[i]);
+    }
+  } catch (const clox::RuntimeException& e) {
+    report(e);
+  } catch (const Stopped&) {
+  }
+  finish();
+}
+
+std::optional<clox::Value> WarmStart::get(const std::string& name) {
+  if (const auto iter = tree_only.find(name); iter != tree_only.end()) return iter->second;
+  if (const Value* v = vm.global(pool->insert_or_get(name))) return to_tree(*v);
+  return std::nullopt;
+}
+
+bool WarmStart::assign(const std::string& name, const clox::Value& v) {
+  const const_string_ptr key{pool->insert_or_get(name)};
+  if (!tree_only.contains(name) && !vm.global(key)) return false;
+  store(name, key, v);
+  return true;
+}
+
+void WarmStart::define(const std::string& name, const clox::Value& v) {
+  store(name, pool->insert_or_get(name), v);
+}
+
+bool WarmStart::poll() {
+  if (active) return true;
+  if (!compiled.load(std::memory_order_acquire)) return false;
+  finish();
+  if (!script) throw Stopped{};
+  // e_reporter holds the compile errors.
+  activate();
+  return true;
+}
+
+void WarmStart::activate() {
+  vm.enter(*script);
+  std::vector<const clox::FunctionStmt*> declared{};
+  for (const clox::StmtPtr& statement : statements) {
+    if (const auto* function = dynamic_cast<const clox::FunctionStmt*>(statement.get())) {
+      declared.push_back(function);
+    }
+  }
+  if (declared.size() == functions.size()) {
+    for (size_t i = 0; i < declared.size(); i++) {
+      compiled_functions.emplace(declared[i], functions[i]);
+      declarations.emplace(functions[i].get(), declared[i]);
+    }
+  }
+  active = true;
+  interpreter.global_env->bind(this);
+}
+
+void WarmStart::finish() {
+  if (worker.joinable()) worker.join();
+}
+
+clox::Value WarmStart::call(Value callee, const std::vector<clox::Value>& args) {
+  const int line{interpreter.call_line};
+  if (!active) {
+    finish();
+    poll();
+  }
+  // Only natives can be called before VM took over, they wait for the worker: VM's
+  // strings and heap aren't the main thread's until it's done.
+  in_flight.assign(1, callee);
+  for (const clox::Value& arg : args) {
+    const std::optional<Value> converted{tree_only.empty() ? to_vm(arg) : std::nullopt};
+    if (!converted) {
+      in_flight.clear();
+      const function_ptr* function = std::get_if<function_ptr>(&callee);
+      const auto declaration = function ? declarations.find(function->get()) : declarations.end();
+      if (declaration == declarations.end()) {
+        e_reporter.set_error("[Runtime error] Can't pass values of the tree-walking interpreter to compiled " +
+                             cpplox::to_string(callee) + ".");
+        throw Stopped{};
+      }
+      return clox::Function{*declaration->second, interpreter.global_env}.call(interpreter, args);
+      // Top-level functions can still be walked.
+    }
+    in_flight.push_back(*converted);
+  }
+  const std::optional<Value> result{
+      vm.call_value(in_flight[0], std::span<const Value>{in_flight}.subspan(1), line)};
+  in_flight.clear();
+  if (!result) throw Reported{line};
+  return to_tree(*result);
+}
+
+std::optional<Value> WarmStart::to_vm(const clox::Value& v) {
+  if (const double* number = std::get_if<double>(&v)) return Value{*number};
+  if (const bool* flag = std::get_if<bool>(&v)) return Value{*flag};
+  if (std::holds_alternative<std::monostate>(v)) return Value{std::monostate{}};
+  if (const std::string* str = std::get_if<std::string>(&v)) return Value{pool->insert_or_get(*str)};
+
+  const clox::CallableSharedPtr& callable{std::get<clox::CallableSharedPtr>(v)};
+  if (const auto* wrapper = dynamic_cast<const CompiledCallable*>(callable.get())) return wrapper->value;
+  if (const auto* function = dynamic_cast<const clox::Function*>(callable.get())) {
+    const auto iter = compiled_functions.find(&function->get_declaration());
+    if (iter != compiled_functions.end()) return Value{iter->second};
+  }
+  return std::nullopt;
+}
+
+clox::Value WarmStart::to_tree(Value v) {
+  if (const double* number = std::get_if<double>(&v)) return *number;
+  if (const bool* flag = std::get_if<bool>(&v)) return *flag;
+  if (std::holds_alternative<std::monostate>(v)) return std::monostate{};
+  if (const const_string_ptr* str = std::get_if<const_string_ptr>(&v)) return std::string{**str};
+
+  Wrapper& wrapper{wrappers[object_of(v)]};
+  if (const std::shared_ptr<CompiledCallable> callable = wrapper.callable.lock()) {
+    return clox::CallableSharedPtr{callable};
+  }
+  const std::shared_ptr<CompiledCallable> callable{std::make_shared<CompiledCallable>(*this, v)};
+  wrapper = {v, callable};
+  return clox::CallableSharedPtr{callable};
+}
+
+void WarmStart::store(const std::string& name, const_string_ptr key, const clox::Value& v) {
+  in_flight.assign(1, key);
+  const std::optional<Value> converted{to_vm(v)};
+  in_flight.clear();
+  if (!converted) {
+    tree_only.insert_or_assign(name, v);
+    return;
+  }
+  tree_only.erase(name);
+  vm.define_global(key, *converted);
+}
+
+void WarmStart::report(const clox::RuntimeException& e) {
+  finish();
+  const bool reported{dynamic_cast<const Reported*>(&e) != nullptr};
+  int line{e.line_number};
+  for (size_t i = 0; i < e.calls.size(); i++) {
+    if (i > 0 || !reported) std::cerr << "[line " << line << "] in " << name_of(e.calls[i].first) << std::endl;
+    line = e.calls[i].second;
+  }
+  std::cerr << "[line " << line << "] in script" << std::endl;
+  // Walked frames, traced like VM's. The innermost call of a reported error is
+  // VM's, which traced it already.
+  if (reported) return;
+
+  std::string message{e.what()};
+  if (const auto* error = dynamic_cast<const clox::CallError*>(&e)) {
+    const auto* callable = std::get_if<clox::CallableSharedPtr>(&error->callee);
+    message = !callable ? "Did not receive a callable."
+                        : "Function " + name_of(*callable) + " expected " + std::to_string((*callable)->arity()) +
+                              " parameters, but got " + std::to_string(error->arg_count) + ".";
+  }
+  // The tree-walker's own wording differs.
+  e_reporter.set_error("[Runtime error] [line " + std::to_string(e.line_number) +
+                       "] while interpreting: " + message);
+}
+
+std::string WarmStart::name_of(const clox::CallableSharedPtr& callable) {
+  if (const auto* wrapper = dynamic_cast<const CompiledCallable*>(callable.get())) return wrapper->name();
+  if (const auto* function = dynamic_cast<const clox::Function*>(callable.get())) {
+    return function->get_declaration().name.get_lexeme();
+  }
+  return callable->to_string();
+}
+
+void WarmStart::mark_roots() const {
+  const GCValueMarkingVisitor marker{heap};
+  if (script) heap->mark(*script);
+  for (const function_ptr function : functions) heap->mark(function);
+  for (const auto& [object, wrapper] : wrappers) std::visit(marker, wrapper.value);
+  for (const Value& v : in_flight) std::visit(marker, v);
+}
+
+}  // namespace cpplox
@@ -0,0 +1,212 @@
+// Build step of CopyAndPatch: reads the object file Stencils.cpp compiles to
+// and writes the code and holes of each cpplox_stencil_ function as C++ arrays,
+// which CopyAndPatch.cpp includes. Stencils it can't use are left out with a
+// note on stderr, CopyAndPatch interprets their instructions instead.
+//
+// Usage: StencilExtractor <Stencils.o> <Stencils.inc>
+
+#include <elf.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace {
+
+  struct Hole {
+    uint64_t offset;
+    std::string symbol;
+    int64_t addend;
+  };
+
+  struct Extracted {
+    std::string name;
+    std::vector<uint8_t> code;
+    std::vector<Hole> holes;
+    uint64_t fallthrough_size;
+  };
+
+  constexpr std::string_view stencil_prefix{"cpplox_stencil_"};
+
+  class ObjectFile {
+  public:
+    explicit ObjectFile(std::vector<char> bytes) : bytes{std::move(bytes)} {}
+
+    bool valid() const {
+      if (bytes.size() < sizeof(Elf64_Ehdr)) return false;
+      const Elf64_Ehdr& header{this->header()};
+      return std::memcmp(header.e_ident, ELFMAG, SELFMAG) == 0 && header.e_ident[EI_CLASS] == ELFCLASS64
+             && header.e_type == ET_REL && header.e_machine == EM_X86_64;
+    }
+
+    const Elf64_Ehdr& header() const { return at<Elf64_Ehdr>(0); }
+    const Elf64_Shdr& section(size_t index) const {
+      return at<Elf64_Shdr>(header().e_shoff + index * sizeof(Elf64_Shdr));
+    }
+    size_t sections() const { return header().e_shnum; }
+
+    template <typename T>
+    const T& entry(const Elf64_Shdr& section, size_t index) const {
+      return at<T>(section.sh_offset + index * sizeof(T));
+    }
+    std::string_view string(const Elf64_Shdr& table, size_t offset) const {
+      return &bytes[table.sh_offset + offset];
+    }
+    const uint8_t* data(const Elf64_Shdr& section) const {
+      return reinterpret_cast<const uint8_t*>(&bytes[section.sh_offset]);
+    }
+
+  private:
+    template <typename T>
+    const T& at(size_t offset) const {
+      return *reinterpret_cast<const T*>(&bytes[offset]);
+    }
+
+    std::vector<char> bytes;
+  };
+
+  constexpr size_t max_jump_distance{16};
+
+  bool is_continuation(std::string_view symbol) {
+    return symbol == "cpplox_hole_continue" || symbol == "cpplox_hole_jump";
+  }
+
+  size_t jump_register_size(const std::vector<uint8_t>& code, size_t offset) {
+    // Size of the jmp *%reg at offset, 0 if there's none.
+    const size_t rex{offset < code.size() && code[offset] == 0x41 ? 1u : 0u};
+    offset += rex;
+    if (offset + 1 < code.size() && code[offset] == 0xff && (code[offset + 1] & 0xf8) == 0xe0) return rex + 2;
+    return 0;
+  }
+
+  std::optional<std::string> check(Extracted& stencil) {
+    // Why the stencil can't be stitched, if it can't. Sets fallthrough_size.
+    stencil.fallthrough_size = stencil.code.size();
+    for (const Hole& hole : stencil.holes) {
+      if (!hole.symbol.starts_with("cpplox_")) return "refers to " + hole.symbol;
+      if (!is_continuation(hole.symbol)) continue;
+      // Continuations must be tail calls: movabs $hole, %reg and, a few
+      // instructions later, jmp *%reg. A call would return into code that isn't
+      // there. This only scans bytes, the compiler is trusted not to do anything
+      // stranger than interleaving register restores and stores.
+      size_t offset{hole.offset + 8};
+      const size_t end{std::min(stencil.code.size(), offset + max_jump_distance)};
+      while (offset < end && jump_register_size(stencil.code, offset) == 0) ++offset;
+      const size_t jump{jump_register_size(stencil.code, offset)};
+      if (jump == 0) return hole.symbol + " isn't jumped to";
+      if (hole.symbol == "cpplox_hole_continue" && offset + jump == stencil.code.size()
+          && offset == hole.offset + 8 && hole.offset >= 2) {
+        stencil.fallthrough_size = hole.offset - 2;
+      }
+    }
+    return std::nullopt;
+  }
+
+  std::vector<Extracted> extract(const ObjectFile& object) {
+    std::vector<Extracted> stencils{};
+    for (size_t i = 0; i < object.sections(); ++i) {
+      const Elf64_Shdr& symtab{object.section(i)};
+      if (symtab.sh_type != SHT_SYMTAB) continue;
+      const Elf64_Shdr& strtab{object.section(symtab.sh_link)};
+      const size_t symbols{symtab.sh_size / sizeof(Elf64_Sym)};
+
+      for (size_t s = 0; s < symbols; ++s) {
+        const Elf64_Sym& symbol{object.entry<Elf64_Sym>(symtab, s)};
+        const std::string_view name{object.string(strtab, symbol.st_name)};
+        if (ELF64_ST_TYPE(symbol.st_info) != STT_FUNC || !name.starts_with(stencil_prefix)) continue;
+
+        Extracted stencil{std::string{name.substr(stencil_prefix.size())}, {}, {}, 0};
+        const uint8_t* code{object.data(object.section(symbol.st_shndx)) + symbol.st_value};
+        stencil.code.assign(code, code + symbol.st_size);
+
+        std::optional<std::string> problem{};
+        for (size_t r = 0; r < object.sections(); ++r) {
+          const Elf64_Shdr& relocations{object.section(r)};
+          if (relocations.sh_type == SHT_REL && relocations.sh_info == symbol.st_shndx) problem = "has REL relocations";
+          if (relocations.sh_type != SHT_RELA || relocations.sh_info != symbol.st_shndx) continue;
+          for (size_t e = 0; e < relocations.sh_size / sizeof(Elf64_Rela); ++e) {
+            const Elf64_Rela& relocation{object.entry<Elf64_Rela>(relocations, e)};
+            if (relocation.r_offset < symbol.st_value || relocation.r_offset >= symbol.st_value + symbol.st_size) {
+              continue;
+            }
+            const Elf64_Sym& target{object.entry<Elf64_Sym>(symtab, ELF64_R_SYM(relocation.r_info))};
+            const std::string_view target_name{object.string(strtab, target.st_name)};
+            if (ELF64_R_TYPE(relocation.r_info) != R_X86_64_64) {
+              problem = "has a relocation of type " + std::to_string(ELF64_R_TYPE(relocation.r_info));
+            } else if (target_name.empty()) {
+              problem = "refers to data of the object file";
+            } else {
+              stencil.holes.push_back({relocation.r_offset - symbol.st_value, std::string{target_name},
+                                       relocation.r_addend});
+            }
+          }
+        }
+        if (!problem) problem = check(stencil);
+        if (problem) {
+          std::cerr << "StencilExtractor: skipping " << stencil.name << ", it " << *problem << '\n';
+          continue;
+        }
+        stencils.push_back(std::move(stencil));
+      }
+    }
+    return stencils;
+  }
+
+  void write(std::ostream& out, const std::vector<Extracted>& stencils) {
+    out << "// Generated by StencilExtractor from the stencils object file, do not edit.\n\n"
+           "namespace cpplox::stencils {\n\n";
+    for (const Extracted& stencil : stencils) {
+      out << "  constexpr uint8_t " << stencil.name << "_code[]{";
+      for (size_t i = 0; i < stencil.code.size(); ++i) {
+        out << (i % 16 == 0 ? "\n    " : " ") << static_cast<int>(stencil.code[i]) << ',';
+      }
+      out << "\n  };\n";
+      if (!stencil.holes.empty()) {
+        out << "  constexpr StencilHole " << stencil.name << "_holes[]{\n";
+        for (const Hole& hole : stencil.holes) {
+          out << "    {" << hole.offset << ", \"" << hole.symbol << "\", " << hole.addend << "},\n";
+        }
+        out << "  };\n";
+      }
+    }
+    out << "\n  constexpr Stencil table[]{\n";
+    for (const Extracted& stencil : stencils) {
+      out << "    {\"" << stencil.name << "\", " << stencil.name << "_code, "
+          << (stencil.holes.empty() ? std::string{"{}"} : stencil.name + "_holes") << ", "
+          << stencil.fallthrough_size << "},\n";
+    }
+    out << "  };\n"
+           "  constexpr std::span<const Stencil> all{table};\n\n"
+           "}  // namespace cpplox::stencils\n";
+  }
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    std::cerr << "Usage: StencilExtractor <Stencils.o> <Stencils.inc>\n";
+    return 64;
+  }
+  std::ifstream ifs{argv[1], std::ios::binary};
+  const ObjectFile object{std::vector<char>{std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>()}};
+  if (!object.valid()) {
+    std::cerr << "StencilExtractor: " << argv[1] << " isn't an x86-64 ELF object file\n";
+    return 65;
+  }
+  const std::vector<Extracted> stencils{extract(object)};
+  if (stencils.empty()) {
+    std::cerr << "StencilExtractor: no stencils in " << argv[1] << '\n';
+    return 65;
+  }
+  std::ofstream out{argv[2]};
+  write(out, stencils);
+  return out ? 0 : 74;
+}
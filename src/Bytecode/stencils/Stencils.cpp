@@ -0,0 +1,185 @@
+// Stencils for CopyAndPatch, one per instruction template. Compiled at build
+// time with flags that make every reference to a hole or slow path a 64 bit
+// absolute address (see CMakeLists.txt), StencilExtractor then copies their
+// code and relocations out of the object file. Not part of the library.
+//
+// Every stencil takes VM and the frame's first slot and passes both on by
+// tail calling the next piece of code, so stitched code runs as one chain of
+// jumps and the first stencil to return ends the function's compiled code.
+
+#include <bit>
+#include <variant>
+
+#include "cpplox/Bytecode/Stencils.h"
+
+using namespace cpplox;
+
+#if defined(__clang__)
+  #define STENCIL_TAIL [[clang::musttail]]
+#else
+  #define STENCIL_TAIL
+  // GCC turns the tail calls into jumps at -O2, StencilExtractor rejects
+  // stencils where it didn't.
+#endif
+#define HOLE(name) reinterpret_cast<uintptr_t>(cpplox_hole_##name)
+#define CONTINUE() STENCIL_TAIL return cpplox_hole_continue(vm, s)
+#define JUMP() STENCIL_TAIL return cpplox_hole_jump(vm, s)
+#define STENCIL(name) extern "C" CompiledStatus cpplox_stencil_##name(VM* vm, Value* s)
+#define IP() reinterpret_cast<const uint8_t*>(cpplox_hole_ip)
+
+namespace {
+inline bool is_number(const Value& value) {
+  return std::holds_alternative<double>(value);
+}
+
+inline double& number(Value& value) {
+  // Only for values known to be numbers: unchecked, unlike std::get.
+  if (!is_number(value)) __builtin_unreachable();
+  return *std::get_if<double>(&value);
+}
+
+inline bool is_falsey(const Value& value) {
+  const bool* boolean{std::get_if<bool>(&value)};
+  return std::holds_alternative<std::monostate>(value) || (boolean && !*boolean);
+}
+}  // namespace
+
+extern "C" CompiledStatus cpplox_stencil_ENTER(VM* vm) {
+  Value* s{cpplox_slots(vm)};
+  CONTINUE();
+}
+
+STENCIL(STEP) {
+  // Any instruction, interpreted. a: stack height.
+  if (!cpplox_step(vm, s + HOLE(a), IP())) return CompiledStatus::RUNTIME_ERROR;
+  CONTINUE();
+}
+
+STENCIL(COPY) {
+  // OP_GET_LOCAL, OP_SET_LOCAL and OP_INLINED_RETURN.
+  s[HOLE(a)] = s[HOLE(b)];
+  CONTINUE();
+}
+
+STENCIL(CONSTANT) {
+  s[HOLE(a)] = *reinterpret_cast<const Value*>(cpplox_hole_constant);
+  CONTINUE();
+}
+
+STENCIL(NIL) {
+  s[HOLE(a)] = std::monostate{};
+  CONTINUE();
+}
+
+STENCIL(TRUE) {
+  s[HOLE(a)] = true;
+  CONTINUE();
+}
+
+STENCIL(FALSE) {
+  s[HOLE(a)] = false;
+  CONTINUE();
+}
+
+STENCIL(GET_UPVALUE) {
+  cpplox_get_upvalue(vm, s + HOLE(a), HOLE(b));
+  CONTINUE();
+}
+
+STENCIL(SET_UPVALUE) {
+  cpplox_set_upvalue(vm, s + HOLE(a), HOLE(b));
+  CONTINUE();
+}
+
+STENCIL(EQUAL) {
+  cpplox_equal(s + HOLE(a));
+  CONTINUE();
+}
+
+STENCIL(NOT) {
+  s[HOLE(a)] = is_falsey(s[HOLE(a)]);
+  CONTINUE();
+}
+
+STENCIL(NEGATE) {
+  // a: operand, b: stack height.
+  if (is_number(s[HOLE(a)])) {
+    double& operand{number(s[HOLE(a)])};
+    operand = std::bit_cast<double>(std::bit_cast<uint64_t>(operand) ^ (uint64_t{1} << 63));
+    // Flipping the sign bit needs no constant in memory, unlike -*number.
+  } else if (!cpplox_step(vm, s + HOLE(b), IP())) {
+    return CompiledStatus::RUNTIME_ERROR;
+  }
+  CONTINUE();
+}
+
+// a: left operand, b: stack height. Operands that aren't numbers take the
+// interpreter's path, which adds strings and reports errors.
+#define ARITHMETIC_STENCIL(name, op)                                          \
+  STENCIL(name) {                                                             \
+    if (is_number(s[HOLE(a)]) && is_number(s[HOLE(a) + 1])) {                 \
+      number(s[HOLE(a)]) op## = number(s[HOLE(a) + 1]);                       \
+    } else if (!cpplox_step(vm, s + HOLE(b), IP())) {                         \
+      return CompiledStatus::RUNTIME_ERROR;                                   \
+    }                                                                         \
+    CONTINUE();                                                               \
+  }                                                                           \
+  STENCIL(name##_NN) {                                                        \
+    number(s[HOLE(a)]) op## = number(s[HOLE(a) + 1]);                         \
+    CONTINUE();                                                               \
+  }
+#define COMPARISON_STENCIL(name, op)                                          \
+  STENCIL(name) {                                                             \
+    if (is_number(s[HOLE(a)]) && is_number(s[HOLE(a) + 1])) {                 \
+      s[HOLE(a)] = number(s[HOLE(a)]) op number(s[HOLE(a) + 1]);              \
+    } else if (!cpplox_step(vm, s + HOLE(b), IP())) {                         \
+      return CompiledStatus::RUNTIME_ERROR;                                   \
+    }                                                                         \
+    CONTINUE();                                                               \
+  }                                                                           \
+  STENCIL(name##_NN) {                                                        \
+    s[HOLE(a)] = number(s[HOLE(a)]) op number(s[HOLE(a) + 1]);                \
+    CONTINUE();                                                               \
+  }
+
+ARITHMETIC_STENCIL(ADD, +)
+ARITHMETIC_STENCIL(SUBTRACT, -)
+ARITHMETIC_STENCIL(MULTIPLY, *)
+ARITHMETIC_STENCIL(DIVIDE, /)
+COMPARISON_STENCIL(GREATER, >)
+COMPARISON_STENCIL(LESS, <)
+
+STENCIL(JUMP) {
+  JUMP();
+}
+
+STENCIL(JUMP_IF_FALSE) {
+  if (is_falsey(s[HOLE(a)])) JUMP();
+  CONTINUE();
+}
+
+STENCIL(JUMP_IF_TRUE) {
+  if (!is_falsey(s[HOLE(a)])) JUMP();
+  CONTINUE();
+}
+
+STENCIL(JUMP_IF_NOT_CALLEE) {
+  if (cpplox_not_callee(s + HOLE(a), reinterpret_cast<const Value*>(cpplox_hole_constant))) JUMP();
+  CONTINUE();
+}
+
+STENCIL(CALL) {
+  // a: stack height, b: argument count, ip: the instruction after the call.
+  if (!cpplox_call(vm, s + HOLE(a), IP(), HOLE(b))) return CompiledStatus::RUNTIME_ERROR;
+  CONTINUE();
+}
+
+STENCIL(TAIL_CALL) {
+  const CompiledStatus status{cpplox_tail_call(vm, s + HOLE(a), IP(), HOLE(b))};
+  if (status != CompiledStatus::RETURNED) return status;
+  CONTINUE();
+}
+
+STENCIL(RETURN) {
+  STENCIL_TAIL return cpplox_return(vm, s + HOLE(a));
+}
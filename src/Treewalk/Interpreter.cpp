@@ -41,9 +41,27 @@ std::string value_as_string(const Value& val) {
   throw runtime_error("non-exhaustive visitor");
 }
 
-void Environment::define(std::string name, Value v) { values[name] = v; }
+void Environment::define(std::string name, Value v) {
+  if (binding) {
+    binding->define(name, v);
+    return;
+  }
+  values[name] = v;
+}
+
+void Environment::bind(GlobalBinding* in_binding) {
+  binding = in_binding;
+  for (const auto& [name, v] : values) {
+    binding->define(name, v);
+  }
+  values.clear();
+}
 
 void Environment::assign(Token name, Value v) {
+  if (binding && binding->assign(name.get_lexeme(), v)) {
+    return;
+  }
+
   if (values.find(name.get_lexeme()) != values.end()) {
     values[name.get_lexeme()] = v;
     return;
@@ -77,6 +95,12 @@ void Environment::assign_at_distance(Token name, Value v, int dist) {
 }
 
 Value Environment::get(Token name) {
+  if (binding) {
+    if (std::optional<Value> v = binding->get(name.get_lexeme())) {
+      return *v;
+    }
+  }
+
   if (values.find(name.get_lexeme()) != values.end()) {
     Value v = values.at(name.get_lexeme());
     return v;
@@ -104,6 +128,10 @@ void Interpreter::interpret(const std::vector<StmtPtr>& statements) {
   }
 }
 
+void Interpreter::execute(const clox::Stmt::Stmt& statement) {
+  statement.accept(*this);
+}
+
 void Interpreter::resolve(const clox::Expr::Expr& expr, int distance) {
   locals.insert({&expr, distance});
 }
@@ -352,6 +380,9 @@ void Interpreter::visitWhile(const WhileStmt& while_) {
 
 // TODO: start using "override"
 void Interpreter::visitCall(const CallExpr& call) {
+  if (before_call) {
+    before_call();
+  }
   evaluate(*call.callee);
   Value callee{val};
 
@@ -362,18 +393,30 @@ void Interpreter::visitCall(const CallExpr& call) {
   }
 
   if (!std::holds_alternative<CallableSharedPtr>(callee)) {
-    throw RuntimeException("Only functions and classes can be called.",
-                           call.paren->get_line());
+    throw CallError("Only functions and classes can be called.",
+                    call.paren->get_line(), callee, arguments.size());
   }
 
   CallableSharedPtr callable_ptr = std::get<CallableSharedPtr>(callee);
-  if (callable_ptr->arity() != arguments.size()) {
-    throw RuntimeException(
-        "Expected: " + std::to_string(callable_ptr->arity()) +
-            " arguments, but got: " + std::to_string(arguments.size()),
-        call.paren->get_line());
+  if (callable_ptr->arity() >= 0 && callable_ptr->arity() != arguments.size()) {
+    throw CallError("Expected: " + std::to_string(callable_ptr->arity()) +
+                        " arguments, but got: " +
+                        std::to_string(arguments.size()),
+                    call.paren->get_line(), callee, arguments.size());
+  }
+  call_line = call.paren->get_line();
+  depth++;
+  try {
+    val = callable_ptr->call(*this, arguments);
+  } catch (RuntimeException& e) {
+    depth--;
+    e.calls.emplace_back(callable_ptr, call.paren->get_line());
+    throw;
+  } catch (...) {
+    depth--;
+    throw;
   }
-  val = callable_ptr->call(*this, arguments);
+  depth--;
 }
 
 void Interpreter::visitFunction(const FunctionStmt& declaration_stmt) {
@@ -398,10 +441,14 @@ void Interpreter::execute_block(const std::vector<StmtPtr>& statements,
   current_env = blocks_env;
 
   try {
-    interpret(statements);
-  } catch (Return ret) {
+    for (auto const& s : statements) {
+      s->accept(*this);
+    }
+  } catch (...) {
+    // Return unwinds through blocks and so do runtime errors, which stop the
+    // program instead of only the block they happened in.
     current_env = to_restore;
-    throw ret;
+    throw;
   };
   current_env = to_restore;
 }
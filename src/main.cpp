@@ -1,9 +1,13 @@
 #include <algorithm>
+#include <cctype>
+#include <charconv>
 #include <iostream>
 #include <map>
 #include <memory>
 #include <numeric>
+#include <optional>
 #include <unordered_map>
+#include <vector>
 
 // #include "cpplox/Treewalk/AstGenerator.h"
 #include "cpplox/Bytecode/ByteCodeRunner.h"
@@ -13,14 +17,127 @@
 #include "cpplox/Bytecode/GC.h"
 
 
-void launch_bytecode(int argc, char* argv[]) {
+template <typename T>
+std::optional<T> parse_count(const std::string& text) {
+  // Whole of text as a non-negative integer that fits T, nullopt otherwise.
+  T value{};
+  const char* const end{text.data() + text.size()};
+  const auto [parsed_to, error] = std::from_chars(text.data(), end, value);
+  if (error != std::errc{} || parsed_to != end) return std::nullopt;
+  return value;
+}
+
+int usage_error(const std::string& message) {
+  std::cerr << "Usage error: " << message << std::endl;
+  return 64;
+}
+
+int count_error(const std::string& flag, const std::string& value) {
+  return usage_error(flag + " expects a non-negative integer, got '" + value + "'.");
+}
+
+int launch_bytecode(int argc, char* argv[]) {
   std::cout << "Running bytecode" << std::endl;
-  if (argc == 2) {
-    std::string arg{argv[1]};
-    cpplox::ByteCodeRunner().runFile(argv[1]);
-  } else if (argc == 1) {
-    cpplox::ByteCodeRunner().runRepl();
-  } else if (argc == 3) {
+  cpplox::CompilerOptions options{};
+  std::vector<std::string> args{};
+  bool compile_only{false};
+  std::string out_path{};
+  std::string cpp_path{};
+  bool jit{true};
+  uint32_t hot_calls{cpplox::Jit::default_hot_calls};
+  uint32_t hot_loops{cpplox::Jit::default_hot_loops};
+  cpplox::JitBackend jit_backend{cpplox::JitBackend::TEMPLATES};
+  std::string cache_dir{};
+  bool warm_start{false};
+  std::string snapshot_path{};
+  std::string prelude_path{};
+  uintmax_t cache_size{cpplox::CompileCache::default_max_bytes};
+  for (int i = 1; i < argc; i++) {
+    const std::string arg{argv[i]};
+    if (arg == "--compile-only") {
+      compile_only = true;
+      // Writes bytecode to -o's file (or the script's path with .loxc extension).
+    } else if (arg == "-o" && i + 1 < argc) {
+      out_path = argv[++i];
+    } else if (arg == "--emit-cpp" && i + 1 < argc) {
+      cpp_path = argv[++i];
+      // Writes a C++ translation of the script instead of running it (see AotCompiler).
+    } else if (arg == "--no-jit") {
+      jit = false;
+    } else if (arg == "--jit-calls" && i + 1 < argc) {
+      const std::optional<uint32_t> count{parse_count<uint32_t>(argv[++i])};
+      if (!count) return count_error(arg, argv[i]);
+      hot_calls = count.value();
+      // Number of calls after which a function is compiled to native code.
+    } else if (arg == "--jit-loops" && i + 1 < argc) {
+      const std::optional<uint32_t> count{parse_count<uint32_t>(argv[++i])};
+      if (!count) return count_error(arg, argv[i]);
+      hot_loops = count.value();
+      // Number of iterations after which an interpreted loop is traced.
+    } else if (arg == "--jit-stencils") {
+      jit_backend = cpplox::JitBackend::STENCILS;
+      // Stitches build-time stencils instead of assembling templates (see CopyAndPatch).
+    } else if (arg == "--cache" && i + 1 < argc) {
+      cache_dir = argv[++i];
+      // Reuses bytecode compiled by earlier runs of the same source and options.
+    } else if (arg == "--cache-size" && i + 1 < argc) {
+      const std::optional<uintmax_t> size{parse_count<uintmax_t>(argv[++i])};
+      if (!size) return count_error(arg, argv[i]);
+      cache_size = size.value();
+    } else if (arg == "--no-peephole") {
+      options.peephole = false;
+    } else if (arg.starts_with("-O") && arg.size() == 3 && std::isdigit(arg[2])) {
+      options.opt_level = arg[2] - '0';
+    } else if (arg == "--lazy") {
+      options.lazy_functions = true;
+      // Compiles function bodies on their first call.
+    } else if (arg == "--warm-start") {
+      warm_start = true;
+      // Walks the tree while compiling, then hands over to the VM. Not combined
+      // with --cache or --prelude, whose scripts start in the VM.
+    } else if (arg == "--snapshot" && i + 1 < argc) {
+      snapshot_path = argv[++i];
+      // Runs the script and writes the globals it leaves behind to a .loxs file.
+    } else if (arg == "--prelude" && i + 1 < argc) {
+      prelude_path = argv[++i];
+      // Starts the script's VM from a .loxs snapshot.
+    } else if (arg == "--peephole-diff") {
+      options.peephole_diff = true;
+      // Before/after disassembly goes to compiler.log.
+    } else {
+      args.push_back(arg);
+    }
+  }
+
+  if (warm_start && (!cache_dir.empty() || !prelude_path.empty())) {
+    return usage_error("--warm-start can't be combined with --cache or --prelude.");
+  }
+
+  if (!cpp_path.empty() && args.size() == 1) {
+    cpplox::ByteCodeRunner(std::cout, std::cin, "compiler.log", options).emitCpp(args[0], cpp_path);
+  } else if (!snapshot_path.empty() && args.size() == 1) {
+    cpplox::ByteCodeRunner runner(std::cout, std::cin, "compiler.log", options);
+    if (!jit) runner.disable_jit();
+    runner.snapshotFile(args[0], snapshot_path);
+  } else if (compile_only && args.size() == 1) {
+    if (out_path.empty()) out_path = args[0].substr(0, args[0].rfind(".lox")) + ".loxc";
+    cpplox::ByteCodeRunner runner(std::cout, std::cin, "compiler.log", options);
+    if (!prelude_path.empty()) runner.enable_snapshot(prelude_path);
+    runner.compileFile(args[0], out_path);
+  } else if (args.size() == 1) {
+    cpplox::ByteCodeRunner runner(std::cout, std::cin, "compiler.log", options);
+    if (!cache_dir.empty()) runner.enable_cache(cache_dir, cache_size);
+    if (warm_start) runner.enable_warm_start();
+    if (!prelude_path.empty()) runner.enable_snapshot(prelude_path);
+    if (jit) {
+      runner.enable_jit(hot_calls, jit_backend, hot_loops);
+    } else {
+      runner.disable_jit();
+    }
+    runner.runFile(args[0]);
+  } else if (args.empty()) {
+    cpplox::ByteCodeRunner(std::cout, std::cin, "compiler.log", options).runRepl();
+  } else if (args.size() == 2) {
     // Debugger runs with 3 args
     cpplox::ByteCodeRunner().runFile(
     //"/Users/psarnick/dev/cpplox/test/closure/assign_to_closure.lox");
@@ -28,9 +145,9 @@ void launch_bytecode(int argc, char* argv[]) {
   } else {
     throw std::logic_error("Unsupported arguments " + std::to_string(argc));
   }
+  return 0;
 }
 
 int main(int argc, char* argv[]) {
-  launch_bytecode(argc, argv);
-  return 0;
+  return launch_bytecode(argc, argv);
 }
@@ -0,0 +1,53 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "cpplox/Bytecode/AotCompiler.h"
+#include "cpplox/Bytecode/ByteCodeRunner.h"
+#include "gtest/gtest.h"
+
+namespace cpplox::aot {
+  extern const std::vector<std::pair<std::string, const AotProgram*>> test_programs;
+  // Generated by test/CMakeLists.txt from AOT_TEST_SCRIPTS.
+}  // namespace cpplox::aot
+
+namespace cpplox_tests {
+
+  using namespace cpplox;
+
+  std::string get_expectation(std::string fpath);
+
+  using aot_param = std::pair<std::string, const AotProgram*>;
+  class TestAotFixture : public ::testing::TestWithParam<aot_param> {
+  protected:
+    std::ostringstream oss;
+    ByteCodeRunner r{oss};
+    const std::string tests_path_prefix = "/Users/psarnick/dev/cpplox/test/";
+  };
+
+  TEST_P(TestAotFixture, SameOutputAsInterpreted) {
+    const auto& [script, program] = GetParam();
+    r.runCompiled(*program);
+    ASSERT_EQ(oss.str(), get_expectation(tests_path_prefix + script));
+  }
+
+  INSTANTIATE_TEST_SUITE_P(
+      AotTests,
+      TestAotFixture,
+      ::testing::ValuesIn(aot::test_programs)
+  );
+
+  TEST(TestAot, TranslatesEachFunction) {
+    std::ostringstream oss;
+    ByteCodeRunner r{oss};
+    ASSERT_TRUE(r.emitCpp("/Users/psarnick/dev/cpplox/test/function/recursion.lox", "recursion_aot.cpp"));
+    std::ifstream ifs{"recursion_aot.cpp"};
+    const std::string cpp((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    ASSERT_NE(cpp.find("CompiledStatus function_1(VM& vm) {\n  // fib\n"), std::string::npos);
+    ASSERT_NE(cpp.find("const AotProgram recursion_aot{bytecode, entries};"), std::string::npos);
+    ASSERT_NE(cpp.find("#ifndef CPPLOX_AOT_NO_MAIN"), std::string::npos);
+  }
+
+}  // namespace cpplox_tests
@@ -0,0 +1,102 @@
+#include <span>
+#include <string>
+
+#include "cpplox/Bytecode/BytecodeFile.h"
+#include "cpplox/Bytecode/Chunk.h"
+#include "cpplox/Bytecode/VM.h"
+#include "gtest/gtest.h"
+
+namespace cpplox_tests {
+
+using namespace cpplox;
+
+class TamperedFileTest : public ::testing::Test {
+  // Serializes a script written opcode by opcode, so the file's checksums match
+  // code the compiler would never emit, and loads it back.
+protected:
+  gc_heap heap{};
+  StringPool pool{&heap};
+  std::string bytes{};
+
+  TamperedFileTest() { heap.register_root_marking_callback([this] { pool.mark_strings(); }); }
+  ~TamperedFileTest() override { heap.deregister_root_marking_callback(); }
+  // Constants are interned before the script holding them exists.
+
+  std::optional<function_ptr> load(const std::vector<OpCode>& ops, const std::vector<Value>& constants = {}) {
+    auto chunk{std::make_unique<Chunk>()};
+    for (const OpCode op : ops) chunk->add_opcode(op, 1);
+    for (const Value& constant : constants) chunk->add_constant(constant);
+    const function_ptr script{heap.make<Function>(0, 0, pool.insert_or_get("script"), std::move(chunk))};
+    bytes = BytecodeWriter().serialize(script).value();
+    std::string error{};
+    return BytecodeLoader(&heap, &pool)
+        .load(MappedFile::view(std::span{reinterpret_cast<const uint8_t*>(bytes.data()), bytes.size()}),
+              "tampered.loxc", error);
+  }
+  // Operands are written as opcodes, OP_RETURN is 0.
+};
+
+TEST_F(TamperedFileTest, UncheckedArithmeticIsProvenAgain) {
+  const std::optional<function_ptr> script{
+      load({OpCode::OP_CONSTANT, OpCode::OP_RETURN, OpCode::OP_CONSTANT, OpCode::OP_RETURN, OpCode::OP_ADD_NN,
+            OpCode::OP_PRINT, OpCode::OP_CONSTANT, static_cast<OpCode>(1), OpCode::OP_CONSTANT,
+            static_cast<OpCode>(1), OpCode::OP_ADD_NN, OpCode::OP_PRINT, OpCode::OP_NIL, OpCode::OP_RETURN},
+           {pool.insert_or_get("x"), 2.0})};
+  ASSERT_TRUE(script.has_value());
+  const std::vector<uint8_t>& code{script.value()->chunk->code};
+  ASSERT_EQ(code[4], static_cast<uint8_t>(OpCode::OP_ADD));
+  // "x" + "x" would reach the VM's unchecked arithmetic.
+  ASSERT_EQ(code[10], static_cast<uint8_t>(OpCode::OP_ADD_NN));
+};
+
+TEST_F(TamperedFileTest, UnbalancedStackIsRejected) {
+  ASSERT_FALSE(load({OpCode::OP_POP, OpCode::OP_NIL, OpCode::OP_RETURN}).has_value());
+  // Underflow: slot 0 holds the script itself.
+
+  std::vector<OpCode> pushes{};
+  for (size_t i = 0; i < VM::FRAME_SLOTS; i++) pushes.push_back(OpCode::OP_NIL);
+  pushes.push_back(OpCode::OP_RETURN);
+  ASSERT_FALSE(load(pushes).has_value());
+  // Overflow: the file reserves no extra slots.
+
+  ASSERT_FALSE(load({OpCode::OP_TRUE, OpCode::OP_JUMP_IF_FALSE, OpCode::OP_RETURN, static_cast<OpCode>(1),
+                     OpCode::OP_NIL, OpCode::OP_POP, OpCode::OP_NIL, OpCode::OP_RETURN})
+                   .has_value());
+  // Paths reach OP_POP with different heights.
+};
+
+TEST(ChunkTests, LineTableStoresOneRunPerLine) {
+  Chunk chunk {};
+  for (const int line : {1, 1, 1, 2, 2, 5, 5, 5, 5}) {
+    chunk.add_byte(0, line);
+  }
+  ASSERT_EQ(chunk.lines.run_count(), 3u);
+
+  const std::vector<int> expected {1, 1, 1, 2, 2, 5, 5, 5, 5};
+  for (size_t offset = 0; offset < expected.size(); offset++) {
+    ASSERT_EQ(chunk.lines.line_at(offset), expected[offset]);
+  }
+};
+
+TEST(ChunkTests, LineTableFollowsTruncation) {
+  Chunk chunk {};
+  for (const int line : {1, 1, 2, 2, 3}) {
+    chunk.add_byte(0, line);
+  }
+  chunk.truncate(3);
+  ASSERT_EQ(chunk.lines.run_count(), 2u);
+  chunk.add_byte(0, 2);
+  chunk.add_byte(0, 4);
+  ASSERT_EQ(chunk.lines.run_count(), 3u);
+  ASSERT_EQ(chunk.lines.line_at(3), 2);
+  ASSERT_EQ(chunk.lines.line_at(4), 4);
+
+  chunk.truncate(2);
+  chunk.add_byte(0, 1);
+  ASSERT_EQ(chunk.lines.run_count(), 1u);
+  ASSERT_EQ(chunk.lines.line_at(2), 1);
+  // Truncating at a run boundary drops the run, bytes from the same line extend
+  // the previous one.
+};
+
+}  // namespace cpplox_tests
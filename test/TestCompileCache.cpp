@@ -0,0 +1,72 @@
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+#include "cpplox/Bytecode/ByteCodeRunner.h"
+#include "cpplox/Bytecode/CompileCache.h"
+#include "gtest/gtest.h"
+
+namespace cpplox_tests {
+
+using namespace cpplox;
+namespace fs = std::filesystem;
+
+std::vector<fs::path> cache_entries(const fs::path& directory) {
+  std::vector<fs::path> entries{};
+  for (const fs::directory_entry& file : fs::directory_iterator(directory)) entries.push_back(file.path());
+  return entries;
+}
+
+TEST(CompileCacheTests, KeyDependsOnSourceAndOptions) {
+  const CompileCache cache{"compile_cache_keys"};
+  const std::string key{cache.key("print 1;", CompilerOptions{})};
+  ASSERT_EQ(key, cache.key("print 1;", CompilerOptions{.peephole_diff = true}));
+  ASSERT_NE(key, cache.key("print 2;", CompilerOptions{}));
+  ASSERT_NE(key, cache.key("print 1;", CompilerOptions{.opt_level = 2}));
+  ASSERT_NE(key, cache.key("print 1;", CompilerOptions{.peephole = false}));
+};
+
+TEST(CompileCacheTests, EvictsLeastRecentlyUsed) {
+  const fs::path directory{"compile_cache_eviction"};
+  fs::remove_all(directory);
+  const CompileCache cache{directory, 250};
+  const std::string entry(100, 'x');
+  ASSERT_TRUE(cache.store("first", entry));
+  ASSERT_TRUE(cache.store("second", entry));
+  fs::last_write_time(directory / "first.loxc", fs::file_time_type::clock::now() - std::chrono::hours(2));
+  fs::last_write_time(directory / "second.loxc", fs::file_time_type::clock::now() - std::chrono::hours(1));
+  ASSERT_TRUE(cache.lookup("first"));
+  // Using the older entry makes the other one the least recently used.
+
+  ASSERT_TRUE(cache.store("third", entry));
+  ASSERT_TRUE(cache.lookup("first"));
+  ASSERT_FALSE(cache.lookup("second"));
+  ASSERT_TRUE(cache.lookup("third"));
+  ASSERT_EQ(cache_entries(directory).size(), 2u);
+};
+
+TEST(CompileCacheTests, RunnerLoadsCompiledSourceOnHit) {
+  const fs::path directory{"compile_cache_runner"};
+  fs::remove_all(directory);
+  const std::string script_path{"/Users/psarnick/dev/cpplox/test/closure/nested_closure.lox"};
+
+  std::ostringstream cold;
+  ByteCodeRunner cold_runner{cold};
+  cold_runner.enable_cache(directory.string());
+  cold_runner.runFile(script_path);
+  ASSERT_EQ(cold.str(), "a\nb\nc\n");
+  const std::vector<fs::path> entries{cache_entries(directory)};
+  ASSERT_EQ(entries.size(), 1u);
+
+  std::ostringstream other;
+  ASSERT_TRUE(ByteCodeRunner{other}.compileFile("/Users/psarnick/dev/cpplox/test/function/recursion.lox",
+                                                entries[0].string()));
+  // Swapping the entry's bytecode shows whether the next run reads it.
+  std::ostringstream warm;
+  ByteCodeRunner warm_runner{warm};
+  warm_runner.enable_cache(directory.string());
+  warm_runner.runFile(script_path);
+  ASSERT_EQ(warm.str(), "21\n");
+};
+
+}  // namespace cpplox_tests
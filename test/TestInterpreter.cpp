@@ -115,8 +115,6 @@ INSTANTIATE_TEST_SUITE_P(LimitTests, TestInterpreterFixture,
                          ::testing::Values(
                              // "limit/too_many_constants.lox",
                              // Only VM
-                             // "limit/no_reuse_constants.lox",
-                             // Needs pooling constants
                              // "limit/too_many_upvalues.lox",
                              // Revisit when closure done
                              // "limit/stack_overflow.lox",
@@ -427,6 +425,7 @@ INSTANTIATE_TEST_SUITE_P(
 
 INSTANTIATE_TEST_SUITE_P(BlockTests, TestInterpreterFixture,
                          ::testing::Values("block/empty.lox", "block/scope.lox",
-                                           "block/double_nested_sope.lox"));
+                                           "block/double_nested_sope.lox",
+                                           "block/error_in_nested_block.lox"));
 
 }  // namespace clox
\ No newline at end of file
@@ -0,0 +1,79 @@
+#include <future>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cpplox/Bytecode/IsolatePool.h"
+#include "gtest/gtest.h"
+
+namespace cpplox_tests {
+
+using namespace cpplox;
+
+TEST(IsolatePoolTests, ScriptsRunInParallelWithTheirOwnGlobals) {
+  IsolatePool pool{4, CompilerOptions{.opt_level = 2}};
+  ASSERT_EQ(pool.size(), 4u);
+  std::vector<std::future<ScriptResult>> results{};
+  for (int i = 0; i < 40; i++) {
+    results.push_back(pool.submit(
+        "var id = " + std::to_string(i) + ";\n"
+        "fun fib(n) { if (n < 2) return n; return fib(n - 2) + fib(n - 1); }\n"
+        "var name = \"job \" + \"" + std::to_string(i) + "\";\n"
+        "print name;\n"
+        "print fib(15) + id;\n"));
+  }
+  for (int i = 0; i < 40; i++) {
+    const ScriptResult result{results[i].get()};
+    ASSERT_EQ(result.output, "job " + std::to_string(i) + "\n" + std::to_string(610 + i) + "\n");
+    ASSERT_TRUE(result.errors.empty());
+  }
+}
+
+TEST(IsolatePoolTests, ErrorsStayWithTheirJob) {
+  std::future<ScriptResult> failing{};
+  std::future<ScriptResult> passing{};
+  {
+    IsolatePool pool{2};
+    failing = pool.submit("print 1;\nprint undefined;\n");
+    passing = pool.submit("print \"fine\";\n");
+  }
+  // Destroying the pool waits for both.
+  const ScriptResult failed{failing.get()};
+  ASSERT_EQ(failed.output, "1\n");
+  ASSERT_EQ(failed.errors, "[Runtime error] [line 2] while interpreting: Undefined variable 'undefined'.\n");
+  const ScriptResult passed{passing.get()};
+  ASSERT_EQ(passed.output, "fine\n");
+  ASSERT_TRUE(passed.errors.empty());
+}
+
+TEST(IsolatePoolTests, IsolatesShareCompiledCode) {
+  const auto shared = std::make_shared<const SharedScript>(
+      "var runs = 0;\n"
+      "fun join(a, b) { return a + b; }\n"
+      "runs = runs + 1;\n"
+      "print join(\"shared \", \"code\") == \"shared code\";\n"
+      "print runs;\n",
+      CompilerOptions{.opt_level = 2, .lazy_functions = true});
+  ASSERT_TRUE(shared->compiled()) << shared->errors();
+  const size_t size{shared->size()};
+
+  std::vector<std::future<ScriptResult>> results{};
+  {
+    IsolatePool pool{4};
+    for (int i = 0; i < 40; i++) results.push_back(pool.submit(shared));
+  }
+  for (std::future<ScriptResult>& result : results) {
+    const ScriptResult ran{result.get()};
+    ASSERT_EQ(ran.output, "true\n1\n");
+    // Strings built at runtime still equal the script's literals, and every
+    // isolate starts from its own globals.
+    ASSERT_TRUE(ran.errors.empty());
+  }
+  ASSERT_EQ(shared->size(), size);
+
+  const SharedScript broken{"fun broken( {}"};
+  ASSERT_FALSE(broken.compiled());
+  ASSERT_EQ(Isolate{}.run(broken).errors, broken.errors());
+}
+
+}  // namespace cpplox_tests
@@ -0,0 +1,89 @@
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "cpplox/Bytecode/Runtime.h"
+#include "gtest/gtest.h"
+
+namespace cpplox_tests {
+
+using namespace cpplox;
+
+TEST(RuntimeTests, CallsCompiledFunctionsManyTimes) {
+  std::ostringstream output;
+  Runtime runtime{output, CompilerOptions{.opt_level = 2}};
+  const std::optional<Runtime::Script> script{runtime.compile(
+      "var calls = 0;\n"
+      "fun greet(name, times) {\n"
+      "  calls = calls + 1;\n"
+      "  var greeting = \"\";\n"
+      "  for (var i = 0; i < times; i = i + 1) greeting = greeting + \"hi \";\n"
+      "  return greeting + name;\n"
+      "}\n"
+      "fun count() { return calls; }\n"
+      "print \"loaded\";\n")};
+  ASSERT_TRUE(script) << runtime.errors();
+  ASSERT_EQ(output.str(), "loaded\n");
+
+  for (int i = 0; i < 500; i++) {
+    const std::vector<HostValue> args{std::string{"lox"}, 2.0};
+    ASSERT_EQ(runtime.call(*script, "greet", args), HostValue{std::string{"hi hi lox"}});
+  }
+  ASSERT_EQ(runtime.call(*script, "count", {}), HostValue{500.0});
+  ASSERT_EQ(output.str(), "loaded\n");
+  // Top-level code ran only when compiling.
+}
+
+TEST(RuntimeTests, CallsRecoverFromErrors) {
+  std::ostringstream output;
+  Runtime runtime{output};
+  const std::optional<Runtime::Script> script{runtime.compile(
+      "fun half(n) { return n / 2; }\n"
+      "fun self() { return self; }\n")};
+  ASSERT_TRUE(script) << runtime.errors();
+
+  const std::vector<HostValue> text{std::string{"x"}};
+  ASSERT_FALSE(runtime.call(*script, "half", text));
+  ASSERT_EQ(runtime.errors(), "[Runtime error] [line 1] while interpreting: Operands must be numbers.\n");
+  ASSERT_FALSE(runtime.call(*script, "half", {}));
+  ASSERT_EQ(runtime.errors(), "[Runtime error] [line 0] while interpreting: Function half expected 1 parameters, but got 0.\n");
+  ASSERT_FALSE(runtime.call(*script, "self", {}));
+  ASSERT_FALSE(runtime.call(*script, "missing", {}));
+  ASSERT_EQ(runtime.errors(), "[Runtime error] Script declares no function missing.\n");
+
+  const std::vector<HostValue> number{HostValue{9.0}};
+  ASSERT_EQ(runtime.call(*script, "half", number), HostValue{4.5});
+  ASSERT_TRUE(runtime.errors().empty());
+}
+
+TEST(RuntimeTests, ScriptsShareGlobalsButKeepTheirFunctions) {
+  std::ostringstream output;
+  Runtime runtime{output};
+  const std::optional<Runtime::Script> first{runtime.compile("var base = 1; fun value() { return base; }")};
+  const std::optional<Runtime::Script> second{runtime.compile("base = 10; fun value() { return base * 2; }")};
+  ASSERT_TRUE(first && second);
+  ASSERT_EQ(runtime.call(*first, "value", {}), HostValue{10.0});
+  ASSERT_EQ(runtime.call(*second, "value", {}), HostValue{20.0});
+
+  ASSERT_FALSE(runtime.compile("fun broken( {}"));
+  ASSERT_FALSE(runtime.errors().empty());
+  ASSERT_EQ(runtime.call(*first, "value", {}), HostValue{10.0});
+}
+
+TEST(RuntimeTests, OptimisedScriptsSeeGlobalsEarlierScriptsAssign) {
+  std::ostringstream output;
+  Runtime runtime{output, CompilerOptions{.opt_level = 2}};
+  ASSERT_TRUE(runtime.compile("var g = 0; fun inc() { g = g + 1; }"));
+  const std::optional<Runtime::Script> script{runtime.compile(
+      "var g = 5;\n"
+      "fun sum() {\n"
+      "  var total = 0;\n"
+      "  for (var i = 0; i < 3; i = i + 1) { inc(); total = total + g; }\n"
+      "  return total;\n"
+      "}\n")};
+  ASSERT_TRUE(script) << runtime.errors();
+  ASSERT_EQ(runtime.call(*script, "sum", {}), HostValue{21.0});
+  // 6 + 7 + 8: g is read after every inc.
+}
+
+}  // namespace cpplox_tests
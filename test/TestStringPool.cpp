@@ -33,4 +33,19 @@ TEST(StringPoolTests, Interning) {
   EXPECT_EQ(*ptr1, "foobar");
 };
 
+TEST(StringPoolTests, InterningFallsBackToSharedPool) {
+  gc_heap shared_heap {};
+  StringPool shared {&shared_heap};
+  const_string_ptr literal {shared.insert_or_get("foo")};
+  shared_heap.freeze();
+
+  gc_heap heap {};
+  StringPool pool {&heap, &shared};
+  EXPECT_EQ(pool.insert_or_get("foo"), literal);
+  EXPECT_EQ(pool.insert_or_get("bar"), pool.insert_or_get("bar"));
+  EXPECT_FALSE(shared.find("bar"));
+  EXPECT_EQ(heap.size(), 1u);
+  // Only the string shared doesn't hold was allocated.
+};
+
 };
\ No newline at end of file
@@ -1,6 +1,11 @@
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+#include <functional>
 #include <iostream>
 #include <memory>
 #include <numeric>
+#include <tuple>
 #include <unordered_set>
 #include <vector>
 
@@ -75,6 +80,7 @@ namespace cpplox_tests {
         "benchmark/binary_trees.lox",
         "benchmark/properties.lox",
         "benchmark/invocation.lox",
+        "benchmark/call.lox",
         "benchmark/fib.lox",
         "benchmark/trees.lox",
         "benchmark/string_equality.lox",
@@ -116,12 +122,24 @@ namespace cpplox_tests {
   INSTANTIATE_TEST_SUITE_P(LimitTests, TestVMFixture,
                           ::testing::Values(
                               "limit/too_many_constants.lox",
-                              //"limit/no_reuse_constants.lox",
+                              "limit/reuse_constants.lox",
                               "limit/too_many_upvalues.lox",
                               "limit/stack_overflow.lox",
+                              "limit/deep_recursion.lox",
                               "limit/too_many_locals.lox",
                               "limit/loop_too_large.lox"));
 
+  TEST(TestVMLimits, WideFramesOverflowAtDepthLimit) {
+    const std::string script_path{"/Users/psarnick/dev/cpplox/test/limit/wide_frame_recursion.lox"};
+    std::ostringstream output;
+    ByteCodeRunner runner{output};
+    runner.set_max_callstack_depth(16);
+    runner.runFile(script_path);
+    ASSERT_EQ(output.str(), get_expectation(script_path));
+    // Execution traces log each 255 argument frame, the default depth would take
+    // minutes when the JIT doesn't take over.
+  }
+
   INSTANTIATE_TEST_SUITE_P(
       VariableTests, TestVMFixture,
       ::testing::Values(
@@ -194,7 +212,9 @@ namespace cpplox_tests {
           "function/local_recursion.lox",
           "function/recursion.lox", "function/print.lox",
           "function/too_many_parameters.lox", "function/mutual_recursion.lox",
-          "function/extra_arguments.lox"));
+          "function/extra_arguments.lox", "function/tail_call.lox",
+          "function/lazy.lox",
+          "function/warm_start.lox"));
 
   /*
   INSTANTIATE_TEST_SUITE_P(
@@ -439,7 +459,8 @@ namespace cpplox_tests {
           "operator/subtract_nonnum_num.lox",
           //"operator/not_class.lox",
           "operator/greater_or_equal_num_nonnum.lox",
-          "operator/less_num_nonnum.lox"));
+          "operator/less_num_nonnum.lox",
+          "operator/constant_folding.lox"));
   /*
   INSTANTIATE_TEST_SUITE_P(
       ConstructorTests,
@@ -460,13 +481,448 @@ namespace cpplox_tests {
   );
   */
 
+  INSTANTIATE_TEST_SUITE_P(
+      OptimizerTests,
+      TestVMFixture,
+      ::testing::Values(
+        "optimizer/peephole.lox",
+        "optimizer/ir.lox",
+        "optimizer/licm.lox",
+        "optimizer/inlining.lox",
+        "optimizer/types.lox"
+      )
+  );
+
+  TEST(TestVMPeephole, SameOutputWhenDisabled) {
+    const std::string script_path{"/Users/psarnick/dev/cpplox/test/optimizer/peephole.lox"};
+    std::ostringstream oss;
+    ByteCodeRunner{oss, std::cin, "compiler.log", CompilerOptions{.peephole = false}}.runFile(script_path);
+    ASSERT_EQ(oss.str(), get_expectation(script_path));
+  }
+
+  TEST(TestVMPeephole, DiffModeLogsBothVersions) {
+    const std::string script_path{"/Users/psarnick/dev/cpplox/test/optimizer/peephole.lox"};
+    const std::string log_path{"peephole_diff.log"};
+    std::ostringstream oss;
+    ByteCodeRunner{oss, std::cin, log_path, CompilerOptions{.peephole_diff = true}}.runFile(script_path);
+    ASSERT_EQ(oss.str(), get_expectation(script_path));
+
+    std::ifstream log{log_path};
+    const std::string logged((std::istreambuf_iterator<char>(log)), std::istreambuf_iterator<char>());
+    ASSERT_NE(logged.find("=== optimized chunk locals: "), std::string::npos);
+    ASSERT_NE(logged.find("+++ after"), std::string::npos);
+  }
+
+  TEST(TestVMInlining, ErrorTraceShowsCallSite) {
+    const std::string script_path{"/Users/psarnick/dev/cpplox/test/optimizer/inlined_error.lox"};
+    std::ostringstream oss;
+    ByteCodeRunner runner{oss, std::cin, "compiler.log", CompilerOptions{.opt_level = 2}};
+    ::testing::internal::CaptureStderr();
+    runner.runFile(script_path);
+    const std::string trace{::testing::internal::GetCapturedStderr()};
+    ASSERT_EQ(oss.str(), get_expectation(script_path));
+    ASSERT_NE(trace.find("[line 5] in caller\n[line 8] in script\n"), std::string::npos);
+    ASSERT_EQ(trace.find("in half"), std::string::npos);
+    // half is inlined into caller, which has no frame of its own for it.
+  }
+
+  struct RunnerConfig {
+    // One way of running scripts that has to print what the interpreter does.
+    std::string name;
+    CompilerOptions options{};
+    std::function<void(ByteCodeRunner&)> configure{};
+    std::function<bool()> supported{};
+    // Scripts are skipped where it returns false.
+    bool via_bytecode_file{false};
+    // Compiles to a .loxc file with options, then runs it with a default runner.
+
+    friend std::ostream& operator<<(std::ostream& os, const RunnerConfig& config) { return os << config.name; }
+  };
+
+  using config_param = std::tuple<RunnerConfig, test_param>;
+  class TestVMConfigFixture : public ::testing::TestWithParam<config_param> {
+  protected:
+    std::ostringstream oss;
+    ByteCodeRunner r{oss};
+    const std::string tests_path_prefix = "/Users/psarnick/dev/cpplox/test/";
+  };
+
+  TEST_P(TestVMConfigFixture, SameOutputAsExpected) {
+    const auto& [config, script] = GetParam();
+    if (config.supported && !config.supported()) GTEST_SKIP() << config.name << " isn't supported by this build";
+    const std::string script_path{tests_path_prefix + script};
+    ByteCodeRunner configured_r{oss, std::cin, "compiler.log", config.options};
+    if (config.configure) config.configure(configured_r);
+    if (config.via_bytecode_file) {
+      const std::string bytecode_path{std::filesystem::path(script_path).stem().string() + ".loxc"};
+      ASSERT_TRUE(configured_r.compileFile(script_path, bytecode_path));
+      ASSERT_EQ(oss.str(), "");
+      r.runFile(bytecode_path);
+    } else {
+      configured_r.runFile(script_path);
+    }
+    ASSERT_EQ(oss.str(), get_expectation(script_path));
+  }
+
+  std::string config_test_name(const ::testing::TestParamInfo<config_param>& info) {
+    std::string name{std::get<0>(info.param).name + "_" + std::get<1>(info.param)};
+    std::replace_if(name.begin(), name.end(), [](char c) { return !std::isalnum(static_cast<unsigned char>(c)); }, '_');
+    return name;
+  }
+
+  const RunnerConfig optimized{.name = "O2", .options = {.opt_level = 2}};
+  const RunnerConfig bytecode_file{.name = "O2_loxc", .options = {.opt_level = 2}, .via_bytecode_file = true};
+  const RunnerConfig lazy{.name = "O2_lazy", .options = {.opt_level = 2, .lazy_functions = true}};
+  const RunnerConfig jit_templates{
+      .name = "templates",
+      .configure = [](ByteCodeRunner& runner) { runner.enable_jit(1); }};
+  // Compiles every function on its first call.
+  const RunnerConfig jit_stencils{
+      .name = "stencils",
+      .configure = [](ByteCodeRunner& runner) { runner.enable_jit(1, JitBackend::STENCILS); },
+      .supported = [] { return Jit::supported(JitBackend::STENCILS); }};
+  const RunnerConfig tracing{
+      .name = "traced",
+      .configure = [](ByteCodeRunner& runner) { runner.enable_jit(1000, JitBackend::TEMPLATES, 1); }};
+  // Functions stay interpreted, loops are traced after their first iteration.
+
+  INSTANTIATE_TEST_SUITE_P(
+      OptimizedTests,
+      TestVMConfigFixture,
+      ::testing::Combine(
+        ::testing::Values(optimized),
+        ::testing::Values(
+          "optimizer/ir.lox",
+          "optimizer/peephole.lox",
+          "optimizer/licm.lox",
+          "optimizer/inlining.lox",
+          "optimizer/inlined_error.lox",
+          "optimizer/types.lox",
+          "limit/too_many_constants.lox",
+          "limit/too_many_locals.lox",
+          "limit/loop_too_large.lox",
+          "block/scope.lox",
+          "closure/reuse_closure_slot.lox",
+          "closure/assign_to_closure.lox",
+          "for/scope.lox",
+          "while/closure_in_body.lox",
+          "variable/in_nested_block.lox",
+          "logical_operator/and_truth.lox"
+        )),
+      config_test_name
+  );
+
+  INSTANTIATE_TEST_SUITE_P(
+      BytecodeFileTests,
+      TestVMConfigFixture,
+      ::testing::Combine(
+        ::testing::Values(bytecode_file),
+        ::testing::Values(
+          "closure/nested_closure.lox",
+          "function/tail_call.lox",
+          "function/local_mutual_recursion.lox",
+          "optimizer/inlining.lox",
+          "optimizer/inlined_error.lox",
+          "optimizer/types.lox",
+          "limit/too_many_constants.lox",
+          "limit/loop_too_large.lox",
+          "variable/undefined_global.lox"
+        )),
+      config_test_name
+  );
+
+  INSTANTIATE_TEST_SUITE_P(
+      JitTests,
+      TestVMConfigFixture,
+      ::testing::Combine(
+        ::testing::Values(jit_templates, jit_stencils),
+        ::testing::Values(
+          "closure/nested_closure.lox",
+          "closure/assign_to_closure.lox",
+          "function/recursion.lox",
+          "function/tail_call.lox",
+          "function/local_mutual_recursion.lox",
+          "function/extra_arguments.lox",
+          "limit/loop_too_large.lox",
+          "for/scope.lox",
+          "while/closure_in_body.lox",
+          "logical_operator/or_truth.lox",
+          "operator/comparison.lox",
+          "operator/negate.lox",
+          "operator/add_bool_string.lox",
+          "optimizer/types.lox",
+          "string/literals.lox"
+        )),
+      config_test_name
+  );
+
+  INSTANTIATE_TEST_SUITE_P(
+      TraceTests,
+      TestVMConfigFixture,
+      ::testing::Combine(
+        ::testing::Values(tracing),
+        ::testing::Values(
+          "trace/numeric.lox",
+          "trace/type_change.lox",
+          "trace/calls.lox",
+          "trace/error.lox",
+          "for/scope.lox",
+          "for/closure_in_body.lox",
+          "while/closure_in_body.lox",
+          "optimizer/types.lox",
+          "optimizer/licm.lox",
+          "limit/loop_too_large.lox"
+        )),
+      config_test_name
+  );
+
+  INSTANTIATE_TEST_SUITE_P(
+      LazyTests,
+      TestVMConfigFixture,
+      ::testing::Combine(
+        ::testing::Values(lazy),
+        ::testing::Values(
+          "function/lazy.lox",
+          "function/lazy_error.lox",
+          // Eagerly compiled, its unused function's syntax error stops the script.
+          "closure/nested_closure.lox",
+          "closure/assign_to_closure.lox",
+          "closure/shadow_closure_with_local.lox",
+          "closure/close_over_later_variable.lox",
+          "closure/reuse_closure_slot.lox",
+          "function/recursion.lox",
+          "function/local_mutual_recursion.lox",
+          "function/extra_arguments.lox",
+          "function/tail_call.lox",
+          "function/empty_body.lox",
+          "optimizer/inlining.lox",
+          "optimizer/licm.lox",
+          "for/closure_in_body.lox"
+        )),
+      config_test_name
+  );
+
+  class TestVMWarmStartFixture : public TestVMFixture {
+  protected:
+    ByteCodeRunner warm_r{oss, std::cin, "compiler.log", CompilerOptions{.opt_level = 2}};
+  };
+
+  TEST_P(TestVMWarmStartFixture, SameOutputWhenStartedInTreewalker) {
+    const std::string script_path{tests_path_prefix + GetParam()};
+    r.runFile(script_path);
+    const std::string vm_output{oss.str()};
+    oss.str("");
+    warm_r.enable_warm_start();
+    warm_r.runFile(script_path);
+    ASSERT_EQ(oss.str(), vm_output);
+  }
+  // Compared with VM rather than the expectations: scripts VM fails the same way
+  // (eg. print.lox's missing concat) still show where the engines differ.
+
+  INSTANTIATE_TEST_SUITE_P(
+      WarmStartTests,
+      TestVMWarmStartFixture,
+      ::testing::Values(
+        "function/warm_start.lox",
+        "function/lazy.lox",
+        "function/recursion.lox",
+        "function/local_mutual_recursion.lox",
+        "function/mutual_recursion.lox",
+        "closure/nested_closure.lox",
+        "closure/assign_to_closure.lox",
+        "closure/close_over_later_variable.lox",
+        "for/scope.lox",
+        "assignment/global.lox",
+        "variable/redefine_global.lox",
+        "while/closure_in_body.lox",
+        "block/error_in_nested_block.lox",
+        "call/bool.lox",
+        "call/nil.lox",
+        "call/num.lox",
+        "call/string.lox",
+        "function/extra_arguments.lox",
+        "function/missing_arguments.lox",
+        "function/nested_call_with_arguments.lox",
+        "function/lazy_error.lox",
+        "limit/stack_overflow.lox",
+        "limit/deep_recursion.lox",
+        "assignment/undefined.lox",
+        "variable/undefined_global.lox",
+        "variable/undefined_local.lox",
+        "string/error_after_multiline.lox",
+        "operator/add_bool_nil.lox",
+        "operator/negate_nonnum.lox",
+        "operator/divide_nonnum_num.lox",
+        "operator/divide_num_nonnum.lox",
+        "operator/greater_nonnum_num.lox",
+        "operator/greater_num_nonnum.lox",
+        "operator/greater_or_equal_nonnum_num.lox",
+        "operator/greater_or_equal_num_nonnum.lox",
+        "operator/less_nonnum_num.lox",
+        "operator/less_num_nonnum.lox",
+        "operator/less_or_equal_nonnum_num.lox",
+        "operator/less_or_equal_num_nonnum.lox",
+        "operator/multiply_nonnum_num.lox",
+        "operator/multiply_num_nonnum.lox",
+        "operator/subtract_nonnum_num.lox",
+        "operator/subtract_num_nonnum.lox",
+        "function/print.lox"
+      )
+  );
+
+  TEST(TestVMRepl, LinesRunOnceAgainstEarlierGlobals) {
+    std::istringstream input{
+        "var total = 1;\n"
+        "fun add(n) { total = total + n; return total; }\n"
+        "print add(2);\n"
+        "print missing;\n"
+        "print add(3);\n"
+        "var keep;\n"
+        "fun capture() { var x = \"kept\"; fun get() { return x; } keep = get; return x + 1; }\n"
+        "capture();\n"
+        "print keep();\n"};
+    std::ostringstream oss;
+    ByteCodeRunner{oss, input}.runRepl();
+    ASSERT_EQ(oss.str(),
+              "> > > 3\n"
+              "> [Runtime error] [line 1] while interpreting: Undefined variable 'missing'.\n"
+              "> 6\n"
+              "> > > [Runtime error] [line 1] while interpreting: Operands must be two numbers or strings.\n"
+              "> kept\n"
+              "> ");
+    // keep's variable was still on the stack when capture failed.
+  }
+
+  TEST(TestVMRepl, EarlierLinesAssignGlobalsOfOptimisedLines) {
+    std::istringstream input{
+        "var g = 0;\n"
+        "fun inc() { g = g + 1; }\n"
+        "var g = 5; var i = 0; while (i < 3) { inc(); print g; i = i + 1; }\n"};
+    std::ostringstream oss;
+    ByteCodeRunner{oss, input, "compiler.log", CompilerOptions{.opt_level = 2}}.runRepl();
+    ASSERT_EQ(oss.str(), "> > > 6\n7\n8\n> ");
+  }
+
+  std::string rewrite_bytes(const std::string& path, size_t offset, char value) {
+    std::ifstream ifs{path, std::ios::binary};
+    std::string bytes((std::istreambuf_iterator<char>(ifs)), std::istreambuf_iterator<char>());
+    bytes[offset < bytes.size() ? offset : bytes.size() - 1] = value;
+    const std::string damaged_path{"damaged_" + path};
+    std::ofstream{damaged_path, std::ios::binary} << bytes;
+    return damaged_path;
+  }
+
+  TEST(TestVMBytecodeFile, RejectsDamagedFiles) {
+    const std::string script_path{"/Users/psarnick/dev/cpplox/test/closure/nested_closure.lox"};
+    const std::string bytecode_path{"nested_closure.loxc"};
+    std::ostringstream compile_output;
+    ASSERT_TRUE(ByteCodeRunner{compile_output}.compileFile(script_path, bytecode_path));
+
+    std::ostringstream version_output;
+    ByteCodeRunner{version_output}.runFile(rewrite_bytes(bytecode_path, 4, 99));
+    ASSERT_EQ(version_output.str(), "[Loading error] damaged_nested_closure.loxc uses format version 99, expected 3.\n");
+
+    std::ostringstream metadata_output;
+    ByteCodeRunner{metadata_output}.runFile(rewrite_bytes(bytecode_path, 34, 'x'));
+    ASSERT_EQ(metadata_output.str(), "[Loading error] damaged_nested_closure.loxc is corrupt.\n");
+
+    std::ostringstream body_output;
+    ByteCodeRunner{body_output}.runFile(rewrite_bytes(bytecode_path, std::string::npos, 'x'));
+    ASSERT_NE(body_output.str().find("Corrupt bytecode in f4."), std::string::npos);
+    // Functions' code is only checked when they are first called: f4 runs last.
+  }
+
+  TEST(TestVMSnapshot, StartsFromPreludeGlobals) {
+    const std::string prelude_path{"prelude.lox"};
+    std::ofstream{prelude_path} << "var table = \"\";\n"
+                                   "for (var i = 0; i < 3; i = i + 1) table = table + \"x\";\n"
+                                   "fun make_counter() {\n"
+                                   "  var n = 0;\n"
+                                   "  fun inc() { n = n + 1; return n; }\n"
+                                   "  return inc;\n"
+                                   "}\n"
+                                   "var counter = make_counter();\n"
+                                   "var same_counter = counter;\n"
+                                   "counter();\n"
+                                   "var tick = clock;\n"
+                                   "fun add(a, b) { return a + b; }\n"
+                                   "print \"prelude ran\";\n";
+    std::ofstream{"main.lox"} << "print table == \"xxx\";\n"
+                                 "print counter();\n"
+                                 "print same_counter();\n"
+                                 "print counter == same_counter;\n"
+                                 "print tick == clock;\n"
+                                 "print add(table, \"!\");\n";
+    std::ostringstream snapshot_output;
+    ASSERT_TRUE(ByteCodeRunner{snapshot_output}.snapshotFile(prelude_path, "prelude.loxs"));
+    ASSERT_EQ(snapshot_output.str(), "prelude ran\n");
+
+    std::ostringstream output;
+    ByteCodeRunner runner{output};
+    runner.enable_snapshot("prelude.loxs");
+    runner.runFile("main.lox");
+    ASSERT_EQ(output.str(), "true\n2\n3\ntrue\ntrue\nxxx!\n");
+    // Both names still refer to one closure, whose captured n kept its value.
+
+    std::ostringstream damaged_output;
+    ByteCodeRunner damaged_runner{damaged_output};
+    damaged_runner.enable_snapshot(rewrite_bytes("prelude.loxs", std::string::npos, 'x'));
+    damaged_runner.runFile("main.lox");
+    ASSERT_EQ(damaged_output.str(), "[Loading error] damaged_prelude.loxs is corrupt.\n");
+  }
+
+  TEST(TestVMSnapshot, PreludeFunctionsAssignGlobalsOfOptimisedScripts) {
+    std::ofstream{"counter_prelude.lox"} << "var counter = 0; fun bump() { counter = counter + 1; }\n";
+    std::ofstream{"counter_main.lox"} << "var counter = 10; var i = 0;\n"
+                                         "while (i < 3) { bump(); print counter; i = i + 1; }\n";
+    std::ostringstream snapshot_output;
+    ASSERT_TRUE(ByteCodeRunner{snapshot_output}.snapshotFile("counter_prelude.lox", "counter_prelude.loxs"));
+
+    std::ostringstream output;
+    ByteCodeRunner runner{output, std::cin, "compiler.log", CompilerOptions{.opt_level = 2}};
+    runner.enable_snapshot("counter_prelude.loxs");
+    runner.runFile("counter_main.lox");
+    ASSERT_EQ(output.str(), "11\n12\n13\n");
+    // The script doesn't see bump's assignment, counter can't leave the loop.
+  }
+
+  TEST(TestVMSnapshot, RefusesBytecodeOptimisedAsWholeProgram) {
+    std::ofstream{"counter_prelude.lox"} << "var counter = 0; fun bump() { counter = counter + 1; }\n";
+    std::ofstream{"counter_main.lox"} << "var counter = 10; var i = 0;\n"
+                                         "while (i < 3) { bump(); print counter; i = i + 1; }\n";
+    std::ostringstream snapshot_output;
+    ASSERT_TRUE(ByteCodeRunner{snapshot_output}.snapshotFile("counter_prelude.lox", "counter_prelude.loxs"));
+    const CompilerOptions options{.opt_level = 2};
+
+    std::ostringstream compile_output;
+    ASSERT_TRUE(ByteCodeRunner(compile_output, std::cin, "compiler.log", options)
+                    .compileFile("counter_main.lox", "counter_main.loxc"));
+    std::ostringstream whole_output;
+    ByteCodeRunner whole_runner{whole_output};
+    whole_runner.enable_snapshot("counter_prelude.loxs");
+    whole_runner.runFile("counter_main.loxc");
+    ASSERT_EQ(whole_output.str(),
+              "[Loading error] Program was optimised as a whole program, it can't start from "
+              "counter_prelude.loxs. Compile it with the snapshot enabled.\n");
+
+    ByteCodeRunner partial_compiler(compile_output, std::cin, "compiler.log", options);
+    partial_compiler.enable_snapshot("counter_prelude.loxs");
+    ASSERT_TRUE(partial_compiler.compileFile("counter_main.lox", "counter_main.loxc"));
+    std::ostringstream output;
+    ByteCodeRunner runner{output};
+    runner.enable_snapshot("counter_prelude.loxs");
+    runner.runFile("counter_main.loxc");
+    ASSERT_EQ(output.str(), "11\n12\n13\n");
+  }
+
   INSTANTIATE_TEST_SUITE_P(
       BlockTests,
       TestVMFixture,
       ::testing::Values(
         "block/empty.lox",
         "block/scope.lox",
-        "block/double_nested_sope.lox"
+        "block/double_nested_sope.lox",
+        "block/error_in_nested_block.lox"
       )
   );
 
@@ -0,0 +1,23 @@
+# Times each benchmark run by the VM and as a binary built from its C++
+# translation (see AotCompiler). Run with cmake -P, defining CPPLOX (the cpplox
+# binary), AOT_DIR (where aot_<script name> binaries are) and SCRIPTS, a comma
+# separated list.
+
+function(elapsed_ms result)
+  string(TIMESTAMP start "%s%f")
+  execute_process(COMMAND ${ARGN} RESULT_VARIABLE status OUTPUT_QUIET ERROR_QUIET WORKING_DIRECTORY ${AOT_DIR})
+  string(TIMESTAMP end "%s%f")
+  if(NOT status EQUAL 0)
+    message(FATAL_ERROR "${ARGN} failed: ${status}")
+  endif()
+  math(EXPR ms "(${end} - ${start}) / 1000")
+  set(${result} ${ms} PARENT_SCOPE)
+endfunction()
+
+string(REPLACE "," ";" SCRIPTS "${SCRIPTS}")
+foreach(script ${SCRIPTS})
+  get_filename_component(name ${script} NAME_WE)
+  elapsed_ms(vm_ms ${CPPLOX} -O2 ${script})
+  elapsed_ms(aot_ms ${AOT_DIR}/aot_${name})
+  message("${name}: vm ${vm_ms} ms, aot ${aot_ms} ms")
+endforeach()
@@ -0,0 +1,60 @@
+// Runs the scripts given on the command line on IsolatePool with 1, 2, 4, ... up
+// to one worker per core, one copy of each script per worker, and reports how
+// many scripts per second each pool size gets through, compiling each copy in
+// its isolate and running a SharedScript compiled once.
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cpplox/Bytecode/IsolatePool.h"
+
+int main(int argc, char* argv[]) {
+  std::vector<std::string> sources{};
+  for (int i = 1; i < argc; i++) {
+    std::ifstream ifs{argv[i]};
+    if (!ifs.good()) {
+      std::cerr << "Can't read " << argv[i] << std::endl;
+      return 1;
+    }
+    sources.emplace_back(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+  }
+  if (sources.empty()) {
+    std::cerr << "Usage: isolate_throughput <script.lox>..." << std::endl;
+    return 1;
+  }
+
+  const cpplox::CompilerOptions options{.opt_level = 2};
+  std::vector<std::shared_ptr<const cpplox::SharedScript>> shared{};
+  for (const std::string& source : sources) shared.push_back(std::make_shared<cpplox::SharedScript>(source, options));
+
+  const size_t cores{cpplox::IsolatePool::default_workers()};
+  for (size_t workers = 1;; workers = std::min(workers * 2, cores)) {
+    for (const bool sharing : {false, true}) {
+      cpplox::IsolatePool pool{workers, options};
+      const auto start{std::chrono::steady_clock::now()};
+      std::vector<std::future<cpplox::ScriptResult>> results{};
+      for (size_t copy = 0; copy < workers; copy++) {
+        for (size_t i = 0; i < sources.size(); i++) {
+          results.push_back(sharing ? pool.submit(shared[i]) : pool.submit(sources[i]));
+        }
+      }
+      size_t failed{0};
+      for (std::future<cpplox::ScriptResult>& result : results) failed += !result.get().errors.empty();
+      const std::chrono::duration<double> elapsed{std::chrono::steady_clock::now() - start};
+
+      std::cout << workers << " isolates" << (sharing ? ", shared code: " : ": ")
+                << results.size() / elapsed.count() << " scripts/s";
+      if (failed > 0) std::cout << " (" << failed << " failed)";
+      std::cout << std::endl;
+    }
+    if (workers == cores) break;
+  }
+  return 0;
+}